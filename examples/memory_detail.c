@@ -0,0 +1,123 @@
+/*
+ * Times update_messages (extending ttls) and delete_messages (a batch
+ * ack) over a large memory backend queue at each detail level, with a
+ * message callback that looks at whatever it is given, as a consumer
+ * would.
+ *
+ * Usage: memory_detail [messages [body size]]
+ */
+#include <libburrow/burrow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct
+{
+  burrow_detail_t detail;
+  const char *name;
+} levels[] =
+{
+  { BURROW_DETAIL_NONE, "none" },
+  { BURROW_DETAIL_ID, "id" },
+  { BURROW_DETAIL_ATTRIBUTES, "attributes" },
+  { BURROW_DETAIL_BODY, "body" },
+  { BURROW_DETAIL_ALL, "all" }
+};
+
+static uint32_t checksum;
+static size_t reported;
+
+static void _message(burrow_st *burrow, const char *message_id,
+                     const void *body, size_t body_size,
+                     const burrow_attributes_st *attributes)
+{
+  const unsigned char *byte = body;
+  size_t i;
+
+  (void)burrow;
+  reported++;
+  checksum += (unsigned char)message_id[0];
+  if (attributes)
+    checksum += burrow_attributes_get_ttl(attributes);
+  for (i = 0; byte && i < body_size; i++)
+    checksum = checksum * 31 + byte[i];
+}
+
+static double _now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void _fill(burrow_st *burrow, size_t count, const char *body,
+                  size_t body_size)
+{
+  char message_id[32];
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    snprintf(message_id, sizeof(message_id), "%zu", i);
+    burrow_create_message(burrow, "bench", "q", message_id, body, body_size,
+                          NULL);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  size_t count = argc > 1 ? (size_t)atol(argv[1]) : 200000;
+  size_t body_size = argc > 2 ? (size_t)atol(argv[2]) : 1024;
+  burrow_attributes_st *attributes;
+  burrow_filters_st *filters;
+  burrow_st *burrow;
+  double update_time;
+  double delete_time;
+  double started;
+  char *body;
+  size_t i;
+
+  if (!count || !(body = malloc(body_size)))
+    return 1;
+  memset(body, 'x', body_size);
+
+  burrow = burrow_create(NULL, "memory");
+  if (!burrow)
+    return 1;
+  burrow_set_message_fn(burrow, &_message);
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+  attributes = burrow_attributes_create(NULL, burrow);
+  filters = burrow_filters_create(NULL, burrow);
+  if (!attributes || !filters)
+    return 1;
+  burrow_attributes_set_ttl(attributes, 600);
+
+  printf("%zu messages of %zu bytes\n", count, body_size);
+  printf("%-12s %14s %14s\n", "detail", "update ns/msg", "delete ns/msg");
+
+  for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+  {
+    _fill(burrow, count, body, body_size);
+    burrow_filters_set_detail(filters, levels[i].detail);
+
+    reported = 0;
+    started = _now();
+    burrow_update_messages(burrow, "bench", "q", attributes, filters);
+    update_time = _now() - started;
+
+    started = _now();
+    burrow_delete_messages(burrow, "bench", "q", filters);
+    delete_time = _now() - started;
+
+    printf("%-12s %14.1f %14.1f   (%zu reported)\n", levels[i].name,
+           update_time * 1e9 / (double)count,
+           delete_time * 1e9 / (double)count, reported);
+  }
+
+  printf("checksum %u\n", checksum);
+  burrow_destroy(burrow);
+  free(body);
+  return 0;
+}
@@ -25,6 +25,8 @@
 #include "backends/dummy/dummy.h"
 #include "backends/http/curl_backend.h"
 #include "backends/memory/memory.h"
+#include "backends/shm/shm.h"
+#include "backends/journal/journal.h"
 
 burrow_backend_functions_st *burrow_backend_load_functions(const char *backend)
 {
@@ -37,6 +39,14 @@ burrow_backend_functions_st *burrow_backend_load_functions(const char *backend)
     return &burrow_backend_http_functions;
   else if (!strcmp(backend, "memory"))
     return &burrow_backend_memory_functions;
+  else if (!strcmp(backend, "journal"))
+    return &burrow_backend_journal_functions;
+#ifdef BURROW_BACKEND_SHM
+  else if (!strcmp(backend, "shm"))
+    return &burrow_backend_shm_functions;
+  else if (!strcmp(backend, "mmap"))
+    return &burrow_backend_mmap_functions;
+#endif
   
   return NULL;
 }
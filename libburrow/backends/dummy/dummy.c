@@ -407,6 +407,19 @@ static int burrow_backend_dummy_create_message(void *ptr,
   return 0;
 }
 
+/** 
+ * Implements burrow_backend_functions_st#create_messages
+ */
+static int burrow_backend_dummy_create_messages(void *ptr,
+                                                const burrow_command_st *cmd)
+{
+  burrow_backend_dummy_st *dummy = (burrow_backend_dummy_st *)ptr;
+  (void) dummy;
+  (void) cmd;
+
+  return 0;
+}
+
 /**
  * The public face of burrow_backend_dummy
  *
@@ -434,6 +447,7 @@ burrow_backend_functions_st burrow_backend_dummy_functions =
   .update_message = &burrow_backend_dummy_update_message,
   .delete_message = &burrow_backend_dummy_delete_message,
   .create_message = &burrow_backend_dummy_create_message,
+  .create_messages = &burrow_backend_dummy_create_messages,
 
   /* May be NULL: */
   .cancel = &burrow_backend_dummy_cancel,
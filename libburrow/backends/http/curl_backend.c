@@ -29,14 +29,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "user_buffer.h"
+#include "json_fast.h"
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
 //#include <libburrow/backends/http/parser/contrib/JSON_PARSER/JSON_parser.h>
 
+/* Defaults for the integer options: most connections opened to the server
+   at once, most idle easy handles (and connections) kept for reuse, and
+   seconds an idle one is kept before being reaped */
+#define BURROW_BACKEND_HTTP_MAX_CONNECTIONS 8
+#define BURROW_BACKEND_HTTP_POOL_SIZE 8
+#define BURROW_BACKEND_HTTP_IDLE_TIMEOUT 30
+
+/* Largest request or response buffer kept for the next command */
+#define BURROW_BACKEND_HTTP_BUFFER_KEEP (16 * 1024 * 1024)
+
+/**
+ * An easy handle waiting in the pool for its next request.
+ */
+struct burrow_pooled_handle_st {
+  CURL *chandle;
+  int64_t idle_since;
+};
+
+/**
+ * One http request in flight.  Each queued command gets its own easy handle
+ * and response buffer, so that several can be run on the multi handle at
+ * once.
+ */
+struct burrow_transfer_st {
+  struct burrow_backend_st *backend;
+  const burrow_command_st *cmd;
+  CURL *chandle;
+  struct user_buffer_st *buffer;
+  struct json_processing_st *json; /* parses the response as it arrives */
+  bool get_body_only;
+  int result;
+  size_t message_index; /* of the message it creates, in create_messages */
+  struct burrow_transfer_st *next;
+  struct burrow_transfer_st *prev;
+};
+typedef struct burrow_transfer_st burrow_transfer_t;
+
 struct burrow_backend_st {
   char proto[32];
   size_t proto_len;
@@ -50,33 +89,42 @@ struct burrow_backend_st {
   char *baseurl;
   size_t baseurl_len;
   burrow_st *burrow;
-  struct user_buffer_st *buffer;
+  burrow_transfer_t *transfers;
+  burrow_ioevent_t *watched; /* events last reported to burrow, by fd */
+  int watched_size;
+  bool timer_set; /* libcurl wants CURL_SOCKET_TIMEOUT at timer_deadline */
+  int64_t timer_deadline;
+
+  /* Idle easy handles, oldest first */
+  struct burrow_pooled_handle_st *pool;
+  int pool_count;
+  int pool_size;
+  int max_connections;
+  int idle_timeout;
+
+  json_fast_mode_t json_mode; /* decoder for responses */
+  struct json_processing_st *json_idle; /* decoders kept for reuse */
+  struct user_buffer_st *spare_buffer; /* emptied, kept for reuse */
 
-  CURL *chandle;
   CURLM *curlptr;
   bool malloced;
-  bool get_body_only;
 };
 //typedef struct burrow_backend_st burrow_backend_t;
 
 static int burrow_backend_http_process(void *ptr);
+static CURLM *burrow_backend_http_multi_init(struct burrow_backend_st *backend);
+static void burrow_backend_http_reap(struct burrow_backend_st *backend);
+static CURL *burrow_backend_http_easy_get(struct burrow_backend_st *backend);
+static void burrow_backend_http_easy_put(struct burrow_backend_st *backend,
+					 CURL *chandle);
+static int burrow_backend_http_start_batched(struct burrow_backend_st *backend,
+					     const burrow_command_st *cmd,
+					     size_t index);
 
 #include "curl_backend.h"
 
 #include "json_processing.h"
 
-/**
- * helper function to find out which command we are executing right now.
- *
- * @param backend
- * @return command that we are executing
- */
-
-burrow_command_t
-burrow_backend_http_get_command(burrow_backend_t *backend) {
-  return backend->burrow->cmd.command;
-}
-
 /**
  * helper function to obtain the burrow struct that corresponds to this backend
  *
@@ -88,19 +136,6 @@ burrow_backend_http_get_burrow(burrow_backend_t *backend) {
   return backend->burrow;
 }
 
-/**
- * helper function to get the curl_easy_handle in use.
- *
- * @param backend
- * @return the CURL* we are using.
- */
-CURL *
-burrow_backend_http_get_curl_easy_handle(burrow_backend_t* backend) {
-  if (backend->chandle == NULL)
-    backend->chandle = curl_easy_init();
-  return backend->chandle;
-}
-
 /**
  * given to libcurl for printing debug messages
  *
@@ -182,13 +217,13 @@ burrow_backend_http_attributes_to_string(const burrow_attributes_st *attributes,
 /**
  * Given filters, return a malloced space containing something
  * suitable for adding to the end of a url
- * @param backend
+ * @param chandle the easy handle of the request, for escaping
  * @param filters The filters we want to examine (can be NULL)
  * @return a malloced string containing a string representation of the filters
  * that we can tack on the end of a URL
  */
 static char *
-burrow_backend_http_filters_to_string(burrow_backend_t *backend,
+burrow_backend_http_filters_to_string(CURL *chandle,
 				      const burrow_filters_st *filters,
 				      int *size)
 {
@@ -241,7 +276,11 @@ burrow_backend_http_filters_to_string(burrow_backend_t *backend,
   
   if (burrow_filters_get_marker(filters) != NULL) {
     char *marker =
-      curl_easy_escape(backend->chandle, burrow_filters_get_marker(filters),0);
+      curl_easy_escape(chandle, burrow_filters_get_marker(filters),0);
+    if (marker == NULL) {
+      *size = ENOMEM;
+      return 0;
+    }
     if (len > 0) {
       len += (size_t)snprintf(buf + len, sizeof(buf) - len, "&marker=%s",
 			      marker);
@@ -267,6 +306,366 @@ burrow_backend_http_filters_to_string(burrow_backend_t *backend,
 }
 
 
+/**
+ * Whether the burrow server's response to a command is of any interest.
+ * Different commands can give back different results.  More importantly,
+ * the same command can produce different results depending on attributes.
+ *
+ * For example, the get command will normall get JSON structures containg
+ * one or more message.  But if the attributes say only get body, it
+ * will only contain the body, not JSON.
+ *
+ * As another example, the DELETE command will normally get nothing,
+ * but if you use the detail attribute, it will get complete messages.
+ * On the other hand, should be able to parse that as json, or ignore
+ * it because empty...
+ *
+ * @param command the command
+ * @return true if the response is to be read.
+ */
+static bool
+burrow_backend_http_has_response(burrow_command_t command)
+{
+  return ((command == BURROW_CMD_GET_MESSAGES) ||
+	  (command == BURROW_CMD_GET_MESSAGE) ||
+	  (command == BURROW_CMD_DELETE_MESSAGES) ||
+	  (command == BURROW_CMD_DELETE_MESSAGE) ||
+	  (command == BURROW_CMD_UPDATE_MESSAGES) ||
+	  (command == BURROW_CMD_UPDATE_MESSAGE) ||
+	  (command == BURROW_CMD_GET_ACCOUNTS) ||
+	  (command == BURROW_CMD_GET_QUEUES));
+}
+
+/**
+ * given to libcurl as the CURLOPT_WRITEFUNCTION for JSON responses.  What
+ * arrives is parsed right away, so callbacks are made as soon as each
+ * account, queue or message is complete, rather than once the whole
+ * response is in.
+ *
+ * @param data what just arrived
+ * @param size size of the items
+ * @param nmemb number of items
+ * @param userdata the transfer
+ * @return size * nmemb, or 0 to have libcurl abort on bad JSON.
+ */
+static size_t
+burrow_backend_http_write_json(char *data, size_t size, size_t nmemb,
+			       void *userdata)
+{
+  burrow_transfer_t *transfer = (burrow_transfer_t *)userdata;
+
+  burrow_current_command(transfer->backend->burrow, transfer->cmd);
+  if (burrow_backend_http_json_parse(transfer->json, data,
+				     size * nmemb) != 0) {
+    transfer->result = EINVAL;
+    return 0;
+  }
+  return size * nmemb;
+}
+
+/**
+ * given to libcurl as the CURLOPT_WRITEFUNCTION for raw message bodies,
+ * which are handed over whole once complete.  The buffer is sized from
+ * the Content-Length, when the server sends one, as soon as the first
+ * piece arrives.
+ *
+ * @param data what just arrived
+ * @param size size of the items
+ * @param nmemb number of items
+ * @param userdata the transfer
+ * @return size * nmemb, or 0 to have libcurl abort if realloc failed.
+ */
+static size_t
+burrow_backend_http_write_body(char *data, size_t size, size_t nmemb,
+			       void *userdata)
+{
+  burrow_transfer_t *transfer = (burrow_transfer_t *)userdata;
+
+  if (user_buffer_get_size(transfer->buffer) == 0) {
+#if LIBCURL_VERSION_NUM >= 0x073700 /* 7.55.0 */
+    curl_off_t length = -1;
+    CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD_T;
+#else
+    double length = -1;
+    CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD;
+#endif
+    if (curl_easy_getinfo(transfer->chandle, info, &length) == CURLE_OK &&
+	length > 0 &&
+	!user_buffer_reserve(transfer->buffer, (size_t)length)) {
+      transfer->result = ENOMEM;
+      return 0;
+    }
+  }
+  return user_buffer_curl_write_function(data, size, nmemb, transfer->buffer);
+}
+
+/**
+ * Get an empty buffer for a request or response, reusing the one kept
+ * from an earlier command if there is one.
+ *
+ * @param backend
+ * @return an empty user_buffer, or NULL if malloc failed.
+ */
+static user_buffer *
+burrow_backend_http_buffer_get(burrow_backend_t *backend)
+{
+  user_buffer *buffer = backend->spare_buffer;
+
+  if (buffer == NULL)
+    return user_buffer_create(0, 0);
+  backend->spare_buffer = 0;
+  user_buffer_clear(buffer);
+  return buffer;
+}
+
+/**
+ * Done with a buffer: keep it for the next command unless one is already
+ * kept, or it has grown too big to hold on to.
+ *
+ * @param backend
+ * @param buffer from burrow_backend_http_buffer_get or user_buffer_create
+ */
+static void
+burrow_backend_http_buffer_put(burrow_backend_t *backend, user_buffer *buffer)
+{
+  if (backend->spare_buffer == NULL &&
+      user_buffer_get_capacity(buffer) <= BURROW_BACKEND_HTTP_BUFFER_KEEP)
+    backend->spare_buffer = buffer;
+  else
+    user_buffer_destroy(buffer);
+}
+
+/**
+ * given to libcurl as the CURLOPT_WRITEFUNCTION for responses of no
+ * interest, so they do not end up on stdout.
+ */
+static size_t
+burrow_backend_http_write_nothing(char *data, size_t size, size_t nmemb,
+				  void *userdata)
+{
+  (void)data;
+  (void)userdata;
+  return size * nmemb;
+}
+
+/**
+ * Hand a fully set up easy handle to the multi handle, to be run on behalf
+ * of a queued command.  Takes ownership of chandle and buffer.
+ *
+ * @param backend
+ * @param cmd the command this request answers
+ * @param chandle easy handle with the request options already set
+ * @param buffer request body buffer for the easy handle, or NULL if there
+ * is none; the response is then read here.
+ * @param get_body_only whether the response is a raw message body
+ * @return EAGAIN if the transfer was started, errno otherwise.
+ */
+static int
+burrow_backend_http_start_transfer(burrow_backend_t *backend,
+				   const burrow_command_st *cmd,
+				   CURL *chandle,
+				   user_buffer *buffer,
+				   bool get_body_only)
+{
+  burrow_transfer_t *transfer = malloc(sizeof(burrow_transfer_t));
+  if (transfer == NULL) {
+    burrow_error(backend->burrow, ENOMEM,
+		 "Failed to malloc space for a new transfer\n");
+    burrow_backend_http_easy_put(backend, chandle);
+    if (buffer)
+      burrow_backend_http_buffer_put(backend, buffer);
+    return ENOMEM;
+  }
+  transfer->backend = backend;
+  transfer->cmd = cmd;
+  transfer->chandle = chandle;
+  transfer->buffer = buffer;
+  transfer->json = 0;
+  transfer->get_body_only = get_body_only;
+  transfer->result = 0;
+  transfer->message_index = 0;
+
+  if (buffer != NULL || !burrow_backend_http_has_response(cmd->command)) {
+    curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
+		     burrow_backend_http_write_nothing);
+  } else if (get_body_only) {
+    /* A raw body is handed over whole, so it is kept until complete */
+    transfer->buffer = burrow_backend_http_buffer_get(backend);
+    curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
+		     burrow_backend_http_write_body);
+    curl_easy_setopt(chandle, CURLOPT_WRITEDATA, transfer);
+  } else {
+    transfer->json = burrow_backend_http_json_create(backend, cmd,
+						     backend->json_mode,
+						     &backend->json_idle);
+    curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
+		     burrow_backend_http_write_json);
+    curl_easy_setopt(chandle, CURLOPT_WRITEDATA, transfer);
+  }
+  if (!transfer->buffer && !transfer->json &&
+      burrow_backend_http_has_response(cmd->command)) {
+    burrow_error(backend->burrow, ENOMEM,
+		 "Failed to malloc space for reading the response\n");
+    burrow_backend_http_easy_put(backend, chandle);
+    free(transfer);
+    return ENOMEM;
+  }
+
+  curl_easy_setopt(chandle, CURLOPT_PRIVATE, transfer);
+#if LIBCURL_VERSION_NUM >= 0x074100 /* 7.65.0 */
+  /* Connections idle for longer than the pool keeps handles are not
+     reused, but closed */
+  curl_easy_setopt(chandle, CURLOPT_MAXAGE_CONN, (long)backend->idle_timeout);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071900 /* 7.25.0 */
+  curl_easy_setopt(chandle, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+  curl_multi_add_handle(backend->curlptr, chandle);
+
+  transfer->prev = 0;
+  transfer->next = backend->transfers;
+  if (backend->transfers)
+    backend->transfers->prev = transfer;
+  backend->transfers = transfer;
+
+  return EAGAIN;
+}
+
+/**
+ * Take a transfer off the multi handle and free it.
+ *
+ * @param transfer a transfer previously started.
+ */
+static void
+burrow_backend_http_destroy_transfer(burrow_transfer_t *transfer)
+{
+  burrow_backend_t *backend = transfer->backend;
+
+  if (transfer->prev)
+    transfer->prev->next = transfer->next;
+  else
+    backend->transfers = transfer->next;
+  if (transfer->next)
+    transfer->next->prev = transfer->prev;
+
+  curl_multi_remove_handle(backend->curlptr, transfer->chandle);
+  burrow_backend_http_easy_put(backend, transfer->chandle);
+  if (transfer->buffer)
+    burrow_backend_http_buffer_put(backend, transfer->buffer);
+  if (transfer->json)
+    burrow_backend_http_json_release(transfer->json, &backend->json_idle);
+  free(transfer);
+}
+
+/**
+ * Drop every transfer started on behalf of a command.
+ *
+ * @param backend
+ * @param cmd the command whose transfers are to go
+ */
+static void
+burrow_backend_http_abort_command(burrow_backend_t *backend,
+				  const burrow_command_st *cmd)
+{
+  burrow_transfer_t *transfer = backend->transfers;
+
+  while (transfer) {
+    burrow_transfer_t *next = transfer->next;
+    if (transfer->cmd == cmd)
+      burrow_backend_http_destroy_transfer(transfer);
+    transfer = next;
+  }
+}
+
+/**
+ * Start the next message of a create_messages batch once one of its
+ * requests is done, unless another has failed or none are left.
+ *
+ * @param transfer the transfer of the batch that is done
+ * @return 0 if successful, errno if the next request could not be started
+ */
+static int
+burrow_backend_http_batch_next(burrow_transfer_t *transfer)
+{
+  burrow_backend_t *backend = transfer->backend;
+  const burrow_command_st *cmd = transfer->cmd;
+  size_t next = transfer->message_index + 1;
+  burrow_transfer_t *sibling;
+  int retval;
+
+  for (sibling = backend->transfers; sibling; sibling = sibling->next) {
+    if (sibling == transfer || sibling->cmd != cmd)
+      continue;
+    if (sibling->result != 0)
+      return 0;
+    if (sibling->message_index >= next)
+      next = sibling->message_index + 1;
+  }
+
+  if (next >= cmd->message_count)
+    return 0;
+  retval = burrow_backend_http_start_batched(backend, cmd, next);
+  return retval == EAGAIN ? 0 : retval;
+}
+
+/**
+ * Deal with the response of a completed transfer, and report its command
+ * to the frontend as done.
+ *
+ * @param transfer the transfer curl reports as done
+ * @param code the libcurl result of the transfer
+ */
+static void
+burrow_backend_http_finish_transfer(burrow_transfer_t *transfer,
+				    CURLcode code)
+{
+  burrow_backend_t *backend = transfer->backend;
+  burrow_command_t command = transfer->cmd->command;
+  burrow_transfer_t *sibling;
+  int result = 0;
+
+  burrow_current_command(backend->burrow, transfer->cmd);
+
+  if (transfer->result != 0) {
+    /* Already reported, e.g. bad JSON cutting the transfer short */
+    result = transfer->result;
+  } else if (code != CURLE_OK) {
+    burrow_error(backend->burrow, EINVAL,
+		 "Error transferring (%d): %s\n",
+		 code,
+		 curl_easy_strerror(code));
+    result = EINVAL;
+  } else if (burrow_backend_http_has_response(command)) {
+    burrow_log_debug(backend->burrow, "Transfer completed successfully\n");
+    if (transfer->get_body_only)
+      burrow_callback_message(backend->burrow,
+			      0,
+			      user_buffer_get_text(transfer->buffer),
+			      user_buffer_get_size(transfer->buffer),
+			      0);
+    else
+      result = burrow_backend_http_json_done(transfer->json);
+  }
+
+  if (result == 0)
+    result = transfer->result;
+
+  if (result == 0 && command == BURROW_CMD_CREATE_MESSAGES)
+    result = burrow_backend_http_batch_next(transfer);
+
+  /* A command fanned out over several transfers (create_messages) is only
+     done with its last one; the first error seen is what it reports. */
+  for (sibling = backend->transfers; sibling; sibling = sibling->next) {
+    if (sibling != transfer && sibling->cmd == transfer->cmd) {
+      if (sibling->result == 0)
+	sibling->result = result;
+      return;
+    }
+  }
+
+  burrow_internal_command_done(backend->burrow, transfer->cmd, result);
+}
+
 /**
  * Return the size of a backend object, if the user should want to
  * allocate the space themself.
@@ -316,11 +715,24 @@ burrow_backend_http_create(void *ptr, burrow_st *burrow)
   backend->baseurl_len = 0;
   strcpy(backend->proto_version, "v1.0");
   backend->proto_version_len = 4;
-  backend->buffer = 0;
-  backend->chandle = 0;
-  backend->get_body_only = false;
-
-  backend->curlptr = curl_multi_init();
+  backend->transfers = 0;
+  backend->watched = 0;
+  backend->watched_size = 0;
+  backend->pool = 0;
+  backend->pool_count = 0;
+  backend->pool_size = BURROW_BACKEND_HTTP_POOL_SIZE;
+  backend->max_connections = BURROW_BACKEND_HTTP_MAX_CONNECTIONS;
+  backend->idle_timeout = BURROW_BACKEND_HTTP_IDLE_TIMEOUT;
+  backend->json_mode = JSON_FAST_DEFAULT;
+  backend->json_idle = 0;
+  backend->spare_buffer = 0;
+
+  if (burrow_backend_http_multi_init(backend) == NULL) {
+    burrow_error(burrow, ENOMEM, "Failed to create a libcurl multi handle\n");
+    if (backend->malloced)
+      free(backend);
+    return (void *)0;
+  }
   return (void *)backend;
 }
 
@@ -336,13 +748,18 @@ burrow_backend_http_destroy(void * ptr) {
     free(backend->server);
   if (backend->baseurl)
     free(backend->baseurl);
-  if (backend->buffer)
-    user_buffer_destroy(backend->buffer);
-  if (backend->chandle) {
-    curl_multi_remove_handle(backend->curlptr, backend->chandle);
-    curl_easy_cleanup(backend->chandle);
-    backend->chandle = 0;
-  }
+  /* Sockets closed from here on are of no more interest to burrow */
+  free(backend->watched);
+  backend->watched = 0;
+  backend->watched_size = 0;
+  while (backend->transfers)
+    burrow_backend_http_destroy_transfer(backend->transfers);
+  burrow_backend_http_json_destroy_idle(&backend->json_idle);
+  if (backend->spare_buffer)
+    user_buffer_destroy(backend->spare_buffer);
+  while (backend->pool_count > 0)
+    curl_easy_cleanup(backend->pool[--backend->pool_count].chandle);
+  free(backend->pool);
   curl_multi_cleanup(backend->curlptr);
   backend->curlptr = 0;
   
@@ -351,7 +768,12 @@ burrow_backend_http_destroy(void * ptr) {
 }
 
 /**
- * Sets an option for this backend
+ * Sets an option for this backend:
+ *   "server", "port"  where the burrow server is
+ *   "json_decoder"    how responses are decoded: "contrib" for the contrib
+ *                     JSON_parser, "fast" for json_fast with the best string
+ *                     scanner available, or "scalar", "sse2" or "avx2" for
+ *                     json_fast with that one
  *
  * @param ptr Pointer to the backend object
  * @param optionname String name of the option
@@ -387,6 +809,14 @@ burrow_backend_http_set_option(void *ptr,
     }
     strcpy(backend->port, value);
     url_affecting = 1;
+  } else if (strcmp(optionname, "json_decoder") == 0) {
+    int result = json_fast_mode_by_name(value, &backend->json_mode);
+    if (result) {
+      burrow_log_error(backend->burrow,
+		       "Can't use json_decoder \"%s\" (%s)\n", value,
+		       result == ENOTSUP ? "not supported here" : "unknown");
+      return result;
+    }
   } else {
     burrow_log_error(backend->burrow,
 		    "Called set_option with illegal option: %s\n", optionname);
@@ -422,71 +852,150 @@ burrow_backend_http_set_option(void *ptr,
 
 
 /**
- * Send a message to the burrow server
+ * Sets an integer option for this backend:
+ *   "pool_size"       most idle easy handles, and connections, kept for
+ *                     reuse (0 turns off reuse)
+ *   "max_connections" most connections opened to the server at once
+ *   "idle_timeout"    seconds an idle handle or connection is kept
  *
  * @param ptr Pointer to the backend object
- * @param cmd pointer to a burrow_command_st
- * return 0 if successful, errno otherwise.
+ * @param optionname String name of the option
+ * @param value the value
+ * @return 0 if successful, EINVAL if the option or value is bad.
  */
 static int
-burrow_backend_http_create_message(void *ptr,
-				   const burrow_command_st *cmd)
+burrow_backend_http_set_option_int(void *ptr,
+				   const char *optionname, int32_t value)
 {
-  char *account;
-  char *queue;
-  char *message_id;
-  const uint8_t *body = cmd->body;
-  size_t body_size = cmd->body_size;
-  const burrow_attributes_st *attributes = cmd->attributes;
-  burrow_backend_t * backend = (burrow_backend_t *)ptr;
-  
-  CURL *chandle = curl_easy_init();
+  burrow_backend_t *backend=(burrow_backend_t *)ptr;
+
+  if (strcmp(optionname, "pool_size") == 0 && value >= 0) {
+    backend->pool_size = value;
+    burrow_backend_http_reap(backend);
+    /* Reallocated to the new size when next needed */
+    if (backend->pool_count == 0) {
+      free(backend->pool);
+      backend->pool = 0;
+    } else {
+      struct burrow_pooled_handle_st *pool =
+	realloc(backend->pool, value * sizeof(struct burrow_pooled_handle_st));
+      if (pool == NULL)
+	return ENOMEM;
+      backend->pool = pool;
+    }
+    curl_multi_setopt(backend->curlptr, CURLMOPT_MAXCONNECTS,
+		      (long)(value > 0 ? value : 1));
+  } else if (strcmp(optionname, "max_connections") == 0 && value > 0) {
+    backend->max_connections = value;
+#if LIBCURL_VERSION_NUM >= 0x071e00 /* 7.30.0 */
+    curl_multi_setopt(backend->curlptr, CURLMOPT_MAX_HOST_CONNECTIONS,
+		      (long)value);
+#endif
+  } else if (strcmp(optionname, "idle_timeout") == 0 && value >= 0) {
+    backend->idle_timeout = value;
+  } else {
+    burrow_log_error(backend->burrow,
+		     "Called set_option_int with illegal option: %s = %d\n",
+		     optionname, (int)value);
+    return EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Start the PUT request that creates one message on the burrow server.
+ *
+ * @param backend Pointer to the backend object
+ * @param cmd the create_message(s) command the message belongs to
+ * @param msgid id of the message
+ * @param body message body
+ * @param body_size size of the body
+ * @param attributes message attributes, may be NULL
+ * return EAGAIN if the request was started, errno otherwise.
+ */
+static int
+burrow_backend_http_start_create(burrow_backend_t *backend,
+				 const burrow_command_st *cmd,
+				 const char *msgid,
+				 const uint8_t *body,
+				 size_t body_size,
+				 const burrow_attributes_st *attributes)
+{
+  char *account = 0;
+  char *queue = 0;
+  char *message_id = 0;
+  char *attr_string = 0;
+  char *url = 0;
+  size_t urllen;
+  size_t urllen_sofar;
+  int attr_str_len;
+  user_buffer *buffer = NULL;
+  int result = ENOMEM;
+
+  CURL *chandle = burrow_backend_http_easy_get(backend);
+  if (chandle == NULL) {
+    burrow_error(backend->burrow, ENOMEM,
+		 "Failed to create a libcurl easy handle\n");
+    return ENOMEM;
+  }
+
   /* Make sure that that which goes into the url is escaped appropriately. */
   account = curl_easy_escape(chandle, cmd->account,0);
   queue = curl_easy_escape(chandle,cmd->queue,0);
-  message_id = curl_easy_escape(chandle,cmd->message_id,0);
+  message_id = curl_easy_escape(chandle,msgid,0);
+  if (account == NULL || queue == NULL || message_id == NULL) {
+    burrow_error(backend->burrow, ENOMEM, "Failed to escape the URL\n");
+    goto cleanup;
+  }
 
   /* Now build up the url string, and hand it off to libcurl */
-  int attr_str_len;
-  char *attr_string = burrow_backend_http_attributes_to_string(attributes,
-							       &attr_str_len);
+  attr_string = burrow_backend_http_attributes_to_string(attributes,
+							 &attr_str_len);
   if ((attr_string == NULL) && (attr_str_len != 0)) {
     burrow_error(backend->burrow,
 		 attr_str_len,
 		 "Attempt to create attribute string from attributes failed");
-    return attr_str_len;
+    result = attr_str_len;
+    goto cleanup;
   }
-  size_t urllen = backend->baseurl_len +
+  urllen = backend->baseurl_len +
     backend->proto_version_len +
     strlen(account) + 
     strlen(queue) + strlen(message_id) +
     (size_t)attr_str_len + 20;
-  char *url = (char *)malloc(urllen);
+  url = (char *)malloc(urllen);
   if (url == NULL) {
     burrow_error(backend->burrow,
 		 ENOMEM,
 		 "Failed to malloc space for URL\n");
-    return ENOMEM;
+    goto cleanup;
   }
-  size_t urllen_sofar =
+  urllen_sofar =
     (size_t)snprintf(url, urllen, "%s/%s/%s/%s/%s",
 		     backend->baseurl,
 		     backend->proto_version,
 		     account, queue, message_id);
-  curl_free(account); account = 0;
-  curl_free(queue); queue = 0;
-  curl_free(message_id); message_id = 0;
   if (attr_string != 0) {
 
     urllen_sofar += (size_t)snprintf(url + urllen_sofar, urllen - urllen_sofar,
 				     "?%s", attr_string);
-    free(attr_string);
   }
   burrow_log_debug(backend->burrow, "create_message url = \"%s\"\n", url);
   curl_easy_setopt(chandle, CURLOPT_URL, url);
 
   /* Set up the data we want to send to burrowd. */
-  user_buffer *buffer = user_buffer_create_sized(0, body, body_size);
+  buffer = burrow_backend_http_buffer_get(backend);
+  if (buffer != NULL &&
+      (!user_buffer_reserve(buffer, body_size) ||
+       !user_buffer_append(buffer, body, body_size))) {
+    burrow_backend_http_buffer_put(backend, buffer);
+    buffer = NULL;
+  }
+  if (buffer == NULL) {
+    burrow_error(backend->burrow, ENOMEM,
+		 "Failed to malloc space for the message body\n");
+    goto cleanup;
+  }
   curl_easy_setopt(chandle, CURLOPT_READFUNCTION,
 		   user_buffer_curl_read_function);
   curl_easy_setopt(chandle, CURLOPT_READDATA, buffer);
@@ -499,157 +1008,417 @@ burrow_backend_http_create_message(void *ptr,
   curl_easy_setopt(chandle, CURLOPT_DEBUGFUNCTION,
 		   burrow_backend_http_curldebug);
   curl_easy_setopt(chandle, CURLOPT_DEBUGDATA, backend);
+  result = EAGAIN;
 
-  if (backend->chandle) {
-    curl_multi_remove_handle(backend->curlptr, backend->chandle);
-    curl_easy_cleanup(backend->chandle);
+cleanup:
+  curl_free(account);
+  curl_free(queue);
+  curl_free(message_id);
+  free(attr_string);
+  free(url);
+  if (result != EAGAIN) {
+    burrow_backend_http_easy_put(backend, chandle);
+    return result;
   }
-  backend->chandle = chandle;
-  curl_multi_add_handle(backend->curlptr, chandle);
 
-  if(backend->buffer) {
-    user_buffer_destroy(backend->buffer);
-  }
-  backend->buffer = buffer;
-  url[0] = '\0';
-  free(url);
+  return burrow_backend_http_start_transfer(backend, cmd, chandle, buffer,
+					    false);
+}
 
-  return burrow_backend_http_process((void*)backend);
+/**
+ * Send a message to the burrow server
+ *
+ * @param ptr Pointer to the backend object
+ * @param cmd pointer to a burrow_command_st
+ * return 0 if successful, errno otherwise.
+ */
+static int
+burrow_backend_http_create_message(void *ptr,
+				   const burrow_command_st *cmd)
+{
+  burrow_backend_t * backend = (burrow_backend_t *)ptr;
+
+  return burrow_backend_http_start_create(backend, cmd, cmd->message_id,
+					  cmd->body, cmd->body_size,
+					  cmd->attributes);
+}
+
+/**
+ * Start the request that creates one message of a create_messages batch.
+ *
+ * @param backend Pointer to the backend object
+ * @param cmd the create_messages command
+ * @param index of the message in the batch
+ * return EAGAIN if the request was started, errno otherwise.
+ */
+static int
+burrow_backend_http_start_batched(burrow_backend_t *backend,
+				  const burrow_command_st *cmd,
+				  size_t index)
+{
+  const burrow_message_st *message = &cmd->messages[index];
+  int retval =
+    burrow_backend_http_start_create(backend, cmd, message->message_id,
+				     message->body, message->body_size,
+				     message->attributes);
+
+  /* A transfer just started is at the head of the list */
+  if (retval == EAGAIN)
+    backend->transfers->message_index = index;
+  return retval;
+}
+
+/**
+ * Send a batch of messages to the burrow server.  Each message is its own
+ * request, with as many run concurrently as the pool keeps handles; the
+ * next is started as each finishes, and the command is done when the
+ * last one does.
+ *
+ * @param ptr Pointer to the backend object
+ * @param cmd pointer to a burrow_command_st
+ * return EAGAIN if the requests were started, errno otherwise.
+ */
+static int
+burrow_backend_http_create_messages(void *ptr,
+				    const burrow_command_st *cmd)
+{
+  burrow_backend_t * backend = (burrow_backend_t *)ptr;
+  size_t in_flight = backend->pool_size > 0 ? (size_t)backend->pool_size : 1;
+  size_t i;
+
+  for (i = 0; i < cmd->message_count && i < in_flight; ++i) {
+    int retval = burrow_backend_http_start_batched(backend, cmd, i);
+    if (retval != EAGAIN) {
+      burrow_backend_http_abort_command(backend, cmd);
+      return retval;
+    }
+  }
+  return EAGAIN;
 }
   
+/**
+ * Tells the "frontend" about a change in what libcurl wants to know about
+ * a file descriptor.  Nothing is said if it is the same as last time.
+ *
+ * @param backend pointer to a backend object
+ * @param fd the file descriptor
+ * @param events what to watch for from now on, BURROW_IOEVENT_NONE to stop
+ * @return 0 if successful, ENOMEM if the table could not grow
+ */
+static int
+burrow_backend_http_watch(burrow_backend_t *backend, int fd,
+			  burrow_ioevent_t events)
+{
+  burrow_ioevent_t old_events = BURROW_IOEVENT_NONE;
+
+  if (fd < backend->watched_size)
+    old_events = backend->watched[fd];
+  if (events == old_events)
+    return 0;
+
+  if (fd >= backend->watched_size) {
+    int size = backend->watched_size * 2;
+    burrow_ioevent_t *watched;
+    if (size <= fd)
+      size = fd + 1;
+    watched = realloc(backend->watched, size * sizeof(burrow_ioevent_t));
+    if (watched == NULL) {
+      burrow_error(backend->burrow, ENOMEM,
+		   "Failed to grow the table of watched fds\n");
+      return ENOMEM;
+    }
+    memset(watched + backend->watched_size, 0,
+	   (size - backend->watched_size) * sizeof(burrow_ioevent_t));
+    backend->watched = watched;
+    backend->watched_size = size;
+  }
+
+  backend->watched[fd] = events;
+  if (old_events == BURROW_IOEVENT_NONE)
+    burrow_watch_fd_add(backend->burrow, fd, events);
+  else if (events == BURROW_IOEVENT_NONE)
+    burrow_watch_fd_remove(backend->burrow, fd);
+  else
+    burrow_watch_fd_modify(backend->burrow, fd, events);
+  return 0;
+}
+
+/**
+ * Stops watching every file descriptor.
+ *
+ * @param backend pointer to a backend object
+ */
+static void
+burrow_backend_http_unwatch_all(burrow_backend_t *backend)
+{
+  for (int fd = 0; fd < backend->watched_size; ++fd)
+    burrow_backend_http_watch(backend, fd, BURROW_IOEVENT_NONE);
+}
+
+/**
+ * given to libcurl as CURLMOPT_SOCKETFUNCTION, to learn which sockets it
+ * wants to be told about, and for which events.
+ *
+ * @param chandle the easy handle the socket is for
+ * @param s the socket
+ * @param what one of the CURL_POLL_* values
+ * @param userp pointer to a backend object
+ * @param socketp unused
+ * @return 0
+ */
+static int
+burrow_backend_http_socket(CURL *chandle, curl_socket_t s, int what,
+			   void *userp, void *socketp)
+{
+  burrow_backend_t *backend = (burrow_backend_t *)userp;
+  burrow_ioevent_t events = BURROW_IOEVENT_NONE;
+
+  (void)chandle;
+  (void)socketp;
+  if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+    events |= BURROW_IOEVENT_READ;
+  if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+    events |= BURROW_IOEVENT_WRITE;
+  burrow_backend_http_watch(backend, s, events);
+  return 0;
+}
+
+/**
+ * @return a monotonic clock reading in milliseconds
+ */
+static int64_t
+burrow_backend_http_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * given to libcurl as CURLMOPT_TIMERFUNCTION.  libcurl wants
+ * curl_multi_socket_action(CURL_SOCKET_TIMEOUT) called once timeout_ms
+ * has passed, which burrow_backend_http_process does.
+ *
+ * @param curlptr the multi handle
+ * @param timeout_ms how long until the timeout, -1 to stop the timer
+ * @param userp pointer to a backend object
+ * @return 0
+ */
+static int
+burrow_backend_http_timer(CURLM *curlptr, long timeout_ms, void *userp)
+{
+  burrow_backend_t *backend = (burrow_backend_t *)userp;
+
+  (void)curlptr;
+  backend->timer_set = (timeout_ms >= 0);
+  if (backend->timer_set)
+    backend->timer_deadline = burrow_backend_http_now() + timeout_ms;
+  return 0;
+}
+
+/**
+ * Sets up a multi handle for the backend.
+ *
+ * @param backend pointer to a backend object
+ * @return the multi handle, or NULL if libcurl could not make one.
+ */
+static CURLM *
+burrow_backend_http_multi_init(burrow_backend_t *backend)
+{
+  backend->timer_set = false;
+  backend->curlptr = curl_multi_init();
+  if (backend->curlptr == NULL)
+    return NULL;
+  /* Requests fanned out beyond this many connections wait inside libcurl,
+     and only as many connections as there are pooled handles are kept */
+#if LIBCURL_VERSION_NUM >= 0x071e00 /* 7.30.0 */
+  curl_multi_setopt(backend->curlptr, CURLMOPT_MAX_HOST_CONNECTIONS,
+		    (long)backend->max_connections);
+#endif
+  curl_multi_setopt(backend->curlptr, CURLMOPT_MAXCONNECTS,
+		    (long)(backend->pool_size > 0 ? backend->pool_size : 1));
+  curl_multi_setopt(backend->curlptr, CURLMOPT_SOCKETFUNCTION,
+		    burrow_backend_http_socket);
+  curl_multi_setopt(backend->curlptr, CURLMOPT_SOCKETDATA, backend);
+  curl_multi_setopt(backend->curlptr, CURLMOPT_TIMERFUNCTION,
+		    burrow_backend_http_timer);
+  curl_multi_setopt(backend->curlptr, CURLMOPT_TIMERDATA, backend);
+  return backend->curlptr;
+}
+
+/**
+ * Cleans up pooled easy handles that have been idle for longer than the
+ * idle timeout, or beyond the pool size.
+ *
+ * @param backend pointer to a backend object
+ */
+static void
+burrow_backend_http_reap(burrow_backend_t *backend)
+{
+  int64_t oldest = burrow_backend_http_now() -
+    (int64_t)backend->idle_timeout * 1000;
+  int reaped = 0;
+
+  while (reaped < backend->pool_count &&
+	 (backend->pool_count - reaped > backend->pool_size ||
+	  backend->pool[reaped].idle_since < oldest))
+    curl_easy_cleanup(backend->pool[reaped++].chandle);
+
+  if (reaped == 0)
+    return;
+  backend->pool_count -= reaped;
+  memmove(backend->pool, backend->pool + reaped,
+	  backend->pool_count * sizeof(struct burrow_pooled_handle_st));
+}
+
+/**
+ * Gets an easy handle for a new request: the most recently used one from
+ * the pool, or a new one if the pool is empty.
+ *
+ * @param backend pointer to a backend object
+ * @return the easy handle, or NULL if libcurl could not make one.
+ */
+static CURL *
+burrow_backend_http_easy_get(burrow_backend_t *backend)
+{
+  burrow_backend_http_reap(backend);
+  if (backend->pool_count > 0)
+    return backend->pool[--backend->pool_count].chandle;
+  return curl_easy_init();
+}
+
+/**
+ * Gives back an easy handle that is done with its request.  It is reset
+ * and pooled for the next request, unless the pool is full.
+ *
+ * @param backend pointer to a backend object
+ * @param chandle the easy handle, no longer on the multi handle
+ */
+static void
+burrow_backend_http_easy_put(burrow_backend_t *backend, CURL *chandle)
+{
+  if (backend->pool_count >= backend->pool_size) {
+    curl_easy_cleanup(chandle);
+    return;
+  }
+
+  if (backend->pool == NULL) {
+    backend->pool = malloc(backend->pool_size *
+			   sizeof(struct burrow_pooled_handle_st));
+    if (backend->pool == NULL) {
+      curl_easy_cleanup(chandle);
+      return;
+    }
+  }
+
+  curl_easy_reset(chandle);
+  backend->pool[backend->pool_count].chandle = chandle;
+  backend->pool[backend->pool_count].idle_since = burrow_backend_http_now();
+  backend->pool_count++;
+}
+
+/**
+ * Checks libcurl's error code, reporting anything that went wrong.
+ *
+ * @param backend pointer to a backend object
+ * @param retval what libcurl returned
+ * @return 0 if all is well, EINVAL otherwise
+ */
+static int
+burrow_backend_http_check_multi(burrow_backend_t *backend, CURLMcode retval)
+{
+  /* Events for a socket libcurl has just let go of are of no consequence */
+  if (retval == CURLM_OK || retval == CURLM_BAD_SOCKET)
+    return 0;
+
+  // it appears some kind of error occured...
+  burrow_error(backend->burrow, EINVAL,
+	       "Call to libcurl failed(%d): %s\n",
+	       retval,
+	       curl_multi_strerror(retval));
+  return EINVAL;
+}
+
 /**
  * Process what we have been told to do, or as much of it as we can do without
- * blocking.
+ * blocking.  The socket work is driven by burrow_backend_http_event_raised;
+ * here libcurl's timer is run when it is due, and every transfer that
+ * completed is reported to the frontend.
  * @param ptr Pointer to backend object.
- * @return 0 if successful, errno if not.
+ * @return 0 if no transfers are left, EAGAIN if some are still running,
+ * errno if something went wrong with libcurl.
  */
 static int
 burrow_backend_http_process(void *ptr) {
   burrow_backend_t *backend = (burrow_backend_t *)ptr;
-  CURLMcode retval;
   int running_handles;
+  int64_t now = burrow_backend_http_now();
 
   burrow_log_debug(backend->burrow, "burrow_backend_http_process starting\n");
-  do {
-    retval = curl_multi_perform(backend->curlptr, &running_handles);
-  } while (retval == CURLM_CALL_MULTI_PERFORM);
-
-  burrow_log_debug(backend->burrow, "burrow_backend_http_process finished looking at stuff, running handles = %d\n", running_handles);
-
-  if (retval != CURLM_OK) {
-    // it appears some kind of error occured...
-    burrow_error(backend->burrow, EINVAL,
-		 "Call to libcurl failed(%d): %s\n",
-		 retval,
-		 curl_multi_strerror(retval));
-    return EINVAL;
+  while (backend->timer_set && backend->timer_deadline <= now) {
+    backend->timer_set = false;
+    if (burrow_backend_http_check_multi(backend,
+		curl_multi_socket_action(backend->curlptr, CURL_SOCKET_TIMEOUT,
+					 0, &running_handles)) != 0)
+      return EINVAL;
+    now = burrow_backend_http_now();
   }
+
   // At this point, the curl_multi interface didn't have a problem,
   // However, there could still have been errors on transfer...
   CURLMsg *curlmsg;
   int msgs_in_queue;
-  curlmsg = curl_multi_info_read(backend->curlptr, &msgs_in_queue);
-  while (curlmsg != NULL) {
-    if (curlmsg->data.result != CURLE_OK) {
-      burrow_error(backend->burrow, EINVAL,
-		   "Error transferring (%d): %s\n",
-		   curlmsg->data.result,
-		   curl_easy_strerror(curlmsg->data.result));
-      return EINVAL;
-    } else {
-      burrow_log_debug(backend->burrow,
-		       "Transfer completed successfully\n");
-    }
-    curlmsg = curl_multi_info_read(backend->curlptr, &msgs_in_queue);
+  while ((curlmsg = curl_multi_info_read(backend->curlptr, &msgs_in_queue))) {
+    burrow_transfer_t *transfer = 0;
+    if (curlmsg->msg != CURLMSG_DONE)
+      continue;
+    curl_easy_getinfo(curlmsg->easy_handle, CURLINFO_PRIVATE,
+		      (char **)&transfer);
+    burrow_backend_http_finish_transfer(transfer, curlmsg->data.result);
+    burrow_backend_http_destroy_transfer(transfer);
   }
 
-  /* If curl still monitoring fds, we need to tell burrow "frontend"
-     which ones to watch for.
-  */
-  if (running_handles > 0) {
-    fd_set read_fd_set, write_fd_set, exec_fd_set;
-    int max_fd = -1;
-    FD_ZERO(&read_fd_set); FD_ZERO(&write_fd_set); FD_ZERO(&exec_fd_set);
-    retval =
-      curl_multi_fdset(backend->curlptr, &read_fd_set,
-		       &write_fd_set, &exec_fd_set, &max_fd);
-    if (max_fd == -1)
-      return 0;
-    for (int i = 0; i <= max_fd; ++i) {
-      burrow_ioevent_t burrow_event = BURROW_IOEVENT_NONE;
-      if (FD_ISSET(i, &read_fd_set))
-	burrow_event |= BURROW_IOEVENT_READ;
-      if (FD_ISSET(i, &write_fd_set))
-	burrow_event |= BURROW_IOEVENT_WRITE;
-      if (FD_ISSET(i, &exec_fd_set))
-	burrow_error(backend->burrow,
-		     ENOTSUP,
-		     "ERROR! libcurl wants to monitor exceptions on file_descriptor=%d, not presently supported",
-		     i);
-      if (burrow_event != BURROW_IOEVENT_NONE) {
-	burrow_watch_fd(backend->burrow, i, burrow_event);
-      }
-    }
-    return EAGAIN;
-  } else {
-    /* this should mean I have retrieved everything I need... I hope.
-       therefore, process it.  The problem is, different commands can
-       give back different results.  More importantly, the same command
-       can produce different results depending on attributes.
-
-       For example, the get command will normall get JSON structures containg
-       one or more message.  But if the attributes say only get body, it
-       will only contain the body, not JSON.
-
-       As another example, the DELETE command will normally get nothing,
-       but if you use the detail attribute, it will get complete messages.
-       On the other hand, should be able to parse that as json, or ignore
-       it because empty...
-    */
-
-    burrow_command_t command = backend->burrow->cmd.command;
-
-    if ((command == BURROW_CMD_GET_MESSAGES) ||
-	(command == BURROW_CMD_GET_MESSAGE) ||
-	(command == BURROW_CMD_DELETE_MESSAGES) ||
-	(command == BURROW_CMD_DELETE_MESSAGE) ||
-	(command == BURROW_CMD_UPDATE_MESSAGES) ||
-	(command == BURROW_CMD_UPDATE_MESSAGE) ||
-	(command == BURROW_CMD_GET_ACCOUNTS) ||
-	(command == BURROW_CMD_GET_QUEUES)
-	)
-      {
-	if (backend->get_body_only)
-	  burrow_callback_message(backend->burrow,
-				  0,
-				  user_buffer_get_text(backend->buffer),
-				  user_buffer_get_size(backend->buffer),
-				  0);
-	else
-	  if (user_buffer_get_size(backend->buffer) > 0) {
-	    int json_return =
-	    burrow_backend_http_parse_json(backend,
-					   user_buffer_get_text(backend->buffer),
-					   user_buffer_get_size(backend->buffer));
-	    if (json_return > 0) {
-	      // apparently an error occured.
-	      burrow_error(backend->burrow,
-			   json_return,
-			   "Error occured while trying to parse JSON message: \"%s\"\n",
-			   user_buffer_get_text(backend->buffer)
-			   );
-	      return json_return;
-	    }
-	  }
-      }
+  if (backend->transfers == 0) {
+    burrow_backend_http_reap(backend);
     return 0;
   }
+
+  /* The sockets libcurl wants watched were handed to the burrow "frontend"
+     as libcurl reported them; only its timer is left to tell about. */
+  if (backend->timer_set)
+    burrow_watch_timeout(backend->burrow,
+			 (int32_t)(backend->timer_deadline - now));
+  return EAGAIN;
+}
+
+/**
+ * Abort every transfer in flight.  The frontend forgets the commands.
+ *
+ * @param ptr pointer to a backend object
+ */
+static void
+burrow_backend_http_cancel(void *ptr)
+{
+  burrow_backend_t *backend = (burrow_backend_t *)ptr;
+
+  while (backend->transfers)
+    burrow_backend_http_destroy_transfer(backend->transfers);
+
+  /* Start over with a new multi handle: libcurl may still be watching the
+     sockets of connections it keeps open, which burrow no longer does */
+  curl_multi_cleanup(backend->curlptr);
+  burrow_backend_http_unwatch_all(backend);
+  if (burrow_backend_http_multi_init(backend) == NULL)
+    burrow_error(backend->burrow, ENOMEM,
+		 "Failed to create a libcurl multi handle\n");
 }
 
 /**
  * Called to tell us that an event has occurred on a file descriptor we
- * previously requested be monitored.  We do not do anything when called,
- * as the caller will next need to call burrow_backend_http_process
+ * previously requested be monitored.  libcurl is told to deal with that
+ * socket alone; transfers it completes are reported by
+ * burrow_backend_http_process, which the caller will call next.
  *
  * @param ptr pointer to a backend object
  * @param fd file descriptor where something happened.
@@ -661,15 +1430,17 @@ burrow_backend_http_event_raised(void *ptr,
 				 int fd,
 				 burrow_ioevent_t event)
 {
-  /* stub.  we are ignoring this for now.*/
-  /* in future it would be good to pay attention, because without it
-     libcurl needs to check the descriptors before it knows which has
-     activity
-  */
-  (void)ptr;
-  (void)fd;
-  (void)event;
-  return 0;
+  burrow_backend_t *backend = (burrow_backend_t *)ptr;
+  int running_handles;
+  int mask = 0;
+
+  if (event & BURROW_IOEVENT_READ)
+    mask |= CURL_CSELECT_IN;
+  if (event & BURROW_IOEVENT_WRITE)
+    mask |= CURL_CSELECT_OUT;
+  return burrow_backend_http_check_multi(backend,
+	   curl_multi_socket_action(backend->curlptr, fd, mask,
+				    &running_handles));
 }
 
 /**
@@ -687,25 +1458,37 @@ burrow_backend_http_common_getlists(void *ptr, const burrow_command_st *cmd)
   size_t account_len = 0;
   const burrow_filters_st *filters = cmd->filters;
   burrow_st *burrow = backend->burrow;
-  burrow_command_t command = burrow->cmd.command;
+  burrow_command_t command = cmd->command;
   size_t urllen = 0;
   char *filter_str = 0;
   int filter_str_len;
-  backend->get_body_only = false;
+  char *url = 0;
+  size_t len_so_far = 0;
+  bool get_body_only = false;
+  int result = ENOMEM;
+
+  CURL *chandle = burrow_backend_http_easy_get(backend);
+  if (chandle == NULL) {
+    burrow_error(burrow, ENOMEM, "Failed to create a libcurl easy handle\n");
+    return ENOMEM;
+  }
 
-  CURL *chandle;
-  chandle = curl_easy_init();
   if (command == BURROW_CMD_GET_QUEUES) {
     account = curl_easy_escape(chandle, cmd->account, 0);
+    if (account == NULL) {
+      burrow_error(burrow, ENOMEM, "Failed to escape the URL\n");
+      goto cleanup;
+    }
     account_len = strlen(account);
   }
-  filter_str = burrow_backend_http_filters_to_string(backend, filters,
+  filter_str = burrow_backend_http_filters_to_string(chandle, filters,
 						     &filter_str_len);
   if ((filter_str == NULL) && (filter_str_len != 0)) {
     burrow_error(burrow,
 		 filter_str_len,
 		 "Attempt to create filterURL from filters failed\n");
-    return filter_str_len;
+    result = filter_str_len;
+    goto cleanup;
   }
   
   /* Build up the url, and pass to libcurl */
@@ -714,14 +1497,13 @@ burrow_backend_http_common_getlists(void *ptr, const burrow_command_st *cmd)
     account_len +
     (size_t)filter_str_len +
     128;
-  char *url = malloc(urllen);
+  url = malloc(urllen);
   if (url == NULL) {
     burrow_error(backend->burrow,
 		 ENOMEM,
 		 "Failed to malloc space for URL\n");
-    return ENOMEM;
+    goto cleanup;
   }
-  size_t len_so_far = 0;
 
   len_so_far = (size_t)snprintf(url, urllen, "%s/%s",
 				backend->baseurl,
@@ -729,47 +1511,36 @@ burrow_backend_http_common_getlists(void *ptr, const burrow_command_st *cmd)
 				);
 
   if (command == BURROW_CMD_GET_QUEUES) {
-    snprintf(url+len_so_far, urllen-len_so_far, "/%s", account);
-    curl_free(account);
+    len_so_far += (size_t)snprintf(url+len_so_far, urllen-len_so_far, "/%s",
+				   account);
+  }
+  if (filter_str != 0) {
+    snprintf(url+len_so_far, urllen-len_so_far, "?%s", filter_str);
   }
 
   curl_easy_setopt(chandle, CURLOPT_URL, url);
-  free(url); url = 0;
 
   curl_easy_setopt(chandle, CURLOPT_UPLOAD, 0L);
   curl_easy_setopt(chandle, CURLOPT_HTTPGET, 1L);
 
-  /* set up the buffer where libcurl will save what it reads */
-  user_buffer *buffer = user_buffer_create(0,0);
-  curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
-		   user_buffer_curl_write_function);
-  curl_easy_setopt(chandle, CURLOPT_WRITEDATA, buffer);
-
   curl_easy_setopt(chandle, CURLOPT_DEBUGFUNCTION,
 		   burrow_backend_http_curldebug);
   curl_easy_setopt(chandle, CURLOPT_DEBUGDATA, backend);
   curl_easy_setopt(chandle, CURLOPT_VERBOSE, 1);
   curl_easy_setopt(chandle, CURLOPT_HEADER, 0);
+  result = EAGAIN;
 
-  // Toss old curl handle, if present and different
-  if (backend->chandle) {
-    if (backend->chandle != chandle) {
-      curl_multi_remove_handle(backend->curlptr, backend->chandle);
-      curl_easy_cleanup(backend->chandle);
-      backend->chandle=chandle;
-      curl_multi_add_handle(backend->curlptr, chandle);
-    }
-  } else {
-    backend->chandle = chandle;
-    curl_multi_add_handle(backend->curlptr, chandle);
+cleanup:
+  curl_free(account);
+  free(filter_str);
+  free(url);
+  if (result != EAGAIN) {
+    burrow_backend_http_easy_put(backend, chandle);
+    return result;
   }
 
-  // Toss old buffer, if present.  Then set new one.
-  if (backend->buffer != 0)
-    user_buffer_destroy(backend->buffer);
-  backend->buffer = buffer;
-
-  return burrow_backend_http_process(backend);
+  return burrow_backend_http_start_transfer(backend, cmd, chandle, 0,
+					    get_body_only);
 }
 
 /**
@@ -814,26 +1585,38 @@ burrow_backend_http_common_delete(void *ptr, const burrow_command_st *cmd)
 
   const burrow_filters_st *filters = cmd->filters;
   burrow_st *burrow = backend->burrow;
-  burrow_command_t command = burrow->cmd.command;
+  burrow_command_t command = cmd->command;
   size_t urllen = 0;
   char *filter_str = 0;
   int filter_str_len;
+  char *url = 0;
+  size_t urllen_so_far;
+  bool get_body_only = false;
+  int result = ENOMEM;
+
+  CURL *chandle = burrow_backend_http_easy_get(backend);
+  if (chandle == NULL) {
+    burrow_error(burrow, ENOMEM, "Failed to create a libcurl easy handle\n");
+    return ENOMEM;
+  }
 
-  backend->get_body_only = false;
-  CURL *chandle;
-  chandle = curl_easy_init();
   if (command == BURROW_CMD_DELETE_QUEUES) {
     account = curl_easy_escape(chandle, cmd->account, 0);
+    if (account == NULL) {
+      burrow_error(burrow, ENOMEM, "Failed to escape the URL\n");
+      goto cleanup;
+    }
     account_len = strlen(account);
   }
 
-  filter_str = burrow_backend_http_filters_to_string(backend, filters,
+  filter_str = burrow_backend_http_filters_to_string(chandle, filters,
 						     &filter_str_len);
   if ((filter_str == NULL) && (filter_str_len != 0)) {
     burrow_error(burrow,
 		 filter_str_len,
 		 "Attempt to create URL type string from filters failed\n");
-    return filter_str_len;
+    result = filter_str_len;
+    goto cleanup;
   }
   urllen = backend->baseurl_len +
     backend->proto_version_len +
@@ -841,14 +1624,13 @@ burrow_backend_http_common_delete(void *ptr, const burrow_command_st *cmd)
     (size_t)filter_str_len +
     128;
 
-  char *url = malloc(urllen);
+  url = malloc(urllen);
   if (url == NULL) {
     burrow_error(backend->burrow,
 		 ENOMEM,
 		 "Failed to malloc space for URL\n");
-    return ENOMEM;
+    goto cleanup;
   }
-  size_t urllen_so_far;
 
   urllen_so_far = (size_t)snprintf(url, urllen, "%s/%s",
 				backend->baseurl,
@@ -861,50 +1643,35 @@ burrow_backend_http_common_delete(void *ptr, const burrow_command_st *cmd)
 			      urllen-urllen_so_far,
 			      "/%s",
 			      account);
-    curl_free(account); account = 0;
   }
   if (filter_str != 0) {
     urllen_so_far += 
       (size_t)snprintf(url+urllen_so_far, urllen-urllen_so_far, "?%s", filter_str);
-    free(filter_str); filter_str_len = 0;
   }
   curl_easy_setopt(chandle, CURLOPT_URL, url);
-  free(url); url = 0;
 
   /* Set random libcurl stuff */
   curl_easy_setopt(chandle, CURLOPT_UPLOAD, 0L);
   curl_easy_setopt(chandle, CURLOPT_CUSTOMREQUEST, "DELETE");
 
-  /* Setup buffer for libcurl to use for response */
-  user_buffer *buffer = user_buffer_create(0,0);
-  curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
-		   user_buffer_curl_write_function);
-  curl_easy_setopt(chandle, CURLOPT_WRITEDATA, buffer);
-
   curl_easy_setopt(chandle, CURLOPT_DEBUGFUNCTION,
 		   burrow_backend_http_curldebug);
   curl_easy_setopt(chandle, CURLOPT_DEBUGDATA, backend);
   curl_easy_setopt(chandle, CURLOPT_VERBOSE, 1);
   curl_easy_setopt(chandle, CURLOPT_HEADER, 0);
-  // Toss old curl handle, if present and different
-  if (backend->chandle) {
-    if (backend->chandle != chandle) {
-      curl_multi_remove_handle(backend->curlptr, backend->chandle);
-      curl_easy_cleanup(backend->chandle);
-      backend->chandle=chandle;
-      curl_multi_add_handle(backend->curlptr, chandle);
-    }
-  } else {
-    backend->chandle = chandle;
-    curl_multi_add_handle(backend->curlptr, chandle);
-  }
+  result = EAGAIN;
 
-  // Toss old buffer, if present
-  if (backend->buffer != 0)
-    user_buffer_destroy(backend->buffer);
-  backend->buffer = buffer;
+cleanup:
+  curl_free(account);
+  free(filter_str);
+  free(url);
+  if (result != EAGAIN) {
+    burrow_backend_http_easy_put(backend, chandle);
+    return result;
+  }
 
-  return burrow_backend_http_process(backend);
+  return burrow_backend_http_start_transfer(backend, cmd, chandle, 0,
+					    get_body_only);
 }
 
 /**
@@ -946,9 +1713,9 @@ burrow_backend_http_common_getting(void *ptr,
 				   const burrow_command_st *cmd)
 {  
   burrow_backend_t *backend = (burrow_backend_t *)ptr;
-  char *account;
+  char *account = 0;
   size_t account_len = 0;
-  char *queue;
+  char *queue = 0;
   size_t queue_len = 0;
   char *message_id = 0;
   size_t message_id_len = 0;
@@ -956,50 +1723,61 @@ burrow_backend_http_common_getting(void *ptr,
   const burrow_attributes_st *attributes = cmd->attributes;
   const burrow_filters_st *filters = cmd->filters;
   burrow_st *burrow = backend->burrow;
-  burrow_command_t command = burrow->cmd.command;
+  burrow_command_t command = cmd->command;
   size_t urllen = 0;
   char *filter_str = 0;
   int filter_str_len;
   char *attribute_str = 0;
+  int attribute_str_len = 0;
+  char *url = 0;
+  size_t urllen_so_far = 0;
+  bool get_body_only;
+  int result = ENOMEM;
 
   if ((filters) &&
       (burrow_filters_isset_detail(filters)) &&
       (burrow_filters_get_detail(filters) == BURROW_DETAIL_BODY))
-    backend->get_body_only = true;
+    get_body_only = true;
   else
-    backend->get_body_only = false;
+    get_body_only = false;
 
-  CURL *chandle;
+  CURL *chandle = burrow_backend_http_easy_get(backend);
+  if (chandle == NULL) {
+    burrow_error(burrow, ENOMEM, "Failed to create a libcurl easy handle\n");
+    return ENOMEM;
+  }
 
-  //if (backend->chandle) {
-  //chandle = backend->chandle;
-  //curl_easy_reset(chandle);
-  //} else {
-  chandle = curl_easy_init();
-    //}
   account = curl_easy_escape(chandle, cmd->account,0);
-  account_len = strlen(account);
   queue = curl_easy_escape(chandle, cmd->queue, 0);
+  if (account == NULL || queue == NULL) {
+    burrow_error(burrow, ENOMEM, "Failed to escape the URL\n");
+    goto cleanup;
+  }
+  account_len = strlen(account);
   queue_len = strlen(queue);
 
   if ((command == BURROW_CMD_UPDATE_MESSAGE) || (command == BURROW_CMD_DELETE_MESSAGE)||
       (command == BURROW_CMD_GET_MESSAGE))
     {
       message_id = curl_easy_escape(chandle, cmd->message_id, 0);
+      if (message_id == NULL) {
+	burrow_error(burrow, ENOMEM, "Failed to escape the URL\n");
+	goto cleanup;
+      }
       message_id_len = strlen(message_id);
     }
 
-  filter_str = burrow_backend_http_filters_to_string(backend, filters,
+  filter_str = burrow_backend_http_filters_to_string(chandle, filters,
 						     &filter_str_len);
   if ((filter_str == NULL) && (filter_str_len != 0)) {
     burrow_error(burrow,
 		 filter_str_len,
 		 "Attempt to create URL string from filters failed\n");
-    return filter_str_len;
+    result = filter_str_len;
+    goto cleanup;
   }
 
   // If this is an update, attributes are also sent.
-  int attribute_str_len = 0;
   if ((command == BURROW_CMD_UPDATE_MESSAGES) || (command == BURROW_CMD_UPDATE_MESSAGE))
     {
       attribute_str = burrow_backend_http_attributes_to_string(attributes,
@@ -1009,7 +1787,8 @@ burrow_backend_http_common_getting(void *ptr,
 	burrow_error(burrow,
 		     attribute_str_len,
 		     "Call to create string from attributes failed\n");
-	return attribute_str_len;
+	result = attribute_str_len;
+	goto cleanup;
       }
     }
     
@@ -1021,14 +1800,13 @@ burrow_backend_http_common_getting(void *ptr,
     (size_t)filter_str_len +
     (size_t)attribute_str_len +
     + 128;
-  char *url = malloc(urllen);
+  url = malloc(urllen);
   if (url == NULL) {
     burrow_error(backend->burrow,
 		 ENOMEM,
 		 "Failed to malloc space for URL\n");
-    return ENOMEM;
+    goto cleanup;
   }
-  size_t urllen_so_far = 0;
 
   urllen_so_far +=
     (size_t)snprintf(url, urllen, "%s/%s/%s/%s",
@@ -1036,15 +1814,12 @@ burrow_backend_http_common_getting(void *ptr,
 		     backend->proto_version,
 		     account,
 		     queue);
-  curl_free(account); account = 0;
-  curl_free(queue); queue = 0;
   if ((command == BURROW_CMD_UPDATE_MESSAGE) || (command == BURROW_CMD_DELETE_MESSAGE)||
       (command == BURROW_CMD_GET_MESSAGE))
     {
       urllen_so_far += 
 	(size_t)snprintf(url + urllen_so_far, urllen-urllen_so_far, "/%s",
 			 message_id);
-      curl_free(message_id); message_id = 0;
     }
   
   if (filter_str_len != 0) {
@@ -1052,7 +1827,6 @@ burrow_backend_http_common_getting(void *ptr,
       (size_t)snprintf(url + urllen_so_far, urllen - urllen_so_far,
 		       "?%s",
 		       filter_str);
-    // free filter_str later
   }
   if (attribute_str_len != 0) {
     if (filter_str != 0)
@@ -1062,11 +1836,6 @@ burrow_backend_http_common_getting(void *ptr,
     else
       urllen_so_far += 
 	(size_t)snprintf(url+urllen_so_far, urllen-urllen_so_far, "?%s", attribute_str);
-    free(attribute_str); attribute_str = 0;
-  }
-  if(filter_str != 0) {
-    free(filter_str);
-    filter_str = 0;
   }
 
   burrow_log_debug(backend->burrow,
@@ -1074,7 +1843,6 @@ burrow_backend_http_common_getting(void *ptr,
 		   url);
 
   curl_easy_setopt(chandle, CURLOPT_URL, url);
-  free(url); url=0;
 
   /* set up libcurl command and related stuff... */
   if ((command == BURROW_CMD_GET_MESSAGES) || (command == BURROW_CMD_GET_MESSAGE)){
@@ -1091,12 +1859,6 @@ burrow_backend_http_common_getting(void *ptr,
     curl_easy_setopt(chandle, CURLOPT_CUSTOMREQUEST, "DELETE");
   }
 
-  /* setup buffer for libcurl to use for response */
-  user_buffer *buffer = user_buffer_create(0,0);
-  curl_easy_setopt(chandle, CURLOPT_WRITEFUNCTION,
-		   user_buffer_curl_write_function);
-  curl_easy_setopt(chandle, CURLOPT_WRITEDATA, buffer);
-
   if ((command == BURROW_CMD_UPDATE_MESSAGE) ||
       (command == BURROW_CMD_UPDATE_MESSAGES)) {
     curl_easy_setopt(chandle, CURLOPT_READFUNCTION,
@@ -1108,26 +1870,22 @@ burrow_backend_http_common_getting(void *ptr,
   curl_easy_setopt(chandle, CURLOPT_DEBUGDATA, backend);
   curl_easy_setopt(chandle, CURLOPT_VERBOSE, 1);
   curl_easy_setopt(chandle, CURLOPT_HEADER, 0);
-
-  // Toss old curl handle, if present and different
-  if (backend->chandle) {
-    if (backend->chandle != chandle) {
-      curl_multi_remove_handle(backend->curlptr, backend->chandle);
-      curl_easy_cleanup(backend->chandle);
-      backend->chandle=chandle;
-      curl_multi_add_handle(backend->curlptr, chandle);
-    }
-  } else {
-    backend->chandle = chandle;
-    curl_multi_add_handle(backend->curlptr, chandle);
+  result = EAGAIN;
+
+cleanup:
+  curl_free(account);
+  curl_free(queue);
+  curl_free(message_id);
+  free(filter_str);
+  free(attribute_str);
+  free(url);
+  if (result != EAGAIN) {
+    burrow_backend_http_easy_put(backend, chandle);
+    return result;
   }
 
-  // Toss old buffer, if present
-  if (backend->buffer != 0)
-    user_buffer_destroy(backend->buffer);
-  backend->buffer = buffer;
-
-  return burrow_backend_http_process(backend);
+  return burrow_backend_http_start_transfer(backend, cmd, chandle, 0,
+					    get_body_only);
 }
 
 /**
@@ -1217,8 +1975,9 @@ burrow_backend_functions_st burrow_backend_http_functions = {
   .size = &burrow_backend_http_size,
 
   .set_option = &burrow_backend_http_set_option,
-  .set_option_int = NULL,
+  .set_option_int = &burrow_backend_http_set_option_int,
 
+  .cancel = &burrow_backend_http_cancel,
   .event_raised = &burrow_backend_http_event_raised,
 
   .get_accounts = &burrow_backend_http_get_accounts,
@@ -1235,6 +1994,7 @@ burrow_backend_functions_st burrow_backend_http_functions = {
   .update_message = &burrow_backend_http_update_message,
   .delete_message = &burrow_backend_http_delete_message,
   .create_message = &burrow_backend_http_create_message,
+  .create_messages = &burrow_backend_http_create_messages,
 
   .process = &burrow_backend_http_process,
 };
@@ -33,12 +33,8 @@ extern burrow_backend_functions_st burrow_backend_http_functions;
 
 typedef struct burrow_backend_st burrow_backend_t;
 
-burrow_command_t  burrow_backend_http_get_command(burrow_backend_t *backend);
-
 burrow_st *burrow_backend_http_get_burrow(burrow_backend_t *backend);
 
-CURL *burrow_backend_http_get_curl_easy_handle(burrow_backend_t *backend);
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,676 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Adrian Miranda
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief A fast JSON decoder for http responses.
+ *
+ * The contrib JSON_parser takes every byte through its state table.  Almost
+ * all of a burrow response is the inside of strings (ids and bodies), so
+ * this decoder finds the end of a string -- the next quote, backslash or
+ * control character -- 16 or 32 bytes at a time with SSE2 or AVX2, and
+ * copies the run between them in one go.  Only the structural characters
+ * outside strings are looked at one at a time.
+ *
+ * It makes the same callbacks, with the same values, as the contrib parser
+ * does, so the same callback decodes either one's output.  Like the contrib
+ * parser it takes the response in pieces, as they arrive, and a string,
+ * number or escape may be split between any two of them.  Unlike it, it
+ * does not accept comments, which burrow servers never send.
+ */
+
+#include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "json_fast.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_FAST_HAVE_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define JSON_FAST_HAVE_AVX2
+#endif
+
+/* What is allowed next, outside of any string, number or literal */
+typedef enum {
+  EXPECT_TOP,           /* the object or array that is the whole response */
+  EXPECT_VALUE,         /* after a ':', or a ',' in an array */
+  EXPECT_VALUE_OR_END,  /* just after a '[' */
+  EXPECT_KEY,           /* after a ',' in an object */
+  EXPECT_KEY_OR_END,    /* just after a '{' */
+  EXPECT_COLON,
+  EXPECT_COMMA_OR_END,
+  EXPECT_NOTHING        /* the response is complete */
+} json_fast_expect_t;
+
+/* What the bytes being read are part of */
+typedef enum {
+  LEX_NONE,
+  LEX_STRING,
+  LEX_ESCAPE,   /* just after a backslash in a string */
+  LEX_UNICODE,  /* in the four hex digits of a \u escape */
+  LEX_NUMBER,
+  LEX_LITERAL   /* true, false or null */
+} json_fast_lex_t;
+
+/* Returns the first quote, backslash or control character in [p, end) */
+typedef const char *(*json_fast_scan_fn)(const char *p, const char *end);
+
+struct json_fast_st {
+  JSON_parser_callback callback;
+  void *ctx;
+  json_fast_scan_fn scan;
+
+  char *stack; /* '{' or '[' for each open container */
+  int stack_size;
+  int depth;
+  int max_depth; /* or -1 for no limit, the stack growing as needed */
+
+  json_fast_expect_t expect;
+  json_fast_lex_t lex;
+  bool is_key; /* the string being read is an object key */
+
+  /* The string, number or literal being read, kept NUL terminated */
+  char *buf;
+  size_t len;
+  size_t size;
+
+  uint32_t unicode; /* \u escape being read */
+  int unicode_digits;
+  uint32_t high_surrogate; /* first half of a \u pair, or 0 */
+};
+
+static const char *
+json_fast_scan_scalar(const char *p, const char *end)
+{
+  while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+    p++;
+  return p;
+}
+
+#ifdef JSON_FAST_HAVE_SSE2
+static const char *
+json_fast_scan_sse2(const char *p, const char *end)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    /* control characters are those no bigger than 0x1f, unsigned */
+    __m128i hits =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+				_mm_cmpeq_epi8(chunk, backslash)),
+		   _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz((unsigned)mask);
+    p += 16;
+  }
+  return json_fast_scan_scalar(p, end);
+}
+#endif
+
+#ifdef JSON_FAST_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *
+json_fast_scan_avx2(const char *p, const char *end)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+
+  while (end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hits =
+      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+				      _mm256_cmpeq_epi8(chunk, backslash)),
+		      _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control),
+					control));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return json_fast_scan_scalar(p, end);
+}
+
+static bool
+json_fast_have_avx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/**
+ * Looks up the decoder named by the "json_decoder" backend option.
+ *
+ * @param name "contrib", "fast", "scalar", "sse2" or "avx2"
+ * @param mode set to the decoder, if it can be used
+ * @return 0 if successful, EINVAL if the name is unknown, or ENOTSUP if
+ * this build or cpu can't run that decoder.
+ */
+int
+json_fast_mode_by_name(const char *name, json_fast_mode_t *mode)
+{
+  if (strcmp(name, "contrib") == 0)
+    *mode = JSON_FAST_OFF;
+  else if (strcmp(name, "fast") == 0)
+    *mode = JSON_FAST_BEST;
+  else if (strcmp(name, "scalar") == 0)
+    *mode = JSON_FAST_SCALAR;
+  else if (strcmp(name, "sse2") == 0) {
+#ifdef JSON_FAST_HAVE_SSE2
+    *mode = JSON_FAST_SSE2;
+#else
+    return ENOTSUP;
+#endif
+  } else if (strcmp(name, "avx2") == 0) {
+#ifdef JSON_FAST_HAVE_AVX2
+    if (!json_fast_have_avx2())
+      return ENOTSUP;
+    *mode = JSON_FAST_AVX2;
+#else
+    return ENOTSUP;
+#endif
+  } else
+    return EINVAL;
+  return 0;
+}
+
+/**
+ * Creates a decoder.  Only the callback, callback_ctx and depth of the
+ * config are used, a negative depth allowing any nesting, as it does for
+ * JSON_parser.
+ *
+ * @param config as for new_JSON_parser
+ * @param mode which string scanner to use; JSON_FAST_BEST picks the widest
+ * one the cpu supports
+ * @return a new decoder, or NULL if malloc failed.
+ */
+json_fast *
+json_fast_create(const JSON_config *config, json_fast_mode_t mode)
+{
+  json_fast *jf = malloc(sizeof(json_fast));
+  if (jf == NULL)
+    return 0;
+
+  jf->callback = config->callback;
+  jf->ctx = config->callback_ctx;
+  jf->max_depth = config->depth;
+  jf->size = 64;
+
+  jf->scan = json_fast_scan_scalar;
+#ifdef JSON_FAST_HAVE_SSE2
+  if (mode == JSON_FAST_SSE2 || mode == JSON_FAST_BEST)
+    jf->scan = json_fast_scan_sse2;
+#endif
+#ifdef JSON_FAST_HAVE_AVX2
+  if ((mode == JSON_FAST_AVX2 || mode == JSON_FAST_BEST) &&
+      json_fast_have_avx2())
+    jf->scan = json_fast_scan_avx2;
+#endif
+
+  jf->stack_size = jf->max_depth > 0 ? jf->max_depth : 16;
+  jf->stack = malloc((size_t)jf->stack_size);
+  jf->buf = malloc(jf->size);
+  if (jf->stack == NULL || jf->buf == NULL) {
+    json_fast_destroy(jf);
+    return 0;
+  }
+  json_fast_reset(jf);
+  return jf;
+}
+
+/**
+ * Readies a decoder for another JSON text, keeping its buffers.
+ *
+ * @param jf the decoder
+ */
+void
+json_fast_reset(json_fast *jf)
+{
+  jf->depth = 0;
+  jf->expect = EXPECT_TOP;
+  jf->lex = LEX_NONE;
+  jf->is_key = false;
+  jf->len = 0;
+  jf->buf[0] = 0;
+  jf->unicode = 0;
+  jf->unicode_digits = 0;
+  jf->high_surrogate = 0;
+}
+
+/**
+ * Deletes a decoder made by json_fast_create
+ *
+ * @param jf the decoder
+ */
+void
+json_fast_destroy(json_fast *jf)
+{
+  free(jf->stack);
+  free(jf->buf);
+  free(jf);
+}
+
+/* Adds bytes to the string, number or literal being read */
+static int
+json_fast_append(json_fast *jf, const char *data, size_t size)
+{
+  if (jf->len + size + 1 > jf->size) {
+    size_t size_needed = jf->size * 2;
+    char *buf;
+
+    if (size_needed < jf->len + size + 1)
+      size_needed = jf->len + size + 1;
+    buf = realloc(jf->buf, size_needed);
+    if (buf == NULL)
+      return 0;
+    jf->buf = buf;
+    jf->size = size_needed;
+  }
+  memcpy(jf->buf + jf->len, data, size);
+  jf->len += size;
+  jf->buf[jf->len] = 0;
+  return 1;
+}
+
+/* Adds a code point to the string being read, as UTF-8 */
+static int
+json_fast_append_utf8(json_fast *jf, uint32_t code)
+{
+  char utf8[4];
+  size_t size;
+
+  if (code < 0x80) {
+    utf8[0] = (char)code;
+    size = 1;
+  } else if (code < 0x800) {
+    utf8[0] = (char)(0xc0 | (code >> 6));
+    utf8[1] = (char)(0x80 | (code & 0x3f));
+    size = 2;
+  } else if (code < 0x10000) {
+    utf8[0] = (char)(0xe0 | (code >> 12));
+    utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    utf8[2] = (char)(0x80 | (code & 0x3f));
+    size = 3;
+  } else {
+    utf8[0] = (char)(0xf0 | (code >> 18));
+    utf8[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    utf8[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    utf8[3] = (char)(0x80 | (code & 0x3f));
+    size = 4;
+  }
+  return json_fast_append(jf, utf8, size);
+}
+
+/* Takes in a complete \u escape, pairing up surrogates */
+static int
+json_fast_unicode(json_fast *jf)
+{
+  uint32_t code = jf->unicode;
+
+  if (code >= 0xd800 && code < 0xdc00) {
+    if (jf->high_surrogate)
+      return 0;
+    jf->high_surrogate = code;
+    return 1;
+  }
+  if (code >= 0xdc00 && code < 0xe000) {
+    if (!jf->high_surrogate)
+      return 0;
+    code = 0x10000 + ((jf->high_surrogate - 0xd800) << 10) + (code - 0xdc00);
+    jf->high_surrogate = 0;
+  }
+  return json_fast_append_utf8(jf, code);
+}
+
+/* Called as each value is completed */
+static void
+json_fast_value_done(json_fast *jf)
+{
+  jf->expect = jf->depth == 0 ? EXPECT_NOTHING : EXPECT_COMMA_OR_END;
+}
+
+static int
+json_fast_emit(json_fast *jf, int type, const JSON_value *value)
+{
+  return jf->callback == NULL || jf->callback(jf->ctx, type, value);
+}
+
+static int
+json_fast_end_string(json_fast *jf)
+{
+  JSON_value value;
+
+  if (jf->high_surrogate)
+    return 0;
+  value.vu.str.value = jf->buf;
+  value.vu.str.length = jf->len;
+  if (jf->is_key) {
+    jf->expect = EXPECT_COLON;
+    return json_fast_emit(jf, JSON_T_KEY, &value);
+  }
+  json_fast_value_done(jf);
+  return json_fast_emit(jf, JSON_T_STRING, &value);
+}
+
+/* Checks the number being read against the JSON grammar, and passes it on
+   as an integer or a float */
+static int
+json_fast_end_number(json_fast *jf)
+{
+  JSON_value value;
+  const char *p = jf->buf;
+  bool is_float = false;
+
+  if (*p == '-')
+    p++;
+  if (*p == '0')
+    p++;
+  else if (*p >= '1' && *p <= '9')
+    while (*p >= '0' && *p <= '9')
+      p++;
+  else
+    return 0;
+  if (*p == '.') {
+    is_float = true;
+    if (*++p < '0' || *p > '9')
+      return 0;
+    while (*p >= '0' && *p <= '9')
+      p++;
+  }
+  if (*p == 'e' || *p == 'E') {
+    is_float = true;
+    if (*++p == '+' || *p == '-')
+      p++;
+    if (*p < '0' || *p > '9')
+      return 0;
+    while (*p >= '0' && *p <= '9')
+      p++;
+  }
+  if (*p != 0)
+    return 0;
+
+  json_fast_value_done(jf);
+  if (is_float) {
+    value.vu.float_value = strtod(jf->buf, NULL);
+    return json_fast_emit(jf, JSON_T_FLOAT, &value);
+  }
+  value.vu.integer_value = (JSON_int_t)strtoll(jf->buf, NULL, 10);
+  return json_fast_emit(jf, JSON_T_INTEGER, &value);
+}
+
+static int
+json_fast_end_literal(json_fast *jf)
+{
+  int type;
+
+  if (strcmp(jf->buf, "true") == 0)
+    type = JSON_T_TRUE;
+  else if (strcmp(jf->buf, "false") == 0)
+    type = JSON_T_FALSE;
+  else if (strcmp(jf->buf, "null") == 0)
+    type = JSON_T_NULL;
+  else
+    return 0;
+  json_fast_value_done(jf);
+  return json_fast_emit(jf, type, NULL);
+}
+
+static bool
+json_fast_expects_value(const json_fast *jf)
+{
+  return jf->expect == EXPECT_VALUE || jf->expect == EXPECT_VALUE_OR_END;
+}
+
+/* Makes room for more open containers, when there's no limit on them */
+static int
+json_fast_grow_stack(json_fast *jf)
+{
+  char *stack = realloc(jf->stack, (size_t)jf->stack_size * 2);
+
+  if (stack == NULL)
+    return 0;
+  jf->stack = stack;
+  jf->stack_size *= 2;
+  return 1;
+}
+
+/* Handles one character outside of any string, number or literal */
+static int
+json_fast_structural(json_fast *jf, char c)
+{
+  switch (c) {
+  case '{':
+  case '[':
+    if (!json_fast_expects_value(jf) && jf->expect != EXPECT_TOP)
+      return 0;
+    if (jf->max_depth >= 0 && jf->depth == jf->max_depth)
+      return 0;
+    if (jf->depth == jf->stack_size && !json_fast_grow_stack(jf))
+      return 0;
+    jf->stack[jf->depth++] = c;
+    jf->expect = c == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+    return json_fast_emit(jf, c == '{' ? JSON_T_OBJECT_BEGIN
+			  : JSON_T_ARRAY_BEGIN, NULL);
+  case '}':
+    if (jf->depth == 0 || jf->stack[jf->depth - 1] != '{' ||
+	(jf->expect != EXPECT_KEY_OR_END && jf->expect != EXPECT_COMMA_OR_END))
+      return 0;
+    jf->depth--;
+    json_fast_value_done(jf);
+    return json_fast_emit(jf, JSON_T_OBJECT_END, NULL);
+  case ']':
+    if (jf->depth == 0 || jf->stack[jf->depth - 1] != '[' ||
+	(jf->expect != EXPECT_VALUE_OR_END && jf->expect != EXPECT_COMMA_OR_END))
+      return 0;
+    jf->depth--;
+    json_fast_value_done(jf);
+    return json_fast_emit(jf, JSON_T_ARRAY_END, NULL);
+  case ':':
+    if (jf->expect != EXPECT_COLON)
+      return 0;
+    jf->expect = EXPECT_VALUE;
+    return 1;
+  case ',':
+    if (jf->expect != EXPECT_COMMA_OR_END)
+      return 0;
+    jf->expect = jf->stack[jf->depth - 1] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+    return 1;
+  case '"':
+    if (jf->expect == EXPECT_KEY || jf->expect == EXPECT_KEY_OR_END)
+      jf->is_key = true;
+    else if (json_fast_expects_value(jf))
+      jf->is_key = false;
+    else
+      return 0;
+    jf->lex = LEX_STRING;
+    jf->len = 0;
+    jf->buf[0] = 0;
+    return 1;
+  case '-':
+  case '0': case '1': case '2': case '3': case '4':
+  case '5': case '6': case '7': case '8': case '9':
+    if (!json_fast_expects_value(jf))
+      return 0;
+    jf->lex = LEX_NUMBER;
+    jf->len = 0;
+    return json_fast_append(jf, &c, 1);
+  case 't':
+  case 'f':
+  case 'n':
+    if (!json_fast_expects_value(jf))
+      return 0;
+    jf->lex = LEX_LITERAL;
+    jf->len = 0;
+    return json_fast_append(jf, &c, 1);
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Decodes the next piece of a JSON text, making callbacks for everything
+ * completed in it.
+ *
+ * @param jf the decoder
+ * @param text the piece of JSON text
+ * @param size its size
+ * @return 1 if successful, or 0 if the JSON is bad or a callback failed.
+ */
+int
+json_fast_parse(json_fast *jf, const char *text, size_t size)
+{
+  const char *p = text;
+  const char *end = text + size;
+
+  while (p < end) {
+    const char *stop;
+    char c;
+
+    switch (jf->lex) {
+    case LEX_STRING:
+      stop = jf->scan(p, end);
+      if (stop > p && !json_fast_append(jf, p, (size_t)(stop - p)))
+	return 0;
+      if (stop > p && jf->high_surrogate)
+	return 0;
+      p = stop;
+      if (p == end)
+	break;
+      c = *p++;
+      if (c == '\\')
+	jf->lex = LEX_ESCAPE;
+      else if (c == '"') {
+	jf->lex = LEX_NONE;
+	if (!json_fast_end_string(jf))
+	  return 0;
+      } else
+	return 0; /* unescaped control character */
+      break;
+
+    case LEX_ESCAPE:
+      c = *p++;
+      jf->lex = LEX_STRING;
+      if (c == 'u') {
+	jf->lex = LEX_UNICODE;
+	jf->unicode = 0;
+	jf->unicode_digits = 0;
+	break;
+      }
+      if (jf->high_surrogate)
+	return 0;
+      switch (c) {
+      case '"': case '\\': case '/': break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      default: return 0;
+      }
+      if (!json_fast_append(jf, &c, 1))
+	return 0;
+      break;
+
+    case LEX_UNICODE:
+      c = *p++;
+      jf->unicode <<= 4;
+      if (c >= '0' && c <= '9')
+	jf->unicode |= (uint32_t)(c - '0');
+      else if (c >= 'a' && c <= 'f')
+	jf->unicode |= (uint32_t)(c - 'a' + 10);
+      else if (c >= 'A' && c <= 'F')
+	jf->unicode |= (uint32_t)(c - 'A' + 10);
+      else
+	return 0;
+      if (++jf->unicode_digits == 4) {
+	jf->lex = LEX_STRING;
+	if (!json_fast_unicode(jf))
+	  return 0;
+      }
+      break;
+
+    case LEX_NUMBER:
+      for (stop = p; stop < end && ((*stop >= '0' && *stop <= '9') ||
+				    *stop == '.' || *stop == 'e' ||
+				    *stop == 'E' || *stop == '+' ||
+				    *stop == '-'); stop++)
+	;
+      if (stop > p && !json_fast_append(jf, p, (size_t)(stop - p)))
+	return 0;
+      p = stop;
+      if (p < end) {
+	jf->lex = LEX_NONE;
+	if (!json_fast_end_number(jf))
+	  return 0;
+      }
+      break;
+
+    case LEX_LITERAL:
+      for (stop = p; stop < end && *stop >= 'a' && *stop <= 'z'; stop++)
+	;
+      if (stop > p && !json_fast_append(jf, p, (size_t)(stop - p)))
+	return 0;
+      p = stop;
+      if (p < end) {
+	jf->lex = LEX_NONE;
+	if (!json_fast_end_literal(jf))
+	  return 0;
+      }
+      break;
+
+    case LEX_NONE:
+      c = *p++;
+      if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+	break;
+      if (jf->expect == EXPECT_NOTHING || !json_fast_structural(jf, c))
+	return 0;
+      break;
+
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Called once the whole JSON text has been passed to json_fast_parse.
+ *
+ * @param jf the decoder
+ * @return 1 if the text was one complete object or array (or, as with
+ * JSON_parser_done, nothing but whitespace), otherwise 0.
+ */
+int
+json_fast_done(json_fast *jf)
+{
+  return jf->lex == LEX_NONE &&
+    (jf->expect == EXPECT_NOTHING || jf->expect == EXPECT_TOP);
+}
@@ -0,0 +1,57 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Adrian Miranda
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Declarations for the fast JSON decoder, a drop-in alternative to
+ * the contrib JSON_parser that makes the same callbacks.
+ */
+
+#include <libburrow/backends/http/parser/contrib/JSON_PARSER/JSON_parser.h>
+
+/**
+ * Which decoder parses http responses, set with the "json_decoder" backend
+ * option.
+ */
+typedef enum {
+  JSON_FAST_OFF,     /* "contrib": the contrib JSON_parser, byte by byte */
+  JSON_FAST_BEST,    /* "fast": the widest string scanner the cpu has */
+  JSON_FAST_SCALAR,  /* "scalar" */
+  JSON_FAST_SSE2,    /* "sse2" */
+  JSON_FAST_AVX2     /* "avx2" */
+} json_fast_mode_t;
+
+#ifdef BURROW_HTTP_FAST_JSON
+#define JSON_FAST_DEFAULT JSON_FAST_BEST
+#else
+#define JSON_FAST_DEFAULT JSON_FAST_OFF
+#endif
+
+typedef struct json_fast_st json_fast;
+
+int json_fast_mode_by_name(const char *name, json_fast_mode_t *mode);
+
+json_fast *json_fast_create(const JSON_config *config, json_fast_mode_t mode);
+
+void json_fast_reset(json_fast *jf);
+
+void json_fast_destroy(json_fast *jf);
+
+int json_fast_parse(json_fast *jf, const char *text, size_t size);
+
+int json_fast_done(json_fast *jf);
@@ -32,59 +32,124 @@
 #include "dmalloc.h"
 #endif
 
+#include "json_fast.h"
 #include "json_processing.h"
-#include <libburrow/backends/http/parser/contrib/JSON_PARSER/JSON_parser.h>
 
+/* The message keys the callback knows about */
+typedef enum {
+  JSON_KEY_OTHER,
+  JSON_KEY_ID,
+  JSON_KEY_BODY,
+  JSON_KEY_HIDE,
+  JSON_KEY_TTL
+} json_key_t;
+
+/*
+ * A json_processing_t is reused for response after response, so that once
+ * its buffers have grown to fit the messages being received, decoding them
+ * allocates nothing.
+ */
 struct json_processing_st {
   burrow_backend_t* backend;
+  const burrow_command_st *cmd;
+  json_fast_mode_t mode;
+  struct JSON_parser_struct *jc; /* the contrib parser, or */
+  json_fast *jf; /* the fast decoder */
+  size_t offset; /* bytes of the response parsed so far */
   char *body;
   size_t body_size;
-  char *message_id;
+  size_t body_alloc;
+  bool has_body;
+  char *message_id; /* also holds account and queue names */
+  size_t message_id_alloc;
+  bool has_message_id;
   int is_key;
-  char *key;
+  json_key_t key;
+  char key_name[32]; /* only kept for error messages */
   burrow_attributes_st *attributes;
-
+  json_processing_t *next; /* in the backend's list of idle ones */
 };
 
 /**
- * create a new json_processing_st
+ * Makes sure one of the buffers kept in the json_processing_t can hold
+ * size bytes, growing it geometrically.
  *
- * @param backend pointer to a burrow_backend_t
- * @return pointer to a new json_processing_st, or NULL if malloc failed.
+ * @param jproc the json_processing_t the buffer belongs to
+ * @param buf the buffer
+ * @param alloc its current size
+ * @param size the size needed
+ * @return 1 if good, 0 if realloc failed
  */
-static json_processing_t*
-burrow_easy_json_st_create(burrow_backend_t* backend)
+static int
+burrow_backend_http_json_reserve(json_processing_t *jproc, char **buf,
+				 size_t *alloc, size_t size)
 {
-  json_processing_t *jproc = malloc(sizeof(json_processing_t));
-  if (jproc == NULL)
+  size_t new_alloc;
+  char *new_buf;
+
+  if (size <= *alloc)
+    return 1;
+  new_alloc = *alloc ? *alloc * 2 : 64;
+  if (new_alloc < size)
+    new_alloc = size;
+  new_buf = realloc(*buf, new_alloc);
+  if (new_buf == NULL) {
+    burrow_error(burrow_backend_http_get_burrow(jproc->backend),
+		 ENOMEM,
+		 "ERROR!  malloc failed during JSON parsing");
     return 0;
-  jproc->backend = backend;
-  jproc->body = 0;
-  jproc->body_size = 0;
-  jproc->message_id = 0;
-  jproc->is_key = 0;
-  jproc->key = 0;
-  jproc->attributes = burrow_attributes_create(0, 0);
-  return jproc;
+  }
+  *buf = new_buf;
+  *alloc = new_alloc;
+  return 1;
+}
+
+static int
+burrow_backend_http_json_hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
 }
 
 /**
- * delete a previously allocated json_processing_t object
- *
- * @param jproc pointer to a json_processing_t object
+ * Decodes the %XX escapes in a string sent by the server, as
+ * curl_easy_unescape does, into the message_id buffer.
  *
+ * @param jproc the json_processing_t
+ * @param value the JSON string
+ * @return the unescaped string, or NULL if realloc failed
  */
-static void
-burrow_easy_json_st_destroy(json_processing_t *jproc) {
-  if (jproc->body)
-    free(jproc->body);
-  if (jproc->message_id)
-    free(jproc->message_id);
-  if (jproc->key)
-    free(jproc->key);
-  if (jproc->attributes)
-    burrow_attributes_destroy(jproc->attributes);
-  free(jproc);
+static char *
+burrow_backend_http_json_unescape(json_processing_t *jproc,
+				  const JSON_value *value)
+{
+  const char *src = value->vu.str.value;
+  const char *end = src + value->vu.str.length;
+  char *dst;
+
+  if (!burrow_backend_http_json_reserve(jproc, &jproc->message_id,
+					&jproc->message_id_alloc,
+					value->vu.str.length + 1))
+    return 0;
+
+  dst = jproc->message_id;
+  while (src < end) {
+    int high, low;
+    if (*src == '%' && end - src >= 3 &&
+	(high = burrow_backend_http_json_hex(src[1])) >= 0 &&
+	(low = burrow_backend_http_json_hex(src[2])) >= 0) {
+      *dst++ = (char)(high << 4 | low);
+      src += 3;
+    } else
+      *dst++ = *src++;
+  }
+  *dst = 0;
+  return jproc->message_id;
 }
 
 /**
@@ -106,7 +171,7 @@ static int burrow_backend_http_json_callback(void *ctx,
   json_processing_t* jproc = (json_processing_t *)ctx;
 
   // determine what command is being processed.
-  burrow_command_t bcommand = burrow_backend_http_get_command(jproc->backend);
+  burrow_command_t bcommand = jproc->cmd->command;
 
   /* This section is for commands that return burrow messages, whether they
      return one message or a list of messages.
@@ -122,10 +187,7 @@ static int burrow_backend_http_json_callback(void *ctx,
       switch(type) {
       case JSON_T_ARRAY_BEGIN:
       case JSON_T_ARRAY_END:
-	break;
       case JSON_T_OBJECT_BEGIN:
-	// make sure we have attributes, and they are unset
-	jproc->attributes = burrow_attributes_create(jproc->attributes, 0);
 	break;
       case JSON_T_OBJECT_END:
 	/*
@@ -134,79 +196,58 @@ static int burrow_backend_http_json_callback(void *ctx,
 	 * to the appropriate callback.
 	 */
 	burrow_callback_message(burrow_backend_http_get_burrow(jproc->backend),
-				jproc->message_id,
-				(uint8_t *)jproc->body,
+				jproc->has_message_id ? jproc->message_id : 0,
+				jproc->has_body ? (uint8_t *)jproc->body : 0,
 				jproc->body_size,
 				jproc->attributes);
-	/* clean up for the next message, in case there is one */
-	if (jproc->message_id) {
-	  free(jproc->message_id);
-	  jproc->message_id = 0;
-	}
-	if (jproc->body) {
-	  free(jproc->body);
-	  jproc->body = 0;
-	}
+	/* clean up for the next message, in case there is one; the
+	   buffers are kept for it */
+	jproc->has_message_id = false;
+	jproc->has_body = false;
 	jproc->body_size = 0;
-	/* Make sure we have a clean set of attributes */
-	if (jproc->attributes) {
-	  burrow_attributes_unset_all(jproc->attributes);
-	} else {
-	  jproc->attributes = burrow_attributes_create(0,0);
-	}
-
+	burrow_attributes_unset_all(jproc->attributes);
 	break;
       case JSON_T_KEY:
 	// We don't check if the key is valid until later,
 	// when we have the value
 	jproc->is_key = 1;
-	if (jproc->key)
-	  free(jproc->key);
-
-	jproc->key = malloc(value->vu.str.length + 1);
-	if (jproc->key == NULL) {
-	  burrow_error(burrow_backend_http_get_burrow(jproc->backend),
-		       ENOMEM,
-		       "ERROR!  malloc failed during JSON parsing");
-	  return 0;
+	if (strcmp(value->vu.str.value, "id") == 0)
+	  jproc->key = JSON_KEY_ID;
+	else if (strcmp(value->vu.str.value, "body") == 0)
+	  jproc->key = JSON_KEY_BODY;
+	else if (strcmp(value->vu.str.value, "hide") == 0)
+	  jproc->key = JSON_KEY_HIDE;
+	else if (strcmp(value->vu.str.value, "ttl") == 0)
+	  jproc->key = JSON_KEY_TTL;
+	else {
+	  jproc->key = JSON_KEY_OTHER;
+	  snprintf(jproc->key_name, sizeof(jproc->key_name), "%s",
+		   value->vu.str.value);
 	}
-	memcpy(jproc->key, value->vu.str.value, value->vu.str.length + 1);
 	break;
       case JSON_T_STRING:
 	// Now check if key is valid
 	if(jproc->is_key) {
 	  jproc->is_key = 0;
-	  if (strcmp(jproc->key, "id") == 0) {
-	    char *message_id =
-	      curl_easy_unescape(burrow_backend_http_get_curl_easy_handle(jproc->backend),
-				 value->vu.str.value,
-				 0, 0);
-	    if (jproc->message_id)
-	      free(jproc->message_id);
-	    size_t len = strlen(message_id);
-	    jproc->message_id = malloc(len + 1);
-	    if(jproc->message_id == NULL) {
-	      burrow_error(burrow_backend_http_get_burrow(jproc->backend),
-			   ENOMEM,
-			   "ERROR!  malloc failed!\n");
+	  if (jproc->key == JSON_KEY_ID) {
+	    if (burrow_backend_http_json_unescape(jproc, value) == NULL)
 	      return 0;
-	    }
-	    memcpy(jproc->message_id, message_id, len + 1);
-	    curl_free(message_id);
-	  } else if (strcmp(jproc->key, "body") == 0) {
-	    jproc->body_size = value->vu.str.length;
-	    jproc->body = malloc(jproc->body_size);
-	    if (jproc->body == 0) {
-	      burrow_error(burrow_backend_http_get_burrow(jproc->backend),
-			   ENOMEM,
-			   "ERROR!  malloc failed!\n");
+	    jproc->has_message_id = true;
+	  } else if (jproc->key == JSON_KEY_BODY) {
+	    if (!burrow_backend_http_json_reserve(jproc, &jproc->body,
+						  &jproc->body_alloc,
+						  value->vu.str.length + 1))
 	      return 0;
-	    }
+	    jproc->body_size = value->vu.str.length;
 	    memcpy(jproc->body, value->vu.str.value, jproc->body_size + 1);
+	    jproc->has_body = true;
 	  } else {
 	    burrow_error(burrow_backend_http_get_burrow(jproc->backend),
 			 EINVAL,
-			 "ERROR!  unrecognized string valued key \"%s\"=\"%s\"\n", jproc->key, value->vu.str.value);
+			 "ERROR!  unrecognized string valued key \"%s\"=\"%s\"\n",
+			 jproc->key == JSON_KEY_OTHER ? jproc->key_name
+			 : jproc->key == JSON_KEY_HIDE ? "hide" : "ttl",
+			 value->vu.str.value);
 	    return 0;
 	  }
 	} else {
@@ -218,17 +259,19 @@ static int burrow_backend_http_json_callback(void *ctx,
       case JSON_T_INTEGER:
 	if(jproc->is_key) {
 	  jproc->is_key = 0;
-	  if (strcmp(jproc->key, "hide") == 0) {
+	  if (jproc->key == JSON_KEY_HIDE) {
 	    burrow_attributes_set_hide(jproc->attributes,
 				       (uint32_t)value->vu.integer_value);
-	  } else if (strcmp(jproc->key, "ttl") == 0) {
+	  } else if (jproc->key == JSON_KEY_TTL) {
 	    burrow_attributes_set_ttl(jproc->attributes,
 				      (uint32_t)value->vu.integer_value);
 	  } else {
 	     burrow_error(burrow_backend_http_get_burrow(jproc->backend),
 			  EINVAL,
 			  "WARNING! JSON parsing found unrecognized integer key \"%s\"=%d\n",
-			  jproc->key, value->vu.integer_value);
+			  jproc->key == JSON_KEY_OTHER ? jproc->key_name
+			  : jproc->key == JSON_KEY_ID ? "id" : "body",
+			  value->vu.integer_value);
 	    return 0;
 	  }
 	}
@@ -247,6 +290,8 @@ static int burrow_backend_http_json_callback(void *ctx,
       /* This section is for commands that return lists of strings, such as when
        * you list the queues or the accounts
        */
+      char *name;
+
       switch(type) {
       case JSON_T_ARRAY_BEGIN:
 	break;
@@ -254,18 +299,15 @@ static int burrow_backend_http_json_callback(void *ctx,
 	/* Does not seem to be anything to do here. */
 	break;
       case JSON_T_STRING:
+	name = burrow_backend_http_json_unescape(jproc, value);
+	if (name == NULL)
+	  return 0;
 	if (bcommand == BURROW_CMD_GET_ACCOUNTS) {
-	  char *account = curl_easy_unescape(burrow_backend_http_get_curl_easy_handle(jproc->backend),
-					     value->vu.str.value, 0,0);
 	  burrow_callback_account(burrow_backend_http_get_burrow(jproc->backend),
-				  account);
-	  curl_free(account);
+				  name);
 	} else if (bcommand == BURROW_CMD_GET_QUEUES) {
-	  char *queue = curl_easy_unescape(burrow_backend_http_get_curl_easy_handle(jproc->backend),
-					   value->vu.str.value, 0,0);
 	  burrow_callback_queue(burrow_backend_http_get_burrow(jproc->backend),
-				queue);
-	  curl_free(queue);
+				name);
 	}
 	break;
       default:
@@ -283,57 +325,200 @@ static int burrow_backend_http_json_callback(void *ctx,
 }
 
 /**
- * Process a JSON object that we got from the burrow server.
- * Presently intended to be called on a complete JSON thingie. In future
- * perhaps this should be extended so it can be called on an incomplete
- * JSON response, allowing us to start parsing before we get the entire
- * message.
+ * Get a parser for the JSON response to a command.  The response can
+ * then be handed over in pieces as it arrives, and callbacks are made for
+ * each account, queue or message as soon as it is complete.
+ *
+ * One left idle by burrow_backend_http_json_release is reused if there is
+ * one, otherwise a new one is made.
  *
  * @param backend the http backend
- * @param jsontext the actual JSON text we got from the burrow server
- * @param jsonsize the size of the JSON text we got from the burrow server
- * @return 0 if successful, otherwise errno value if it fails.
+ * @param cmd the command whose response is being parsed
+ * @param mode which decoder to use
+ * @param idle the backend's list of idle json_processing_t
+ * @return pointer to a json_processing_t, or NULL if malloc failed.
  */
-int
-burrow_backend_http_parse_json(burrow_backend_t *backend,
-			       char *jsontext,
-			       size_t jsonsize)
+json_processing_t *
+burrow_backend_http_json_create(burrow_backend_t *backend,
+				const burrow_command_st *cmd,
+				json_fast_mode_t mode,
+				json_processing_t **idle)
 {
   JSON_config config;
-  struct JSON_parser_struct* jc = NULL;
-  init_JSON_config(&config);
-  
-  json_processing_t *json_processing = burrow_easy_json_st_create(backend);
+  json_processing_t *jproc;
 
+  /* Those made for another decoder are of no more use */
+  while (*idle && (*idle)->mode != mode) {
+    jproc = *idle;
+    *idle = jproc->next;
+    burrow_backend_http_json_destroy(jproc);
+  }
+  if (*idle) {
+    jproc = *idle;
+    *idle = jproc->next;
+    jproc->cmd = cmd;
+    jproc->next = 0;
+    return jproc;
+  }
+
+  jproc = malloc(sizeof(json_processing_t));
+  if (jproc == NULL)
+    return 0;
+  jproc->backend = backend;
+  jproc->cmd = cmd;
+  jproc->mode = mode;
+  jproc->offset = 0;
+  jproc->body = 0;
+  jproc->body_size = 0;
+  jproc->body_alloc = 0;
+  jproc->has_body = false;
+  jproc->message_id = 0;
+  jproc->message_id_alloc = 0;
+  jproc->has_message_id = false;
+  jproc->is_key = 0;
+  jproc->key = JSON_KEY_OTHER;
+  jproc->key_name[0] = 0;
+  jproc->next = 0;
+  jproc->attributes = burrow_attributes_create(0, 0);
+  jproc->jc = 0;
+  jproc->jf = 0;
+
+  init_JSON_config(&config);
   config.depth                  = 19;
   config.callback               = &burrow_backend_http_json_callback;
-  config.callback_ctx		= json_processing;
+  config.callback_ctx		= jproc;
   config.allow_comments         = 1;
   config.handle_floats_manually = 0;
-  jc = new_JSON_parser(&config);
+  if (mode == JSON_FAST_OFF)
+    jproc->jc = new_JSON_parser(&config);
+  else
+    jproc->jf = json_fast_create(&config, mode);
+
+  if (jproc->attributes == NULL || (jproc->jc == NULL && jproc->jf == NULL)) {
+    burrow_backend_http_json_destroy(jproc);
+    return 0;
+  }
+  return jproc;
+}
+
+/**
+ * Done with a json_processing_t for now: reset it, and keep it for the
+ * next response.
+ *
+ * @param jproc pointer to a json_processing_t object
+ * @param idle the backend's list of idle json_processing_t
+ */
+void
+burrow_backend_http_json_release(json_processing_t *jproc,
+				 json_processing_t **idle)
+{
+  if (jproc->jc && !JSON_parser_reset(jproc->jc)) {
+    burrow_backend_http_json_destroy(jproc);
+    return;
+  }
+  if (jproc->jf)
+    json_fast_reset(jproc->jf);
+  jproc->cmd = 0;
+  jproc->offset = 0;
+  jproc->body_size = 0;
+  jproc->has_body = false;
+  jproc->has_message_id = false;
+  jproc->is_key = 0;
+  burrow_attributes_unset_all(jproc->attributes);
+  jproc->next = *idle;
+  *idle = jproc;
+}
+
+/**
+ * delete a previously created json_processing_t object
+ *
+ * @param jproc pointer to a json_processing_t object
+ */
+void
+burrow_backend_http_json_destroy(json_processing_t *jproc) {
+  if (jproc->jc)
+    delete_JSON_parser(jproc->jc);
+  if (jproc->jf)
+    json_fast_destroy(jproc->jf);
+  if (jproc->body)
+    free(jproc->body);
+  if (jproc->message_id)
+    free(jproc->message_id);
+  if (jproc->attributes)
+    burrow_attributes_destroy(jproc->attributes);
+  free(jproc);
+}
 
-  int i;
-  for (i = 0; i < (int)jsonsize; ++i) {
+/**
+ * delete every json_processing_t in a list of idle ones
+ *
+ * @param idle the backend's list of idle json_processing_t
+ */
+void
+burrow_backend_http_json_destroy_idle(json_processing_t **idle) {
+  while (*idle) {
+    json_processing_t *jproc = *idle;
+    *idle = jproc->next;
+    burrow_backend_http_json_destroy(jproc);
+  }
+}
+/**
+ * Parse the next piece of a JSON response from the burrow server.
+ *
+ * @param jproc the parser for the response
+ * @param jsontext the piece of JSON text that just arrived
+ * @param jsonsize its size
+ * @return 0 if successful, otherwise EINVAL if the JSON is bad.
+ */
+int
+burrow_backend_http_json_parse(json_processing_t *jproc,
+			       const char *jsontext,
+			       size_t jsonsize)
+{
+  size_t i;
+
+  if (jproc->jf) {
+    if (!json_fast_parse(jproc->jf, jsontext, jsonsize)) {
+      burrow_error(burrow_backend_http_get_burrow(jproc->backend),
+		   EINVAL,
+		   "WARNING! JSON syntax error in bytes %d to %d\n",
+		   (int)jproc->offset, (int)(jproc->offset + jsonsize));
+      return EINVAL;
+    }
+    jproc->offset += jsonsize;
+    return 0;
+  }
+
+  for (i = 0; i < jsonsize; ++i) {
     int retval;
     int nextchar = jsontext[i];
-    if ((retval = JSON_parser_char(jc, nextchar)) <= 0) {
-      burrow_error(burrow_backend_http_get_burrow(backend),
+    if ((retval = JSON_parser_char(jproc->jc, nextchar)) <= 0) {
+      burrow_error(burrow_backend_http_get_burrow(jproc->backend),
 		   EINVAL,
 		   "WARNING! JSON_parser_char (%d) at byte %d (%d = '%c')\n",
-		   retval, i, (int)nextchar, nextchar);
+		   retval, (int)(jproc->offset + i), (int)nextchar, nextchar);
       return EINVAL;
     }
-  }    
-  if (!JSON_parser_done(jc)) {
-    burrow_error(burrow_backend_http_get_burrow(backend),
+  }
+  jproc->offset += jsonsize;
+  return 0;
+}
+
+/**
+ * Called once the whole JSON response has been parsed.
+ *
+ * @param jproc the parser for the response
+ * @return 0 if the response was complete (or empty), otherwise EINVAL.
+ */
+int
+burrow_backend_http_json_done(json_processing_t *jproc)
+{
+  if (jproc->offset > 0 &&
+      !(jproc->jf ? json_fast_done(jproc->jf) : JSON_parser_done(jproc->jc))) {
+    burrow_error(burrow_backend_http_get_burrow(jproc->backend),
 		 EINVAL,
 		 "WARNING! JSON_parser_end indicates JSON syntax error\n");
-    delete_JSON_parser(jc);
-    burrow_easy_json_st_destroy(json_processing);
     return EINVAL;
   }
-  delete_JSON_parser(jc);
-  burrow_easy_json_st_destroy(json_processing);
   return 0;
 }
-
@@ -23,6 +23,20 @@
 
 typedef struct json_processing_st json_processing_t;
 
-int burrow_backend_http_parse_json(burrow_backend_t *backend,
-				   char *jsontext,
+json_processing_t *burrow_backend_http_json_create(burrow_backend_t *backend,
+						   const burrow_command_st *cmd,
+						   json_fast_mode_t mode,
+						   json_processing_t **idle);
+
+void burrow_backend_http_json_release(json_processing_t *jproc,
+				      json_processing_t **idle);
+
+void burrow_backend_http_json_destroy(json_processing_t *jproc);
+
+void burrow_backend_http_json_destroy_idle(json_processing_t **idle);
+
+int burrow_backend_http_json_parse(json_processing_t *jproc,
+				   const char *jsontext,
 				   size_t jsonsize);
+
+int burrow_backend_http_json_done(json_processing_t *jproc);
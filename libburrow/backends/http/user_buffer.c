@@ -31,11 +31,15 @@
 
 struct user_buffer_st {
   size_t size;
-  size_t where;
+  size_t where; /* how much has been read out */
+  size_t capacity; /* bytes allocated at buf */
   char *buf;
   bool malloced;
 };
 
+/* Smallest allocation made when data first arrives */
+#define USER_BUFFER_MIN_CAPACITY 4096
+
 
 #include "user_buffer.h"
 
@@ -75,21 +79,77 @@ user_buffer_create_sized(user_buffer *buffer, const uint8_t *data, size_t data_s
     buffer->malloced = false;
   }
   buffer->where = 0;
-  if (data == 0) {
-    buffer->buf = 0;
-    buffer->size = 0;
-  } else {
-    buffer->buf = malloc(data_size);
-    if (buffer->buf == NULL){
+  buffer->buf = 0;
+  buffer->size = 0;
+  buffer->capacity = 0;
+  if (data != 0 && (!user_buffer_reserve(buffer, data_size) ||
+		    !user_buffer_append(buffer, data, data_size))) {
+    if (buffer->malloced)
       free(buffer);
-      return 0;
-    }
-    memcpy(buffer->buf, data, data_size);
-    buffer->size = data_size;
+    return 0;
   }
   return buffer;
 }  
 
+/**
+ * Makes sure a user_buffer has room for capacity bytes, so that data up
+ * to that size can be added without reallocating.
+ *
+ * @param buffer pointer to a user_buffer
+ * @param capacity bytes wanted
+ * @return true if successful, false if realloc failed
+ */
+bool
+user_buffer_reserve(user_buffer *buffer, size_t capacity) {
+  char *buf;
+
+  if (capacity <= buffer->capacity)
+    return true;
+  buf = realloc(buffer->buf, capacity);
+  if (buf == NULL)
+    return false;
+  buffer->buf = buf;
+  buffer->capacity = capacity;
+  return true;
+}
+
+/**
+ * Adds data to the end of a user_buffer.  The buffer grows geometrically,
+ * so that filling it a piece at a time copies each byte a bounded number
+ * of times.
+ *
+ * @param buffer pointer to a user_buffer
+ * @param data the data
+ * @param data_size its size
+ * @return true if successful, false if realloc failed
+ */
+bool
+user_buffer_append(user_buffer *buffer, const uint8_t *data, size_t data_size) {
+  if (buffer->size + data_size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2
+      : USER_BUFFER_MIN_CAPACITY;
+    while (capacity < buffer->size + data_size)
+      capacity *= 2;
+    if (!user_buffer_reserve(buffer, capacity))
+      return false;
+  }
+  if (data_size > 0)
+    memcpy(buffer->buf + buffer->size, data, data_size);
+  buffer->size += data_size;
+  return true;
+}
+
+/**
+ * Empties a user_buffer for reuse, keeping its memory.
+ *
+ * @param buffer pointer to a user_buffer
+ */
+void
+user_buffer_clear(user_buffer *buffer) {
+  buffer->size = 0;
+  buffer->where = 0;
+}
+
 /**
  * Destroys a previously allocated user_buffer.
  *
@@ -114,6 +174,17 @@ user_buffer_get_text(const user_buffer *buffer) {
   return buffer->buf;
 }
 
+/**
+ * Returns how much a user_buffer can hold without reallocating
+ *
+ * @param buffer pointer to a user_buffer
+ * @return its capacity in bytes
+ */
+size_t
+user_buffer_get_capacity(const user_buffer *buffer){
+  return buffer->capacity;
+}
+
 /**
  * Returns the amount of data within a user_buffer
  *
@@ -140,23 +211,8 @@ user_buffer_curl_write_function(char *data, size_t size, size_t nmemb, void *use
 {
   user_buffer *userd = (user_buffer *)userdata;
   size_t len = size * nmemb;
-  if (userd->size != 0) {
-    if (userd->buf != 0) {
-      char *temp = (char *)realloc(userd->buf, userd->size + len);
-      if (temp == NULL) 
-	return 0;
-      userd->buf = temp;
-      userd->size += len;
-    }
-  } else {
-    userd->size = len;
-    userd->buf = malloc(len);
-    if (userd->buf == 0)
-      return 0;
-    userd->where = 0;
-  }
-  memcpy(userd->buf + userd->where, data, len);
-  userd->where += len;
+  if (!user_buffer_append(userd, (const uint8_t *)data, len))
+    return 0;
   return len;
 }
 
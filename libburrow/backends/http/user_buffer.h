@@ -37,6 +37,12 @@ user_buffer *user_buffer_create(user_buffer *buffer, const uint8_t *data);
 
 void user_buffer_destroy(struct user_buffer_st *buffer);
 
+bool user_buffer_reserve(user_buffer *buffer, size_t capacity);
+
+bool user_buffer_append(user_buffer *buffer, const uint8_t *data, size_t data_size);
+
+void user_buffer_clear(user_buffer *buffer);
+
 size_t user_buffer_curl_write_function(char *data, size_t size, size_t nmemb, void *userdata);
 
 size_t user_buffer_curl_read_function(char *data, size_t size, size_t nmemb, void *userdata);
@@ -46,3 +52,5 @@ size_t user_buffer_curl_read_nothing_function(char *data, size_t size, size_t nm
 char *user_buffer_get_text(const user_buffer *buffer);
 
 size_t user_buffer_get_size(const user_buffer *buffer);
+
+size_t user_buffer_get_capacity(const user_buffer *buffer);
@@ -0,0 +1,1581 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Journal backend implementation
+ *
+ * Commands are served from a memory backend of the journal's own, and
+ * every change they make to it is appended to a log, in a directory of
+ * segments: hex-numbered files, "<n>.log", each written once in order and
+ * never reopened. Changes are logged as what they did rather than as the
+ * commands that did them, so that replaying them later gives the same
+ * messages whatever the time: a message created or updated with the time
+ * it expires, and one deleted by its id.
+ *
+ * Records are kept in a buffer until committed, with one write and one
+ * fdatasync for all of them. A command that changed anything stays in
+ * flight until then, which is once burrow_process() has started every
+ * command queued with it, or later, with the "commit_interval" option, to
+ * let more commands share the same commit.
+ *
+ * Once enough segments have filled up, the log is compacted: a child
+ * process writes what the index holds, as it was then, to a snapshot,
+ * "<n>.snap", while commands go on being logged to the segments after it.
+ * Everything before the snapshot is removed once it is on disk, as seen
+ * by the next burrow_process(). Opening the journal replays the latest
+ * snapshot and the segments after it, dropping a record cut short at the
+ * very end.
+ */
+
+#include <libburrow/common.h>
+#include "journal.h"
+#include "../memory/memory.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_DEFAULT_PATH "burrow.journal"
+#define JOURNAL_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define JOURNAL_DEFAULT_COMPACT_SEGMENTS 8
+#define JOURNAL_MIN_SEGMENT_SIZE 4096
+
+/* Messages live five minutes unless given a ttl, as with the memory
+   backend */
+#define JOURNAL_DEFAULT_TTL 300
+
+/* How much of a snapshot is buffered before it's written */
+#define JOURNAL_SNAPSHOT_BUFFER (1024 * 1024)
+
+typedef enum
+{
+  JOURNAL_CREATE = 1,
+  JOURNAL_UPDATE,
+  JOURNAL_DELETE,
+  JOURNAL_DELETE_QUEUE,
+  JOURNAL_DELETE_ACCOUNT
+} journal_record_t;
+
+/* Every record starts with this, followed by the account, queue and
+   message id, each with its nul, and the body */
+typedef struct
+{
+  uint32_t size;           /* of the whole record */
+  uint32_t checksum;       /* of all of it after this field */
+  uint16_t type;
+  uint16_t account_size;
+  uint16_t queue_size;
+  uint16_t id_size;
+  uint32_t body_size;
+  uint32_t ttl;            /* both in seconds since the epoch */
+  uint32_t hide;
+} journal_record_st;
+
+/* What is done with the callbacks the index makes during a command */
+typedef enum
+{
+  CAPTURE_NONE,
+  CAPTURE_QUIET,           /* dropped, while replaying */
+  CAPTURE_UPDATE,          /* messages reported are logged as updated */
+  CAPTURE_DELETE,          /* or deleted, and reported on to the user */
+  CAPTURE_NAMES,           /* queue and account names are collected */
+  CAPTURE_SNAPSHOT         /* messages are written to a snapshot */
+} journal_capture_t;
+
+typedef struct
+{
+  int selfallocated;
+  burrow_st *burrow;
+  void *memory;            /* the index commands are served from */
+
+  char path[PATH_MAX];
+  int32_t commit_interval; /* milliseconds */
+  uint32_t segment_size;
+  uint32_t compact_segments;
+
+  bool opened;             /* and replayed, on the first command */
+  int dir_fd;
+  int fd;                  /* the segment appended to */
+  uint32_t segment;
+  uint64_t segment_bytes;
+  uint32_t sealed;         /* segments filled since the last snapshot */
+  pid_t compact_pid;       /* of the child writing a snapshot, if any */
+  uint32_t compact_segment;
+  uint32_t compact_sealed; /* what sealed was when it started */
+
+  /* Records not yet committed, or a snapshot being written */
+  char *buffer;
+  size_t buffer_size;
+  size_t buffer_used;
+  int64_t buffer_since;
+
+  /* While a command runs against the index */
+  journal_capture_t capture;
+  const burrow_command_st *cmd;
+  uint32_t now;
+  int capture_result;
+  int snapshot_fd;
+  burrow_message_fn *message_fn;
+  burrow_detail_t detail;  /* of what the user is reported */
+  char *names;
+  size_t names_size;
+  size_t names_used;
+} burrow_backend_journal_st;
+
+static int64_t _now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t _checksum(const char *data, size_t size)
+{
+  /* FNV-1a, enough to tell a record cut short or never written */
+  uint32_t hash = 2166136261u;
+
+  while (size--)
+    hash = (hash ^ (uint8_t)*data++) * 16777619;
+
+  return hash;
+}
+
+static int _reserve(burrow_backend_journal_st *self, char **buffer,
+                    size_t *size, size_t needed)
+{
+  size_t new_size = *size ? *size : 4096;
+  char *new_buffer;
+
+  if (needed <= *size)
+    return 0;
+
+  while (new_size < needed)
+    new_size *= 2;
+
+  new_buffer = burrow_malloc(self->burrow, new_size);
+  if (!new_buffer)
+  {
+    burrow_log_error(self->burrow, "journal: couldn't allocate buffer");
+    return ENOMEM;
+  }
+
+  if (*buffer)
+  {
+    memcpy(new_buffer, *buffer, *size);
+    burrow_free(self->burrow, *buffer);
+  }
+
+  *buffer = new_buffer;
+  *size = new_size;
+  return 0;
+}
+
+/* Adds a record to the buffer */
+static int _append(burrow_backend_journal_st *self,
+                   journal_record_t type,
+                   const char *account,
+                   const char *queue,
+                   const char *message_id,
+                   const void *body,
+                   size_t body_size,
+                   uint32_t ttl,
+                   uint32_t hide)
+{
+  size_t account_size = strlen(account) + 1;
+  size_t queue_size = queue ? strlen(queue) + 1 : 0;
+  size_t id_size = message_id ? strlen(message_id) + 1 : 0;
+  journal_record_st record;
+  char *data;
+  int result;
+
+  if (account_size > UINT16_MAX || queue_size > UINT16_MAX ||
+      id_size > UINT16_MAX || body_size > UINT32_MAX / 2)
+  {
+    burrow_log_error(self->burrow, "journal: record too large to log");
+    return EINVAL;
+  }
+
+  record.size = (uint32_t)(sizeof(record) + account_size + queue_size +
+                           id_size + body_size);
+  record.type = (uint16_t)type;
+  record.account_size = (uint16_t)account_size;
+  record.queue_size = (uint16_t)queue_size;
+  record.id_size = (uint16_t)id_size;
+  record.body_size = (uint32_t)body_size;
+  record.ttl = ttl;
+  record.hide = hide;
+
+  if ((result = _reserve(self, &self->buffer, &self->buffer_size,
+                         self->buffer_used + record.size)))
+    return result;
+
+  if (!self->buffer_used)
+    self->buffer_since = _now_ms();
+
+  data = self->buffer + self->buffer_used;
+  memcpy(data + sizeof(record), account, account_size);
+  if (queue_size)
+    memcpy(data + sizeof(record) + account_size, queue, queue_size);
+  if (id_size)
+    memcpy(data + sizeof(record) + account_size + queue_size, message_id,
+           id_size);
+  if (body_size)
+    memcpy(data + sizeof(record) + account_size + queue_size + id_size,
+           body, body_size);
+
+  memcpy(data, &record, sizeof(record));
+  record.checksum = _checksum(data + 8, record.size - 8);
+  memcpy(data + 4, &record.checksum, sizeof(record.checksum));
+
+  self->buffer_used += record.size;
+  return 0;
+}
+
+static int _append_create(burrow_backend_journal_st *self,
+                          const burrow_command_st *cmd,
+                          const char *message_id,
+                          const void *body,
+                          size_t body_size,
+                          const burrow_attributes_st *attributes,
+                          uint32_t now)
+{
+  uint32_t ttl = now + JOURNAL_DEFAULT_TTL;
+  uint32_t hide = 0;
+
+  if (attributes && (attributes->set & BURROW_ATTRIBUTES_TTL))
+    ttl = now + attributes->ttl;
+  if (attributes && (attributes->set & BURROW_ATTRIBUTES_HIDE) &&
+      attributes->hide)
+    hide = now + attributes->hide;
+
+  return _append(self, JOURNAL_CREATE, cmd->account, cmd->queue, message_id,
+                 body, body_size, ttl, hide);
+}
+
+static int _write_all(int fd, const char *data, size_t size)
+{
+  while (size)
+  {
+    ssize_t written = write(fd, data, size);
+
+    if (written == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+
+    data += written;
+    size -= (size_t)written;
+  }
+
+  return 0;
+}
+
+/* Capturing callbacks from the index: */
+
+static void _capture_message(burrow_st *burrow,
+                             const char *message_id,
+                             const void *body,
+                             size_t body_size,
+                             const burrow_attributes_st *attributes)
+{
+  burrow_backend_journal_st *self = burrow->backend_context;
+  const burrow_command_st *cmd = self->cmd;
+  uint32_t ttl = self->now + (attributes ? attributes->ttl : 0);
+  uint32_t hide = attributes && attributes->hide ?
+                  self->now + attributes->hide : 0;
+  int result = 0;
+
+  switch (self->capture)
+  {
+  case CAPTURE_UPDATE:
+    result = _append(self, JOURNAL_UPDATE, cmd->account, cmd->queue,
+                     message_id, NULL, 0, ttl, hide);
+    break;
+
+  case CAPTURE_DELETE:
+    result = _append(self, JOURNAL_DELETE, cmd->account, cmd->queue,
+                     message_id, NULL, 0, 0, 0);
+    break;
+
+  case CAPTURE_SNAPSHOT:
+    result = _append(self, JOURNAL_CREATE, cmd->account, cmd->queue,
+                     message_id, body, body_size, ttl, hide);
+    if (!result && self->buffer_used >= JOURNAL_SNAPSHOT_BUFFER)
+    {
+      result = _write_all(self->snapshot_fd, self->buffer,
+                          self->buffer_used);
+      self->buffer_used = 0;
+    }
+    break;
+
+  case CAPTURE_NONE:
+  case CAPTURE_QUIET:
+  case CAPTURE_NAMES:
+  default:
+    return;
+  }
+
+  if (result && !self->capture_result)
+    self->capture_result = result;
+  if (self->capture == CAPTURE_SNAPSHOT)
+    return;
+
+  /* The index reported what the log needed, the user only gets what was
+     asked for */
+  if (!self->message_fn || self->detail == BURROW_DETAIL_NONE)
+    return;
+  if (self->detail != BURROW_DETAIL_BODY && self->detail != BURROW_DETAIL_ALL)
+  {
+    body = NULL;
+    body_size = 0;
+  }
+  if (self->detail != BURROW_DETAIL_ATTRIBUTES &&
+      self->detail != BURROW_DETAIL_ALL)
+    attributes = NULL;
+
+  self->message_fn(burrow, message_id, body, body_size, attributes);
+}
+
+static void _capture_name(burrow_st *burrow, const char *name)
+{
+  burrow_backend_journal_st *self = burrow->backend_context;
+  size_t size = strlen(name) + 1;
+
+  if (_reserve(self, &self->names, &self->names_size,
+               self->names_used + size))
+  {
+    self->capture_result = ENOMEM;
+    return;
+  }
+
+  memcpy(self->names + self->names_used, name, size);
+  self->names_used += size;
+}
+
+/* How much of each message the user asked to have reported */
+static burrow_detail_t _detail(const burrow_command_st *cmd)
+{
+  if (cmd->filters && (cmd->filters->set & BURROW_FILTERS_DETAIL))
+    return cmd->filters->detail;
+
+  return BURROW_DETAIL_ALL;
+}
+
+/* Commands reach the index as a copy when it must report more of each
+   message than the user asked for, for the log to have what they did, or
+   when they have the wait filter set, as the index only waits for a
+   process of its own, which the journal doesn't run */
+static const burrow_command_st *_index_command(const burrow_command_st *cmd,
+                                               burrow_detail_t needed,
+                                               burrow_command_st *copy,
+                                               burrow_filters_st *filters)
+{
+  burrow_detail_t detail = _detail(cmd);
+
+  /* Only BURROW_DETAIL_ALL has both attributes and bodies */
+  if (detail == BURROW_DETAIL_NONE ||
+      (detail == BURROW_DETAIL_ID && needed == BURROW_DETAIL_ATTRIBUTES))
+    detail = needed;
+  else if (detail == BURROW_DETAIL_BODY && needed == BURROW_DETAIL_ATTRIBUTES)
+    detail = BURROW_DETAIL_ALL;
+
+  if (detail == _detail(cmd) &&
+      !(cmd->filters && (cmd->filters->set & BURROW_FILTERS_WAIT)))
+    return cmd;
+
+  if (cmd->filters)
+    *filters = *cmd->filters;
+  else
+    memset(filters, 0, sizeof(*filters));
+  filters->set = (filters->set & ~BURROW_FILTERS_WAIT) | BURROW_FILTERS_DETAIL;
+  filters->wait = 0;
+  filters->detail = detail;
+
+  *copy = *cmd;
+  copy->filters = filters;
+  return copy;
+}
+
+/* Runs a command against the index, with its callbacks captured */
+static int _run(burrow_backend_journal_st *self,
+                burrow_backend_command_fn *command_fn,
+                const burrow_command_st *cmd,
+                journal_capture_t capture)
+{
+  burrow_st *burrow = self->burrow;
+  burrow_message_fn *message_fn = burrow->message_fn;
+  burrow_queue_fn *queue_fn = burrow->queue_fn;
+  burrow_account_fn *account_fn = burrow->account_fn;
+  burrow_command_st copy;
+  burrow_filters_st filters;
+  int result;
+
+  /* Updates are logged with the attributes they leave, deletes by id */
+  self->detail = _detail(cmd);
+  if (capture == CAPTURE_UPDATE)
+    cmd = _index_command(cmd, BURROW_DETAIL_ATTRIBUTES, &copy, &filters);
+  else if (capture == CAPTURE_DELETE)
+    cmd = _index_command(cmd, BURROW_DETAIL_ID, &copy, &filters);
+
+  self->capture = capture;
+  self->cmd = cmd;
+  self->now = (uint32_t)time(NULL);
+  self->capture_result = 0;
+  self->message_fn = message_fn;
+
+  burrow->message_fn = &_capture_message;
+  if (capture == CAPTURE_NAMES || capture == CAPTURE_QUIET ||
+      capture == CAPTURE_SNAPSHOT)
+  {
+    burrow->queue_fn = capture == CAPTURE_NAMES ? &_capture_name : NULL;
+    burrow->account_fn = capture == CAPTURE_NAMES ? &_capture_name : NULL;
+  }
+
+  result = command_fn(self->memory, cmd);
+
+  burrow->message_fn = message_fn;
+  burrow->queue_fn = queue_fn;
+  burrow->account_fn = account_fn;
+  self->capture = CAPTURE_NONE;
+
+  return result ? result : self->capture_result;
+}
+
+/* Segments: */
+
+static void _segment_name(char *name, size_t size, uint32_t segment,
+                          const char *suffix)
+{
+  snprintf(name, size, "%08x.%s", segment, suffix);
+}
+
+static int _segment_open(burrow_backend_journal_st *self)
+{
+  char name[32];
+
+  _segment_name(name, sizeof(name), self->segment, "log");
+  self->fd = openat(self->dir_fd, name,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                    0600);
+  if (self->fd == -1)
+  {
+    burrow_log_error(self->burrow, "journal: creating %s/%s: 0x%x",
+                     self->path, name, errno);
+    return errno;
+  }
+
+  self->segment_bytes = 0;
+  fsync(self->dir_fd);
+  return 0;
+}
+
+/* Removes every segment and snapshot before the given one */
+static void _segments_remove(burrow_backend_journal_st *self,
+                             uint32_t before)
+{
+  DIR *dir = opendir(self->path);
+  struct dirent *entry;
+
+  if (!dir)
+    return;
+
+  while ((entry = readdir(dir)))
+  {
+    char *end;
+    unsigned long segment = strtoul(entry->d_name, &end, 16);
+
+    if (end == entry->d_name + 8 && *end == '.' && segment < before)
+      unlinkat(self->dir_fd, entry->d_name, 0);
+  }
+
+  closedir(dir);
+}
+
+/* Closes the segment appended to, and opens the next */
+static int _seal(burrow_backend_journal_st *self)
+{
+  close(self->fd);
+  self->segment++;
+  self->sealed++;
+  return _segment_open(self);
+}
+
+/* Closes the segment just opened, still empty, for a snapshot to take its
+   number, and moves on to the next; records logged from here on go there */
+static int _snapshot_segment(burrow_backend_journal_st *self,
+                             uint32_t *segment)
+{
+  char name[32];
+
+  close(self->fd);
+  self->fd = -1;
+  _segment_name(name, sizeof(name), self->segment, "log");
+  unlinkat(self->dir_fd, name, 0);
+
+  *segment = self->segment++;
+  return _segment_open(self);
+}
+
+/* Writes what the index holds to a snapshot, message by message, under a
+   temporary name until it's all on disk */
+static int _snapshot_write(burrow_backend_journal_st *self, uint32_t segment)
+{
+  burrow_command_st cmd;
+  burrow_filters_st filters;
+  char tmp_name[32];
+  char name[32];
+  size_t accounts_used;
+  size_t account;
+  size_t queue;
+  int result;
+
+  _segment_name(tmp_name, sizeof(tmp_name), segment, "tmp");
+  _segment_name(name, sizeof(name), segment, "snap");
+  self->snapshot_fd = openat(self->dir_fd, tmp_name,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (self->snapshot_fd == -1)
+    return errno;
+
+  memset(&cmd, 0, sizeof(cmd));
+  memset(&filters, 0, sizeof(filters));
+  filters.set = BURROW_FILTERS_MATCH_HIDDEN;
+  filters.match_hidden = true;
+
+  /* Names are kept by offset, as collecting more may move them */
+  self->names_used = 0;
+  result = _run(self, burrow_backend_memory_functions.get_accounts, &cmd,
+                CAPTURE_NAMES);
+  accounts_used = self->names_used;
+
+  for (account = 0; !result && account < accounts_used;
+       account += strlen(self->names + account) + 1)
+  {
+    cmd.account = self->names + account;
+    self->names_used = accounts_used;
+    result = _run(self, burrow_backend_memory_functions.get_queues, &cmd,
+                  CAPTURE_NAMES);
+
+    for (queue = accounts_used; !result && queue < self->names_used;
+         queue += strlen(self->names + queue) + 1)
+    {
+      cmd.account = self->names + account;
+      cmd.queue = self->names + queue;
+      cmd.filters = &filters;
+      result = _run(self, burrow_backend_memory_functions.get_messages, &cmd,
+                    CAPTURE_SNAPSHOT);
+      cmd.filters = NULL;
+      cmd.queue = NULL;
+    }
+  }
+
+  if (!result)
+    result = _write_all(self->snapshot_fd, self->buffer, self->buffer_used);
+  self->buffer_used = 0;
+
+  if (!result && fdatasync(self->snapshot_fd) == -1)
+    result = errno;
+  close(self->snapshot_fd);
+  self->snapshot_fd = -1;
+
+  if (!result && renameat(self->dir_fd, tmp_name, self->dir_fd, name) == -1)
+    result = errno;
+  if (result)
+    unlinkat(self->dir_fd, tmp_name, 0);
+
+  return result;
+}
+
+/* Once a snapshot is written, removes what came before it; the segments
+   it would have replaced are kept if it wasn't */
+static void _snapshot_done(burrow_backend_journal_st *self, uint32_t segment,
+                           uint32_t sealed, int result)
+{
+  char name[32];
+
+  if (result)
+  {
+    _segment_name(name, sizeof(name), segment, "snap");
+    burrow_log_error(self->burrow, "journal: writing %s/%s: 0x%x",
+                     self->path, name, result);
+    return;
+  }
+
+  fsync(self->dir_fd);
+  _segments_remove(self, segment);
+  self->sealed -= sealed;
+}
+
+/* Compacts the log at once, as a restore needs */
+static int _compact(burrow_backend_journal_st *self)
+{
+  uint32_t sealed = self->sealed;
+  uint32_t segment;
+  int result;
+
+  if ((result = _snapshot_segment(self, &segment)))
+    return result;
+
+  result = _snapshot_write(self, segment);
+  _snapshot_done(self, segment, sealed, result);
+  return result;
+}
+
+/* Finds out whether the compaction running has finished, waiting for it
+   if asked to */
+static int _compact_wait(burrow_backend_journal_st *self, bool block)
+{
+  int status;
+  int result;
+  pid_t pid;
+
+  if (self->compact_pid <= 0)
+    return 0;
+
+  while ((pid = waitpid(self->compact_pid, &status, block ? 0 : WNOHANG)) ==
+         -1 && errno == EINTR)
+    ;
+
+  if (pid == 0)
+    return EINPROGRESS;
+
+  /* The child exits with the errno it failed on, if it did */
+  self->compact_pid = 0;
+  if (pid == -1)
+    result = errno;
+  else if (!WIFEXITED(status))
+    result = EIO;
+  else
+    result = WEXITSTATUS(status);
+
+  _snapshot_done(self, self->compact_segment, self->compact_sealed, result);
+  return result;
+}
+
+/* Starts compacting the log, unless it already is: a child writes the
+   snapshot from its copy of the index, as it is now, while commands go on
+   being served and logged to the segments after it */
+static int _compact_start(burrow_backend_journal_st *self)
+{
+  uint32_t segment;
+  int result;
+  pid_t pid;
+
+  if (_compact_wait(self, false) == EINPROGRESS)
+    return 0;
+
+  if ((result = _snapshot_segment(self, &segment)))
+    return result;
+
+  pid = fork();
+  if (pid == 0)
+    _exit(_snapshot_write(self, segment));
+
+  if (pid == -1)
+  {
+    burrow_log_error(self->burrow, "journal: compacting %s: 0x%x",
+                     self->path, errno);
+    return 0;
+  }
+
+  self->compact_pid = pid;
+  self->compact_segment = segment;
+  self->compact_sealed = self->sealed;
+  return 0;
+}
+
+/* Writes out the records buffered, and makes sure they're on disk */
+static int _commit(burrow_backend_journal_st *self)
+{
+  size_t used = self->buffer_used;
+  int result;
+
+  if (!used)
+    return 0;
+
+  self->buffer_used = 0;
+  if ((result = _write_all(self->fd, self->buffer, used)) ||
+      (fdatasync(self->fd) == -1 && (result = errno)))
+  {
+    burrow_log_error(self->burrow, "journal: committing to %s: 0x%x",
+                     self->path, result);
+    return result;
+  }
+
+  self->segment_bytes += used;
+  if (self->segment_bytes < self->segment_size)
+    return 0;
+
+  /* Full: on to the next segment, and compact once enough are */
+  if ((result = _seal(self)))
+    return result;
+
+  if (self->compact_segments && self->sealed >= self->compact_segments)
+    return _compact_start(self);
+
+  return 0;
+}
+
+/* Replay: */
+
+static int _apply(burrow_backend_journal_st *self,
+                  const journal_record_st *record,
+                  const char *data,
+                  uint32_t now)
+{
+  burrow_backend_functions_st *memory = &burrow_backend_memory_functions;
+  burrow_command_st cmd;
+  burrow_attributes_st attributes;
+  burrow_filters_st filters;
+
+  memset(&cmd, 0, sizeof(cmd));
+  memset(&attributes, 0, sizeof(attributes));
+  memset(&filters, 0, sizeof(filters));
+
+  cmd.account = data;
+  if (record->queue_size)
+    cmd.queue = data + record->account_size;
+  if (record->id_size)
+    cmd.message_id = data + record->account_size + record->queue_size;
+  cmd.body = data + record->account_size + record->queue_size +
+             record->id_size;
+  cmd.body_size = record->body_size;
+
+  attributes.set = BURROW_ATTRIBUTES_TTL;
+  attributes.ttl = record->ttl > now ? record->ttl - now : 0;
+  if (record->hide > now)
+  {
+    attributes.set = BURROW_ATTRIBUTES_ALL;
+    attributes.hide = record->hide - now;
+  }
+  cmd.attributes = &attributes;
+
+  switch (record->type)
+  {
+  case JOURNAL_CREATE:
+    if (!cmd.queue || !cmd.message_id)
+      return EINVAL;
+    if (!attributes.ttl)
+      return 0;
+    return _run(self, memory->create_message, &cmd, CAPTURE_QUIET);
+
+  case JOURNAL_UPDATE:
+    if (!cmd.queue || !cmd.message_id)
+      return EINVAL;
+    if (!attributes.ttl)
+    {
+      _run(self, memory->delete_message, &cmd, CAPTURE_QUIET);
+      return 0;
+    }
+    attributes.set = BURROW_ATTRIBUTES_ALL;
+    _run(self, memory->update_message, &cmd, CAPTURE_QUIET);
+    return 0;
+
+  case JOURNAL_DELETE:
+    if (!cmd.queue || !cmd.message_id)
+      return EINVAL;
+    return _run(self, memory->delete_message, &cmd, CAPTURE_QUIET);
+
+  case JOURNAL_DELETE_QUEUE:
+    if (!cmd.queue)
+      return EINVAL;
+    filters.set = BURROW_FILTERS_MATCH_HIDDEN;
+    filters.match_hidden = true;
+    cmd.filters = &filters;
+    return _run(self, memory->delete_messages, &cmd, CAPTURE_QUIET);
+
+  case JOURNAL_DELETE_ACCOUNT:
+    return _run(self, memory->delete_queues, &cmd, CAPTURE_QUIET);
+
+  default:
+    return EINVAL;
+  }
+}
+
+/* Replays a segment or snapshot into the index. Only the last segment may
+   end with a record cut short, by a crash while it was written, which is
+   cut off. */
+static int _replay(burrow_backend_journal_st *self, const char *name,
+                   bool last)
+{
+  uint32_t now = (uint32_t)time(NULL);
+  journal_record_st record;
+  struct stat st;
+  const char *data;
+  size_t offset = 0;
+  int result = 0;
+  int fd;
+
+  fd = openat(self->dir_fd, name, O_RDWR | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) == -1)
+  {
+    burrow_log_error(self->burrow, "journal: opening %s/%s: 0x%x",
+                     self->path, name, errno);
+    if (fd != -1)
+      close(fd);
+    return errno;
+  }
+
+  if (st.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    burrow_log_error(self->burrow, "journal: mmap %s/%s: 0x%x", self->path,
+                     name, errno);
+    close(fd);
+    return errno;
+  }
+
+  while (!result && offset + sizeof(record) <= (size_t)st.st_size)
+  {
+    const char *strings = data + offset + sizeof(record);
+
+    memcpy(&record, data + offset, sizeof(record));
+    if (record.size < sizeof(record) ||
+        record.size > (size_t)st.st_size - offset ||
+        record.size != sizeof(record) + record.account_size +
+                       record.queue_size + record.id_size +
+                       (size_t)record.body_size ||
+        record.checksum != _checksum(data + offset + 8, record.size - 8) ||
+        !record.account_size || strings[record.account_size - 1] ||
+        (record.queue_size &&
+         strings[record.account_size + record.queue_size - 1]) ||
+        (record.id_size && strings[record.account_size + record.queue_size +
+                                   record.id_size - 1]))
+      break;
+
+    result = _apply(self, &record, strings, now);
+    offset += record.size;
+  }
+
+  munmap((void *)data, (size_t)st.st_size);
+
+  if (!result && offset < (size_t)st.st_size)
+  {
+    if (last && ftruncate(fd, (off_t)offset) == 0)
+      burrow_log_warn(self->burrow, "journal: %s/%s cut short at %zu",
+                      self->path, name, offset);
+    else
+    {
+      burrow_log_error(self->burrow, "journal: %s/%s corrupt at %zu",
+                       self->path, name, offset);
+      result = EIO;
+    }
+  }
+
+  close(fd);
+  return result;
+}
+
+static int _compare_segments(const void *a, const void *b)
+{
+  uint32_t left = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+
+  return left < right ? -1 : left > right;
+}
+
+/* Opens the journal on the first command: replays the latest snapshot and
+   the segments after it, and starts a new segment after all of them */
+static int _open(burrow_backend_journal_st *self)
+{
+  uint32_t *segments = NULL;
+  uint32_t segment_count = 0;
+  uint32_t segment_size = 0;
+  bool snapshot = false;
+  uint32_t latest = 0;
+  uint32_t next = 0;
+  struct dirent *entry;
+  char name[32];
+  DIR *dir;
+  uint32_t i;
+  int result = 0;
+
+  if (self->opened)
+    return 0;
+
+  if (mkdir(self->path, 0700) == -1 && errno != EEXIST)
+  {
+    burrow_log_error(self->burrow, "journal: creating %s: 0x%x", self->path,
+                     errno);
+    return errno;
+  }
+
+  self->dir_fd = open(self->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (self->dir_fd == -1 || !(dir = opendir(self->path)))
+  {
+    burrow_log_error(self->burrow, "journal: opening %s: 0x%x", self->path,
+                     errno);
+    return errno;
+  }
+
+  while (!result && (entry = readdir(dir)))
+  {
+    char *end;
+    unsigned long segment = strtoul(entry->d_name, &end, 16);
+
+    if (end != entry->d_name + 8 || segment > UINT32_MAX - 2)
+      continue;
+
+    if (!strcmp(end, ".tmp"))
+    {
+      unlinkat(self->dir_fd, entry->d_name, 0);
+      continue;
+    }
+
+    if (segment >= next)
+      next = (uint32_t)segment + 1;
+
+    if (!strcmp(end, ".snap") && (!snapshot || segment > latest))
+    {
+      snapshot = true;
+      latest = (uint32_t)segment;
+    }
+    else if (!strcmp(end, ".log"))
+    {
+      if (segment_count == segment_size)
+      {
+        uint32_t *grown;
+
+        segment_size = segment_size ? segment_size * 2 : 16;
+        grown = burrow_malloc(self->burrow, segment_size * sizeof(uint32_t));
+        if (!grown)
+        {
+          result = ENOMEM;
+          break;
+        }
+        if (segments)
+        {
+          memcpy(grown, segments, segment_count * sizeof(uint32_t));
+          burrow_free(self->burrow, segments);
+        }
+        segments = grown;
+      }
+      segments[segment_count++] = (uint32_t)segment;
+    }
+  }
+
+  closedir(dir);
+
+  if (!result && snapshot)
+  {
+    /* Whatever the snapshot holds needn't be replayed */
+    _segments_remove(self, latest);
+    _segment_name(name, sizeof(name), latest, "snap");
+    result = _replay(self, name, false);
+  }
+
+  if (segment_count)
+    qsort(segments, segment_count, sizeof(uint32_t), &_compare_segments);
+  for (i = 0; !result && i < segment_count; i++)
+  {
+    if (snapshot && segments[i] <= latest)
+    {
+      _segment_name(name, sizeof(name), segments[i], "log");
+      unlinkat(self->dir_fd, name, 0);
+      continue;
+    }
+
+    _segment_name(name, sizeof(name), segments[i], "log");
+    result = _replay(self, name, i == segment_count - 1);
+    self->sealed++;
+  }
+
+  if (segments)
+    burrow_free(self->burrow, segments);
+
+  if (result)
+  {
+    close(self->dir_fd);
+    self->dir_fd = -1;
+    return result;
+  }
+
+  self->segment = next;
+  if ((result = _segment_open(self)))
+  {
+    close(self->dir_fd);
+    self->dir_fd = -1;
+    return result;
+  }
+
+  self->opened = true;
+  return 0;
+}
+
+/* Commands: */
+
+/* A command that logged records stays in flight until they're committed */
+static int _logged(burrow_backend_journal_st *self, int result)
+{
+  if (result)
+    return result;
+
+  return self->buffer_used ? EAGAIN : 0;
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_accounts
+ */
+static int burrow_backend_journal_get_accounts(void *ptr,
+                                               const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.get_accounts(self->memory, cmd);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_accounts
+ */
+static int burrow_backend_journal_delete_accounts(void *ptr,
+                                                  const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  size_t account;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  /* Logged as the accounts it deletes, looked up as the index would */
+  self->names_used = 0;
+  result = _run(self, burrow_backend_memory_functions.get_accounts, cmd,
+                CAPTURE_NAMES);
+
+  for (account = 0; !result && account < self->names_used;
+       account += strlen(self->names + account) + 1)
+    result = _append(self, JOURNAL_DELETE_ACCOUNT, self->names + account,
+                     NULL, NULL, NULL, 0, 0, 0);
+
+  if (!result)
+    result = burrow_backend_memory_functions.delete_accounts(self->memory,
+                                                             cmd);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_queues
+ */
+static int burrow_backend_journal_get_queues(void *ptr,
+                                             const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.get_queues(self->memory, cmd);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_queues
+ */
+static int burrow_backend_journal_delete_queues(void *ptr,
+                                                const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  size_t queue;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  self->names_used = 0;
+  result = _run(self, burrow_backend_memory_functions.get_queues, cmd,
+                CAPTURE_NAMES);
+
+  for (queue = 0; !result && queue < self->names_used;
+       queue += strlen(self->names + queue) + 1)
+    result = _append(self, JOURNAL_DELETE_QUEUE, cmd->account,
+                     self->names + queue, NULL, NULL, 0, 0, 0);
+
+  if (!result)
+    result = burrow_backend_memory_functions.delete_queues(self->memory,
+                                                           cmd);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_messages
+ */
+static int burrow_backend_journal_get_messages(void *ptr,
+                                               const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  burrow_command_st copy;
+  burrow_filters_st filters;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  cmd = _index_command(cmd, BURROW_DETAIL_NONE, &copy, &filters);
+  return burrow_backend_memory_functions.get_messages(self->memory, cmd);
+}
+
+/**
+ * Implements burrow_backend_functions_st#update_messages
+ */
+static int burrow_backend_journal_update_messages(void *ptr,
+                                                  const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = _run(self, burrow_backend_memory_functions.update_messages, cmd,
+                CAPTURE_UPDATE);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_messages
+ */
+static int burrow_backend_journal_delete_messages(void *ptr,
+                                                  const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = _run(self, burrow_backend_memory_functions.delete_messages, cmd,
+                CAPTURE_DELETE);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#create_message
+ */
+static int burrow_backend_journal_create_message(void *ptr,
+                                                 const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  uint32_t now = (uint32_t)time(NULL);
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = burrow_backend_memory_functions.create_message(self->memory, cmd);
+  if (!result)
+    result = _append_create(self, cmd, cmd->message_id, cmd->body,
+                            cmd->body_size, cmd->attributes, now);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#create_messages
+ */
+static int burrow_backend_journal_create_messages(void *ptr,
+                                                  const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  uint32_t now = (uint32_t)time(NULL);
+  size_t i;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = burrow_backend_memory_functions.create_messages(self->memory,
+                                                           cmd);
+  for (i = 0; !result && i < cmd->message_count; i++)
+    result = _append_create(self, cmd, cmd->messages[i].message_id,
+                            cmd->messages[i].body,
+                            cmd->messages[i].body_size,
+                            cmd->messages[i].attributes, now);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_message
+ */
+static int burrow_backend_journal_get_message(void *ptr,
+                                              const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.get_message(self->memory, cmd);
+}
+
+/**
+ * Implements burrow_backend_functions_st#update_message
+ */
+static int burrow_backend_journal_update_message(void *ptr,
+                                                 const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = _run(self, burrow_backend_memory_functions.update_message, cmd,
+                CAPTURE_UPDATE);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_message
+ */
+static int burrow_backend_journal_delete_message(void *ptr,
+                                                 const burrow_command_st *cmd)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  result = _run(self, burrow_backend_memory_functions.delete_message, cmd,
+                CAPTURE_DELETE);
+  return _logged(self, result);
+}
+
+/**
+ * Implements burrow_backend_functions_st#process
+ *
+ * Commits the records of every command in flight at once, or waits for
+ * more to come in until the commit interval is up. A compaction that has
+ * finished since is seen to first.
+ */
+static int burrow_backend_journal_process(void *ptr)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int64_t waited;
+
+  _compact_wait(self, false);
+  if (!self->buffer_used)
+    return 0;
+
+  if (self->commit_interval > 0)
+  {
+    waited = _now_ms() - self->buffer_since;
+    if (waited < self->commit_interval)
+    {
+      burrow_watch_timeout(self->burrow,
+                           (int32_t)(self->commit_interval - waited));
+      return EAGAIN;
+    }
+  }
+
+  return _commit(self);
+}
+
+/**
+ * Implements burrow_backend_functions_st#expire
+ */
+static int burrow_backend_journal_expire(void *ptr)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.expire(self->memory);
+}
+
+/**
+ * Implements burrow_backend_functions_st#usage
+ */
+static int burrow_backend_journal_usage(void *ptr, const char *account,
+                                        const char *queue,
+                                        uint64_t *messages, uint64_t *bytes)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.usage(self->memory, account, queue,
+                                               messages, bytes);
+}
+
+/**
+ * Implements burrow_backend_functions_st#snapshot
+ */
+static int burrow_backend_journal_snapshot(void *ptr, const char *path)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int result;
+
+  if ((result = _open(self)))
+    return result;
+
+  return burrow_backend_memory_functions.snapshot(self->memory, path);
+}
+
+/**
+ * Implements burrow_backend_functions_st#snapshot_wait
+ */
+static int burrow_backend_journal_snapshot_wait(void *ptr, bool block)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+
+  return burrow_backend_memory_functions.snapshot_wait(self->memory, block);
+}
+
+/**
+ * Implements burrow_backend_functions_st#restore
+ *
+ * What the index holds once restored is compacted into the log at once,
+ * in place of everything before it, as none of it was logged.
+ */
+static int burrow_backend_journal_restore(void *ptr, const char *path)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+  int compacted;
+  int result;
+
+  if ((result = _open(self)) || (result = _commit(self)))
+    return result;
+
+  _compact_wait(self, true);
+
+  /* Left as it was if the file holds no image */
+  result = burrow_backend_memory_functions.restore(self->memory, path);
+  if (result == EINVAL)
+    return result;
+
+  /* The snapshot takes an empty segment's place */
+  if (self->segment_bytes && (compacted = _seal(self)))
+    return compacted;
+
+  compacted = _compact(self);
+  return result ? result : compacted;
+}
+
+/**
+ * Sets an option for this backend:
+ *   "path"            the directory the journal is kept in
+ *
+ * @param ptr Pointer to the backend object
+ * @param option String name of the option
+ * @param value String value of the option
+ * @return 0 if successful, EINVAL if the option or value is bad.
+ */
+static int burrow_backend_journal_set_option(void *ptr,
+                                             const char *option,
+                                             const char *value)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+
+  if (strcmp(option, "path") || !value || !*value ||
+      strlen(value) >= sizeof(self->path) || self->opened)
+  {
+    burrow_log_error(self->burrow, "journal: bad option %s", option);
+    return EINVAL;
+  }
+
+  strcpy(self->path, value);
+  return 0;
+}
+
+/**
+ * Sets an integer option for this backend:
+ *   "commit_interval"   milliseconds records may wait to be committed with
+ *                       others; 0, the default, commits at once those of
+ *                       all commands started together
+ *   "segment_size"      bytes a segment is filled to
+ *   "compact_segments"  full segments after which the log is compacted, or
+ *                       0 for never
+ *
+ * @param ptr Pointer to the backend object
+ * @param option String name of the option
+ * @param value the value
+ * @return 0 if successful, EINVAL if the option or value is bad.
+ */
+static int burrow_backend_journal_set_option_int(void *ptr,
+                                                 const char *option,
+                                                 int32_t value)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+
+  if (!strcmp(option, "commit_interval") && value >= 0)
+    self->commit_interval = value;
+  else if (!strcmp(option, "segment_size") &&
+           value >= JOURNAL_MIN_SEGMENT_SIZE)
+    self->segment_size = (uint32_t)value;
+  else if (!strcmp(option, "compact_segments") && value >= 0)
+    self->compact_segments = (uint32_t)value;
+  else
+  {
+    burrow_log_error(self->burrow, "journal: bad option %s", option);
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+/**
+ * Implements burrow_backend_functions_st#create
+ */
+static void *burrow_backend_journal_create(void *ptr, burrow_st *burrow)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+
+  if (self == NULL)
+  {
+    self = burrow_malloc(burrow, sizeof(burrow_backend_journal_st));
+    if (!self)
+      return NULL;
+    self->selfallocated = 1;
+  }
+  else
+    self->selfallocated = 0;
+
+  self->burrow = burrow;
+  self->memory = burrow_backend_memory_functions.create(NULL, burrow);
+  if (!self->memory)
+  {
+    if (self->selfallocated)
+      burrow_free(burrow, self);
+    return NULL;
+  }
+
+  strcpy(self->path, JOURNAL_DEFAULT_PATH);
+  self->commit_interval = 0;
+  self->segment_size = JOURNAL_DEFAULT_SEGMENT_SIZE;
+  self->compact_segments = JOURNAL_DEFAULT_COMPACT_SEGMENTS;
+
+  self->opened = false;
+  self->dir_fd = -1;
+  self->fd = -1;
+  self->segment = 0;
+  self->segment_bytes = 0;
+  self->sealed = 0;
+  self->compact_pid = 0;
+  self->compact_segment = 0;
+  self->compact_sealed = 0;
+
+  self->buffer = NULL;
+  self->buffer_size = 0;
+  self->buffer_used = 0;
+  self->buffer_since = 0;
+
+  self->capture = CAPTURE_NONE;
+  self->cmd = NULL;
+  self->now = 0;
+  self->capture_result = 0;
+  self->snapshot_fd = -1;
+  self->message_fn = NULL;
+  self->names = NULL;
+  self->names_size = 0;
+  self->names_used = 0;
+
+  return self;
+}
+
+/**
+ * Implements burrow_backend_functions_st#destroy
+ */
+static void burrow_backend_journal_destroy(void *ptr)
+{
+  burrow_backend_journal_st *self = (burrow_backend_journal_st *)ptr;
+
+  /* Records of commands cancelled are still committed */
+  if (self->opened)
+    _commit(self);
+  _compact_wait(self, true);
+
+  if (self->fd != -1)
+    close(self->fd);
+  if (self->dir_fd != -1)
+    close(self->dir_fd);
+
+  burrow_backend_memory_functions.destroy(self->memory);
+  if (self->buffer)
+    burrow_free(self->burrow, self->buffer);
+  if (self->names)
+    burrow_free(self->burrow, self->names);
+
+  if (self->selfallocated)
+    burrow_free(self->burrow, self);
+}
+
+/**
+ * Implements burrow_backend_functions_st#size
+ */
+static size_t burrow_backend_journal_size(void)
+{
+  return sizeof(burrow_backend_journal_st);
+}
+
+burrow_backend_functions_st burrow_backend_journal_functions = {
+  .create = &burrow_backend_journal_create,
+  .destroy = &burrow_backend_journal_destroy,
+  .size = &burrow_backend_journal_size,
+
+  .set_option = &burrow_backend_journal_set_option,
+  .set_option_int = &burrow_backend_journal_set_option_int,
+
+  .cancel = NULL,
+  .process = &burrow_backend_journal_process,
+  .event_raised = NULL,
+
+  .get_accounts = &burrow_backend_journal_get_accounts,
+  .delete_accounts = &burrow_backend_journal_delete_accounts,
+
+  .get_queues = &burrow_backend_journal_get_queues,
+  .delete_queues = &burrow_backend_journal_delete_queues,
+
+  .get_messages = &burrow_backend_journal_get_messages,
+  .update_messages = &burrow_backend_journal_update_messages,
+  .delete_messages = &burrow_backend_journal_delete_messages,
+
+  .create_message = &burrow_backend_journal_create_message,
+  .create_messages = &burrow_backend_journal_create_messages,
+  .get_message = &burrow_backend_journal_get_message,
+  .update_message = &burrow_backend_journal_update_message,
+  .delete_message = &burrow_backend_journal_delete_message,
+
+  .expire = &burrow_backend_journal_expire,
+  .usage = &burrow_backend_journal_usage,
+  .snapshot = &burrow_backend_journal_snapshot,
+  .snapshot_wait = &burrow_backend_journal_snapshot_wait,
+  .restore = &burrow_backend_journal_restore,
+};
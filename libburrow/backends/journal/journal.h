@@ -0,0 +1,35 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Journal backend, the memory backend made durable by a log
+ */
+#ifndef __BURROW_BACKEND_JOURNAL_H
+#define __BURROW_BACKEND_JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern burrow_backend_functions_st burrow_backend_journal_functions;
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __BURROW_BACKEND_JOURNAL_H */
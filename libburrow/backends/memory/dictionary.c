@@ -23,6 +23,122 @@
 
 #include "dictionary.h"
 
+/* Smallest hash table allocated, in buckets.*/
+#define DICTIONARY_MIN_BUCKETS 16
+
+/******************************************************************************/
+static uint32_t _hash(const char* key)
+{
+  /* FNV-1a*/
+  uint32_t hash = 2166136261u;
+  
+  while(*key)
+  {
+    hash ^= (uint8_t)*key++;
+    hash *= 16777619u;
+  }
+  
+  return hash;
+}
+/******************************************************************************/
+static int _resize_buckets(dictionary_st* self, uint32_t bucket_count)
+{
+  /* Rehash every node into a table of bucket_count buckets.*/
+  dictionary_node_st** buckets;
+  buckets = burrow_malloc(self->burrow, 
+                          bucket_count * sizeof(dictionary_node_st*));
+  if(!buckets)
+    return ENOMEM;
+  
+  memset(buckets, 0, bucket_count * sizeof(dictionary_node_st*));
+  
+  dictionary_node_st* node;
+  for(node = self->first; node; node = node->next)
+  {
+    uint32_t bucket = node->hash & (bucket_count - 1);
+    node->hash_next = buckets[bucket];
+    buckets[bucket] = node;
+  }
+  
+  burrow_free(self->burrow, self->buckets);
+  self->buckets = buckets;
+  self->bucket_count = bucket_count;
+  return 0;
+}
+/******************************************************************************/
+static int _grow_buckets(dictionary_st* self)
+{
+  /* Double the table, keeping at most one node per bucket on average.*/
+  return _resize_buckets(self, self->bucket_count ? self->bucket_count * 2 
+                                                  : DICTIONARY_MIN_BUCKETS);
+}
+/******************************************************************************/
+uint8_t dictionary_random_level(dictionary_st* self)
+{
+  /* Each level up is a quarter as likely as the one below.*/
+  uint32_t x = self->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  self->random = x;
+  
+  uint8_t level = 1;
+  while((x & 3) == 0 && level < DICTIONARY_MAX_LEVEL)
+  {
+    level++;
+    x >>= 2;
+  }
+  
+  return level;
+}
+/******************************************************************************/
+static void _skip_link(dictionary_st* self, dictionary_node_st* node)
+{
+  /* New nodes have the highest sequence number yet, so they go last at 
+   every level of their tower.*/
+  uint8_t i;
+  for(i = 1; i < node->level; i++)
+  {
+    node->skip[i - 1] = NULL;
+    if(self->skip_last[i - 1])
+      self->skip_last[i - 1]->skip[i - 1] = node;
+    else
+      self->skip_first[i - 1] = node;
+    self->skip_last[i - 1] = node;
+  }
+  
+  if(node->level > self->level)
+    self->level = node->level;
+}
+/******************************************************************************/
+static void _skip_unlink(dictionary_st* self, dictionary_node_st* node)
+{
+  /* Come down the skip list to the node, unlinking it at each level of its
+   tower on the way.*/
+  dictionary_node_st* previous = NULL;
+  dictionary_node_st* current;
+  int i;
+  for(i = self->level - 1; i >= 1; i--)
+  {
+    current = previous ? previous->skip[i - 1] : self->skip_first[i - 1];
+    while(current && current->seq < node->seq)
+    {
+      previous = current;
+      current = current->skip[i - 1];
+    }
+    
+    if(i >= node->level)
+      continue;
+    
+    if(previous)
+      previous->skip[i - 1] = node->skip[i - 1];
+    else
+      self->skip_first[i - 1] = node->skip[i - 1];
+    
+    if(self->skip_last[i - 1] == node)
+      self->skip_last[i - 1] = previous;
+  }
+}
 /******************************************************************************/
 dictionary_st* dictionary_init(dictionary_st* self, burrow_st* burrow)
 {
@@ -37,33 +153,44 @@ dictionary_st* dictionary_init(dictionary_st* self, burrow_st* burrow)
   self->last = NULL;
   self->length = 0;
   self->burrow = burrow;
+  self->buckets = NULL;
+  self->bucket_count = 0;
+  self->next_seq = 1;
+  self->deletions = 0;
+  self->deleted_seq = 0;
+  self->random = 2463534242u;
+  self->level = 1;
+  self->linked = false;
+  memset(self->skip_first, 0, sizeof(self->skip_first));
+  memset(self->skip_last, 0, sizeof(self->skip_last));
   return self;
 }
 /******************************************************************************/
-dictionary_node_st* dictionary_add(dictionary_st* self, 
-                                   const char* key, 
-                                   void* data_pointer)
+void dictionary_free(dictionary_st* self)
 {
   if(!self)
-    return NULL;
-  
-  dictionary_node_st* new_node;
-  new_node = burrow_malloc(self->burrow, sizeof(dictionary_node_st));
-  if(!new_node)
-  {
-    burrow_log_error(self->burrow, "add(): malloc failed: new_node");
-    return NULL;
-  }
+    return;
   
-  new_node->key = burrow_malloc(self->burrow, strlen(key)+1);
-  if(!new_node->key)
+  dictionary_node_st* node = self->first;
+  dictionary_node_st* next_node;
+  while(node && !self->linked)
   {
-    burrow_log_error(self->burrow, "add(): malloc failed: new_node->key");
-    burrow_free(self->burrow, new_node);
-    return NULL;
+    next_node = node->next;
+    burrow_free(self->burrow, node);
+    node = next_node;
   }
   
-  strcpy(new_node->key, key);
+  burrow_free(self->burrow, self->buckets);
+  burrow_free(self->burrow, self);
+}
+/******************************************************************************/
+static void _link(dictionary_st* self, 
+                  dictionary_node_st* new_node, 
+                  uint8_t level, 
+                  char* key, 
+                  void* data_pointer)
+{
+  new_node->key = key;
   new_node->previous = self->last;
     
   if(self->last != NULL) 
@@ -77,11 +204,151 @@ dictionary_node_st* dictionary_add(dictionary_st* self,
   new_node->next = NULL;
   new_node->data = data_pointer;
   
+  new_node->hash = _hash(key);
+  uint32_t bucket = new_node->hash & (self->bucket_count - 1);
+  new_node->hash_next = self->buckets[bucket];
+  self->buckets[bucket] = new_node;
+  
+  new_node->seq = self->next_seq++;
+  new_node->level = level;
+  _skip_link(self, new_node);
+  
   self->length++;
+}
+/******************************************************************************/
+size_t dictionary_node_size(uint8_t level)
+{
+  return sizeof(dictionary_node_st) + 
+         (level - 1) * sizeof(dictionary_node_st*);
+}
+/******************************************************************************/
+int dictionary_reserve(dictionary_st* self, uint32_t count)
+{
+  /* Size the table for count nodes at once, rather than doubling it over 
+   and over on the way there.*/
+  uint32_t bucket_count = self->bucket_count ? self->bucket_count 
+                                             : DICTIONARY_MIN_BUCKETS;
+  while(bucket_count < count && bucket_count < UINT32_MAX / 2 + 1)
+    bucket_count *= 2;
+  
+  if(bucket_count == self->bucket_count)
+    return 0;
+  
+  if(_resize_buckets(self, bucket_count))
+  {
+    burrow_log_error(self->burrow, "reserve(): malloc failed: buckets");
+    return ENOMEM;
+  }
+  
+  return 0;
+}
+/******************************************************************************/
+dictionary_node_st* dictionary_add(dictionary_st* self, 
+                                   const char* key, 
+                                   void* data_pointer)
+{
+  if(!self)
+    return NULL;
+  
+  if((uint32_t)self->length >= self->bucket_count && _grow_buckets(self))
+  {
+    burrow_log_error(self->burrow, "add(): malloc failed: buckets");
+    return NULL;
+  }
+  
+  /* The key is copied in right after the node's tower.*/
+  uint8_t level = dictionary_random_level(self);
+  size_t node_size = dictionary_node_size(level);
+  dictionary_node_st* new_node;
+  new_node = burrow_malloc(self->burrow, node_size + strlen(key) + 1);
+  if(!new_node)
+  {
+    burrow_log_error(self->burrow, "add(): malloc failed: new_node");
+    return NULL;
+  }
+  
+  char* key_copy = (char*)new_node + node_size;
+  strcpy(key_copy, key);
+  _link(self, new_node, level, key_copy, data_pointer);
   
   return new_node;
 }
 /******************************************************************************/
+int dictionary_link(dictionary_st* self, 
+                    dictionary_node_st* node, 
+                    uint8_t level, 
+                    char* key, 
+                    void* data_pointer)
+{
+  if((uint32_t)self->length >= self->bucket_count && _grow_buckets(self))
+  {
+    burrow_log_error(self->burrow, "link(): malloc failed: buckets");
+    return ENOMEM;
+  }
+  
+  self->linked = true;
+  _link(self, node, level, key, data_pointer);
+  return 0;
+}
+/******************************************************************************/
+void dictionary_replace(dictionary_st* self, 
+                        dictionary_node_st* node, 
+                        dictionary_node_st* new_node, 
+                        char* key, 
+                        void* data_pointer)
+{
+  *new_node = *node;
+  new_node->key = key;
+  new_node->data = data_pointer;
+  
+  if(node->previous)
+    node->previous->next = new_node;
+  else
+    self->first = new_node;
+  
+  if(node->next)
+    node->next->previous = new_node;
+  else
+    self->last = new_node;
+  
+  dictionary_node_st** link;
+  link = &self->buckets[node->hash & (self->bucket_count - 1)];
+  while(*link != node)
+    link = &(*link)->hash_next;
+  *link = new_node;
+  
+  /* Come down the skip list as to unlink node, pointing at new_node 
+   instead at each level of their tower.*/
+  dictionary_node_st* previous = NULL;
+  dictionary_node_st* current;
+  int i;
+  for(i = self->level - 1; i >= 1; i--)
+  {
+    current = previous ? previous->skip[i - 1] : self->skip_first[i - 1];
+    while(current && current->seq < node->seq)
+    {
+      previous = current;
+      current = current->skip[i - 1];
+    }
+    
+    if(i >= node->level)
+      continue;
+    
+    new_node->skip[i - 1] = node->skip[i - 1];
+    if(previous)
+      previous->skip[i - 1] = new_node;
+    else
+      self->skip_first[i - 1] = new_node;
+    
+    if(self->skip_last[i - 1] == node)
+      self->skip_last[i - 1] = new_node;
+  }
+  
+  /* Cursors may hold on to node: have them look it up again.*/
+  self->deletions++;
+  self->deleted_seq = node->seq;
+}
+/******************************************************************************/
 dictionary_node_st* dictionary_get(dictionary_st* self, 
                                    const char* key, 
                                    dictionary_get_action_t default_action)
@@ -89,14 +356,16 @@ dictionary_node_st* dictionary_get(dictionary_st* self,
   if(!key || !self)
     return NULL;
   
-  dictionary_node_st* current_node = self->first;
+  dictionary_node_st* current_node = NULL;
   
-  int i = 0;
-  while((i < self->length) && ++i)
-    if(!strcmp(current_node->key, key))
-      break;
-    else
-      current_node = current_node->next;
+  if(self->bucket_count)
+  {
+    uint32_t hash = _hash(key);
+    current_node = self->buckets[hash & (self->bucket_count - 1)];
+    while(current_node && 
+          (current_node->hash != hash || strcmp(current_node->key, key)))
+      current_node = current_node->hash_next;
+  }
   
   if(!current_node && default_action == CREATE)
   {
@@ -116,15 +385,42 @@ dictionary_node_st* dictionary_get(dictionary_st* self,
 }
 
 /******************************************************************************/
-void dictionary_delete_node(dictionary_st* self, const char* key)
+dictionary_node_st* dictionary_seek(dictionary_st* self, uint64_t seq)
 {
   if(!self)
-    return;
+    return NULL;
   
-  dictionary_node_st* current_node;
+  dictionary_node_st* previous = NULL;
+  dictionary_node_st* current;
+  int i;
+  for(i = self->level - 1; i >= 1; i--)
+  {
+    current = previous ? previous->skip[i - 1] : self->skip_first[i - 1];
+    while(current && current->seq < seq)
+    {
+      previous = current;
+      current = current->skip[i - 1];
+    }
+  }
   
-  if(!(current_node = dictionary_get(self, key, SEARCH)))
-    return;
+  current = previous ? previous->next : self->first;
+  while(current && current->seq < seq)
+    current = current->next;
+  
+  return current;
+}
+/******************************************************************************/
+void dictionary_unlink(dictionary_st* self, dictionary_node_st* current_node)
+{
+  dictionary_node_st** link;
+  link = &self->buckets[current_node->hash & (self->bucket_count - 1)];
+  while(*link != current_node)
+    link = &(*link)->hash_next;
+  *link = current_node->hash_next;
+  
+  _skip_unlink(self, current_node);
+  self->deletions++;
+  self->deleted_seq = current_node->seq;
   
   if(current_node->previous != NULL)
     current_node->previous->next = current_node->next;
@@ -136,12 +432,24 @@ void dictionary_delete_node(dictionary_st* self, const char* key)
   else
     self->last = current_node->previous;
   
-  burrow_free(self->burrow, current_node->key);
-  burrow_free(self->burrow, current_node);
-  current_node = NULL;
   self->length--;
 }
 /******************************************************************************/
+void dictionary_delete_node(dictionary_st* self, const char* key)
+{
+  if(!self)
+    return;
+  
+  dictionary_node_st* current_node;
+  
+  if(!(current_node = dictionary_get(self, key, SEARCH)))
+    return;
+  
+  dictionary_unlink(self, current_node);
+  if(!self->linked)
+    burrow_free(self->burrow, current_node);
+}
+/******************************************************************************/
 void dictionary_delete(dictionary_st* self, 
                        const char* l_bound_key, 
                        int32_t u_bound)
@@ -164,37 +472,50 @@ void dictionary_delete(dictionary_st* self,
   }
 }
 /******************************************************************************/
-dictionary_st* dictionary_iter(dictionary_st* self, 
-                               const char* l_bound_key, 
-                               uint32_t u_bound)
+void dictionary_cursor_init(dictionary_cursor_st* cursor, 
+                            dictionary_st* self, 
+                            const char* l_bound_key, 
+                            uint32_t u_bound)
 {
+  cursor->dictionary = self;
+  cursor->next = NULL;
+  cursor->remaining = 0;
   if(!self)
-    return NULL;
-  
-  dictionary_st* dictionary = dictionary_init(NULL, self->burrow);
-  if(!dictionary)
-    return NULL;
+    return;
   
-  dictionary_node_st* current_node;
+  dictionary_node_st* marker = dictionary_get(self, l_bound_key, SEARCH);
+  cursor->next = marker ? marker->next : self->first;
   
-  if(!(current_node = dictionary_get(self, l_bound_key, SEARCH)))
-    current_node = self->first;
+  cursor->next_seq = cursor->next ? cursor->next->seq : self->next_seq;
+  cursor->end_seq = self->next_seq;
+  cursor->deletions = self->deletions;
+  cursor->remaining = u_bound == DICTIONARY_LENGTH ? UINT32_MAX : u_bound;
+}
+/******************************************************************************/
+dictionary_node_st* dictionary_cursor_next(dictionary_cursor_st* cursor)
+{
+  dictionary_st* self = cursor->dictionary;
+  if(!self || !cursor->remaining)
+    return NULL;
   
-  if(u_bound == DICTIONARY_LENGTH)
-    u_bound = (uint32_t)self->length;
+  /* Deleting the node just returned leaves next alone; anything else 
+   deleted since may have been next, so look it up again.*/
+  if(self->deletions != cursor->deletions && 
+     (self->deletions != cursor->deletions + 1 || 
+      self->deleted_seq == cursor->next_seq))
+    cursor->next = dictionary_seek(self, cursor->next_seq);
   
-  while(current_node && u_bound)
+  dictionary_node_st* node = cursor->next;
+  if(!node || node->seq >= cursor->end_seq)
   {
-    if(!dictionary_add(dictionary, current_node->key, current_node->data))
-    {
-      dictionary_delete(dictionary, NULL, dictionary->length);
-      break;
-    }
-    
-    current_node = current_node->next;
-    u_bound--;
+    cursor->remaining = 0;
+    return NULL;
   }
   
-  return dictionary;
+  cursor->remaining--;
+  cursor->next = node->next;
+  cursor->next_seq = node->next ? node->next->seq : self->next_seq;
+  cursor->deletions = self->deletions;
+  return node;
 }
-/******************************************************************************/
\ No newline at end of file
+/******************************************************************************/
@@ -34,6 +34,9 @@ extern "C"
   
 #define DICTIONARY_LENGTH 0
 
+/* Most levels in the skip list of a dictionary.*/
+#define DICTIONARY_MAX_LEVEL 16
+
 typedef enum 
 {
   SEARCH, 
@@ -48,9 +51,29 @@ typedef struct dictionary_node_st
   struct dictionary_node_st* next;
   void* data;
   
+  /* Hash index: the key's hash, and the next node in its bucket.*/
+  uint32_t hash;
+  struct dictionary_node_st* hash_next;
+  
+  /* Ordered index: the node's sequence number, and its skip list tower. 
+   Level 0 is next; skip[i - 1] is the next node at level i.*/
+  uint64_t seq;
+  uint8_t level;
+  struct dictionary_node_st* skip[];
+  
 } dictionary_node_st;
 
 
+/* Nodes are kept in insertion order, which is the order they are iterated
+ in, and also hashed by key so that they can be looked up without walking 
+ that list. Each node gets the next sequence number as it is added, and 
+ the list doubles as the bottom level of a skip list, so that the node at 
+ (or after) a sequence number can be found in O(log n).
+ 
+ The nodes of a dictionary are either all allocated by it, key included,
+ with dictionary_add, or all allocated by the caller (together with their
+ key and data, say) and linked in with dictionary_link; the dictionary 
+ never frees these.*/
 typedef struct
 {
   dictionary_node_st* first;
@@ -58,14 +81,48 @@ typedef struct
   int length;
   burrow_st* burrow;
   
+  dictionary_node_st** buckets;
+  uint32_t bucket_count; /* a power of two, or 0 before the first add */
+  
+  uint64_t next_seq;
+  uint64_t deletions; /* count of nodes deleted so far */
+  uint64_t deleted_seq; /* sequence number of the last one */
+  uint32_t random; /* xorshift state, for towers' heights */
+  uint8_t level; /* highest tower so far */
+  bool linked; /* whether the caller allocates the nodes */
+  dictionary_node_st* skip_first[DICTIONARY_MAX_LEVEL - 1];
+  dictionary_node_st* skip_last[DICTIONARY_MAX_LEVEL - 1];
+  
 } dictionary_st;
 
 
+/* Walks a range of a dictionary in place. The node last returned may be 
+ deleted before asking for the next; if other nodes are deleted, the 
+ cursor finds its place again by sequence number. Nodes added after the 
+ cursor was set up are not visited.*/
+typedef struct
+{
+  dictionary_st* dictionary;
+  dictionary_node_st* next;
+  uint64_t next_seq;
+  uint64_t end_seq;
+  uint64_t deletions; /* the dictionary's when next was found */
+  uint32_t remaining;
+  
+} dictionary_cursor_st;
+
+
 /**
  * Some stuff.
  */
 dictionary_st* dictionary_init(dictionary_st* self, burrow_st* burrow);
 
+/**
+ * Deletes every node in a dictionary allocated by dictionary_init, and 
+ * then the dictionary itself. The nodes' data is not touched.
+ */
+void dictionary_free(dictionary_st* self);
+
 /**
  * Some stuff.
  */
@@ -73,6 +130,52 @@ dictionary_node_st* dictionary_add(dictionary_st* self,
                                    const char* key, 
                                    void* data_pointer);
 
+/**
+ * Draws the height of the tower of a node about to be linked in.
+ */
+uint8_t dictionary_random_level(dictionary_st* self);
+
+/**
+ * Returns the size of a node with a tower level high.
+ */
+size_t dictionary_node_size(uint8_t level);
+
+/**
+ * Makes the hash table big enough for count nodes, so that adding up to 
+ * that many doesn't have to rehash the ones already there.
+ *
+ * @return 0 on success or ENOMEM
+ */
+int dictionary_reserve(dictionary_st* self, uint32_t count);
+
+/**
+ * Links in a node allocated by the caller, of dictionary_node_size(level)
+ * bytes or more, under key, which must stay put as long as the node is 
+ * in the dictionary.
+ *
+ * @return 0 on success or ENOMEM
+ */
+int dictionary_link(dictionary_st* self, 
+                    dictionary_node_st* node, 
+                    uint8_t level, 
+                    char* key, 
+                    void* data_pointer);
+
+/**
+ * Puts new_node, allocated by the caller as high as node, in node's place,
+ * with its position and sequence number, under an equal key.
+ */
+void dictionary_replace(dictionary_st* self, 
+                        dictionary_node_st* node, 
+                        dictionary_node_st* new_node, 
+                        char* key, 
+                        void* data_pointer);
+
+/**
+ * Takes a node out of the dictionary, without freeing it.
+ */
+void dictionary_unlink(dictionary_st* self, dictionary_node_st* node);
+
 /**
  * Some stuff.
  */
@@ -80,6 +183,12 @@ dictionary_node_st* dictionary_get(dictionary_st* self,
                                    const char* key, 
                                    dictionary_get_action_t default_action);
 
+/**
+ * Finds the first node whose sequence number is seq or greater, or NULL 
+ * if there is none.
+ */
+dictionary_node_st* dictionary_seek(dictionary_st* self, uint64_t seq);
+
 /**
  * Some stuff.
  */
@@ -93,11 +202,19 @@ void dictionary_delete(dictionary_st* self,
                        int32_t u_bound);
 
 /**
- * Some stuff.
+ * Sets up a cursor over up to u_bound nodes (or all of them, given 
+ * DICTIONARY_LENGTH), starting after the node l_bound_key, or at the 
+ * first one if l_bound_key is NULL or not found.
+ */
+void dictionary_cursor_init(dictionary_cursor_st* cursor, 
+                            dictionary_st* self, 
+                            const char* l_bound_key, 
+                            uint32_t u_bound);
+
+/**
+ * Returns the cursor's next node, or NULL once it is done.
  */
-dictionary_st* dictionary_iter(dictionary_st* self, 
-                               const char* l_bound_key, 
-                               uint32_t u_bound);
+dictionary_node_st* dictionary_cursor_next(dictionary_cursor_st* cursor);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,143 @@
+/*
+ * libburrow -- Memory Backend: deadline heap.
+ *
+ * Copyright (C) 2011 Federico G. Saldarini.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+/**
+ * @file
+ * @brief Memory backend deadline heap implementation
+ */
+
+#include "heap.h"
+
+/******************************************************************************/
+static void _place(heap_st* self, size_t index, const heap_entry_st* entry)
+{
+  self->entries[index] = *entry;
+  *entry->index = index;
+}
+/******************************************************************************/
+static void _sift(heap_st* self, size_t index)
+{
+  /* Move the entry at index up or down the heap, to where its deadline 
+   belongs.*/
+  heap_entry_st entry = self->entries[index];
+  
+  while(index > 0)
+  {
+    size_t parent = (index - 1) / 2;
+    if(self->entries[parent].deadline <= entry.deadline)
+      break;
+    
+    _place(self, index, &self->entries[parent]);
+    index = parent;
+  }
+  
+  for(;;)
+  {
+    size_t child = 2 * index + 1;
+    if(child >= self->count)
+      break;
+    
+    if(child + 1 < self->count && 
+       self->entries[child + 1].deadline < self->entries[child].deadline)
+      child++;
+    
+    if(entry.deadline <= self->entries[child].deadline)
+      break;
+    
+    _place(self, index, &self->entries[child]);
+    index = child;
+  }
+  
+  _place(self, index, &entry);
+}
+/******************************************************************************/
+void heap_init(heap_st* self, burrow_st* burrow)
+{
+  self->burrow = burrow;
+  self->entries = NULL;
+  self->count = 0;
+  self->size = 0;
+}
+/******************************************************************************/
+void heap_destroy(heap_st* self)
+{
+  burrow_free(self->burrow, self->entries);
+  heap_init(self, self->burrow);
+}
+/******************************************************************************/
+int heap_reserve(heap_st* self, size_t count)
+{
+  if(count <= self->size)
+    return 0;
+  
+  size_t size = self->size ? self->size * 2 : 16;
+  while(size < count)
+    size *= 2;
+  
+  heap_entry_st* entries = burrow_malloc(self->burrow, 
+                                         size * sizeof(heap_entry_st));
+  if(!entries)
+  {
+    burrow_log_error(self->burrow, "heap_reserve(): malloc failed");
+    return ENOMEM;
+  }
+  
+  if(self->count)
+    memcpy(entries, self->entries, self->count * sizeof(heap_entry_st));
+  
+  burrow_free(self->burrow, self->entries);
+  self->entries = entries;
+  self->size = size;
+  return 0;
+}
+/******************************************************************************/
+void heap_add(heap_st* self, uint32_t deadline, void* item, size_t* index)
+{
+  heap_entry_st entry;
+  entry.deadline = deadline;
+  entry.index = index;
+  entry.item = item;
+  
+  _place(self, self->count++, &entry);
+  _sift(self, *index);
+}
+/******************************************************************************/
+void heap_remove(heap_st* self, size_t index)
+{
+  if(index == HEAP_NONE)
+    return;
+  
+  *self->entries[index].index = HEAP_NONE;
+  if(index == --self->count)
+    return;
+  
+  _place(self, index, &self->entries[self->count]);
+  _sift(self, index);
+}
+/******************************************************************************/
+void heap_update(heap_st* self, size_t index, uint32_t deadline)
+{
+  self->entries[index].deadline = deadline;
+  _sift(self, index);
+}
+/******************************************************************************/
+heap_entry_st* heap_top(heap_st* self)
+{
+  return self->count ? &self->entries[0] : NULL;
+}
+/******************************************************************************/
@@ -0,0 +1,98 @@
+/*
+ * libburrow -- Memory Backend: deadline heap.
+ *
+ * Copyright (C) 2011 Federico G. Saldarini.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+/**
+ * @file
+ * @brief Memory backend deadline heap declarations
+ */
+#include <libburrow/common.h>
+
+#ifndef __HEAP_H
+#define __HEAP_H
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+/* Marks an item that isn't in a heap.*/
+#define HEAP_NONE ((size_t)-1)
+
+/* An item in a heap, with the deadline it is ordered on, and where it 
+ keeps its own position in the heap, kept up to date as it moves.*/
+typedef struct
+{
+  uint32_t deadline;
+  size_t* index;
+  void* item;
+} heap_entry_st;
+
+
+/* A min-heap on deadlines.*/
+typedef struct
+{
+  burrow_st* burrow;
+  heap_entry_st* entries;
+  size_t count;
+  size_t size;
+  
+} heap_st;
+
+
+/**
+ * Sets up an empty heap.
+ */
+void heap_init(heap_st* self, burrow_st* burrow);
+
+/**
+ * Frees a heap's entries; the items aren't touched.
+ */
+void heap_destroy(heap_st* self);
+
+/**
+ * Makes room for count items, so that adding them can't fail.
+ *
+ * @return 0 on success or ENOMEM
+ */
+int heap_reserve(heap_st* self, size_t count);
+
+/**
+ * Adds an item, for which room was reserved. Its position is kept in 
+ * *index from then on.
+ */
+void heap_add(heap_st* self, uint32_t deadline, void* item, size_t* index);
+
+/**
+ * Removes the item at index, if it is in the heap (not HEAP_NONE).
+ */
+void heap_remove(heap_st* self, size_t index);
+
+/**
+ * Changes the deadline of the item at index.
+ */
+void heap_update(heap_st* self, size_t index, uint32_t deadline);
+
+/**
+ * Returns the entry with the earliest deadline, or NULL if empty.
+ */
+heap_entry_st* heap_top(heap_st* self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,7 +22,19 @@
  */
 
 #include "dictionary.h"
+#include "slab.h"
+#include "heap.h"
+#include "memory.h"
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 
 /* These are the possible actions when scanning a queue:*/
 typedef enum 
@@ -40,6 +52,32 @@ typedef enum
   IGNORE
 } delete_action_t;
 
+/* The deadlines messages are kept in order of, each in its own heap.*/
+typedef enum
+{
+  EXPIRY, /* on ttl: when the message goes away*/
+  HIDDEN, /* on hide: when a hidden message shows again*/
+  DEADLINES
+} deadline_t;
+
+/* What is done when a message would take a queue or account past a limit.*/
+typedef enum
+{
+  LIMIT_REJECT, /* the message is turned down*/
+  LIMIT_DROP_OLDEST, /* the queue's oldest messages make room for it*/
+  LIMIT_DROP_EXPIRING /* or those due to expire soonest*/
+} limit_policy_t;
+
+/* How many messages there are, and the bytes of memory they take, in a 
+ queue, an account, or a whole store; or the most there may be, with 0 
+ for no limit. A message takes the whole slab block it is given, but the 
+ room left in the queue's partly used slabs isn't counted.*/
+typedef struct
+{
+  uint64_t messages;
+  uint64_t bytes;
+} usage_st;
+
 /* Some redefinitions, just to make the code more sensible.*/
 typedef dictionary_st accounts_st;
 typedef dictionary_st queues_st;
@@ -47,43 +85,387 @@ typedef dictionary_node_st account_st;
 typedef dictionary_node_st queue_st;
 typedef dictionary_node_st message_node_st;
 
-/* A burrow message as stored in the memory backend.*/
-typedef struct
+/* A burrow message as stored in the memory backend. It is allocated in one 
+ piece with its dictionary node, which comes first, and its id (also the 
+ node's key) and body, which come right after it.*/
+typedef struct message_st
 {
   char* message_id;
   char* body;
   size_t body_size;
+  size_t record_size; /* of the whole piece*/
   uint32_t ttl;
   uint32_t hide;
-} burrow_message_st;
+  size_t heap_index[DEADLINES]; /* where it is in each heap*/
+  account_st* account; /* and where it is stored, to reclaim it from there*/
+  queue_st* queue;
+  message_node_st* node;
+  
+  /* Visible messages are linked in the order they came in.*/
+  bool visible;
+  struct message_st* visible_previous;
+  struct message_st* visible_next;
+} message_st;
+
+/* A command reading with the wait filter that found nothing, parked on 
+ its queue until a message comes in there, or its wait runs out. It is in 
+ the queue's waiters for as long as it is parked, under the queue's lock: 
+ a message coming in unparks every one there and signals each one's 
+ backend, through its eventfd, to look again.*/
+typedef struct memory_wait_st
+{
+  const burrow_command_st* cmd;
+  scan_action_t scan_type;
+  int64_t deadline; /* in milliseconds, on the monotonic clock*/
+  int event_fd; /* of the backend it is parked for*/
+  bool parked;
+  struct memory_wait_st* waiter_previous;
+  struct memory_wait_st* waiter_next;
+  struct memory_wait_st* next; /* among the backend's waits*/
+} memory_wait_st;
+
+/* What a queue node holds: all its messages by id, and the visible ones 
+ apart, so that fetching them never has to step over hidden ones. The 
+ messages are allocated from the queue's own slabs, and ordered on their 
+ deadlines in the queue's own heaps, so that all of it goes at once when 
+ the queue does. In a shared store, all of it is under the queue's lock.*/
+typedef struct
+{
+  dictionary_st* messages;
+  message_st* visible_first;
+  message_st* visible_last;
+  heap_st heaps[DEADLINES];
+  size_t heap_index[DEADLINES]; /* where the queue is among the others*/
+  slab_cache_st slabs;
+  usage_st usage;
+  memory_wait_st* waiters; /* parked on the queue*/
+  pthread_mutex_t lock;
+} queue_data_st;
+
+/* What an account node holds: its queues, and what they hold between them. 
+ In a shared store this is added to under the queues' locks, so atomically.*/
+typedef struct
+{
+  queues_st* queues;
+  usage_st usage;
+} account_data_st;
+
+/* Where the accounts, and everything in them, are kept. Each backend has a 
+ store of its own, and may attach to a shared one instead, by name, along 
+ with any other backend in the process, whatever thread it is used from.*/
+typedef struct memory_store_st
+{
+  burrow_st* burrow; /* what the store allocates with, and logs to*/
+  accounts_st* accounts;
+  
+  /* Queues with messages in a heap are in the store's heap of the same 
+   kind, on the earliest deadline there, so that the messages due can be 
+   dealt with without looking at any other.*/
+  heap_st queues[DEADLINES];
+  size_t queue_count;
+  
+  /* What the store holds, and what any one queue or account may.*/
+  usage_st usage;
+  usage_st queue_limit;
+  usage_st account_limit;
+  limit_policy_t limit_policy;
+  
+  /* A shared store is only ever changed under its locks: the store's own 
+   is read-locked to work within the queues there are, and write-locked to 
+   add or drop any, while each queue's lock guards its messages. The 
+   heaps of queues have one more lock to themselves, taken last.*/
+  bool shared;
+  char* name;
+  uint32_t references;
+  uint32_t ticked; /* when deadlines were last dealt with*/
+  struct memory_store_st* next;
+  pthread_rwlock_t lock;
+  pthread_mutex_t deadline_lock;
+} memory_store_st;
 
 /* The memory backend internal structure.*/
 typedef struct 
 {
   int selfallocated;
-  burrow_st* burrow;
-  accounts_st* accounts;
-  
+  burrow_st* burrow; /* what callbacks go to*/
+  memory_store_st* store; /* the one in use: own_store, or a shared one*/
+  memory_store_st own_store;
+  pid_t snapshot_pid; /* of the child writing a snapshot, if any*/
+  memory_wait_st* waits; /* commands in flight, parked on a queue*/
+  int event_fd; /* what they are woken through, once any has been*/
 } burrow_backend_memory_st;
 
+/* A snapshot image: a header, then every account, each with its queues, 
+ each with its messages, in the order they are kept. Names are stored with 
+ their size (nul included) first, and each account and queue with the 
+ count of what follows it. Deadlines are stored as times, and everything 
+ in the host's byte order: an image is only good on the machine it was 
+ taken on.*/
+#define IMAGE_MAGIC "BURROWM1"
+
+typedef struct
+{
+  char magic[8];
+  uint32_t taken;
+  uint32_t account_count;
+} image_header_st;
+
+typedef struct
+{
+  uint32_t id_size;
+  uint32_t body_size;
+  uint32_t ttl;
+  uint32_t hide;
+} image_message_st;
+
+/* Images are written through a buffer of this size, on the stack of the 
+ child writing it, which had best not allocate.*/
+#define IMAGE_BUFFER 65536
+
+typedef struct
+{
+  int fd;
+  int error;
+  size_t used;
+  char data[IMAGE_BUFFER];
+} image_writer_st;
+
+/* And read in place, from a map of the whole file.*/
+typedef struct
+{
+  const char* next;
+  const char* end;
+} image_reader_st;
+
+/* The shared stores in the process, by name.*/
+static memory_store_st* _shared_stores = NULL;
+static pthread_mutex_t _shared_stores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************/
+static void _store_read_lock(memory_store_st* store)
+{
+  if(store->shared)
+    pthread_rwlock_rdlock(&store->lock);
+}
+/******************************************************************************/
+static void _store_write_lock(memory_store_st* store)
+{
+  if(store->shared)
+    pthread_rwlock_wrlock(&store->lock);
+}
+/******************************************************************************/
+static void _store_unlock(memory_store_st* store)
+{
+  if(store->shared)
+    pthread_rwlock_unlock(&store->lock);
+}
+/******************************************************************************/
+static void _queue_lock(memory_store_st* store, queue_data_st* data)
+{
+  if(store->shared)
+    pthread_mutex_lock(&data->lock);
+}
+/******************************************************************************/
+static void _queue_unlock(memory_store_st* store, queue_data_st* data)
+{
+  if(store->shared)
+    pthread_mutex_unlock(&data->lock);
+}
+/******************************************************************************/
+static void _queue_reheap(memory_store_st* store, 
+                          queue_data_st* data, 
+                          deadline_t deadline)
+{
+  /* Put a queue back in its place among the others, after the earliest 
+   deadline in one of its heaps may have changed.*/
+  heap_entry_st* top = heap_top(&data->heaps[deadline]);
+  heap_st* queues = &store->queues[deadline];
+  
+  if(store->shared)
+    pthread_mutex_lock(&store->deadline_lock);
+  
+  size_t index = data->heap_index[deadline];
+  if(!top)
+    heap_remove(queues, index);
+  else if(index == HEAP_NONE)
+    heap_add(queues, top->deadline, data, &data->heap_index[deadline]);
+  else if(queues->entries[index].deadline != top->deadline)
+    heap_update(queues, index, top->deadline);
+  
+  if(store->shared)
+    pthread_mutex_unlock(&store->deadline_lock);
+}
+/******************************************************************************/
+static queue_data_st* _due_queue(memory_store_st* store, 
+                                 deadline_t deadline, 
+                                 uint32_t current_time)
+{
+  /* The queue with the earliest deadline of a kind, if that has come.*/
+  queue_data_st* data = NULL;
+  
+  if(store->shared)
+    pthread_mutex_lock(&store->deadline_lock);
+  
+  heap_entry_st* top = heap_top(&store->queues[deadline]);
+  if(top && top->deadline <= current_time)
+    data = top->item;
+  
+  if(store->shared)
+    pthread_mutex_unlock(&store->deadline_lock);
+  
+  return data;
+}
+/******************************************************************************/
+static void _deadline_set(memory_store_st* store, 
+                          message_st* message, 
+                          deadline_t deadline, 
+                          uint32_t value)
+{
+  /* Room was reserved in the heap when the message was stored.*/
+  queue_data_st* data = message->queue->data;
+  size_t index = message->heap_index[deadline];
+  
+  if(index == HEAP_NONE)
+    heap_add(&data->heaps[deadline], 
+             value, 
+             message, 
+             &message->heap_index[deadline]);
+  else
+    heap_update(&data->heaps[deadline], index, value);
+  
+  _queue_reheap(store, data, deadline);
+}
 /******************************************************************************/
-static burrow_filters_st* _process_filter(burrow_backend_memory_st* self, 
-                                          const burrow_filters_st* in_filters)
+static void _deadline_clear(memory_store_st* store, 
+                            message_st* message, 
+                            deadline_t deadline)
 {
-  /* Allocate a default filter to scan a dictionary from beggining to end 
-   and, in the case of queues, ignore hidden messages.*/
-  burrow_filters_st* out_filters;
-  out_filters = burrow_malloc(self->burrow, sizeof(burrow_filters_st));
-  if(!out_filters)
+  if(message->heap_index[deadline] == HEAP_NONE)
+    return;
+  
+  queue_data_st* data = message->queue->data;
+  heap_remove(&data->heaps[deadline], message->heap_index[deadline]);
+  _queue_reheap(store, data, deadline);
+}
+/******************************************************************************/
+static void _wake_waiters(queue_data_st* data)
+{
+  /* Unpark every command parked on a queue, and signal each one's backend 
+   to look at the queue again. An eventfd only fails to count another 
+   signal when it has so many already that one more makes no difference.*/
+  uint64_t one = 1;
+  
+  while(data->waiters)
   {
-    burrow_log_error(self->burrow, "_process_filter(): malloc failed");
-    return NULL;
+    memory_wait_st* wait = data->waiters;
+    data->waiters = wait->waiter_next;
+    __atomic_store_n(&wait->parked, false, __ATOMIC_RELAXED);
+    
+    ssize_t written = write(wait->event_fd, &one, sizeof(one));
+    (void)written;
+  }
+}
+/******************************************************************************/
+static void _visible_link(message_st* message)
+{
+  /* Put a message back among the visible ones of its queue, in the order 
+   it came in. New messages go last; the ones shown again usually were 
+   hidden a while, so they are looked for from the front.*/
+  queue_data_st* data = message->queue->data;
+  uint64_t seq = message->node->seq;
+  message_st* after = data->visible_last;
+  
+  if(after && after->node->seq > seq)
+  {
+    message_st* before = data->visible_first;
+    while(before->node->seq < seq)
+      before = before->visible_next;
+    after = before->visible_previous;
+  }
+  
+  message->visible_previous = after;
+  if(after)
+  {
+    message->visible_next = after->visible_next;
+    after->visible_next = message;
+  }
+  else
+  {
+    message->visible_next = data->visible_first;
+    data->visible_first = message;
+  }
+  
+  if(message->visible_next)
+    message->visible_next->visible_previous = message;
+  else
+    data->visible_last = message;
+  
+  message->visible = true;
+  _wake_waiters(data);
+}
+/******************************************************************************/
+static void _visible_unlink(message_st* message)
+{
+  if(!message->visible)
+    return;
+  
+  queue_data_st* data = message->queue->data;
+  
+  if(message->visible_previous)
+    message->visible_previous->visible_next = message->visible_next;
+  else
+    data->visible_first = message->visible_next;
+  
+  if(message->visible_next)
+    message->visible_next->visible_previous = message->visible_previous;
+  else
+    data->visible_last = message->visible_previous;
+  
+  message->visible = false;
+}
+/******************************************************************************/
+static void _set_hide(memory_store_st* store, 
+                      message_st* message, 
+                      uint32_t hide, 
+                      uint32_t current_time)
+{
+  /* Hide a message until the given time, or show it if that has come.*/
+  message->hide = hide;
+  
+  if(hide > current_time)
+  {
+    _visible_unlink(message);
+    _deadline_set(store, message, HIDDEN, hide);
+  }
+  else
+  {
+    _deadline_clear(store, message, HIDDEN);
+    if(!message->visible)
+      _visible_link(message);
   }
+}
+/******************************************************************************/
+static burrow_detail_t _detail(const burrow_filters_st* filters)
+{
+  /* How much of each message a command reports: everything, unless asked 
+   for less.*/
+  if(filters && (filters->set & BURROW_FILTERS_DETAIL))
+    return filters->detail;
   
-  out_filters->set |= BURROW_FILTERS_LIMIT | BURROW_FILTERS_MATCH_HIDDEN;
+  return BURROW_DETAIL_ALL;
+}
+/******************************************************************************/
+static void _process_filter(const burrow_filters_st* in_filters, 
+                            burrow_filters_st* out_filters)
+{
+  /* By default scan a dictionary from beggining to end and, in the case 
+   of queues, ignore hidden messages, reporting all of every message.*/
+  out_filters->set = BURROW_FILTERS_LIMIT | BURROW_FILTERS_MATCH_HIDDEN | 
+                     BURROW_FILTERS_DETAIL;
   out_filters->marker = NULL;
   out_filters->limit = DICTIONARY_LENGTH;
   out_filters->match_hidden = false;
+  out_filters->detail = _detail(in_filters);
   
   /* But if the supplied filter has sensible values, use those instead...*/
   if(in_filters)
@@ -97,725 +479,2070 @@ static burrow_filters_st* _process_filter(burrow_backend_memory_st* self,
     if(in_filters->set & BURROW_FILTERS_MATCH_HIDDEN)
       out_filters->match_hidden = in_filters->match_hidden;
   }
+}
+/******************************************************************************/
+static queues_st* _queues(account_st* account)
+{
+  return ((account_data_st*)(account->data))->queues;
+}
+/******************************************************************************/
+static void _usage_add(memory_store_st* store, 
+                       usage_st* usage, 
+                       int64_t messages, 
+                       int64_t bytes)
+{
+  if(store->shared)
+  {
+    __atomic_add_fetch(&usage->messages, (uint64_t)messages, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&usage->bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    usage->messages += (uint64_t)messages;
+    usage->bytes += (uint64_t)bytes;
+  }
+}
+/******************************************************************************/
+static void _usage_get(memory_store_st* store, 
+                       const usage_st* usage, 
+                       usage_st* out)
+{
+  if(store->shared)
+  {
+    out->messages = __atomic_load_n(&usage->messages, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&usage->bytes, __ATOMIC_RELAXED);
+  }
+  else
+    *out = *usage;
+}
+/******************************************************************************/
+static void _usage_count(memory_store_st* store, 
+                         const message_st* message, 
+                         int64_t sign)
+{
+  /* Count a message in (sign 1) or out (-1) of its queue, its account and 
+   the store.*/
+  queue_data_st* data = message->queue->data;
+  account_data_st* account_data = message->account->data;
+  int64_t bytes = sign * (int64_t)slab_block_size(message->record_size);
+  
+  data->usage.messages += (uint64_t)sign;
+  data->usage.bytes += (uint64_t)bytes;
+  _usage_add(store, &account_data->usage, sign, bytes);
+  _usage_add(store, &store->usage, sign, bytes);
+}
+/******************************************************************************/
+static void _free_message(memory_store_st* store, message_st* message)
+{
+  queue_data_st* data = message->queue->data;
   
-  return out_filters;
+  _usage_count(store, message, -1);
+  _deadline_clear(store, message, EXPIRY);
+  _deadline_clear(store, message, HIDDEN);
+  _visible_unlink(message);
+  slab_free(&data->slabs, message->node, message->record_size);
 }
 /******************************************************************************/
-static int _scan_queue(burrow_backend_memory_st* self, 
-                       const burrow_command_st* cmd, 
-                       scan_action_t scan_type, 
-                       delete_action_t delete_action)
+static queue_st* _new_queue(memory_store_st* store, 
+                            account_st* account, 
+                            const char* name)
 {
-  /* Get current time: 
-   messages'ttl/hide are relative to "now" = the current time when 
-   this function is called.
-      
-   Also, get the appropriate account and queue.*/
-  uint32_t current_time = (uint32_t)time(NULL);
+  queue_data_st* data = burrow_malloc(store->burrow, sizeof(queue_data_st));
+  if(!data)
+  {
+    burrow_log_error(store->burrow, "_new_queue(): malloc failed");
+    return NULL;
+  }
   
-  account_st* account = dictionary_get(self->accounts, cmd->account, SEARCH);
-  if(!account)
-    return 0;
+  data->visible_first = NULL;
+  data->visible_last = NULL;
+  heap_init(&data->heaps[EXPIRY], store->burrow);
+  heap_init(&data->heaps[HIDDEN], store->burrow);
+  data->heap_index[EXPIRY] = HEAP_NONE;
+  data->heap_index[HIDDEN] = HEAP_NONE;
+  slab_init(&data->slabs, store->burrow);
+  data->usage.messages = 0;
+  data->usage.bytes = 0;
+  data->waiters = NULL;
+  
+  /* Make room for the queue among the others in the store's heaps.*/
+  size_t count = store->queue_count + 1;
+  if(heap_reserve(&store->queues[EXPIRY], count) || 
+     heap_reserve(&store->queues[HIDDEN], count) || 
+     !(data->messages = dictionary_init(NULL, store->burrow)))
+  {
+    burrow_free(store->burrow, data);
+    return NULL;
+  }
   
-  queue_st* queue = dictionary_get(account->data, cmd->queue, SEARCH);
+  queue_st* queue = dictionary_add(_queues(account), name, data);
   if(!queue)
-    return 0;
+  {
+    dictionary_free(data->messages);
+    burrow_free(store->burrow, data);
+    return NULL;
+  }
   
-  /* validate incoming attributes only relevant if updating messages' ttl/hide*/
-  burrow_attributes_st reference_attributes;
-  uint32_t attributes_ttl = 0; 
-  uint32_t attributes_hide = 0;
-  if(cmd->attributes)
+  pthread_mutex_init(&data->lock, NULL);
+  store->queue_count++;
+  return queue;
+}
+/******************************************************************************/
+static void _drop_queue(memory_store_st* store, 
+                        account_st* account, 
+                        queue_st* queue)
+{
+  /* Every message in a queue, hidden or not, goes with its slabs and 
+   heaps, without looking at any of them, and is counted out all at once. 
+   Commands parked on it look again, and park on a new one.*/
+  queue_data_st* data = queue->data;
+  _wake_waiters(data);
+  _usage_add(store, 
+             &((account_data_st*)(account->data))->usage, 
+             -(int64_t)data->usage.messages, 
+             -(int64_t)data->usage.bytes);
+  _usage_add(store, 
+             &store->usage, 
+             -(int64_t)data->usage.messages, 
+             -(int64_t)data->usage.bytes);
+  heap_remove(&store->queues[EXPIRY], data->heap_index[EXPIRY]);
+  heap_remove(&store->queues[HIDDEN], data->heap_index[HIDDEN]);
+  heap_destroy(&data->heaps[EXPIRY]);
+  heap_destroy(&data->heaps[HIDDEN]);
+  slab_destroy(&data->slabs);
+  pthread_mutex_destroy(&data->lock);
+  
+  dictionary_free(data->messages);
+  burrow_free(store->burrow, data);
+  dictionary_delete_node(_queues(account), queue->key);
+  store->queue_count--;
+}
+/******************************************************************************/
+static account_st* _new_account(memory_store_st* store, const char* name)
+{
+  account_data_st* data = burrow_malloc(store->burrow, 
+                                        sizeof(account_data_st));
+  if(!data)
   {
-    if(cmd->attributes->set & BURROW_ATTRIBUTES_TTL)
-      attributes_ttl = cmd->attributes->ttl + current_time;
-    
-    if(cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)
-      attributes_hide = cmd->attributes->hide + current_time;
+    burrow_log_error(store->burrow, "_new_account(): malloc failed");
+    return NULL;
   }
   
-  burrow_filters_st* ref_filters = _process_filter(self, cmd->filters);
-  if(!ref_filters)
+  data->usage.messages = 0;
+  data->usage.bytes = 0;
+  if(!(data->queues = dictionary_init(NULL, store->burrow)))
   {
-    burrow_log_error(self->burrow, "_scan_queue(): malloc failed");
-    return 0;
+    burrow_free(store->burrow, data);
+    return NULL;
   }
   
-  dictionary_st* iterator = dictionary_iter(queue->data, 
-                                            ref_filters->marker, 
-                                            ref_filters->limit);
-  if(!iterator)
+  account_st* account = dictionary_add(store->accounts, name, data);
+  if(!account)
   {
-    burrow_free(self->burrow, ref_filters);
-    return 0;
+    dictionary_free(data->queues);
+    burrow_free(store->burrow, data);
   }
   
-  dictionary_node_st* item = iterator->first;
-  burrow_message_st* message;
+  return account;
+}
+/******************************************************************************/
+static void _drop_account(memory_store_st* store, account_st* account)
+{
+  account_data_st* data = account->data;
+  queues_st* queues = data->queues;
+  while(queues->first)
+    _drop_queue(store, account, queues->first);
+  
+  dictionary_free(queues);
+  burrow_free(store->burrow, data);
+  dictionary_delete_node(store->accounts, account->key);
+}
+/******************************************************************************/
+static void _prune_queue(memory_store_st* store, 
+                         account_st* account, 
+                         queue_st* queue)
+{
+  /* Don't leave behind an empty queue, or account. In a shared store that 
+   would take its write lock, over and over for a queue drained as fast as 
+   it fills, so there they stay (out of sight) until deleted.*/
+  if(store->shared)
+    return;
   
-  /* Iterate through the selected range of messages in a specific queue, 
-   performing one of the following, on each message in the range:
-   
-   UPDATE: update ttl / hide attributes.
-   GET:    return the message unmodified.
-   DELETE: delete the message.
-   
-   DELETE additionaly can either IGNORE: just delete the message 
-   or REPORT: still return the deleted message.*/
-  int i;
-  for(i=0; i < iterator->length; i++)
+  /* One with commands parked on it stays for them.*/
+  queue_data_st* data = queue->data;
+  if(!data->messages->length && !data->waiters)
+    _drop_queue(store, account, queue);
+  
+  if(!_queues(account)->length)
+    _drop_account(store, account);
+}
+/******************************************************************************/
+static bool _queue_empty(memory_store_st* store, queue_st* queue)
+{
+  queue_data_st* data = queue->data;
+  
+  _queue_lock(store, data);
+  bool empty = !data->messages->length;
+  _queue_unlock(store, data);
+  
+  return empty;
+}
+/******************************************************************************/
+static bool _account_empty(memory_store_st* store, account_st* account)
+{
+  queue_st* queue;
+  for(queue = _queues(account)->first; queue; queue = queue->next)
+    if(!_queue_empty(store, queue))
+      return false;
+  
+  return true;
+}
+/******************************************************************************/
+static void _tick(memory_store_st* store, uint32_t current_time)
+{
+  /* Reclaim every message whose ttl has run out, earliest first, then show 
+   again those whose hide has. A shared store only has this done once a 
+   second, by whichever thread gets there first, each queue under its own 
+   lock as it comes up.*/
+  if(store->shared && 
+     __atomic_exchange_n(&store->ticked, current_time, __ATOMIC_ACQ_REL) == 
+     current_time)
+    return;
+  
+  heap_entry_st* top;
+  queue_data_st* data;
+  
+  _store_read_lock(store);
+  
+  while((data = _due_queue(store, EXPIRY, current_time)))
   {
-    /* Check if messge ttl expired and if so, delete*/
-    message = item->data;
-    if(message->ttl <= current_time)
-    {
-      dictionary_delete_node(queue->data, item->key);
-      burrow_free(self->burrow, message->message_id);
-      burrow_free(self->burrow, message->body);
-      burrow_free(self->burrow, message);
-      item = item->next;
-      continue;
-    }
-    /* Check if message hidden, if so skip unless the range includes 
-     hidden messages*/
-    if(!ref_filters->match_hidden && (message->hide > current_time))
+    _queue_lock(store, data);
+    
+    account_st* account = NULL;
+    queue_st* queue = NULL;
+    while((top = heap_top(&data->heaps[EXPIRY])) && 
+          top->deadline <= current_time)
     {
-      item = item->next;
-      continue;
+      message_st* message = top->item;
+      account = message->account;
+      queue = message->queue;
+      dictionary_unlink(data->messages, message->node);
+      _free_message(store, message);
     }
     
-    switch(scan_type)
+    _queue_unlock(store, data);
+    if(queue)
+      _prune_queue(store, account, queue);
+  }
+  
+  while((data = _due_queue(store, HIDDEN, current_time)))
+  {
+    _queue_lock(store, data);
+    
+    while((top = heap_top(&data->heaps[HIDDEN])) && 
+          top->deadline <= current_time)
     {
-      case UPDATE:
-        if(attributes_ttl)
-          message->ttl = attributes_ttl;
-        
-        if(attributes_hide)
-          message->hide = attributes_hide;
-        /* FALLTHROUGH*/
-        
-      case GET:
-        reference_attributes.ttl = message->ttl - current_time;
-        
-        if(message->hide > current_time)
-          reference_attributes.hide = message->hide - current_time;
-        else
-          reference_attributes.hide = 0;
-        
-        reference_attributes.set |= BURROW_ATTRIBUTES_TTL;
-        reference_attributes.set |= BURROW_ATTRIBUTES_HIDE;
-        
-        burrow_callback_message(self->burrow, 
-                                message->message_id, 
-                                message->body, 
-                                message->body_size, 
-                                &reference_attributes);
-        
-        break;
-        
-      case DELETE:
-        dictionary_delete_node(queue->data, item->key);
-        
-        if(delete_action == REPORT)
-        {
-          reference_attributes.ttl = message->ttl - current_time;
-          
-          if(message->hide > current_time)
-            reference_attributes.hide = message->hide - current_time;
-          else
-            reference_attributes.hide = 0;
-
-          reference_attributes.set |= BURROW_ATTRIBUTES_TTL;
-          reference_attributes.set |= BURROW_ATTRIBUTES_HIDE;
-          
-          burrow_callback_message(self->burrow, 
-                                  message->message_id, 
-                                  message->body, 
-                                  message->body_size, 
-                                  &reference_attributes);
-         
-        }
-
-        burrow_free(self->burrow, message->message_id);
-        burrow_free(self->burrow, message->body);
-        burrow_free(self->burrow, message);
-        
-        break;
-        
-      default:
-        break;
+      message_st* message = top->item;
+      _deadline_clear(store, message, HIDDEN);
+      _visible_link(message);
     }
     
-    item = item->next;
+    _queue_unlock(store, data);
   }
   
-  burrow_free(self->burrow, ref_filters);
-  dictionary_delete(iterator, NULL, iterator->length);
-  burrow_free(self->burrow, iterator);
+  _store_unlock(store);
+}
+/******************************************************************************/
+static void _report_message(burrow_backend_memory_st* self, 
+                            const message_st* message, 
+                            burrow_detail_t detail, 
+                            uint32_t current_time)
+{
+  /* Only as much of a message is reported as asked for: nothing, its id, 
+   its id and attributes, its id and body, or all of it. Attributes are 
+   only worked out for those that want them.*/
+  if(detail == BURROW_DETAIL_NONE)
+    return;
+  
+  const void* body = NULL;
+  size_t body_size = 0;
+  if(detail == BURROW_DETAIL_BODY || detail == BURROW_DETAIL_ALL)
+  {
+    body = message->body;
+    body_size = message->body_size;
+  }
+  
+  if(detail != BURROW_DETAIL_ATTRIBUTES && detail != BURROW_DETAIL_ALL)
+  {
+    burrow_callback_message(self->burrow, 
+                            message->message_id, 
+                            body, 
+                            body_size, 
+                            NULL);
+    return;
+  }
+  
+  /* A shared store may not have reclaimed a message due this second yet.*/
+  burrow_attributes_st attributes;
+  attributes.set = BURROW_ATTRIBUTES_TTL | BURROW_ATTRIBUTES_HIDE;
+  if(message->ttl > current_time)
+    attributes.ttl = message->ttl - current_time;
+  else
+    attributes.ttl = 0;
+  if(message->hide > current_time)
+    attributes.hide = message->hide - current_time;
+  else
+    attributes.hide = 0;
+  
+  burrow_callback_message(self->burrow, 
+                          message->message_id, 
+                          body, 
+                          body_size, 
+                          &attributes);
+}
+/******************************************************************************/
+static queue_st* _find_queue(memory_store_st* store, 
+                             const burrow_command_st* cmd, 
+                             account_st** account)
+{
+  if(!(*account = dictionary_get(store->accounts, cmd->account, SEARCH)))
+    return NULL;
+  
+  return dictionary_get(_queues(*account), cmd->queue, SEARCH);
+}
+/******************************************************************************/
+static queue_st* _create_queue(memory_store_st* store, 
+                               const burrow_command_st* cmd, 
+                               account_st** account)
+{
+  /* Find the account and queue a message goes into, creating them if 
+   need be. Only a write-locked store may have either created, so one 
+   that is only read-locked is unlocked and write-locked for that, and 
+   left so.*/
+  queue_st* queue = _find_queue(store, cmd, account);
+  if(queue)
+    return queue;
+  
+  if(store->shared)
+  {
+    _store_unlock(store);
+    _store_write_lock(store);
+  }
+  
+  *account = dictionary_get(store->accounts, cmd->account, SEARCH);
+  if(!*account && !(*account = _new_account(store, cmd->account)))
+    return NULL;
+  
+  queue = dictionary_get(_queues(*account), cmd->queue, SEARCH);
+  if(!queue && !(queue = _new_queue(store, *account, cmd->queue)))
+  {
+    if(!_queues(*account)->length)
+      _drop_account(store, *account);
+    return NULL;
+  }
+  
+  return queue;
+}
+/******************************************************************************/
+static uint32_t _scan_queue(burrow_backend_memory_st* self, 
+                            queue_st* queue, 
+                            const burrow_command_st* cmd, 
+                            scan_action_t scan_type, 
+                            delete_action_t delete_action, 
+                            uint32_t current_time)
+{
+  /* Messages'ttl/hide are relative to "now" = the current time when 
+   the command came in. Returns how many messages were in range.*/
+  memory_store_st* store = self->store;
+  queue_data_st* data = queue->data;
+  
+  /* validate incoming attributes only relevant if updating messages' ttl/hide*/
+  uint32_t attributes_ttl = 0; 
+  uint32_t attributes_hide = 0;
+  bool set_hide = false;
+  if(cmd->attributes)
+  {
+    if(cmd->attributes->set & BURROW_ATTRIBUTES_TTL)
+      attributes_ttl = cmd->attributes->ttl + current_time;
+    
+    if(cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)
+    {
+      attributes_hide = cmd->attributes->hide + current_time;
+      set_hide = true;
+    }
+  }
+  
+  burrow_filters_st ref_filters;
+  _process_filter(cmd->filters, &ref_filters);
+  
+  /* Hidden messages in range are walked with the rest by a cursor over 
+   the whole queue. Otherwise only the visible list is, starting from the 
+   first visible message after the marker. Either way the message just 
+   looked at can be deleted or hidden on the way.*/
+  dictionary_cursor_st cursor;
+  message_st* next = NULL;
+  uint32_t remaining = ref_filters.limit == DICTIONARY_LENGTH ? 
+                       UINT32_MAX : ref_filters.limit;
+  
+  if(ref_filters.match_hidden)
+    dictionary_cursor_init(&cursor, 
+                           data->messages, 
+                           ref_filters.marker, 
+                           DICTIONARY_LENGTH);
+  else
+  {
+    message_node_st* item = dictionary_get(data->messages, 
+                                           ref_filters.marker, 
+                                           SEARCH);
+    if(!item)
+      next = data->visible_first;
+    else
+      item = item->next;
+    
+    while(item && !next)
+    {
+      if(((message_st*)(item->data))->visible)
+        next = item->data;
+      item = item->next;
+    }
+  }
+  
+  message_st* message;
+  uint32_t matched = 0;
+  
+  /* Iterate through the selected range of messages in a specific queue, 
+   performing one of the following, on each message in the range:
+   
+   UPDATE: update ttl / hide attributes.
+   GET:    return the message unmodified.
+   DELETE: delete the message.
+   
+   DELETE additionaly can either IGNORE: just delete the message 
+   or REPORT: still return the deleted message.
+   
+   Messages past their ttl are skipped: in a shared store another thread 
+   may not have reclaimed them yet.*/
+  while(remaining)
+  {
+    if(ref_filters.match_hidden)
+    {
+      message_node_st* item = dictionary_cursor_next(&cursor);
+      if(!item)
+        break;
+      
+      message = item->data;
+    }
+    else
+    {
+      if(!next)
+        break;
+      
+      message = next;
+      next = message->visible_next;
+    }
+    
+    if(message->ttl <= current_time)
+      continue;
+    
+    remaining--;
+    matched++;
+    switch(scan_type)
+    {
+      case UPDATE:
+        if(attributes_ttl)
+        {
+          message->ttl = attributes_ttl;
+          _deadline_set(store, message, EXPIRY, message->ttl);
+        }
+        
+        if(set_hide)
+          _set_hide(store, message, attributes_hide, current_time);
+        /* FALLTHROUGH*/
+        
+      case GET:
+        _report_message(self, message, ref_filters.detail, current_time);
+        break;
+        
+      case DELETE:
+        if(delete_action == REPORT)
+          _report_message(self, message, ref_filters.detail, current_time);
+        
+        dictionary_unlink(data->messages, message->node);
+        _free_message(store, message);
+        break;
+        
+      default:
+        break;
+    }
+  }
+  
+  return matched;
+}
+/******************************************************************************/
+static int _run_scan(burrow_backend_memory_st* self, 
+                     const burrow_command_st* cmd, 
+                     scan_action_t scan_type, 
+                     delete_action_t delete_action, 
+                     memory_wait_st* wait)
+{
+  /* Get current time, and the appropriate account and queue, and scan the 
+   queue with nothing else getting at it. Given a wait, a scan that finds 
+   nothing parks it on the queue, created for it if need be, and returns 
+   EAGAIN.*/
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
+  int result = 0;
+  _tick(store, current_time);
+  
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = wait ? _create_queue(store, cmd, &account) 
+                         : _find_queue(store, cmd, &account);
+  if(queue)
+  {
+    queue_data_st* data = queue->data;
+    _queue_lock(store, data);
+    if(!_scan_queue(self, 
+                    queue, 
+                    cmd, 
+                    scan_type, 
+                    delete_action, 
+                    current_time) && wait)
+    {
+      wait->waiter_previous = NULL;
+      wait->waiter_next = data->waiters;
+      if(data->waiters)
+        data->waiters->waiter_previous = wait;
+      data->waiters = wait;
+      __atomic_store_n(&wait->parked, true, __ATOMIC_RELAXED);
+      result = EAGAIN;
+    }
+    _queue_unlock(store, data);
+    
+    /* If all messages in a queue were deleted, delete the queue itself, 
+     and the account if that was its only queue.*/
+    _prune_queue(store, account, queue);
+  }
+  else if(wait)
+    result = ENOMEM;
+  
+  _store_unlock(store);
+  return result;
+}
+/******************************************************************************/
+static int64_t _now_ms(void)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+/******************************************************************************/
+static void _wait_unpark(memory_store_st* store, memory_wait_st* wait)
+{
+  /* Take a command off the queue it is parked on, unless a message has 
+   already. Either way the queue's lock is taken, so that whatever woke 
+   it is done with it before it goes.*/
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = _find_queue(store, wait->cmd, &account);
+  if(queue)
+  {
+    queue_data_st* data = queue->data;
+    _queue_lock(store, data);
+    
+    if(wait->parked)
+    {
+      if(wait->waiter_previous)
+        wait->waiter_previous->waiter_next = wait->waiter_next;
+      else
+        data->waiters = wait->waiter_next;
+      
+      if(wait->waiter_next)
+        wait->waiter_next->waiter_previous = wait->waiter_previous;
+      
+      __atomic_store_n(&wait->parked, false, __ATOMIC_RELAXED);
+    }
+    
+    _queue_unlock(store, data);
+    _prune_queue(store, account, queue);
+  }
+  
+  _store_unlock(store);
+}
+/******************************************************************************/
+static int _run_messages(burrow_backend_memory_st* self, 
+                         const burrow_command_st* cmd, 
+                         scan_action_t scan_type)
+{
+  /* A command with the wait filter set that finds nothing stays in flight, 
+   parked on the queue until process finds it a message, or its wait runs 
+   out.*/
+  if(!cmd->filters || !(cmd->filters->set & BURROW_FILTERS_WAIT) || 
+     !cmd->filters->wait)
+    return _run_scan(self, cmd, scan_type, REPORT, NULL);
+  
+  if(self->event_fd == -1 && 
+     (self->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+  {
+    burrow_log_error(self->burrow, "_run_messages(): eventfd failed.");
+    return errno;
+  }
+  
+  memory_wait_st* wait = burrow_malloc(self->burrow, sizeof(memory_wait_st));
+  if(!wait)
+  {
+    burrow_log_error(self->burrow, "_run_messages(): malloc failed.");
+    return ENOMEM;
+  }
+  
+  wait->cmd = cmd;
+  wait->scan_type = scan_type;
+  wait->deadline = _now_ms() + (int64_t)cmd->filters->wait * 1000;
+  wait->event_fd = self->event_fd;
+  wait->parked = false;
+  
+  int result = _run_scan(self, cmd, scan_type, REPORT, wait);
+  if(result != EAGAIN)
+  {
+    burrow_free(self->burrow, wait);
+    return result;
+  }
+  
+  wait->next = self->waits;
+  self->waits = wait;
+  return EAGAIN;
+}
+/******************************************************************************/
+static int burrow_backend_memory_get_queues(void* ptr, 
+                                            const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  _tick(store, (uint32_t)time(NULL));
+  
+  _store_read_lock(store);
+  
+  account_st* account = dictionary_get(store->accounts, cmd->account, SEARCH);
+  if(!account || !account->data)
+  {
+    _store_unlock(store);
+    return 0;
+  }
+  
+  burrow_filters_st ref_filters;
+  _process_filter(cmd->filters, &ref_filters);
+  
+  /* Only queues with messages count, which a shared store may have left, 
+   and commands be parked on.*/
+  dictionary_cursor_st cursor;
+  dictionary_cursor_init(&cursor, 
+                         _queues(account), 
+                         ref_filters.marker, 
+                         DICTIONARY_LENGTH);
+  
+  uint32_t remaining = ref_filters.limit == DICTIONARY_LENGTH ? 
+                       UINT32_MAX : ref_filters.limit;
+  dictionary_node_st* item;
+  while(remaining && (item = dictionary_cursor_next(&cursor)))
+    if(!_queue_empty(store, item))
+    {
+      burrow_callback_queue(self->burrow, item->key);
+      remaining--;
+    }
+  
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_delete_queues(void* ptr, 
+                                               const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  _tick(store, (uint32_t)time(NULL));
+  
+  _store_write_lock(store);
+  
+  account_st* account = dictionary_get(store->accounts, cmd->account, SEARCH);
+  if(!account || !account->data)
+  {
+    _store_unlock(store);
+    return 0;
+  }
+  
+  queues_st* queues = _queues(account);
+  
+  burrow_filters_st ref_filters;
+  _process_filter(cmd->filters, &ref_filters);
+  
+  dictionary_cursor_st cursor;
+  dictionary_cursor_init(&cursor, 
+                         queues, 
+                         ref_filters.marker, 
+                         ref_filters.limit);
+  
+  dictionary_node_st* item;
+  while((item = dictionary_cursor_next(&cursor)))
+    _drop_queue(store, account, item);
+  
+  /* The account goes too once its last queue is gone, but only after the 
+   cursor over its queues is done with.*/
+  if(!queues->length)
+    _drop_account(store, account);
+  
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_get_accounts(void* ptr, 
+                                              const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  _tick(store, (uint32_t)time(NULL));
+  
+  _store_read_lock(store);
+  
+  burrow_filters_st ref_filters;
+  _process_filter(cmd->filters, &ref_filters);
+  
+  /* Only accounts with messages count, which a shared store may have left, 
+   and commands be parked on.*/
+  dictionary_cursor_st cursor;
+  dictionary_cursor_init(&cursor, 
+                         store->accounts, 
+                         ref_filters.marker, 
+                         DICTIONARY_LENGTH);
+  
+  uint32_t remaining = ref_filters.limit == DICTIONARY_LENGTH ? 
+                       UINT32_MAX : ref_filters.limit;
+  dictionary_node_st* item;
+  while(remaining && (item = dictionary_cursor_next(&cursor)))
+    if(!_account_empty(store, item))
+    {
+      burrow_callback_account(self->burrow, item->key);
+      remaining--;
+    }
+  
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_delete_accounts(void* ptr, 
+                                                 const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  _tick(store, (uint32_t)time(NULL));
+  
+  _store_write_lock(store);
+  
+  burrow_filters_st ref_filters;
+  _process_filter(cmd->filters, &ref_filters);
+  
+  dictionary_cursor_st cursor;
+  dictionary_cursor_init(&cursor, 
+                         store->accounts, 
+                         ref_filters.marker, 
+                         ref_filters.limit);
+  
+  dictionary_node_st* item;
+  while((item = dictionary_cursor_next(&cursor)))
+    _drop_account(store, item);
+  
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_get_messages(void *ptr, 
+                                              const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  
+  return _run_messages(self, cmd, GET);
+}
+/******************************************************************************/
+static int burrow_backend_memory_update_messages(void *ptr, 
+                                                 const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  
+  return _run_messages(self, cmd, UPDATE);
+}
+/******************************************************************************/
+static int burrow_backend_memory_delete_messages(void *ptr, 
+                                                 const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  
+  return _run_messages(self, cmd, DELETE);
+}
+/******************************************************************************/
+static size_t _record_size(uint8_t level, size_t id_size, size_t body_size)
+{
+  return dictionary_node_size(level) + sizeof(message_st) + id_size + 
+         body_size;
+}
+/******************************************************************************/
+static bool _over_limit(const usage_st* usage, 
+                        const usage_st* limit, 
+                        int64_t messages, 
+                        int64_t bytes)
+{
+  return (limit->messages && 
+          (int64_t)usage->messages + messages > (int64_t)limit->messages) || 
+         (limit->bytes && 
+          (int64_t)usage->bytes + bytes > (int64_t)limit->bytes);
+}
+/******************************************************************************/
+static message_st* _victim(memory_store_st* store, 
+                           queue_data_st* data, 
+                           const message_st* keep)
+{
+  /* The message to drop next from a queue to make room, other than the 
+   one about to be overwritten: the first one in, or the one due to expire 
+   first, which is on top of the heap unless it is the one kept, in which 
+   case it is the sooner of its two children.*/
+  if(store->limit_policy == LIMIT_DROP_OLDEST)
+  {
+    message_node_st* node = data->messages->first;
+    if(node && node->data == keep)
+      node = node->next;
+    return node ? node->data : NULL;
+  }
+  
+  heap_st* heap = &data->heaps[EXPIRY];
+  if(!heap->count)
+    return NULL;
+  if(heap->entries[0].item != keep)
+    return heap->entries[0].item;
+  if(heap->count == 1)
+    return NULL;
+  if(heap->count > 2 && heap->entries[2].deadline < heap->entries[1].deadline)
+    return heap->entries[2].item;
+  return heap->entries[1].item;
+}
+/******************************************************************************/
+static int _make_room(memory_store_st* store, 
+                      account_st* account, 
+                      queue_st* queue, 
+                      const message_st* keep, 
+                      int64_t messages, 
+                      int64_t bytes)
+{
+  /* Turn down a message that would take its queue or account past a limit,
+   or drop others to make room for it, as the store's policy says. Only the 
+   queue written to is dropped from, being the only one locked, so if that 
+   isn't enough for the account the message is turned down after all. In 
+   a shared store, messages created at the same time into an account's 
+   other queues may take it past its limit by as much as they take.*/
+  queue_data_st* data = queue->data;
+  account_data_st* account_data = account->data;
+  usage_st none = { 0, 0 };
+  usage_st account_usage;
+  
+  /* One that could never fit isn't let drop anything first.*/
+  if(_over_limit(&none, &store->queue_limit, messages, bytes) || 
+     _over_limit(&none, &store->account_limit, messages, bytes))
+    return ENOSPC;
+  
+  for(;;)
+  {
+    _usage_get(store, &account_data->usage, &account_usage);
+    if(!_over_limit(&data->usage, &store->queue_limit, messages, bytes) && 
+       !_over_limit(&account_usage, &store->account_limit, messages, bytes))
+      return 0;
+    
+    message_st* victim = NULL;
+    if(store->limit_policy != LIMIT_REJECT)
+      victim = _victim(store, data, keep);
+    if(!victim)
+      return ENOSPC;
+    
+    dictionary_unlink(data->messages, victim->node);
+    _free_message(store, victim);
+  }
+}
+/******************************************************************************/
+static message_st* _new_message(memory_store_st* store, 
+                                account_st* account, 
+                                queue_st* queue, 
+                                uint8_t level, 
+                                const char* message_id, 
+                                size_t id_size, 
+                                const void* body, 
+                                size_t body_size)
+{
+  /* Allocate a message in one piece with a node level high, not linked 
+   in anywhere yet, nor given any deadline.*/
+  queue_data_st* data = queue->data;
+  size_t node_size = dictionary_node_size(level);
+  size_t record_size = _record_size(level, id_size, body_size);
+  
+  message_node_st* node = slab_alloc(&data->slabs, record_size);
+  if(!node)
+  {
+    burrow_log_error(store->burrow, "create_message(): malloc failed.");
+    return NULL;
+  }
+  
+  message_st* new_message = (message_st*)((char*)node + node_size);
+  new_message->message_id = (char*)(new_message + 1);
+  new_message->body = new_message->message_id + id_size;
+  new_message->body_size = body_size;
+  new_message->record_size = record_size;
+  memcpy(new_message->message_id, message_id, id_size);
+  memcpy(new_message->body, body, body_size);
+  
+  new_message->heap_index[EXPIRY] = HEAP_NONE;
+  new_message->heap_index[HIDDEN] = HEAP_NONE;
+  new_message->account = account;
+  new_message->queue = queue;
+  new_message->node = node;
+  new_message->visible = false;
+  
+  return new_message;
+}
+/******************************************************************************/
+static int _store_message(memory_store_st* store, 
+                          account_st* account, 
+                          queue_st* queue, 
+                          const char* message_id, 
+                          const void* body, 
+                          size_t body_size, 
+                          const burrow_attributes_st* attributes, 
+                          uint32_t creation_time)
+{
+  /* Make room in the heaps for one more message, so that it can always be 
+   hidden or shown later on.*/
+  queue_data_st* data = queue->data;
+  size_t count = data->heaps[EXPIRY].count + 1;
+  if(heap_reserve(&data->heaps[EXPIRY], count) || 
+     heap_reserve(&data->heaps[HIDDEN], count))
+    return ENOMEM;
+  
+  /* A message with the same id is overwritten, in its place, so the new 
+   node must be as high as the old one.*/
+  message_node_st* old_node = dictionary_get(data->messages, 
+                                             message_id, 
+                                             SEARCH);
+  uint8_t level = old_node ? old_node->level 
+                           : dictionary_random_level(data->messages);
+  size_t id_size = strlen(message_id) + 1;
+  
+  /* Counting in the new message, and out the one it overwrites.*/
+  message_st* old_message = old_node ? old_node->data : NULL;
+  int64_t bytes = (int64_t)slab_block_size(_record_size(level, 
+                                                         id_size, 
+                                                         body_size));
+  if(old_message)
+    bytes -= (int64_t)slab_block_size(old_message->record_size);
+  int result = _make_room(store, 
+                          account, 
+                          queue, 
+                          old_message, 
+                          old_message ? 0 : 1, 
+                          bytes);
+  if(result)
+    return result;
+  
+  message_st* new_message = _new_message(store, 
+                                         account, 
+                                         queue, 
+                                         level, 
+                                         message_id, 
+                                         id_size, 
+                                         body, 
+                                         body_size);
+  if(!new_message)
+    return ENOMEM;
+  
+  message_node_st* node = new_message->node;
+  
+  if(attributes && (attributes->set & BURROW_ATTRIBUTES_TTL))  
+    new_message->ttl = creation_time + attributes->ttl;
+  else
+    new_message->ttl = creation_time + 300; /* five minutes by default.*/
+  
+  new_message->hide = 0;
+  if(attributes && (attributes->set & BURROW_ATTRIBUTES_HIDE)) 
+    if(attributes->hide)
+      new_message->hide = creation_time + attributes->hide;
+  
+  if(old_node)
+  {
+    dictionary_replace(data->messages, 
+                       old_node, 
+                       node, 
+                       new_message->message_id, 
+                       new_message);
+    _free_message(store, old_message);
+  }
+  else if(dictionary_link(data->messages, 
+                          node, 
+                          level, 
+                          new_message->message_id, 
+                          new_message))
+  {
+    slab_free(&data->slabs, node, new_message->record_size);
+    return ENOMEM;
+  }
+  
+  _usage_count(store, new_message, 1);
+  _deadline_set(store, new_message, EXPIRY, new_message->ttl);
+  _set_hide(store, new_message, new_message->hide, creation_time);
+  
+  /* A hidden message wakes commands parked on the queue too, for those 
+   matching hidden ones.*/
+  _wake_waiters(data);
+  
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_create_message(void* ptr, 
+                                                const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint32_t creation_time = (uint32_t)time(NULL);
+  _tick(store, creation_time);
+  
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = _create_queue(store, cmd, &account);
+  if(!queue)
+  {
+    _store_unlock(store);
+    return ENOMEM;
+  }
+  
+  /* Don't leave behind an empty queue (and account) we just created.*/
+  _queue_lock(store, queue->data);
+  int result = _store_message(store, 
+                              account, 
+                              queue, 
+                              cmd->message_id, 
+                              cmd->body, 
+                              cmd->body_size, 
+                              cmd->attributes, 
+                              creation_time);
+  _queue_unlock(store, queue->data);
+  _prune_queue(store, account, queue);
+  
+  _store_unlock(store);
+  return result;
+}
+/******************************************************************************/
+static int burrow_backend_memory_create_messages(void* ptr, 
+                                                 const burrow_command_st* cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint32_t creation_time = (uint32_t)time(NULL);
+  int result = 0;
+  _tick(store, creation_time);
+  
+  _store_read_lock(store);
+  
+  /* The account and queue are looked up (or created) once for the batch, 
+   and the queue locked once for it too.*/
+  account_st* account;
+  queue_st* queue = _create_queue(store, cmd, &account);
+  if(!queue)
+  {
+    _store_unlock(store);
+    return ENOMEM;
+  }
+  
+  _queue_lock(store, queue->data);
+  
+  size_t i;
+  for(i = 0; i < cmd->message_count; i++)
+  {
+    const burrow_message_st* message = &cmd->messages[i];
+    if((result = _store_message(store, 
+                                account, 
+                                queue, 
+                                message->message_id, 
+                                message->body, 
+                                message->body_size, 
+                                message->attributes, 
+                                creation_time)))
+      break;
+  }
+  
+  _queue_unlock(store, queue->data);
+  _prune_queue(store, account, queue);
+  
+  _store_unlock(store);
+  return result;
+}
+/******************************************************************************/
+static message_st* _find_message(queue_st* queue, 
+                                  const burrow_command_st* cmd, 
+                                  uint32_t current_time)
+{
+  /* A message past its ttl isn't there, even before it's reclaimed.*/
+  queue_data_st* data = queue->data;
+  message_node_st* message_node = dictionary_get(data->messages, 
+                                                 cmd->message_id, 
+                                                 SEARCH);
+  if(!message_node || 
+     ((message_st*)(message_node->data))->ttl <= current_time)
+    return NULL;
+  
+  return message_node->data;
+}
+/******************************************************************************/
+static int burrow_backend_memory_update_message(void *ptr, 
+                                                const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr; 
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
+  _tick(store, current_time);
+  
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = _find_queue(store, cmd, &account);
+  message_st* message = NULL;
+  if(queue)
+  {
+    _queue_lock(store, queue->data);
+    message = _find_message(queue, cmd, current_time);
+  }
+  
+  if(!message)
+  {
+    if(queue)
+      _queue_unlock(store, queue->data);
+    _store_unlock(store);
+    return EINVAL;
+  }
+  
+  if(cmd->attributes)
+  {
+    if(cmd->attributes->set & BURROW_ATTRIBUTES_TTL)
+      if(cmd->attributes->ttl > 0)
+      {
+        message->ttl = cmd->attributes->ttl + current_time;
+        _deadline_set(store, message, EXPIRY, message->ttl);
+      }
+    
+    if(cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)
+      _set_hide(store, message, cmd->attributes->hide + current_time, 
+                current_time);
+  }
+  
+  _report_message(self, message, _detail(cmd->filters), current_time);
+  
+  _queue_unlock(store, queue->data);
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_get_message(void *ptr, 
+                                             const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr; 
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
+  _tick(store, current_time);
+  
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = _find_queue(store, cmd, &account);
+  message_st* message = NULL;
+  if(queue)
+  {
+    _queue_lock(store, queue->data);
+    if((message = _find_message(queue, cmd, current_time)))
+      _report_message(self, message, _detail(cmd->filters), current_time);
+    _queue_unlock(store, queue->data);
+  }
+  
+  _store_unlock(store);
+  return message ? 0 : EINVAL;
+}
+/******************************************************************************/
+static int burrow_backend_memory_delete_message(void *ptr, 
+                                                const burrow_command_st *cmd)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
+  _tick(store, current_time);
+  
+  _store_read_lock(store);
+  
+  account_st* account;
+  queue_st* queue = _find_queue(store, cmd, &account);
+  if(queue)
+  {
+    _queue_lock(store, queue->data);
+    
+    message_st* message = _find_message(queue, cmd, current_time);
+    if(message)
+    {
+      _report_message(self, message, _detail(cmd->filters), current_time);
+      dictionary_unlink(((queue_data_st*)(queue->data))->messages, 
+                        message->node);
+      _free_message(store, message);
+    }
+    
+    _queue_unlock(store, queue->data);
+    _prune_queue(store, account, queue);
+  }
+  
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_process(void* ptr)
+{
+  /* Commands a message has unparked look at their queue again, as do those 
+   whose wait has run out, for the last time. Those that find messages, 
+   or have run out, are done; the rest stay parked, for the eventfd to be 
+   signalled or the earliest wait to run out.*/
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  int64_t now = _now_ms();
+  int64_t deadline = INT64_MAX;
+  memory_wait_st** link = &self->waits;
+  
+  while(*link)
+  {
+    memory_wait_st* wait = *link;
+    bool expired = now >= wait->deadline;
+    int result = EAGAIN;
+    
+    if(expired || !__atomic_load_n(&wait->parked, __ATOMIC_RELAXED))
+    {
+      burrow_current_command(self->burrow, wait->cmd);
+      if(expired)
+        _wait_unpark(self->store, wait);
+      result = _run_scan(self, 
+                         wait->cmd, 
+                         wait->scan_type, 
+                         REPORT, 
+                         expired ? NULL : wait);
+    }
+    
+    if(result == EAGAIN)
+    {
+      if(wait->deadline < deadline)
+        deadline = wait->deadline;
+      link = &wait->next;
+      continue;
+    }
+    
+    *link = wait->next;
+    burrow_internal_command_done(self->burrow, wait->cmd, result);
+    burrow_free(self->burrow, wait);
+  }
+  
+  if(!self->waits)
+    return 0;
+  
+  burrow_watch_fd(self->burrow, self->event_fd, BURROW_IOEVENT_READ);
+  burrow_watch_timeout(self->burrow, (int32_t)(deadline - now));
+  return EAGAIN;
+}
+/******************************************************************************/
+static int burrow_backend_memory_event_raised(void* ptr, 
+                                              int fd, 
+                                              burrow_ioevent_t event)
+{
+  /* The eventfd only says to look again, however many times signalled.*/
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  uint64_t count;
+  
+  (void)event;
+  if(fd != self->event_fd)
+    return EINVAL;
+  
+  if(read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    return errno;
+  
+  return 0;
+}
+/******************************************************************************/
+static void burrow_backend_memory_cancel(void* ptr)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  
+  while(self->waits)
+  {
+    memory_wait_st* wait = self->waits;
+    self->waits = wait->next;
+    _wait_unpark(self->store, wait);
+    burrow_free(self->burrow, wait);
+  }
+}
+/******************************************************************************/
+static int _store_init(memory_store_st* store, burrow_st* burrow, bool shared)
+{
+  store->burrow = burrow;
+  if(!(store->accounts = dictionary_init(NULL, burrow)))
+    return ENOMEM;
+  
+  heap_init(&store->queues[EXPIRY], burrow);
+  heap_init(&store->queues[HIDDEN], burrow);
+  store->queue_count = 0;
+  
+  memset(&store->usage, 0, sizeof(store->usage));
+  memset(&store->queue_limit, 0, sizeof(store->queue_limit));
+  memset(&store->account_limit, 0, sizeof(store->account_limit));
+  store->limit_policy = LIMIT_REJECT;
+  
+  store->shared = shared;
+  store->name = NULL;
+  store->references = 0;
+  store->ticked = 0;
+  store->next = NULL;
+  if(shared)
+  {
+    pthread_rwlock_init(&store->lock, NULL);
+    pthread_mutex_init(&store->deadline_lock, NULL);
+  }
+  
+  return 0;
+}
+/******************************************************************************/
+static void _store_destroy(memory_store_st* store)
+{
+  /* Drop every account, and everything in it.*/
+  while(store->accounts->first)
+    _drop_account(store, store->accounts->first);
+  
+  dictionary_free(store->accounts);
+  heap_destroy(&store->queues[EXPIRY]);
+  heap_destroy(&store->queues[HIDDEN]);
+  
+  if(store->shared)
+  {
+    pthread_rwlock_destroy(&store->lock);
+    pthread_mutex_destroy(&store->deadline_lock);
+  }
+}
+/******************************************************************************/
+static memory_store_st* _store_attach(burrow_st* burrow, const char* name)
+{
+  /* Find the shared store by the given name, or start it. It is none of 
+   the backends', as it lasts as long as any is attached, so it allocates 
+   with a burrow_st of its own.*/
+  memory_store_st* store;
+  
+  pthread_mutex_lock(&_shared_stores_lock);
+  
+  for(store = _shared_stores; store; store = store->next)
+    if(!strcmp(store->name, name))
+      break;
   
-  /* If all messages in a queue were deleted, delete the queue itself.*/
-  if(!((dictionary_st*)(queue->data))->length)
+  if(!store)
   {
-    burrow_free(self->burrow, queue->data);
-    dictionary_delete_node(dictionary_get(self->accounts, cmd->account, SEARCH)->data, queue->key);
+    burrow_st* store_burrow = burrow_create(NULL, "dummy");
+    if(!store_burrow || 
+       !(store = burrow_malloc(store_burrow, sizeof(memory_store_st))))
+    {
+      burrow_log_error(burrow, "set_option(): malloc failed.");
+      if(store_burrow)
+        burrow_destroy(store_burrow);
+      pthread_mutex_unlock(&_shared_stores_lock);
+      return NULL;
+    }
+    
+    if(_store_init(store, store_burrow, true) || 
+       !(store->name = burrow_malloc(store_burrow, strlen(name) + 1)))
+    {
+      burrow_log_error(burrow, "set_option(): malloc failed.");
+      if(store->accounts)
+        _store_destroy(store);
+      burrow_free(store_burrow, store);
+      burrow_destroy(store_burrow);
+      pthread_mutex_unlock(&_shared_stores_lock);
+      return NULL;
+    }
+    
+    strcpy(store->name, name);
+    store->next = _shared_stores;
+    _shared_stores = store;
   }
   
-  /* And if the recently deleted queue was the only queue in an account, 
-   delete that account.*/
-  if(!((dictionary_st*)(account->data))->length)
-  {
-    burrow_free(self->burrow, account->data);
-    dictionary_delete_node(self->accounts, cmd->account);    
-  }
+  store->references++;
   
-  return 0;
+  pthread_mutex_unlock(&_shared_stores_lock);
+  return store;
 }
 /******************************************************************************/
-static int burrow_backend_memory_get_queues(void* ptr, 
-                                            const burrow_command_st* cmd)
+static void _store_detach(memory_store_st* store)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
-  
-  account_st* account = (dictionary_get(self->accounts, cmd->account, SEARCH));
-  if(!account)
-    return 0;
-  
-  queues_st* queues = account->data;
-  if(!queues)
-    return 0;
+  /* The last backend to leave a shared store takes it down.*/
+  if(!store->shared)
+    return;
   
-  burrow_filters_st* ref_filters = _process_filter(self, cmd->filters);
-  if(!ref_filters)
-    return 0;
+  pthread_mutex_lock(&_shared_stores_lock);
   
-  dictionary_st* iterator = dictionary_iter(queues, 
-                                            ref_filters->marker, 
-                                            ref_filters->limit);
-  if(!iterator)
+  if(--store->references)
   {
-    burrow_free(self->burrow, ref_filters);
-    return 0;
+    pthread_mutex_unlock(&_shared_stores_lock);
+    return;
   }
   
-  dictionary_node_st* item = iterator->first;
-  
-  int i;
-  for(i=0; i < iterator->length; i++)
-  {
-    burrow_callback_queue(self->burrow, item->key);
-    item = item->next;
-  }
+  memory_store_st** link = &_shared_stores;
+  while(*link != store)
+    link = &(*link)->next;
+  *link = store->next;
   
-  burrow_free(self->burrow, ref_filters);
-  dictionary_delete(iterator, NULL, iterator->length);
-  burrow_free(self->burrow, iterator);
+  pthread_mutex_unlock(&_shared_stores_lock);
   
-  return 0;
+  burrow_st* store_burrow = store->burrow;
+  _store_destroy(store);
+  burrow_free(store_burrow, store->name);
+  burrow_free(store_burrow, store);
+  burrow_destroy(store_burrow);
 }
 /******************************************************************************/
-static int burrow_backend_memory_delete_queues(void* ptr, 
-                                               const burrow_command_st* cmd)
+static size_t burrow_backend_memory_size(void)
+{
+  return sizeof(burrow_backend_memory_st);
+}
+/******************************************************************************/
+static void* burrow_backend_memory_create(void* ptr, burrow_st* burrow)
 {
   burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
   
-  account_st* account = dictionary_get(self->accounts, cmd->account, SEARCH);
-  if(!account)
-    return 0;
-  
-  queues_st* queues = account->data;
-  if(!queues)
-    return 0;
-  
-  burrow_filters_st* ref_filters = _process_filter(self, cmd->filters);
-  if(!ref_filters)
-    return 0;
-  
-  dictionary_st* iterator = dictionary_iter(queues, 
-                                            ref_filters->marker, 
-                                            ref_filters->limit);
-  if(!iterator)
+  if(self)
+    self->selfallocated = 0;
+  else
   {
-    burrow_free(self->burrow, ref_filters);
-    return 0;
+    if(!(self = burrow_malloc(burrow, sizeof(burrow_backend_memory_st))))
+    {
+      burrow_log_error(burrow, "create(): malloc failed.");
+      return NULL;
+    }
+    
+    self->selfallocated = 1;
   }
   
-  burrow_command_st* erase_cmd;
-  erase_cmd = burrow_malloc(self->burrow, sizeof(burrow_command_st)); 
-  if(!erase_cmd)
-  {
-    burrow_log_error(self->burrow, "delete_queues(): malloc failed: erase_cmd");
-    burrow_free(self->burrow, ref_filters);
-    dictionary_delete(iterator, NULL, iterator->length);
-    burrow_free(self->burrow, iterator);
-    return 0;
-  }
+  self->burrow = burrow;
+  _store_init(&self->own_store, burrow, false);
+  self->store = &self->own_store;
+  self->snapshot_pid = 0;
+  self->waits = NULL;
+  self->event_fd = -1;
   
-  erase_cmd->filters = _process_filter(self, NULL);
-  if(!erase_cmd->filters)
-  {
-    burrow_free(self->burrow, ref_filters);
-    dictionary_delete(iterator, NULL, iterator->length);
-    burrow_free(self->burrow, iterator);
-    burrow_free(self->burrow, erase_cmd);
-    return 0;
-  }
-  erase_cmd->attributes = NULL;
+  return self;
+}
+/******************************************************************************/
+static int burrow_backend_memory_snapshot_wait(void* ptr, bool block);
+
+static void burrow_backend_memory_free(void* ptr)
+{
+  burrow_backend_memory_st *self = (burrow_backend_memory_st *)ptr;
   
-  dictionary_node_st* item = iterator->first;
-  erase_cmd->account = cmd->account;
+  /* A snapshot still being written is let finish, not left behind.*/
+  burrow_backend_memory_snapshot_wait(self, true);
   
-  int i;
-  for(i = 0; i < iterator->length; i++)
-  {
-    erase_cmd->queue = item->key;
-    _scan_queue(self, erase_cmd, DELETE, IGNORE);
-    item = item->next;
-  }
+  /* Nor are commands left parked on a queue.*/
+  burrow_backend_memory_cancel(self);
+  if(self->event_fd != -1)
+    close(self->event_fd);
   
-  burrow_free(self->burrow, ref_filters);
-  dictionary_delete(iterator, NULL, iterator->length);
-  burrow_free(self->burrow, iterator);
-  burrow_free(self->burrow, (burrow_filters_st*)erase_cmd->filters);
-  burrow_free(self->burrow, erase_cmd);
+  _store_detach(self->store);
+  _store_destroy(&self->own_store);
   
-  return 0;
+  if (self->selfallocated)
+    burrow_free(self->burrow, self);
 }
 /******************************************************************************/
-static int burrow_backend_memory_get_accounts(void* ptr, 
-                                              const burrow_command_st* cmd)
+static int burrow_backend_memory_set_option(void* ptr, 
+                                            const char* option, 
+                                            const char* value)
 {
+  /* "store" is the name of a store to share with every other memory 
+   backend in the process set to the same name, whichever thread each is 
+   used from. NULL or "" go back to the backend's own store, which is kept 
+   as it was meanwhile. Callbacks are made with the queue they are about 
+   locked, so they must not wait on another thread using it.
+   
+   "limit_policy" is what is done with a message that would take its queue 
+   or account past a limit (see set_option_int): "reject" it, the default, 
+   or make room for it by dropping the queue's oldest messages, 
+   "drop_oldest", or those due to expire soonest, "drop_expiring". Like the 
+   limits, it is the store's, and so set for whoever shares it.*/
   burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
   
-  burrow_filters_st* ref_filters = _process_filter(self, cmd->filters);
-  if(!ref_filters)
-    return 0;
-  
-  dictionary_st* iterator = dictionary_iter(self->accounts, 
-                                            ref_filters->marker, 
-                                            ref_filters->limit);
-  if(!iterator)
+  if(!strcmp(option, "limit_policy"))
   {
-    burrow_free(self->burrow, ref_filters);
+    limit_policy_t policy;
+    if(value && !strcmp(value, "reject"))
+      policy = LIMIT_REJECT;
+    else if(value && !strcmp(value, "drop_oldest"))
+      policy = LIMIT_DROP_OLDEST;
+    else if(value && !strcmp(value, "drop_expiring"))
+      policy = LIMIT_DROP_EXPIRING;
+    else
+    {
+      burrow_log_error(self->burrow, "set_option(): bad limit_policy.");
+      return EINVAL;
+    }
+    
+    _store_write_lock(self->store);
+    self->store->limit_policy = policy;
+    _store_unlock(self->store);
     return 0;
   }
   
-  dictionary_node_st* item = iterator->first;
+  if(strcmp(option, "store"))
+  {
+    burrow_log_error(self->burrow, "set_option(): unknown option %s.", option);
+    return EINVAL;
+  }
   
-  int i;
-  for(i=0; i < iterator->length; i++)
+  /* Commands parked on the store in use are still in flight there.*/
+  if(self->waits)
   {
-    burrow_callback_account(self->burrow, item->key);
-    item = item->next;
+    burrow_log_error(self->burrow, "set_option(): commands waiting.");
+    return EINVAL;
   }
   
-  burrow_free(self->burrow, ref_filters); 
-  dictionary_delete(iterator, NULL, iterator->length);
-  burrow_free(self->burrow, iterator);
+  memory_store_st* store = &self->own_store;
+  if(value && *value && !(store = _store_attach(self->burrow, value)))
+    return ENOMEM;
+  
+  _store_detach(self->store);
+  self->store = store;
   
   return 0;
 }
 /******************************************************************************/
-static int burrow_backend_memory_delete_accounts(void* ptr, 
-                                                 const burrow_command_st* cmd)
+static int burrow_backend_memory_set_option_int(void* ptr, 
+                                                const char* option, 
+                                                int32_t value)
 {
+  /* Limits on what any one queue, or account, of the store may hold: 
+   "queue_max_messages", "queue_max_kbytes", "account_max_messages" and 
+   "account_max_kbytes", each 0 for none, the default. Bytes are those of 
+   the slab blocks the messages take, ids and all.*/
   burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint64_t* limit;
+  uint64_t unit = 1;
   
-  burrow_filters_st* ref_filters = _process_filter(self, cmd->filters);
-  if(!ref_filters)
-    return 0;
-  
-  dictionary_st* iterator = dictionary_iter(self->accounts, 
-                                            ref_filters->marker, 
-                                            ref_filters->limit);
-  if(!iterator)
+  if(!strcmp(option, "queue_max_messages"))
+    limit = &store->queue_limit.messages;
+  else if(!strcmp(option, "queue_max_kbytes"))
   {
-    burrow_free(self->burrow, ref_filters);
-    return 0;
+    limit = &store->queue_limit.bytes;
+    unit = 1024;
   }
-  
-  burrow_command_st* erase_cmd;
-  erase_cmd = burrow_malloc(self->burrow, sizeof(burrow_command_st)); 
-  if(!erase_cmd)
+  else if(!strcmp(option, "account_max_messages"))
+    limit = &store->account_limit.messages;
+  else if(!strcmp(option, "account_max_kbytes"))
   {
-    burrow_log_error(self->burrow, 
-                     "delete_accounts(): malloc failed: erase_cmd");
-    
-    burrow_free(self->burrow, ref_filters);
-    dictionary_delete(iterator, NULL, iterator->length);
-    burrow_free(self->burrow, iterator);
-    return 0;
+    limit = &store->account_limit.bytes;
+    unit = 1024;
+  }
+  else
+  {
+    burrow_log_error(self->burrow, "set_option_int(): unknown option %s.", 
+                     option);
+    return EINVAL;
   }
   
-  erase_cmd->filters = _process_filter(self, NULL);
-  if(!erase_cmd->filters)
+  if(value < 0)
   {
-    burrow_free(self->burrow, ref_filters);
-    dictionary_delete(iterator, NULL, iterator->length);
-    burrow_free(self->burrow, iterator);
-    burrow_free(self->burrow, erase_cmd);
-    return 0;
+    burrow_log_error(self->burrow, "set_option_int(): bad %s.", option);
+    return EINVAL;
   }
   
-  dictionary_node_st* item = iterator->first;
+  _store_write_lock(store);
+  *limit = (uint64_t)value * unit;
+  _store_unlock(store);
+  return 0;
+}
+/******************************************************************************/
+static int burrow_backend_memory_usage(void* ptr, 
+                                       const char* account, 
+                                       const char* queue, 
+                                       uint64_t* messages, 
+                                       uint64_t* bytes)
+{
+  /* What the whole store holds, without an account; an account, without a 
+   queue; or a queue. One that isn't there holds nothing.*/
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  usage_st usage = { 0, 0 };
+  
+  _tick(store, (uint32_t)time(NULL));
+  _store_read_lock(store);
   
-  int i;
-  for(i = 0; i < iterator->length; i++)
+  account_st* account_node = NULL;
+  queue_st* queue_node = NULL;
+  if(!account)
+    _usage_get(store, &store->usage, &usage);
+  else if((account_node = dictionary_get(store->accounts, account, SEARCH)))
   {
-    erase_cmd->account = item->key;
-    burrow_backend_memory_delete_queues(self, erase_cmd);
-    item = item->next;
+    if(!queue)
+      _usage_get(store, 
+                 &((account_data_st*)(account_node->data))->usage, 
+                 &usage);
+    else if((queue_node = dictionary_get(_queues(account_node), 
+                                         queue, 
+                                         SEARCH)))
+    {
+      queue_data_st* data = queue_node->data;
+      _queue_lock(store, data);
+      usage = data->usage;
+      _queue_unlock(store, data);
+    }
   }
   
-  burrow_free(self->burrow, ref_filters);
-  dictionary_delete(iterator, NULL, iterator->length);
-  burrow_free(self->burrow, iterator);
-  burrow_free(self->burrow, (burrow_filters_st*)erase_cmd->filters);
-  burrow_free(self->burrow, erase_cmd);
+  _store_unlock(store);
   
+  if(messages)
+    *messages = usage.messages;
+  if(bytes)
+    *bytes = usage.bytes;
   return 0;
 }
 /******************************************************************************/
-static int burrow_backend_memory_get_messages(void *ptr, 
-                                              const burrow_command_st *cmd)
+static int burrow_backend_memory_expire(void* ptr)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
   
-  _scan_queue(self, cmd, GET, REPORT);
+  _tick(self->store, (uint32_t)time(NULL));
   return 0;
 }
 /******************************************************************************/
-static int burrow_backend_memory_update_messages(void *ptr, 
-                                                 const burrow_command_st *cmd)
+static void _image_flush(image_writer_st* writer)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  size_t written = 0;
+  while(written < writer->used && !writer->error)
+  {
+    ssize_t result = write(writer->fd, 
+                           writer->data + written, 
+                           writer->used - written);
+    if(result >= 0)
+      written += (size_t)result;
+    else if(errno != EINTR)
+      writer->error = errno;
+  }
   
-  _scan_queue(self, cmd, UPDATE, REPORT);
-  return 0;
+  writer->used = 0;
 }
 /******************************************************************************/
-static int burrow_backend_memory_delete_messages(void *ptr, 
-                                                 const burrow_command_st *cmd)
+static void _image_write(image_writer_st* writer, const void* bytes, size_t size)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;  
+  const char* next = bytes;
   
-  _scan_queue(self, cmd, DELETE, REPORT);
-  return 0;
+  while(size && !writer->error)
+  {
+    if(writer->used == IMAGE_BUFFER)
+      _image_flush(writer);
+    
+    size_t chunk = IMAGE_BUFFER - writer->used;
+    if(chunk > size)
+      chunk = size;
+    memcpy(writer->data + writer->used, next, chunk);
+    writer->used += chunk;
+    next += chunk;
+    size -= chunk;
+  }
 }
 /******************************************************************************/
-static int burrow_backend_memory_create_message(void* ptr, 
-                                                const burrow_command_st* cmd)
+static void _image_write_name(image_writer_st* writer, 
+                              const char* name, 
+                              uint32_t count)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
-  uint32_t creation_time = (uint32_t)time(NULL);
-  
-  burrow_message_st* new_message;
-  new_message = burrow_malloc(self->burrow, sizeof(burrow_message_st));
-  
-  char* body = burrow_malloc(self->burrow, cmd->body_size);
-  
-  char* message_id = burrow_malloc(self->burrow, strlen(cmd->message_id)+1);
-  
+  uint32_t size = (uint32_t)strlen(name) + 1;
+  _image_write(writer, &size, sizeof(size));
+  _image_write(writer, name, size);
+  _image_write(writer, &count, sizeof(count));
+}
+/******************************************************************************/
+static int _snapshot_write(memory_store_st* store, 
+                           const char* path, 
+                           uint32_t current_time)
+{
+  /* Run in the child: the store is the parent's as it was when forked, 
+   which nothing else changes from here, so it is read without locks. The 
+   image goes to a file beside the one named, renamed over it once it is 
+   all on disk, so that a reader never finds one half written.*/
+  char tmp_path[PATH_MAX];
+  if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= PATH_MAX)
+    return ENAMETOOLONG;
+  
+  image_writer_st writer;
+  writer.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(writer.fd == -1)
+    return errno;
+  writer.error = 0;
+  writer.used = 0;
+  
+  image_header_st header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.taken = current_time;
+  header.account_count = (uint32_t)store->accounts->length;
+  _image_write(&writer, &header, sizeof(header));
   
-  if(!new_message || !body || !message_id)  
+  account_st* account;
+  for(account = store->accounts->first; account; account = account->next)
   {
-    burrow_log_error(self->burrow, "create_message(): malloc failed.");
-    burrow_free(self->burrow, new_message);
-    burrow_free(self->burrow, body);
-    burrow_free(self->burrow, message_id);
-    return 0;
+    queues_st* queues = _queues(account);
+    _image_write_name(&writer, account->key, (uint32_t)queues->length);
+    
+    queue_st* queue;
+    for(queue = queues->first; queue; queue = queue->next)
+    {
+      dictionary_st* messages = ((queue_data_st*)(queue->data))->messages;
+      _image_write_name(&writer, queue->key, (uint32_t)messages->length);
+      
+      message_node_st* node;
+      for(node = messages->first; node; node = node->next)
+      {
+        message_st* message = node->data;
+        image_message_st record;
+        record.id_size = (uint32_t)strlen(message->message_id) + 1;
+        record.body_size = (uint32_t)message->body_size;
+        record.ttl = message->ttl;
+        record.hide = message->hide;
+        _image_write(&writer, &record, sizeof(record));
+        _image_write(&writer, message->message_id, record.id_size);
+        _image_write(&writer, message->body, record.body_size);
+      }
+    }
   }
   
-  memcpy(body, cmd->body, cmd->body_size);
-  new_message->body = body;
-  strcpy(message_id, cmd->message_id);
-  new_message->message_id = message_id;
-  new_message->body_size = cmd->body_size;
+  _image_flush(&writer);
   
-  if(cmd->attributes && (cmd->attributes->set & BURROW_ATTRIBUTES_TTL))  
-    new_message->ttl = creation_time + cmd->attributes->ttl;
-  else
-    new_message->ttl = creation_time + 300; /* five minutes by default.*/
+  int result = writer.error;
+  if(!result && fdatasync(writer.fd) == -1)
+    result = errno;
+  close(writer.fd);
   
-  new_message->hide = 0;
-  if(cmd->attributes && (cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)) 
-    if(cmd->attributes->hide)
-      new_message->hide = creation_time + cmd->attributes->hide;
+  if(!result && rename(tmp_path, path) == -1)
+    result = errno;
+  if(result)
+    unlink(tmp_path);
+  
+  return result;
+}
+/******************************************************************************/
+static int burrow_backend_memory_snapshot(void* ptr, const char* path)
+{
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
   
+  if(self->snapshot_pid > 0)
+    return EINPROGRESS;
   
-  account_st* account = dictionary_get(self->accounts, cmd->account, CREATE);
-  if(!account)
-  {
-    burrow_free(self->burrow, new_message);
-    burrow_free(self->burrow, body);
-    burrow_free(self->burrow, message_id);
-    return 0;
-  }
+  _tick(store, current_time);
   
-  queue_st* queue = dictionary_get(account->data, cmd->queue, CREATE);
-  if(!queue)
-  {
-    if(!((dictionary_st*)(account->data))->length)
-      dictionary_delete_node(self->accounts, cmd->account);
-    
-    burrow_free(self->burrow, new_message);
-    burrow_free(self->burrow, body);
-    burrow_free(self->burrow, message_id);
-    return 0;
-  }
+  /* The child gets a copy of the store, as is, to write out at its own 
+   pace while the parent goes on changing its own. A shared store is write 
+   locked over the fork, so that no other thread is half way through 
+   changing it (and holding one of its locks) as it is copied.*/
+  _store_write_lock(store);
+  pid_t pid = fork();
+  if(pid == 0)
+    _exit(_snapshot_write(store, path, current_time));
+  _store_unlock(store);
   
-  message_node_st* message_node;
-  message_node = dictionary_get(queue->data, new_message->message_id, SEARCH);
-  if(message_node)
+  if(pid == -1)
   {
-    burrow_free(self->burrow, message_node->data);
-    message_node->data = new_message;
+    burrow_log_error(self->burrow, "snapshot(): fork failed: %d", errno);
+    return errno;
   }
-  else
-    if(!dictionary_add(queue->data, new_message->message_id, new_message))
-      if(!((dictionary_st*)(queue->data))->length)
-        dictionary_delete_node(account->data, cmd->queue);
   
+  self->snapshot_pid = pid;
   return 0;
 }
 /******************************************************************************/
-static int burrow_backend_memory_update_message(void *ptr, 
-                                                const burrow_command_st *cmd)
+static int burrow_backend_memory_snapshot_wait(void* ptr, bool block)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr; 
-  uint32_t current_time = (uint32_t)time(NULL);
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  int status;
+  pid_t pid;
   
-  account_st* account;
-  queue_st* queue;
-  message_node_st* message_node;
-  burrow_message_st* message; 
+  if(self->snapshot_pid <= 0)
+    return 0;
   
-  if((account = dictionary_get(self->accounts, cmd->account, SEARCH)))
-    if((queue = dictionary_get(account->data, cmd->queue, SEARCH)))
-      if((message_node = dictionary_get(queue->data, cmd->message_id, SEARCH)))
-        if((message = message_node->data))
-        {
-          if(message->ttl <= current_time)
-          {
-            burrow_free(self->burrow, message->message_id);
-            burrow_free(self->burrow, message->body);
-            burrow_free(self->burrow, message);
-            dictionary_delete_node(queue->data, cmd->message_id);
-            
-            if(!((dictionary_st*)(queue->data))->length)
-            {
-              burrow_free(self->burrow, queue->data);
-              dictionary_delete_node(account->data, cmd->queue);
-            }
-            
-            if(!((dictionary_st*)(account->data))->length)
-            {
-              burrow_free(self->burrow, account->data);
-              dictionary_delete_node(self->accounts, cmd->account);
-            }
-            
-            return 0;
-          }
-          
-          uint32_t attributes_ttl = 0;
-          uint32_t attributes_hide = 0;
-          if(cmd->attributes)
-          {
-            if(cmd->attributes->set & BURROW_ATTRIBUTES_TTL)
-              if(cmd->attributes->ttl > 0)
-                attributes_ttl = cmd->attributes->ttl + current_time;
-            
-            if(cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)
-              attributes_hide = cmd->attributes->hide + current_time;
-          }
-          
-          if(attributes_ttl)
-            message->ttl = attributes_ttl;
-          
-          if(attributes_hide)
-            message->hide = attributes_hide;
-          
-          burrow_attributes_st attributes;
-          attributes.ttl = message->ttl - current_time;
-          if(message->hide > current_time)
-            attributes.hide = message->hide - current_time;
-          else
-            attributes.hide = 0;
-          
-          burrow_callback_message(self->burrow, 
-                                  message->message_id, 
-                                  message->body, 
-                                  message->body_size, 
-                                  &attributes);
-          return 0;
-        }
+  while((pid = waitpid(self->snapshot_pid, &status, block ? 0 : WNOHANG)) == -1 
+        && errno == EINTR)
+    ;
+  
+  if(pid == 0)
+    return EINPROGRESS;
   
-  return EINVAL;
+  self->snapshot_pid = 0;
+  if(pid == -1)
+    return errno;
+  
+  /* The child exits with the errno it failed on, if it did.*/
+  if(!WIFEXITED(status))
+    return EIO;
+  
+  return WEXITSTATUS(status);
 }
 /******************************************************************************/
-static int burrow_backend_memory_get_message(void *ptr, 
-                                             const burrow_command_st *cmd)
+static const void* _image_read(image_reader_st* reader, size_t size)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr; 
-  uint32_t current_time = (uint32_t)time(NULL);
+  if((size_t)(reader->end - reader->next) < size)
+    return NULL;
   
-  account_st* account;
-  queue_st* queue;
-  message_node_st* message_node;
-  burrow_message_st* message;
+  const void* bytes = reader->next;
+  reader->next += size;
+  return bytes;
+}
+/******************************************************************************/
+static const char* _image_read_name(image_reader_st* reader, uint32_t* count)
+{
+  /* A name, nul terminated, and the count of what comes under it.*/
+  uint32_t size;
+  const void* bytes = _image_read(reader, sizeof(size));
+  if(!bytes)
+    return NULL;
+  memcpy(&size, bytes, sizeof(size));
   
-  if((account = dictionary_get(self->accounts, cmd->account, SEARCH)))
-    if((queue = dictionary_get(account->data, cmd->queue, SEARCH)))
-      if((message_node = dictionary_get(queue->data, cmd->message_id, SEARCH)))
-        if((message = message_node->data))
-        {
-          if(message->ttl <= current_time)
-          {
-            burrow_free(self->burrow, message);
-            burrow_free(self->burrow, message->message_id);
-            burrow_free(self->burrow, message->body);
-            dictionary_delete_node(queue->data, cmd->message_id);
-            
-            if(!((dictionary_st*)(queue->data))->length)
-            {
-              burrow_free(self->burrow, queue->data);
-              dictionary_delete_node(account->data, cmd->queue);
-            }
-            
-            if(!((dictionary_st*)(account->data))->length)
-            {
-              burrow_free(self->burrow, account->data);
-              dictionary_delete_node(self->accounts, cmd->account);
-            }
-            
-            return 0;
-          }
-          
-          burrow_attributes_st attributes;
-          attributes.ttl = message->ttl - current_time;
-          if(message->hide > current_time)
-            attributes.hide = message->hide - current_time;
-          else
-            attributes.hide = 0;
-          
-          burrow_callback_message(self->burrow, 
-                                  message->message_id, 
-                                  message->body, 
-                                  message->body_size, 
-                                  &attributes);
-          return 0;
-        }
+  const char* name = _image_read(reader, size);
+  if(!name || !size || name[size - 1] || strlen(name) != size - 1 || 
+     !(bytes = _image_read(reader, sizeof(*count))))
+    return NULL;
+  memcpy(count, bytes, sizeof(*count));
   
-  return EINVAL;
+  return name;
 }
 /******************************************************************************/
-static int burrow_backend_memory_delete_message(void *ptr, 
-                                                const burrow_command_st *cmd)
+static const char* _image_read_message(image_reader_st* reader, 
+                                       image_message_st* record)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
-  uint32_t current_time = (uint32_t)time(NULL);
-  
-  account_st* account;
-  queue_st* queue;
-  message_node_st* message_node;
-  burrow_message_st* message;
+  /* A message's deadlines and sizes, then its id, with the body after.*/
+  const void* bytes = _image_read(reader, sizeof(*record));
+  if(!bytes)
+    return NULL;
+  memcpy(record, bytes, sizeof(*record));
   
-  if((account = dictionary_get(self->accounts, cmd->account, SEARCH)))
-    if((queue = dictionary_get(account->data, cmd->queue, SEARCH)))
-      if((message_node = dictionary_get(queue->data, cmd->message_id, SEARCH)))
-        if((message = message_node->data))
-        {
-          if(message->ttl > current_time)
-          {
-            burrow_attributes_st attributes;
-            attributes.ttl = message->ttl - current_time;
-            if(message->hide > current_time)
-              attributes.hide = message->hide - current_time;
-            else
-              attributes.hide = 0;
-
-            
-            burrow_callback_message(self->burrow, 
-                                    message->message_id, 
-                                    message->body, 
-                                    message->body_size, 
-                                    &attributes);
-          }
-
-          burrow_free(self->burrow, message->message_id);
-          burrow_free(self->burrow, message->body);
-          burrow_free(self->burrow, message);
-          dictionary_delete_node(queue->data, cmd->message_id);
-          
-          if(!((dictionary_st*)(queue->data))->length)
-          {
-            burrow_free(self->burrow, queue->data);
-            dictionary_delete_node(account->data, cmd->queue);
-          }
-          
-          if(!((dictionary_st*)(account->data))->length)
-          {
-            burrow_free(self->burrow, account->data);
-            dictionary_delete_node(self->accounts, cmd->account);
-          }
-        }
+  const char* message_id = _image_read(reader, record->id_size);
+  if(!message_id || !record->id_size || message_id[record->id_size - 1] || 
+     strlen(message_id) != record->id_size - 1 || 
+     !_image_read(reader, record->body_size))
+    return NULL;
   
-  return 0;
+  return message_id;
 }
 /******************************************************************************/
-static size_t burrow_backend_memory_size(void)
+static bool _image_check(const char* image, size_t size)
 {
-  return sizeof(burrow_backend_memory_st);
+  /* Go over the whole image before loading any of it, so that a broken 
+   one is turned down with the store left as it was.*/
+  image_reader_st reader = { image, image + size };
+  const image_header_st* header = _image_read(&reader, sizeof(*header));
+  if(!header || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)))
+    return false;
+  
+  uint32_t accounts;
+  memcpy(&accounts, &header->account_count, sizeof(accounts));
+  while(accounts--)
+  {
+    uint32_t queues;
+    if(!_image_read_name(&reader, &queues))
+      return false;
+    
+    while(queues--)
+    {
+      uint32_t messages;
+      if(!_image_read_name(&reader, &messages))
+        return false;
+      
+      image_message_st record;
+      while(messages--)
+        if(!_image_read_message(&reader, &record))
+          return false;
+    }
+  }
+  
+  return reader.next == reader.end;
 }
 /******************************************************************************/
-static void* burrow_backend_memory_create(void* ptr, burrow_st* burrow)
+static int _load_queue(memory_store_st* store, 
+                       account_st* account, 
+                       queue_st* queue, 
+                       image_reader_st* reader, 
+                       uint32_t count, 
+                       uint32_t current_time)
 {
-  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
-  
-  if(self)
-    self->selfallocated = 0;
-  else
+  /* The queue is new, and its messages come in the order they are to be 
+   kept, each with an id of its own: so each goes last, without looking 
+   for one by the same id first, and with room made for all of them at 
+   once. Those since expired are left out.*/
+  queue_data_st* data = queue->data;
+  if(heap_reserve(&data->heaps[EXPIRY], count) || 
+     heap_reserve(&data->heaps[HIDDEN], count) || 
+     dictionary_reserve(data->messages, count))
+    return ENOMEM;
+  
+  while(count--)
   {
-    if(!(self = burrow_malloc(burrow, sizeof(burrow_backend_memory_st))))
+    image_message_st record;
+    const char* message_id = _image_read_message(reader, &record);
+    if(record.ttl <= current_time)
+      continue;
+    
+    uint8_t level = dictionary_random_level(data->messages);
+    message_st* message = _new_message(store, 
+                                       account, 
+                                       queue, 
+                                       level, 
+                                       message_id, 
+                                       record.id_size, 
+                                       message_id + record.id_size, 
+                                       record.body_size);
+    if(!message)
+      return ENOMEM;
+    
+    if(dictionary_link(data->messages, 
+                       message->node, 
+                       level, 
+                       message->message_id, 
+                       message))
     {
-      burrow_log_error(burrow, "create(): malloc failed.");
-      return NULL;
+      slab_free(&data->slabs, message->node, message->record_size);
+      return ENOMEM;
     }
     
-    self->selfallocated = 1;
+    /* The queue is put in its place among the others once it is loaded, 
+     rather than after each message.*/
+    _usage_count(store, message, 1);
+    message->ttl = record.ttl;
+    message->hide = record.hide > current_time ? record.hide : 0;
+    heap_add(&data->heaps[EXPIRY], 
+             message->ttl, 
+             message, 
+             &message->heap_index[EXPIRY]);
+    if(message->hide)
+      heap_add(&data->heaps[HIDDEN], 
+               message->hide, 
+               message, 
+               &message->heap_index[HIDDEN]);
+    else
+      _visible_link(message);
   }
   
-  self->burrow = burrow;
-  self->accounts = dictionary_init(NULL, burrow);
-  
-  return self;
+  return 0;
 }
 /******************************************************************************/
-static void burrow_backend_memory_free(void* ptr)
+static int burrow_backend_memory_restore(void* ptr, const char* path)
 {
-  burrow_backend_memory_st *self = (burrow_backend_memory_st *)ptr;
+  burrow_backend_memory_st* self = (burrow_backend_memory_st*)ptr;
+  memory_store_st* store = self->store;
+  uint32_t current_time = (uint32_t)time(NULL);
+  struct stat st;
+  int result = 0;
   
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1 || fstat(fd, &st) == -1)
+  {
+    result = errno;
+    burrow_log_error(self->burrow, "restore(): can't open %s: %d", path, 
+                     result);
+    if(fd != -1)
+      close(fd);
+    return result;
+  }
   
-  burrow_command_st* erase_cmd;
-  erase_cmd = burrow_malloc(self->burrow, sizeof(burrow_command_st)); 
-  if(!erase_cmd)
+  size_t size = (size_t)st.st_size;
+  const char* image = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) 
+                           : MAP_FAILED;
+  close(fd);
+  if(image == MAP_FAILED || !_image_check(image, size))
   {
-    burrow_log_error(self->burrow, 
-                     "free(): malloc failed: erase_cmd");
-    
-    return;
+    burrow_log_error(self->burrow, "restore(): %s is no image", path);
+    if(image != MAP_FAILED)
+      munmap((void*)image, size);
+    return EINVAL;
   }
   
-  erase_cmd->filters = _process_filter(self, NULL);
-  if(!erase_cmd->filters)
-    return;
+  madvise((void*)image, size, MADV_SEQUENTIAL);
   
-  burrow_backend_memory_delete_accounts(self, erase_cmd);
-  burrow_free(self->burrow, (burrow_filters_st*)erase_cmd->filters);
-  burrow_free(self->burrow, erase_cmd);
-  burrow_free(self->burrow, self->accounts);
+  /* What the store held goes, and the image takes its place.*/
+  _store_write_lock(store);
+  while(store->accounts->first)
+    _drop_account(store, store->accounts->first);
   
-  if (self->selfallocated)
-    burrow_free(self->burrow, self);
+  image_reader_st reader = { image, image + size };
+  const image_header_st* header = _image_read(&reader, sizeof(*header));
+  uint32_t accounts;
+  memcpy(&accounts, &header->account_count, sizeof(accounts));
+  
+  while(accounts--)
+  {
+    uint32_t queues;
+    const char* account_name = _image_read_name(&reader, &queues);
+    account_st* account = dictionary_get(store->accounts, account_name, SEARCH);
+    if(!account && !(account = _new_account(store, account_name)))
+    {
+      result = ENOMEM;
+      break;
+    }
+    
+    while(queues--)
+    {
+      uint32_t messages;
+      const char* queue_name = _image_read_name(&reader, &messages);
+      
+      /* An image taken of a store has no queue twice.*/
+      if(dictionary_get(_queues(account), queue_name, SEARCH))
+      {
+        result = EINVAL;
+        break;
+      }
+      
+      queue_st* queue = _new_queue(store, account, queue_name);
+      if(!queue)
+      {
+        result = ENOMEM;
+        break;
+      }
+      
+      result = _load_queue(store, 
+                           account, 
+                           queue, 
+                           &reader, 
+                           messages, 
+                           current_time);
+      
+      queue_data_st* data = queue->data;
+      _queue_reheap(store, data, EXPIRY);
+      _queue_reheap(store, data, HIDDEN);
+      if(!data->messages->length)
+        _drop_queue(store, account, queue);
+      
+      if(result)
+        break;
+    }
+    
+    if(!_queues(account)->length)
+      _drop_account(store, account);
+    
+    if(result)
+      break;
+  }
+  
+  _store_unlock(store);
+  munmap((void*)image, size);
+  
+  if(result)
+    burrow_log_error(self->burrow, "restore(): %s only partly loaded: %d", 
+                     path, result);
+  return result;
 }
 /********FOR-EXPORT STRUCT*****************************************************/
 burrow_backend_functions_st burrow_backend_memory_functions = 
@@ -824,11 +2551,11 @@ burrow_backend_functions_st burrow_backend_memory_functions =
   .destroy          = &burrow_backend_memory_free,
   .size             = &burrow_backend_memory_size,
   
-  .cancel           = NULL,
-  .set_option       = NULL,
-  .set_option_int   = NULL,
-  .event_raised     = NULL,
-  .process          = NULL,
+  .cancel           = &burrow_backend_memory_cancel,
+  .set_option       = &burrow_backend_memory_set_option,
+  .set_option_int   = &burrow_backend_memory_set_option_int,
+  .event_raised     = &burrow_backend_memory_event_raised,
+  .process          = &burrow_backend_memory_process,
 
   .get_accounts     = &burrow_backend_memory_get_accounts,
   .delete_accounts  = &burrow_backend_memory_delete_accounts,
@@ -841,8 +2568,15 @@ burrow_backend_functions_st burrow_backend_memory_functions =
   .delete_messages  = &burrow_backend_memory_delete_messages,
   
   .create_message   = &burrow_backend_memory_create_message,
+  .create_messages  = &burrow_backend_memory_create_messages,
   .get_message      = &burrow_backend_memory_get_message,
   .update_message   = &burrow_backend_memory_update_message,
   .delete_message   = &burrow_backend_memory_delete_message,
+  
+  .expire           = &burrow_backend_memory_expire,
+  .usage            = &burrow_backend_memory_usage,
+  .snapshot         = &burrow_backend_memory_snapshot,
+  .snapshot_wait    = &burrow_backend_memory_snapshot_wait,
+  .restore          = &burrow_backend_memory_restore,
 };
 /******************************************************************************/
@@ -0,0 +1,271 @@
+/*
+ * libburrow -- Memory Backend: size-classed slab allocator.
+ *
+ * Copyright (C) 2011 Federico G. Saldarini.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+/**
+ * @file
+ * @brief Memory backend slab allocator implementation
+ */
+
+#include "slab.h"
+
+/* Sixteen bytes apart up to 128, then four classes to each doubling, so 
+ that no block is more than a quarter bigger than asked for (past 128).*/
+static const uint32_t _class_size[SLAB_CLASSES] = 
+{
+  32, 48, 64, 80, 96, 112, 128, 
+  160, 192, 224, 256, 
+  320, 384, 448, 512, 
+  640, 768, 896, 1024, 
+  1280, 1536, 1792, 2048, 
+  2560, 3072, 3584, 4096, 
+  5120, 6144, 7168, 8192, 
+  10240, 12288, 14336, 16384
+};
+
+/******************************************************************************/
+static int _class(size_t size)
+{
+  /* The smallest class size is big enough for.*/
+  int low = 0;
+  int high = SLAB_CLASSES - 1;
+  while(low < high)
+  {
+    int middle = (low + high) / 2;
+    if(_class_size[middle] < size)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  
+  return low;
+}
+/******************************************************************************/
+static size_t _find(const slab_cache_st* self, const void* block)
+{
+  /* The last slab starting at or before the block, which holds it.*/
+  size_t low = 0;
+  size_t high = self->slab_count;
+  while(high - low > 1)
+  {
+    size_t middle = (low + high) / 2;
+    if((const void*)self->slabs[middle] <= block)
+      low = middle;
+    else
+      high = middle;
+  }
+  
+  return low;
+}
+/******************************************************************************/
+static void _link(slab_cache_st* self, int class, slab_st* slab)
+{
+  slab->previous = NULL;
+  slab->next = self->partial[class];
+  if(slab->next)
+    slab->next->previous = slab;
+  self->partial[class] = slab;
+}
+/******************************************************************************/
+static void _unlink(slab_cache_st* self, int class, slab_st* slab)
+{
+  if(slab->previous)
+    slab->previous->next = slab->next;
+  else
+    self->partial[class] = slab->next;
+  
+  if(slab->next)
+    slab->next->previous = slab->previous;
+}
+/******************************************************************************/
+static slab_st* _new_slab(slab_cache_st* self, int class)
+{
+  if(self->slab_count == self->slab_room)
+  {
+    size_t room = self->slab_room ? self->slab_room * 2 : 16;
+    slab_st** slabs = burrow_malloc(self->burrow, room * sizeof(slab_st*));
+    if(!slabs)
+      return NULL;
+    
+    if(self->slab_count)
+      memcpy(slabs, self->slabs, self->slab_count * sizeof(slab_st*));
+    
+    burrow_free(self->burrow, self->slabs);
+    self->slabs = slabs;
+    self->slab_room = room;
+  }
+  
+  uint32_t size = self->next_size[class];
+  while(size < _class_size[class])
+    size *= 2;
+  
+  slab_st* slab = burrow_malloc(self->burrow, SLAB_HEADER + size);
+  if(!slab)
+    return NULL;
+  
+  uint32_t count = size / _class_size[class];
+  slab->free = NULL;
+  slab->current = (char*)slab + SLAB_HEADER;
+  slab->end = slab->current + count * _class_size[class];
+  slab->used = 0;
+  slab->size = size;
+  _link(self, class, slab);
+  if(size < SLAB_SIZE)
+    self->next_size[class] = size * 2;
+  
+  /* Keep the slabs in order of address.*/
+  size_t index = self->slab_count;
+  while(index && self->slabs[index - 1] > slab)
+    index--;
+  
+  memmove(&self->slabs[index + 1], 
+          &self->slabs[index], 
+          (self->slab_count - index) * sizeof(slab_st*));
+  self->slabs[index] = slab;
+  self->slab_count++;
+  return slab;
+}
+/******************************************************************************/
+static void _release(slab_cache_st* self, int class, size_t index)
+{
+  slab_st* slab = self->slabs[index];
+  _unlink(self, class, slab);
+  self->slab_count--;
+  memmove(&self->slabs[index], 
+          &self->slabs[index + 1], 
+          (self->slab_count - index) * sizeof(slab_st*));
+  
+  /* The class has shrunk, so its next slab needn't be as big.*/
+  if(self->next_size[class] > SLAB_MIN_SIZE)
+    self->next_size[class] /= 2;
+  
+  burrow_free(self->burrow, slab);
+}
+/******************************************************************************/
+void slab_init(slab_cache_st* self, burrow_st* burrow)
+{
+  int class;
+  self->burrow = burrow;
+  memset(self->partial, 0, sizeof(self->partial));
+  for(class = 0; class < SLAB_CLASSES; class++)
+    self->next_size[class] = SLAB_MIN_SIZE;
+  
+  self->slabs = NULL;
+  self->slab_count = 0;
+  self->slab_room = 0;
+  self->large = NULL;
+}
+/******************************************************************************/
+void slab_destroy(slab_cache_st* self)
+{
+  size_t index;
+  for(index = 0; index < self->slab_count; index++)
+    burrow_free(self->burrow, self->slabs[index]);
+  
+  burrow_free(self->burrow, self->slabs);
+  
+  slab_large_st* large = self->large;
+  slab_large_st* next_large;
+  while(large)
+  {
+    next_large = large->next;
+    burrow_free(self->burrow, large);
+    large = next_large;
+  }
+  
+  slab_init(self, self->burrow);
+}
+/******************************************************************************/
+void* slab_alloc(slab_cache_st* self, size_t size)
+{
+  if(size > SLAB_MAX_SIZE)
+  {
+    slab_large_st* large = burrow_malloc(self->burrow, 
+                                         SLAB_LARGE_HEADER + size);
+    if(!large)
+      return NULL;
+    
+    large->previous = NULL;
+    large->next = self->large;
+    if(large->next)
+      large->next->previous = large;
+    self->large = large;
+    return (char*)large + SLAB_LARGE_HEADER;
+  }
+  
+  int class = _class(size);
+  slab_st* slab = self->partial[class];
+  if(!slab && !(slab = _new_slab(self, class)))
+    return NULL;
+  
+  slab_block_st* block = slab->free;
+  if(block)
+    slab->free = block->next;
+  else
+  {
+    block = (slab_block_st*)slab->current;
+    slab->current += _class_size[class];
+  }
+  
+  slab->used++;
+  if(!slab->free && slab->current == slab->end)
+    _unlink(self, class, slab);
+  
+  return block;
+}
+/******************************************************************************/
+void slab_free(slab_cache_st* self, void* block, size_t size)
+{
+  if(!block)
+    return;
+  
+  if(size > SLAB_MAX_SIZE)
+  {
+    slab_large_st* large = (slab_large_st*)((char*)block - 
+                                            SLAB_LARGE_HEADER);
+    if(large->previous)
+      large->previous->next = large->next;
+    else
+      self->large = large->next;
+    
+    if(large->next)
+      large->next->previous = large->previous;
+    
+    burrow_free(self->burrow, large);
+    return;
+  }
+  
+  int class = _class(size);
+  size_t index = _find(self, block);
+  slab_st* slab = self->slabs[index];
+  if(!slab->free && slab->current == slab->end)
+    _link(self, class, slab);
+  
+  ((slab_block_st*)block)->next = slab->free;
+  slab->free = block;
+  if(!--slab->used)
+    _release(self, class, index);
+}
+/******************************************************************************/
+size_t slab_block_size(size_t size)
+{
+  if(size > SLAB_MAX_SIZE)
+    return SLAB_LARGE_HEADER + size;
+  
+  return _class_size[_class(size)];
+}
+/******************************************************************************/
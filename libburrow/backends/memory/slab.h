@@ -0,0 +1,117 @@
+/*
+ * libburrow -- Memory Backend: size-classed slab allocator.
+ *
+ * Copyright (C) 2011 Federico G. Saldarini.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+/**
+ * @file
+ * @brief Memory backend slab allocator declarations
+ */
+#include <libburrow/common.h>
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+/* How many size classes there are, and the largest of them. Anything 
+ bigger is allocated on its own, after a header linking it to the others.*/
+#define SLAB_CLASSES 35
+#define SLAB_MAX_SIZE 16384
+
+/* How much is allocated at a time, to be carved into blocks of a class, 
+ after a header keeping track of them. A class's first slab is small, and 
+ each new one twice the last, so that a queue holding a few messages 
+ takes a few kilobytes rather than a full slab per class it has used.*/
+#define SLAB_MIN_SIZE 1024
+#define SLAB_SIZE 65536
+#define SLAB_HEADER 48
+#define SLAB_LARGE_HEADER 16
+
+typedef struct slab_block_st
+{
+  struct slab_block_st* next;
+} slab_block_st;
+
+typedef struct slab_st
+{
+  struct slab_st* previous; /* among its class's slabs with room*/
+  struct slab_st* next;
+  slab_block_st* free; /* blocks given back to it*/
+  char* current; /* what is left of it that was never handed out*/
+  char* end;
+  uint32_t used; /* blocks handed out*/
+  uint32_t size; /* bytes past the header*/
+} slab_st;
+
+typedef struct slab_large_st
+{
+  struct slab_large_st* previous;
+  struct slab_large_st* next;
+} slab_large_st;
+
+
+/* Each slab keeps the blocks freed back to it, to be handed out again 
+ before any new one is carved out of it, and is given back as soon as the 
+ last of its blocks is. A block's slab is found through an array of 
+ every slab, sorted by address. Whatever is left goes when the cache is 
+ destroyed, all at once, along with any large blocks still allocated.*/
+typedef struct
+{
+  burrow_st* burrow;
+  slab_st* partial[SLAB_CLASSES]; /* slabs with room, per class*/
+  uint32_t next_size[SLAB_CLASSES]; /* of each class's next slab*/
+  slab_st** slabs; /* every slab, by address*/
+  size_t slab_count;
+  size_t slab_room;
+  slab_large_st* large;
+  
+} slab_cache_st;
+
+
+/**
+ * Sets up an empty cache.
+ */
+void slab_init(slab_cache_st* self, burrow_st* burrow);
+
+/**
+ * Frees every slab of a cache, and so every block allocated from it.
+ */
+void slab_destroy(slab_cache_st* self);
+
+/**
+ * Allocates size bytes, aligned for any type, or returns NULL.
+ */
+void* slab_alloc(slab_cache_st* self, size_t size);
+
+/**
+ * Frees a block allocated with slab_alloc, given the same size.
+ */
+void slab_free(slab_cache_st* self, void* block, size_t size);
+
+/**
+ * Returns how many bytes a block of size bytes takes, rounded up to its 
+ * class, or with its header if it is allocated on its own.
+ */
+size_t slab_block_size(size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,2233 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Shared memory backend implementation
+ *
+ * Queues live in a region every process on the host opens by name with
+ * shm_open, so that producers and consumers there share them without a
+ * server in between. The region holds only offsets, never pointers, and is
+ * laid out once by whichever process creates it:
+ *
+ *   header | queue table | message slots
+ *
+ * Each queue in the table has, after it, a ring of the message slots it
+ * holds in the order they came in, and an open-addressed table of the same
+ * slots by id. Slots are taken from one pool for the whole region, through
+ * a lock-free free list. A queue is changed only under its own mutex, and
+ * the table of queues under the header's; both are process-shared and
+ * robust, so that a process dying with one held does not hang the others.
+ *
+ * Consumers reading with the wait filter, and finding nothing, park until
+ * a message comes in. Producers bump the header's wakeups word and wake
+ * the futex on it whenever they add to a queue with waiters. A thread per
+ * backend waits on that futex and turns it into an eventfd event, which
+ * the backend watches with burrow_watch_fd like any other.
+ * Parked consumers are counted by process, so that those of a process
+ * that died stop holding their queue in the table.
+ *
+ * The mmap backend lays out the same region in a file instead, which then
+ * outlives the processes using it. Opening one is only a mapping, with
+ * pages read in as queues are used. Every change links a message in only
+ * once it's written, so that a store left by a process that crashed holds
+ * each message whole or not at all; the first process to open it again
+ * drops what was half linked and takes back the slots lost. A store closed
+ * cleanly skips that. With the "sync" option each change is also flushed
+ * to disk before the command returns.
+ *
+ * That holds against processes crashing, not the host: the kernel writes
+ * a file's pages back in no particular order, so a change in flight when
+ * power is lost, even with "sync", may reach the disk linked but not
+ * whole. Only changes whose commands returned with "sync" set are sure to
+ * be there, and intact.
+ */
+
+#include <libburrow/common.h>
+#include "shm.h"
+
+#ifdef BURROW_BACKEND_SHM
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x42757277 /* "Burw" */
+#define SHM_VERSION 2
+
+/* Longest account and queue names, and message ids, with the nul */
+#define SHM_NAME_SIZE 64
+#define SHM_ID_SIZE 128
+
+/* Region geometry, unless set with burrow_set_backend_option_int */
+#define SHM_DEFAULT_NAME "/burrow"
+#define SHM_DEFAULT_QUEUES 64
+#define SHM_DEFAULT_MESSAGES 4096
+#define SHM_DEFAULT_MESSAGE_SIZE 1024
+#define SHM_MAX_QUEUES 65536
+#define SHM_MAX_MESSAGES (1 << 24)
+#define SHM_MAX_MESSAGE_SIZE (1 << 24)
+
+/* Processes that may have consumers parked on one queue at once */
+#define SHM_WAITING 8
+
+/* Ring entries and buckets that hold no message slot */
+#define SHM_NONE UINT32_MAX
+#define SHM_TOMB (UINT32_MAX - 1)
+
+/* Messages live five minutes unless given a ttl, as with the memory
+   backend */
+#define SHM_DEFAULT_TTL 300
+
+/* How long a process waits for another to finish laying out a region */
+#define SHM_SETUP_TRIES 1000
+
+/* Default file for the mmap backend, and the bytes of it locked by
+   processes opening it, and holding it open */
+#define SHM_DEFAULT_PATH "burrow.store"
+#define SHM_LOCK_SETUP 0
+#define SHM_LOCK_OPEN 1
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ready;          /* set last, once the region is laid out */
+  uint32_t queue_count;
+  uint32_t message_count;  /* in the pool, and most in one queue */
+  uint32_t message_size;   /* largest body */
+  uint32_t wakeups;        /* futex word: bumped for waiting consumers */
+  uint32_t unused;         /* slots never yet handed out start here */
+  uint32_t clean;          /* file closed by the last process using it */
+  uint64_t size;
+  uint64_t queue_stride;
+  uint64_t message_stride;
+  uint64_t queues_offset;
+  uint64_t messages_offset;
+  uint64_t free_list;      /* ABA tag << 32 | first free slot */
+  pthread_mutex_t lock;    /* over the queue table */
+} shm_header_st;
+
+/* Consumers of one process parked on a queue */
+typedef struct
+{
+  int32_t pid;
+  uint32_t count;          /* none if the entry is free */
+} shm_waiting_st;
+
+typedef struct
+{
+  uint32_t used;
+  uint32_t hash;           /* of the account and queue names */
+  char account[SHM_NAME_SIZE];
+  char queue[SHM_NAME_SIZE];
+  uint32_t head;           /* ring positions count up, wrapping the ring */
+  uint32_t tail;
+  uint32_t count;          /* messages held, expired or not */
+  uint32_t tombs;          /* buckets left by deleted messages */
+  uint32_t waiters;        /* consumers parked on the queue */
+  shm_waiting_st waiting[SHM_WAITING]; /* the same, by process */
+  pthread_mutex_t lock;
+  /* uint32_t ring[message_count]; uint32_t buckets[message_count * 2]; */
+} shm_queue_st;
+
+typedef struct
+{
+  uint32_t next_free;
+  uint32_t hash;           /* of the id */
+  uint32_t position;       /* in the queue's ring */
+  uint32_t ttl;            /* both in seconds since the epoch */
+  uint32_t hide;
+  uint32_t body_size;
+  char id[SHM_ID_SIZE];
+  char body[];
+} shm_message_st;
+
+typedef enum
+{
+  SHM_GET,
+  SHM_UPDATE,
+  SHM_DELETE
+} shm_action_t;
+
+/* A command parked until a message comes in, or its wait runs out */
+typedef struct
+{
+  const burrow_command_st *cmd;
+  shm_action_t action;
+  uint32_t queue;          /* index in the table, kept by the waiter count */
+  int64_t deadline;        /* monotonic milliseconds */
+} shm_wait_st;
+
+/* A message copied out of the region, to be reported once it's unlocked */
+typedef struct
+{
+  uint32_t ttl;
+  uint32_t hide;
+  uint32_t id_size;
+  uint32_t body_size;
+  /* char id[id_size]; char body[body_size]; */
+} shm_report_st;
+
+typedef struct
+{
+  int selfallocated;
+  burrow_st *burrow;
+
+  /* Options, used when the region is first opened */
+  bool persistent;         /* in a file rather than shared memory */
+  bool sync;
+  char name[PATH_MAX];
+  uint32_t queue_count;
+  uint32_t message_count;
+  uint32_t message_size;
+
+  shm_header_st *header;   /* NULL until the first command */
+  int fd;                  /* held open for the mmap backend's locks */
+
+  shm_wait_st *waits;
+  uint32_t wait_count;
+  uint32_t wait_size;
+
+  /* The futex waiter thread, and how it tells the backend */
+  int event_fd;
+  bool waiter_started;
+  bool waiter_armed;
+  bool waiter_stop;
+  uint32_t waiter_seen;
+  pthread_t waiter;
+  pthread_mutex_t waiter_lock;
+  pthread_cond_t waiter_cond;
+
+  char *reports;
+  size_t reports_size;
+  size_t reports_used;
+} burrow_backend_shm_st;
+
+static uint32_t _hash(const char *key, uint32_t hash)
+{
+  /* FNV-1a */
+  while (*key)
+    hash = (hash ^ (uint8_t)*key++) * 16777619;
+
+  return hash;
+}
+
+static uint32_t _round_up_pow2(uint32_t value)
+{
+  uint32_t pow2 = 1;
+
+  while (pow2 < value)
+    pow2 <<= 1;
+
+  return pow2;
+}
+
+static int64_t _now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static shm_queue_st *_queue(shm_header_st *header, uint32_t index)
+{
+  return (shm_queue_st *)((char *)header + header->queues_offset +
+                          index * header->queue_stride);
+}
+
+static uint32_t *_ring(shm_queue_st *queue)
+{
+  return (uint32_t *)(queue + 1);
+}
+
+static uint32_t *_buckets(shm_header_st *header, shm_queue_st *queue)
+{
+  return _ring(queue) + header->message_count;
+}
+
+static shm_message_st *_message(shm_header_st *header, uint32_t slot)
+{
+  return (shm_message_st *)((char *)header + header->messages_offset +
+                            slot * header->message_stride);
+}
+
+/* Locks a process-shared mutex, taking it over from a process that died
+   holding it. Returns true in that case, as what it guards may be half
+   changed. */
+static bool _lock(pthread_mutex_t *mutex)
+{
+  if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+  {
+    pthread_mutex_consistent(mutex);
+    return true;
+  }
+
+  return false;
+}
+
+static int _futex_wait(uint32_t *word, uint32_t value)
+{
+  return (int)syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/* Message slot pool: */
+
+static uint32_t _slot_alloc(shm_header_st *header)
+{
+  uint64_t old = __atomic_load_n(&header->free_list, __ATOMIC_ACQUIRE);
+  uint64_t new;
+  uint32_t slot;
+
+  do
+  {
+    slot = (uint32_t)old;
+    if (slot == SHM_NONE)
+    {
+      /* Nothing freed yet: hand out a slot never used, which leaves the
+         pages of the pool untouched until they are needed */
+      slot = __atomic_fetch_add(&header->unused, 1, __ATOMIC_RELAXED);
+      if (slot >= header->message_count)
+      {
+        __atomic_store_n(&header->unused, header->message_count,
+                         __ATOMIC_RELAXED);
+        return SHM_NONE;
+      }
+      return slot;
+    }
+
+    new = (((old >> 32) + 1) << 32) |
+          __atomic_load_n(&_message(header, slot)->next_free,
+                          __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&header->free_list, &old, new, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return slot;
+}
+
+static void _slot_free(shm_header_st *header, uint32_t slot)
+{
+  uint64_t old = __atomic_load_n(&header->free_list, __ATOMIC_RELAXED);
+  uint64_t new;
+
+  do
+  {
+    __atomic_store_n(&_message(header, slot)->next_free, (uint32_t)old,
+                     __ATOMIC_RELAXED);
+    new = (((old >> 32) + 1) << 32) | slot;
+  } while (!__atomic_compare_exchange_n(&header->free_list, &old, new, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Buckets of a queue, by message id: */
+
+static uint32_t *_bucket_find(shm_header_st *header, shm_queue_st *queue,
+                              const char *id, uint32_t hash)
+{
+  uint32_t *buckets = _buckets(header, queue);
+  uint32_t mask = header->message_count * 2 - 1;
+  uint32_t i;
+
+  for (i = hash & mask; buckets[i] != SHM_NONE; i = (i + 1) & mask)
+  {
+    shm_message_st *message;
+
+    if (buckets[i] == SHM_TOMB)
+      continue;
+
+    message = _message(header, buckets[i]);
+    if (message->hash == hash && !strcmp(message->id, id))
+      return &buckets[i];
+  }
+
+  return NULL;
+}
+
+static void _bucket_add(shm_header_st *header, shm_queue_st *queue,
+                        uint32_t slot)
+{
+  uint32_t *buckets = _buckets(header, queue);
+  uint32_t mask = header->message_count * 2 - 1;
+  uint32_t i;
+
+  for (i = _message(header, slot)->hash & mask;
+       buckets[i] != SHM_NONE && buckets[i] != SHM_TOMB;
+       i = (i + 1) & mask);
+
+  if (buckets[i] == SHM_TOMB)
+    queue->tombs--;
+  buckets[i] = slot;
+}
+
+static void _buckets_rebuild(shm_header_st *header, shm_queue_st *queue)
+{
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t position;
+
+  memset(_buckets(header, queue), 0xff,
+         header->message_count * 2 * sizeof(uint32_t));
+  queue->tombs = 0;
+
+  for (position = queue->tail; position != queue->head; position++)
+    if (ring[position & mask] != SHM_TOMB)
+      _bucket_add(header, queue, ring[position & mask]);
+}
+
+/* Rebuilds the buckets once deleted messages leave too few free to find
+   an id quickly. Up to half hold messages, at most. */
+static void _buckets_check(shm_header_st *header, shm_queue_st *queue)
+{
+  if (queue->count + queue->tombs > header->message_count * 3 / 2)
+    _buckets_rebuild(header, queue);
+}
+
+/* Queues: */
+
+static void _queue_set_count(shm_queue_st *queue, uint32_t count)
+{
+  /* Read without the queue's lock by listings */
+  __atomic_store_n(&queue->count, count, __ATOMIC_RELEASE);
+}
+
+/* Frees a message and drops it from its queue. Callers check the buckets
+   once done. */
+static void _message_remove(shm_header_st *header, shm_queue_st *queue,
+                            uint32_t slot)
+{
+  shm_message_st *message = _message(header, slot);
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+
+  *_bucket_find(header, queue, message->id, message->hash) = SHM_TOMB;
+  queue->tombs++;
+
+  ring[message->position & mask] = SHM_TOMB;
+  while (queue->tail != queue->head && ring[queue->tail & mask] == SHM_TOMB)
+    queue->tail++;
+
+  _queue_set_count(queue, queue->count - 1);
+  _slot_free(header, slot);
+}
+
+/* Squeezes deleted and expired messages out of a full ring */
+static void _ring_compact(shm_header_st *header, shm_queue_st *queue,
+                          uint32_t now)
+{
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t next = queue->tail;
+  uint32_t position;
+
+  for (position = queue->tail; position != queue->head; position++)
+  {
+    uint32_t slot = ring[position & mask];
+    shm_message_st *message;
+
+    if (slot == SHM_TOMB)
+      continue;
+
+    message = _message(header, slot);
+    if (message->ttl <= now)
+    {
+      *_bucket_find(header, queue, message->id, message->hash) = SHM_TOMB;
+      queue->tombs++;
+      ring[position & mask] = SHM_TOMB;
+      _queue_set_count(queue, queue->count - 1);
+      _slot_free(header, slot);
+      continue;
+    }
+
+    ring[next & mask] = slot;
+    message->position = next++;
+  }
+
+  queue->head = next;
+  _buckets_check(header, queue);
+}
+
+/* Brings a queue's ring and buckets back in line after a process died
+   changing them. A message is kept only where it says it is in the ring,
+   which drops those left behind by a compaction or an overwrite cut
+   short, and with referenced, those already kept by another queue. Slots
+   taken, and not yet linked, are lost until the free list is rebuilt. */
+static void _queue_repair(shm_header_st *header, shm_queue_st *queue,
+                          uint8_t *referenced)
+{
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t count = 0;
+  uint32_t position;
+
+  if (queue->head - queue->tail > header->message_count)
+    queue->head = queue->tail;
+
+  for (position = queue->tail; position != queue->head; position++)
+  {
+    uint32_t slot = ring[position & mask];
+
+    if (slot == SHM_TOMB)
+      continue;
+
+    if (slot >= header->message_count ||
+        _message(header, slot)->position != position ||
+        (referenced && (referenced[slot / 8] & (1 << (slot % 8)))))
+    {
+      ring[position & mask] = SHM_TOMB;
+      continue;
+    }
+
+    if (referenced)
+      referenced[slot / 8] |= 1 << (slot % 8);
+    count++;
+  }
+
+  while (queue->tail != queue->head && ring[queue->tail & mask] == SHM_TOMB)
+    queue->tail++;
+
+  _queue_set_count(queue, count);
+  _buckets_rebuild(header, queue);
+}
+
+static void _queue_lock(shm_header_st *header, shm_queue_st *queue)
+{
+  if (_lock(&queue->lock))
+    _queue_repair(header, queue, NULL);
+}
+
+static void _queue_clear(shm_header_st *header, shm_queue_st *queue)
+{
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t head = queue->head;
+  uint32_t position;
+
+  /* Emptied before its slots are freed, so none is ever in both */
+  __atomic_store_n(&queue->head, queue->tail, __ATOMIC_RELEASE);
+
+  for (position = queue->tail; position != head; position++)
+    if (ring[position & mask] != SHM_TOMB)
+      _slot_free(header, ring[position & mask]);
+
+  queue->head = 0;
+  queue->tail = 0;
+  queue->tombs = 0;
+  _queue_set_count(queue, 0);
+  memset(_buckets(header, queue), 0xff,
+         header->message_count * 2 * sizeof(uint32_t));
+}
+
+static void _queue_waiters_clear(shm_queue_st *queue)
+{
+  queue->waiters = 0;
+  memset(queue->waiting, 0, sizeof(queue->waiting));
+}
+
+/* Whether any consumer is parked on a queue. Those of processes gone are
+   dropped from its count first, as nothing else ever will. Called with
+   the queue locked. */
+static bool _queue_waited(shm_queue_st *queue)
+{
+  uint32_t i;
+
+  if (!queue->waiters)
+    return false;
+
+  for (i = 0; i < SHM_WAITING; i++)
+  {
+    shm_waiting_st *waiting = &queue->waiting[i];
+
+    if (waiting->count && kill((pid_t)waiting->pid, 0) == -1 &&
+        errno == ESRCH)
+    {
+      queue->waiters -= waiting->count;
+      waiting->count = 0;
+    }
+  }
+
+  return queue->waiters != 0;
+}
+
+/* The entry counting this process's consumers parked on a queue, taking
+   a free one with add. NULL if there is none, or none free. */
+static shm_waiting_st *_queue_waiting(shm_queue_st *queue, bool add)
+{
+  int32_t pid = (int32_t)getpid();
+  shm_waiting_st *free_waiting = NULL;
+  uint32_t i;
+
+  for (i = 0; i < SHM_WAITING; i++)
+  {
+    shm_waiting_st *waiting = &queue->waiting[i];
+
+    if (waiting->count && waiting->pid == pid)
+      return waiting;
+    if (!waiting->count && !free_waiting)
+      free_waiting = waiting;
+  }
+
+  if (!add)
+    return NULL;
+
+  /* Those of processes gone may be taken back */
+  if (!free_waiting)
+  {
+    _queue_waited(queue);
+    for (i = 0; i < SHM_WAITING && !free_waiting; i++)
+      if (!queue->waiting[i].count)
+        free_waiting = &queue->waiting[i];
+  }
+
+  if (free_waiting)
+    free_waiting->pid = pid;
+  return free_waiting;
+}
+
+/* Finds a queue by its account and name, and returns it locked, or NULL.
+   With create, the queue is set up if it isn't there, in a free entry of
+   the table or one left empty. */
+static shm_queue_st *_queue_get(burrow_backend_shm_st *self,
+                                const char *account,
+                                const char *name,
+                                bool create)
+{
+  shm_header_st *header = self->header;
+  uint32_t hash = _hash(name, _hash(account, 2166136261u) * 31);
+  shm_queue_st *free_queue = NULL;
+  shm_queue_st *queue;
+  uint32_t i;
+
+  if (strlen(account) >= SHM_NAME_SIZE || strlen(name) >= SHM_NAME_SIZE)
+  {
+    burrow_log_error(self->burrow, "shm: account or queue name too long");
+    return NULL;
+  }
+
+  _lock(&header->lock);
+
+  for (i = 0; i < header->queue_count; i++)
+  {
+    queue = _queue(header, i);
+    if (!queue->used)
+    {
+      if (!free_queue)
+        free_queue = queue;
+    }
+    else if (queue->hash == hash && !strcmp(queue->account, account) &&
+             !strcmp(queue->queue, name))
+    {
+      _queue_lock(header, queue);
+      pthread_mutex_unlock(&header->lock);
+      return queue;
+    }
+  }
+
+  if (!create)
+  {
+    pthread_mutex_unlock(&header->lock);
+    return NULL;
+  }
+
+  /* No free entry: take one over from a queue left empty */
+  for (i = 0; !free_queue && i < header->queue_count; i++)
+  {
+    queue = _queue(header, i);
+    if (__atomic_load_n(&queue->count, __ATOMIC_ACQUIRE))
+      continue;
+
+    _queue_lock(header, queue);
+    if (!queue->count && !_queue_waited(queue))
+    {
+      _queue_clear(header, queue);
+      queue->used = 0;
+      free_queue = queue;
+    }
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  if (!free_queue)
+  {
+    pthread_mutex_unlock(&header->lock);
+    burrow_log_error(self->burrow, "shm: no room for queue %s", name);
+    return NULL;
+  }
+
+  queue = free_queue;
+  _queue_lock(header, queue);
+  _queue_clear(header, queue);
+  _queue_waiters_clear(queue);
+  queue->hash = hash;
+  strcpy(queue->account, account);
+  strcpy(queue->queue, name);
+  queue->used = 1;
+
+  pthread_mutex_unlock(&header->lock);
+  return queue;
+}
+
+/* Region: */
+
+/* Sets up the locks of a region, which no other process may be using */
+static int _locks_init(burrow_backend_shm_st *self, shm_header_st *header)
+{
+  pthread_mutexattr_t attr;
+  uint32_t i;
+
+  if (pthread_mutexattr_init(&attr) ||
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST))
+  {
+    burrow_log_error(self->burrow, "shm: process-shared mutexes unavailable");
+    return ENOTSUP;
+  }
+
+  pthread_mutex_init(&header->lock, &attr);
+  for (i = 0; i < header->queue_count; i++)
+    pthread_mutex_init(&_queue(header, i)->lock, &attr);
+
+  pthread_mutexattr_destroy(&attr);
+  return 0;
+}
+
+static int _layout(burrow_backend_shm_st *self, shm_header_st *header,
+                   size_t size)
+{
+  uint32_t i;
+  int result;
+
+  header->magic = SHM_MAGIC;
+  header->version = SHM_VERSION;
+  header->queue_count = self->queue_count;
+  header->message_count = self->message_count;
+  header->message_size = self->message_size;
+  header->wakeups = 0;
+  header->unused = 0;
+  header->size = size;
+  header->queue_stride = (sizeof(shm_queue_st) +
+                          self->message_count * 3 * sizeof(uint32_t) + 63) &
+                         ~(uint64_t)63;
+  header->message_stride = (sizeof(shm_message_st) + self->message_size +
+                            7) & ~(uint64_t)7;
+  header->queues_offset = (sizeof(shm_header_st) + 63) & ~(uint64_t)63;
+  header->messages_offset = header->queues_offset +
+                            header->queue_count * header->queue_stride;
+  header->free_list = SHM_NONE;
+  header->clean = 1;
+
+  for (i = 0; i < header->queue_count; i++)
+    _queue(header, i)->used = 0;
+
+  if ((result = _locks_init(self, header)))
+    return result;
+
+  __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static size_t _region_size(burrow_backend_shm_st *self)
+{
+  size_t queue_stride = (sizeof(shm_queue_st) +
+                         self->message_count * 3 * sizeof(uint32_t) + 63) &
+                        ~(size_t)63;
+  size_t message_stride = (sizeof(shm_message_st) + self->message_size + 7) &
+                          ~(size_t)7;
+
+  return ((sizeof(shm_header_st) + 63) & ~(size_t)63) +
+         self->queue_count * queue_stride +
+         self->message_count * message_stride;
+}
+
+/* Takes back a file store for the first process to open it since it was
+   last closed. Locks left held by processes gone are set up again, and
+   if none closed it cleanly, every queue is repaired and the free list
+   rebuilt from the slots no queue holds. */
+static int _recover(burrow_backend_shm_st *self, shm_header_st *header)
+{
+  uint8_t *referenced;
+  uint32_t clean;
+  uint32_t slot;
+  uint32_t i;
+  int result;
+
+  if ((result = _locks_init(self, header)))
+    return result;
+
+  /* Marked in use on disk before anything in it changes, so that a store
+     left half changed is never taken for one closed cleanly */
+  clean = header->clean;
+  header->clean = 0;
+  if (fdatasync(self->fd) == -1)
+  {
+    burrow_log_error(self->burrow, "shm: fdatasync %s: 0x%x", self->name,
+                     errno);
+    return errno;
+  }
+
+  if (clean)
+    return 0;
+
+  burrow_log_warn(self->burrow, "shm: %s wasn't closed cleanly, repairing",
+                  self->name);
+
+  referenced = burrow_malloc(self->burrow, header->message_count / 8 + 1);
+  if (!referenced)
+  {
+    burrow_log_error(self->burrow, "shm: couldn't allocate repair map");
+    return ENOMEM;
+  }
+  memset(referenced, 0, header->message_count / 8 + 1);
+
+  for (i = 0; i < header->queue_count; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    _queue_waiters_clear(queue);
+    if (queue->used)
+      _queue_repair(header, queue, referenced);
+  }
+
+  if (header->unused > header->message_count)
+    header->unused = header->message_count;
+
+  header->free_list = SHM_NONE;
+  for (slot = 0; slot < header->unused; slot++)
+    if (!(referenced[slot / 8] & (1 << (slot % 8))))
+      _slot_free(header, slot);
+
+  burrow_free(self->burrow, referenced);
+  return 0;
+}
+
+static int _file_lock(int fd, short type, off_t start, bool wait)
+{
+  struct flock lock;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = start;
+  lock.l_len = 1;
+
+  /* Held by the open file rather than the process, so that two backends
+     in one process see each other */
+  return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+/* Marks a file store held open by this backend, recovering it if no other
+   process has it open. Opening and closing are serialized by the setup
+   byte, so that nobody opens it while it's recovered or marked clean. */
+static int _file_open(burrow_backend_shm_st *self, shm_header_st *header)
+{
+  int result = 0;
+
+  if (_file_lock(self->fd, F_WRLCK, SHM_LOCK_SETUP, true) == -1)
+  {
+    burrow_log_error(self->burrow, "shm: locking %s: 0x%x", self->name,
+                     errno);
+    return errno;
+  }
+
+  if (_file_lock(self->fd, F_WRLCK, SHM_LOCK_OPEN, false) == 0)
+    result = _recover(self, header);
+
+  if (!result)
+    _file_lock(self->fd, F_RDLCK, SHM_LOCK_OPEN, true);
+
+  _file_lock(self->fd, F_UNLCK, SHM_LOCK_SETUP, true);
+  return result;
+}
+
+/* Marks a file store clean if this backend is the last to hold it open,
+   once everything written to it is on disk */
+static void _file_close(burrow_backend_shm_st *self)
+{
+  _file_lock(self->fd, F_WRLCK, SHM_LOCK_SETUP, true);
+
+  if (_file_lock(self->fd, F_WRLCK, SHM_LOCK_OPEN, false) == 0 &&
+      fdatasync(self->fd) == 0)
+  {
+    self->header->clean = 1;
+    fdatasync(self->fd);
+  }
+}
+
+static int _region_open(burrow_backend_shm_st *self, int flags)
+{
+  if (self->persistent)
+    return open(self->name, flags | O_CLOEXEC, 0600);
+
+  return shm_open(self->name, flags, 0600);
+}
+
+static void _region_unlink(burrow_backend_shm_st *self)
+{
+  if (self->persistent)
+    unlink(self->name);
+  else
+    shm_unlink(self->name);
+}
+
+/* Opens the region on the first command, creating and laying it out if no
+   other process has. A region already there keeps the geometry it was
+   created with. */
+static int _attach(burrow_backend_shm_st *self)
+{
+  struct timespec pause = { 0, 1000000 };
+  shm_header_st *header;
+  struct stat st;
+  bool created = false;
+  size_t size;
+  int tries;
+  int fd;
+
+  if (self->header)
+    return 0;
+
+  fd = _region_open(self, O_RDWR | O_CREAT | O_EXCL);
+  if (fd != -1)
+  {
+    created = true;
+    size = _region_size(self);
+    if (ftruncate(fd, (off_t)size) == -1)
+    {
+      burrow_log_error(self->burrow, "shm: ftruncate %s: 0x%x", self->name,
+                       errno);
+      close(fd);
+      _region_unlink(self);
+      return ENOMEM;
+    }
+  }
+  else if (errno == EEXIST && (fd = _region_open(self, O_RDWR)) != -1)
+  {
+    /* The process creating it may not have sized it yet */
+    st.st_size = 0;
+    for (tries = 0; tries < SHM_SETUP_TRIES; tries++)
+    {
+      if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(shm_header_st))
+        break;
+      nanosleep(&pause, NULL);
+    }
+    size = (size_t)st.st_size;
+  }
+  else
+  {
+    burrow_log_error(self->burrow, "shm: opening %s: 0x%x", self->name,
+                     errno);
+    return errno;
+  }
+
+  header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED)
+  {
+    burrow_log_error(self->burrow, "shm: mmap %s: 0x%x", self->name, errno);
+    close(fd);
+    return errno;
+  }
+
+  if (created)
+  {
+    int result = _layout(self, header, size);
+    if (result)
+    {
+      munmap(header, size);
+      close(fd);
+      _region_unlink(self);
+      return result;
+    }
+  }
+  else
+  {
+    for (tries = 0; tries < SHM_SETUP_TRIES &&
+         !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE); tries++)
+      nanosleep(&pause, NULL);
+
+    if (!header->ready || header->magic != SHM_MAGIC ||
+        header->version != SHM_VERSION || header->size != size)
+    {
+      burrow_log_error(self->burrow, "shm: %s is not a burrow region",
+                       self->name);
+      munmap(header, size);
+      close(fd);
+      return EINVAL;
+    }
+  }
+
+  if (self->persistent)
+  {
+    int result;
+
+    self->fd = fd;
+    if ((result = _file_open(self, header)))
+    {
+      munmap(header, size);
+      close(fd);
+      self->fd = -1;
+      return result;
+    }
+  }
+  else
+    close(fd);
+
+  self->header = header;
+  return 0;
+}
+
+/* Flushes a change to a file store to disk, with the sync option */
+static int _commit(burrow_backend_shm_st *self)
+{
+  if (!self->sync)
+    return 0;
+
+  if (fdatasync(self->fd) == -1)
+  {
+    burrow_log_error(self->burrow, "shm: fdatasync %s: 0x%x", self->name,
+                     errno);
+    return errno;
+  }
+
+  return 0;
+}
+
+/* Reports: */
+
+static int _report_add(burrow_backend_shm_st *self,
+                       const shm_message_st *message,
+                       uint32_t now)
+{
+  uint32_t id_size = (uint32_t)strlen(message->id) + 1;
+  size_t size = (sizeof(shm_report_st) + id_size + message->body_size + 7) &
+                ~(size_t)7;
+  shm_report_st *report;
+
+  if (self->reports_used + size > self->reports_size)
+  {
+    size_t reports_size = self->reports_size ? self->reports_size * 2 : 4096;
+    char *reports;
+
+    while (reports_size < self->reports_used + size)
+      reports_size *= 2;
+
+    reports = burrow_malloc(self->burrow, reports_size);
+    if (!reports)
+    {
+      burrow_log_error(self->burrow, "shm: couldn't allocate reports");
+      return ENOMEM;
+    }
+
+    if (self->reports)
+    {
+      memcpy(reports, self->reports, self->reports_used);
+      burrow_free(self->burrow, self->reports);
+    }
+    self->reports = reports;
+    self->reports_size = reports_size;
+  }
+
+  report = (shm_report_st *)(self->reports + self->reports_used);
+  report->ttl = message->ttl > now ? message->ttl - now : 0;
+  report->hide = message->hide > now ? message->hide - now : 0;
+  report->id_size = id_size;
+  report->body_size = message->body_size;
+  memcpy(report + 1, message->id, id_size);
+  memcpy((char *)(report + 1) + id_size, message->body, message->body_size);
+
+  self->reports_used += size;
+  return 0;
+}
+
+/* Makes the callbacks for the messages copied out, with nothing locked */
+static void _report_flush(burrow_backend_shm_st *self)
+{
+  burrow_attributes_st attributes;
+  size_t offset = 0;
+
+  attributes.set = BURROW_ATTRIBUTES_TTL | BURROW_ATTRIBUTES_HIDE;
+
+  while (offset < self->reports_used)
+  {
+    shm_report_st *report = (shm_report_st *)(self->reports + offset);
+    const char *id = (const char *)(report + 1);
+
+    attributes.ttl = report->ttl;
+    attributes.hide = report->hide;
+    burrow_callback_message(self->burrow, id, id + report->id_size,
+                            report->body_size, &attributes);
+
+    offset += (sizeof(shm_report_st) + report->id_size + report->body_size +
+               7) & ~(size_t)7;
+  }
+
+  self->reports_used = 0;
+}
+
+/* Messages: */
+
+/* Walks a locked queue as the filters say, acting on each message in
+   range, and copying out those to report. Expired messages met on the way
+   are reclaimed. */
+static int _scan(burrow_backend_shm_st *self,
+                 shm_queue_st *queue,
+                 const burrow_command_st *cmd,
+                 shm_action_t action,
+                 uint32_t now,
+                 uint32_t *matched)
+{
+  shm_header_st *header = self->header;
+  const burrow_filters_st *filters = cmd->filters;
+  const burrow_attributes_st *attributes = cmd->attributes;
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t remaining = UINT32_MAX;
+  bool match_hidden = false;
+  uint32_t position = queue->tail;
+  int result = 0;
+
+  if (filters)
+  {
+    if (filters->set & BURROW_FILTERS_LIMIT)
+      remaining = filters->limit;
+    if (filters->set & BURROW_FILTERS_MATCH_HIDDEN)
+      match_hidden = filters->match_hidden;
+    if (filters->marker)
+    {
+      uint32_t *bucket = _bucket_find(header, queue, filters->marker,
+                                      _hash(filters->marker, 2166136261u));
+      if (bucket)
+        position = _message(header, *bucket)->position + 1;
+    }
+  }
+
+  for (; position != queue->head && remaining && !result; position++)
+  {
+    uint32_t slot = ring[position & mask];
+    shm_message_st *message;
+
+    if (slot == SHM_TOMB)
+      continue;
+
+    message = _message(header, slot);
+    if (message->ttl <= now)
+    {
+      _message_remove(header, queue, slot);
+      continue;
+    }
+
+    if (message->hide > now && !match_hidden)
+      continue;
+
+    remaining--;
+    (*matched)++;
+
+    if (action == SHM_UPDATE && attributes)
+    {
+      if (attributes->set & BURROW_ATTRIBUTES_TTL)
+        message->ttl = now + attributes->ttl;
+      if (attributes->set & BURROW_ATTRIBUTES_HIDE)
+        message->hide = now + attributes->hide;
+    }
+
+    result = _report_add(self, message, now);
+
+    if (action == SHM_DELETE)
+      _message_remove(header, queue, slot);
+  }
+
+  _buckets_check(header, queue);
+  return result;
+}
+
+static int _store(burrow_backend_shm_st *self,
+                  shm_queue_st *queue,
+                  const char *id,
+                  const void *body,
+                  size_t body_size,
+                  const burrow_attributes_st *attributes,
+                  uint32_t now)
+{
+  shm_header_st *header = self->header;
+  uint32_t hash = _hash(id, 2166136261u);
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t *bucket;
+  shm_message_st *message;
+  uint32_t slot;
+
+  if (strlen(id) >= SHM_ID_SIZE || body_size > header->message_size)
+  {
+    burrow_log_error(self->burrow, "shm: message %s too large", id);
+    return EINVAL;
+  }
+
+  if (queue->head - queue->tail == header->message_count)
+    _ring_compact(header, queue, now);
+
+  /* Written out whole before it's linked in, so that a process dying here
+     leaves at most a slot to take back */
+  slot = _slot_alloc(header);
+  if (slot == SHM_NONE)
+  {
+    burrow_log_error(self->burrow, "shm: no room for message %s", id);
+    return ENOSPC;
+  }
+
+  message = _message(header, slot);
+  message->hash = hash;
+  strcpy(message->id, id);
+  message->body_size = (uint32_t)body_size;
+  memcpy(message->body, body, body_size);
+
+  message->ttl = now + SHM_DEFAULT_TTL;
+  message->hide = 0;
+  if (attributes)
+  {
+    if (attributes->set & BURROW_ATTRIBUTES_TTL)
+      message->ttl = now + attributes->ttl;
+    if ((attributes->set & BURROW_ATTRIBUTES_HIDE) && attributes->hide)
+      message->hide = now + attributes->hide;
+  }
+
+  /* A message with the same id is replaced, in its place */
+  bucket = _bucket_find(header, queue, id, hash);
+  if (bucket)
+  {
+    uint32_t old = *bucket;
+
+    message->position = _message(header, old)->position;
+    __atomic_store_n(&ring[message->position & mask], slot,
+                     __ATOMIC_RELEASE);
+    *bucket = slot;
+    _slot_free(header, old);
+    return 0;
+  }
+
+  if (queue->head - queue->tail == header->message_count)
+  {
+    _slot_free(header, slot);
+    burrow_log_error(self->burrow, "shm: no room for message %s", id);
+    return ENOSPC;
+  }
+
+  message->position = queue->head;
+  __atomic_store_n(&ring[queue->head & mask], slot, __ATOMIC_RELEASE);
+  __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+  _bucket_add(header, queue, slot);
+  _queue_set_count(queue, queue->count + 1);
+  return 0;
+}
+
+/* Wakes the consumers parked on a queue, in whatever process. Called with
+   the queue locked, so that none can park in between. */
+static bool _wake_prepare(shm_header_st *header, shm_queue_st *queue)
+{
+  if (!queue->waiters)
+    return false;
+
+  __atomic_fetch_add(&header->wakeups, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+/* Waiting: */
+
+static void *_waiter(void *ptr)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint64_t one = 1;
+  uint32_t seen;
+
+  pthread_mutex_lock(&self->waiter_lock);
+
+  while (!self->waiter_stop)
+  {
+    if (!self->waiter_armed)
+    {
+      pthread_cond_wait(&self->waiter_cond, &self->waiter_lock);
+      continue;
+    }
+
+    seen = self->waiter_seen;
+    pthread_mutex_unlock(&self->waiter_lock);
+    _futex_wait(&self->header->wakeups, seen);
+    pthread_mutex_lock(&self->waiter_lock);
+
+    if (self->waiter_armed && self->waiter_seen == seen &&
+        __atomic_load_n(&self->header->wakeups, __ATOMIC_SEQ_CST) != seen)
+    {
+      self->waiter_armed = false;
+      if (write(self->event_fd, &one, sizeof(one)) == -1)
+        burrow_log_error(self->burrow, "shm: eventfd write: 0x%x", errno);
+    }
+  }
+
+  pthread_mutex_unlock(&self->waiter_lock);
+  return NULL;
+}
+
+static void _waiter_arm(burrow_backend_shm_st *self, bool armed,
+                        uint32_t seen)
+{
+  pthread_mutex_lock(&self->waiter_lock);
+  self->waiter_armed = armed;
+  self->waiter_seen = seen;
+  pthread_cond_signal(&self->waiter_cond);
+  pthread_mutex_unlock(&self->waiter_lock);
+}
+
+static int _wait_add(burrow_backend_shm_st *self,
+                     const burrow_command_st *cmd,
+                     shm_action_t action,
+                     shm_queue_st *queue)
+{
+  shm_header_st *header = self->header;
+  shm_waiting_st *waiting;
+
+  if (self->event_fd == -1)
+  {
+    self->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->event_fd == -1)
+    {
+      burrow_log_error(self->burrow, "shm: eventfd: 0x%x", errno);
+      return errno;
+    }
+  }
+
+  if (!self->waiter_started)
+  {
+    if (pthread_create(&self->waiter, NULL, &_waiter, self))
+    {
+      burrow_log_error(self->burrow, "shm: couldn't start waiter thread");
+      return ENOMEM;
+    }
+    self->waiter_started = true;
+  }
+
+  if (self->wait_count == self->wait_size)
+  {
+    uint32_t wait_size = self->wait_size ? self->wait_size * 2 : 4;
+    shm_wait_st *waits = burrow_malloc(self->burrow,
+                                       wait_size * sizeof(shm_wait_st));
+    if (!waits)
+    {
+      burrow_log_error(self->burrow, "shm: couldn't allocate waits");
+      return ENOMEM;
+    }
+
+    if (self->waits)
+    {
+      memcpy(waits, self->waits, self->wait_count * sizeof(shm_wait_st));
+      burrow_free(self->burrow, self->waits);
+    }
+    self->waits = waits;
+    self->wait_size = wait_size;
+  }
+
+  if (!(waiting = _queue_waiting(queue, true)))
+  {
+    burrow_log_error(self->burrow, "shm: too many processes waiting on %s",
+                     queue->queue);
+    return ENOSPC;
+  }
+  waiting->count++;
+  queue->waiters++;
+
+  self->waits[self->wait_count].cmd = cmd;
+  self->waits[self->wait_count].action = action;
+  self->waits[self->wait_count].queue = (uint32_t)
+    (((char *)queue - (char *)header - header->queues_offset) /
+     header->queue_stride);
+  self->waits[self->wait_count].deadline = _now_ms() +
+                                           (int64_t)cmd->filters->wait * 1000;
+  self->wait_count++;
+  return 0;
+}
+
+static void _wait_drop(burrow_backend_shm_st *self, uint32_t index)
+{
+  shm_queue_st *queue = _queue(self->header, self->waits[index].queue);
+  shm_waiting_st *waiting;
+
+  _queue_lock(self->header, queue);
+  if ((waiting = _queue_waiting(queue, false)))
+  {
+    waiting->count--;
+    queue->waiters--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  self->waits[index] = self->waits[--self->wait_count];
+}
+
+/* Commands: */
+
+static int _messages_command(burrow_backend_shm_st *self,
+                             const burrow_command_st *cmd,
+                             shm_action_t action)
+{
+  bool wait = cmd->filters && (cmd->filters->set & BURROW_FILTERS_WAIT) &&
+              cmd->filters->wait;
+  uint32_t now = (uint32_t)time(NULL);
+  shm_queue_st *queue;
+  uint32_t matched = 0;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+
+  /* A consumer about to wait needs the queue there to wait on */
+  queue = _queue_get(self, cmd->account, cmd->queue, wait);
+  if (!queue)
+    return 0;
+
+  result = _scan(self, queue, cmd, action, now, &matched);
+  if (!result && !matched && wait)
+  {
+    result = _wait_add(self, cmd, action, queue);
+    pthread_mutex_unlock(&queue->lock);
+    return result ? result : EAGAIN;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  if (!result && action != SHM_GET)
+    result = _commit(self);
+  _report_flush(self);
+  return result;
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_messages
+ */
+static int burrow_backend_shm_get_messages(void *ptr,
+                                           const burrow_command_st *cmd)
+{
+  return _messages_command((burrow_backend_shm_st *)ptr, cmd, SHM_GET);
+}
+
+/**
+ * Implements burrow_backend_functions_st#update_messages
+ */
+static int burrow_backend_shm_update_messages(void *ptr,
+                                              const burrow_command_st *cmd)
+{
+  return _messages_command((burrow_backend_shm_st *)ptr, cmd, SHM_UPDATE);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_messages
+ */
+static int burrow_backend_shm_delete_messages(void *ptr,
+                                              const burrow_command_st *cmd)
+{
+  return _messages_command((burrow_backend_shm_st *)ptr, cmd, SHM_DELETE);
+}
+
+static int _message_command(burrow_backend_shm_st *self,
+                            const burrow_command_st *cmd,
+                            shm_action_t action)
+{
+  uint32_t now = (uint32_t)time(NULL);
+  shm_queue_st *queue;
+  shm_message_st *message = NULL;
+  uint32_t *bucket;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+
+  queue = _queue_get(self, cmd->account, cmd->queue, false);
+  if (!queue)
+    return action == SHM_DELETE ? 0 : EINVAL;
+
+  bucket = _bucket_find(self->header, queue, cmd->message_id,
+                        _hash(cmd->message_id, 2166136261u));
+  if (bucket)
+  {
+    message = _message(self->header, *bucket);
+    if (message->ttl <= now)
+    {
+      _message_remove(self->header, queue, *bucket);
+      _buckets_check(self->header, queue);
+      message = NULL;
+    }
+  }
+
+  if (message)
+  {
+    if (action == SHM_UPDATE && cmd->attributes)
+    {
+      if ((cmd->attributes->set & BURROW_ATTRIBUTES_TTL) &&
+          cmd->attributes->ttl > 0)
+        message->ttl = now + cmd->attributes->ttl;
+      if (cmd->attributes->set & BURROW_ATTRIBUTES_HIDE)
+        message->hide = now + cmd->attributes->hide;
+    }
+
+    result = _report_add(self, message, now);
+
+    if (action == SHM_DELETE)
+    {
+      _message_remove(self->header, queue, *bucket);
+      _buckets_check(self->header, queue);
+    }
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  if (message && !result && action != SHM_GET)
+    result = _commit(self);
+  _report_flush(self);
+
+  if (!message && action != SHM_DELETE)
+    return EINVAL;
+  return result;
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_message
+ */
+static int burrow_backend_shm_get_message(void *ptr,
+                                          const burrow_command_st *cmd)
+{
+  return _message_command((burrow_backend_shm_st *)ptr, cmd, SHM_GET);
+}
+
+/**
+ * Implements burrow_backend_functions_st#update_message
+ */
+static int burrow_backend_shm_update_message(void *ptr,
+                                             const burrow_command_st *cmd)
+{
+  return _message_command((burrow_backend_shm_st *)ptr, cmd, SHM_UPDATE);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_message
+ */
+static int burrow_backend_shm_delete_message(void *ptr,
+                                             const burrow_command_st *cmd)
+{
+  return _message_command((burrow_backend_shm_st *)ptr, cmd, SHM_DELETE);
+}
+
+static int _create_command(burrow_backend_shm_st *self,
+                           const burrow_command_st *cmd,
+                           const burrow_message_st *messages,
+                           size_t message_count)
+{
+  uint32_t now = (uint32_t)time(NULL);
+  shm_queue_st *queue;
+  bool wake;
+  size_t i;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+
+  queue = _queue_get(self, cmd->account, cmd->queue, true);
+  if (!queue)
+    return ENOSPC;
+
+  for (i = 0; i < message_count && !result; i++)
+    result = _store(self, queue, messages[i].message_id, messages[i].body,
+                    messages[i].body_size, messages[i].attributes, now);
+
+  wake = _wake_prepare(self->header, queue);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (wake)
+    _futex_wake(&self->header->wakeups);
+
+  if (!result)
+    result = _commit(self);
+  return result;
+}
+
+/**
+ * Implements burrow_backend_functions_st#create_message
+ */
+static int burrow_backend_shm_create_message(void *ptr,
+                                             const burrow_command_st *cmd)
+{
+  burrow_message_st message;
+
+  message.message_id = cmd->message_id;
+  message.body = cmd->body;
+  message.body_size = cmd->body_size;
+  message.attributes = cmd->attributes;
+
+  return _create_command((burrow_backend_shm_st *)ptr, cmd, &message, 1);
+}
+
+/**
+ * Implements burrow_backend_functions_st#create_messages
+ */
+static int burrow_backend_shm_create_messages(void *ptr,
+                                              const burrow_command_st *cmd)
+{
+  return _create_command((burrow_backend_shm_st *)ptr, cmd, cmd->messages,
+                         cmd->message_count);
+}
+
+/* Whether a queue holds any message not yet expired, reclaiming those that
+   are. Only empty queues are left unlocked to look at. */
+static bool _queue_live(shm_header_st *header, shm_queue_st *queue,
+                        uint32_t now)
+{
+  uint32_t *ring = _ring(queue);
+  uint32_t mask = header->message_count - 1;
+  uint32_t position;
+  bool live = false;
+
+  if (!queue->used || !__atomic_load_n(&queue->count, __ATOMIC_ACQUIRE))
+    return false;
+
+  _queue_lock(header, queue);
+
+  for (position = queue->tail; position != queue->head && !live; position++)
+  {
+    uint32_t slot = ring[position & mask];
+
+    if (slot == SHM_TOMB)
+      continue;
+
+    if (_message(header, slot)->ttl <= now)
+      _message_remove(header, queue, slot);
+    else
+      live = true;
+  }
+
+  _buckets_check(header, queue);
+  pthread_mutex_unlock(&queue->lock);
+  return live;
+}
+
+/* Whether a listing of accounts, or of one account's queues, starts from
+   the first: it has no marker, or the marker names none in use */
+static bool _listing_unmarked(shm_header_st *header,
+                              const burrow_filters_st *filters,
+                              const char *account)
+{
+  uint32_t i;
+
+  if (!filters || !filters->marker)
+    return true;
+
+  for (i = 0; i < header->queue_count; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    if (!queue->used)
+      continue;
+    if (account ? !strcmp(queue->account, account) &&
+                  !strcmp(queue->queue, filters->marker) :
+                  !strcmp(queue->account, filters->marker))
+      return false;
+  }
+
+  return true;
+}
+
+/* Where a listing starts: after the marker, walking every entry in use */
+static bool _listing_started(const burrow_filters_st *filters,
+                             const char *name, bool *started)
+{
+  if (*started)
+    return true;
+
+  /* From the next one on */
+  *started = !strcmp(filters->marker, name);
+  return false;
+}
+
+/* Whether a queue is the first of its account in the table, among those
+   in use, or only those live */
+static bool _account_first(shm_header_st *header, uint32_t index,
+                           uint32_t now, bool live)
+{
+  shm_queue_st *queue = _queue(header, index);
+  uint32_t i;
+
+  for (i = 0; i < index; i++)
+  {
+    shm_queue_st *other = _queue(header, i);
+
+    if (other->used && !strcmp(other->account, queue->account) &&
+        (!live || _queue_live(header, other, now)))
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_accounts
+ */
+static int burrow_backend_shm_get_accounts(void *ptr,
+                                           const burrow_command_st *cmd)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint32_t now = (uint32_t)time(NULL);
+  uint32_t remaining = UINT32_MAX;
+  bool started;
+  shm_header_st *header;
+  uint32_t i;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+  header = self->header;
+
+  if (cmd->filters && (cmd->filters->set & BURROW_FILTERS_LIMIT))
+    remaining = cmd->filters->limit;
+
+  _lock(&header->lock);
+  started = _listing_unmarked(header, cmd->filters, NULL);
+
+  /* Each account once, where its first live queue is in the table */
+  for (i = 0; i < header->queue_count && remaining; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    if (!queue->used ||
+        !_listing_started(cmd->filters, queue->account, &started) ||
+        !_queue_live(header, queue, now) ||
+        !_account_first(header, i, now, true))
+      continue;
+
+    burrow_callback_account(self->burrow, queue->account);
+    remaining--;
+  }
+
+  pthread_mutex_unlock(&header->lock);
+  return 0;
+}
+
+/**
+ * Implements burrow_backend_functions_st#get_queues
+ */
+static int burrow_backend_shm_get_queues(void *ptr,
+                                         const burrow_command_st *cmd)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint32_t now = (uint32_t)time(NULL);
+  uint32_t remaining = UINT32_MAX;
+  bool started;
+  shm_header_st *header;
+  uint32_t i;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+  header = self->header;
+
+  if (cmd->filters && (cmd->filters->set & BURROW_FILTERS_LIMIT))
+    remaining = cmd->filters->limit;
+
+  _lock(&header->lock);
+  started = _listing_unmarked(header, cmd->filters, cmd->account);
+
+  for (i = 0; i < header->queue_count && remaining; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    if (!queue->used || strcmp(queue->account, cmd->account) ||
+        !_listing_started(cmd->filters, queue->queue, &started) ||
+        !_queue_live(header, queue, now))
+      continue;
+
+    burrow_callback_queue(self->burrow, queue->queue);
+    remaining--;
+  }
+
+  pthread_mutex_unlock(&header->lock);
+  return 0;
+}
+
+/* Empties a queue, and frees its entry in the table unless consumers are
+   parked on it */
+static void _queue_delete(shm_header_st *header, shm_queue_st *queue)
+{
+  _queue_lock(header, queue);
+  _queue_clear(header, queue);
+  if (!_queue_waited(queue))
+    queue->used = 0;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_accounts
+ *
+ * The marker and limit count accounts, each deleted with all its queues.
+ */
+static int burrow_backend_shm_delete_accounts(void *ptr,
+                                              const burrow_command_st *cmd)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint32_t remaining = UINT32_MAX;
+  bool started;
+  shm_header_st *header;
+  char account[SHM_NAME_SIZE];
+  uint32_t i, j;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+  header = self->header;
+
+  if (cmd->filters && (cmd->filters->set & BURROW_FILTERS_LIMIT))
+    remaining = cmd->filters->limit;
+
+  _lock(&header->lock);
+  started = _listing_unmarked(header, cmd->filters, NULL);
+
+  for (i = 0; i < header->queue_count && remaining; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    if (!queue->used ||
+        !_listing_started(cmd->filters, queue->account, &started) ||
+        !_account_first(header, i, 0, false))
+      continue;
+
+    /* The name stays in the entry once it's freed, but not once reused */
+    memcpy(account, queue->account, sizeof(account));
+    for (j = i; j < header->queue_count; j++)
+    {
+      shm_queue_st *other = _queue(header, j);
+
+      if (other->used && !strcmp(other->account, account))
+        _queue_delete(header, other);
+    }
+    remaining--;
+  }
+
+  pthread_mutex_unlock(&header->lock);
+  return _commit(self);
+}
+
+/**
+ * Implements burrow_backend_functions_st#delete_queues
+ */
+static int burrow_backend_shm_delete_queues(void *ptr,
+                                            const burrow_command_st *cmd)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint32_t remaining = UINT32_MAX;
+  bool started;
+  shm_header_st *header;
+  uint32_t i;
+  int result;
+
+  if ((result = _attach(self)))
+    return result;
+  header = self->header;
+
+  if (cmd->filters && (cmd->filters->set & BURROW_FILTERS_LIMIT))
+    remaining = cmd->filters->limit;
+
+  _lock(&header->lock);
+  started = _listing_unmarked(header, cmd->filters, cmd->account);
+
+  for (i = 0; i < header->queue_count && remaining; i++)
+  {
+    shm_queue_st *queue = _queue(header, i);
+
+    if (!queue->used || strcmp(queue->account, cmd->account) ||
+        !_listing_started(cmd->filters, queue->queue, &started))
+      continue;
+
+    _queue_delete(header, queue);
+    remaining--;
+  }
+
+  pthread_mutex_unlock(&header->lock);
+  return _commit(self);
+}
+
+/**
+ * Implements burrow_backend_functions_st#process
+ *
+ * Looks again at the queues commands are parked on, finishing those that
+ * now find messages or whose wait has run out, and watches the eventfd
+ * for the rest.
+ */
+static int burrow_backend_shm_process(void *ptr)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  shm_header_st *header = self->header;
+  uint32_t now = (uint32_t)time(NULL);
+  int64_t now_ms = _now_ms();
+  int64_t deadline = INT64_MAX;
+  uint32_t seen;
+  uint32_t i = 0;
+
+  if (!self->wait_count)
+    return 0;
+
+  /* Anything added after this shows as a change from it */
+  seen = __atomic_load_n(&header->wakeups, __ATOMIC_SEQ_CST);
+
+  while (i < self->wait_count)
+  {
+    shm_wait_st *wait = &self->waits[i];
+    shm_queue_st *queue = _queue(header, wait->queue);
+    const burrow_command_st *cmd = wait->cmd;
+    uint32_t matched = 0;
+    int result;
+
+    _queue_lock(header, queue);
+    result = _scan(self, queue, cmd, wait->action, now, &matched);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!result && !matched && now_ms < wait->deadline)
+    {
+      if (wait->deadline < deadline)
+        deadline = wait->deadline;
+      i++;
+      continue;
+    }
+
+    if (matched && !result && wait->action != SHM_GET)
+      result = _commit(self);
+
+    _wait_drop(self, i);
+    burrow_current_command(self->burrow, cmd);
+    _report_flush(self);
+    burrow_internal_command_done(self->burrow, cmd, result);
+  }
+
+  if (!self->wait_count)
+  {
+    _waiter_arm(self, false, 0);
+    return 0;
+  }
+
+  _waiter_arm(self, true, seen);
+  burrow_watch_fd(self->burrow, self->event_fd, BURROW_IOEVENT_READ);
+  burrow_watch_timeout(self->burrow, (int32_t)(deadline - now_ms));
+  return EAGAIN;
+}
+
+/**
+ * Implements burrow_backend_functions_st#event_raised
+ */
+static int burrow_backend_shm_event_raised(void *ptr, int fd,
+                                           burrow_ioevent_t event)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+  uint64_t count;
+
+  (void)event;
+  if (fd != self->event_fd)
+    return EINVAL;
+
+  if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    return errno;
+
+  return 0;
+}
+
+/**
+ * Implements burrow_backend_functions_st#cancel
+ */
+static void burrow_backend_shm_cancel(void *ptr)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+
+  while (self->wait_count)
+    _wait_drop(self, 0);
+
+  if (self->waiter_started)
+    _waiter_arm(self, false, 0);
+}
+
+/**
+ * Sets an option for this backend:
+ *   "name"            the shared memory object the queues are in, shared
+ *                     with every process that opens the same one (shm)
+ *   "path"            the file the queues are in (mmap)
+ *
+ * @param ptr Pointer to the backend object
+ * @param option String name of the option
+ * @param value String value of the option
+ * @return 0 if successful, EINVAL if the option or value is bad.
+ */
+static int burrow_backend_shm_set_option(void *ptr,
+                                         const char *option,
+                                         const char *value)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+
+  if (self->header)
+  {
+    burrow_log_error(self->burrow, "shm: %s set after the region opened",
+                     option);
+    return EINVAL;
+  }
+
+  if (strcmp(option, self->persistent ? "path" : "name") || !value ||
+      !*value || strlen(value) + (value[0] != '/') >= sizeof(self->name) ||
+      (!self->persistent && strlen(value) + (value[0] != '/') > NAME_MAX))
+  {
+    burrow_log_error(self->burrow, "shm: bad option %s", option);
+    return EINVAL;
+  }
+
+  /* shm_open wants a name with one leading slash */
+  if (self->persistent)
+    strcpy(self->name, value);
+  else
+    snprintf(self->name, sizeof(self->name), "%s%s",
+             value[0] == '/' ? "" : "/", value);
+  return 0;
+}
+
+/**
+ * Sets an integer option for this backend. All but "sync" are used only by
+ * the process that creates the region:
+ *   "queues"          most queues at once, across accounts
+ *   "messages"        most messages at once, across queues (rounded up to
+ *                     a power of two)
+ *   "message_size"    largest message body
+ *   "sync"            if nonzero, changes are on disk before commands that
+ *                     make them return (mmap)
+ *
+ * @param ptr Pointer to the backend object
+ * @param option String name of the option
+ * @param value the value
+ * @return 0 if successful, EINVAL if the option or value is bad.
+ */
+static int burrow_backend_shm_set_option_int(void *ptr,
+                                             const char *option,
+                                             int32_t value)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+
+  if (self->persistent && !strcmp(option, "sync"))
+  {
+    self->sync = value != 0;
+    return 0;
+  }
+
+  if (self->header)
+  {
+    burrow_log_error(self->burrow, "shm: %s set after the region opened",
+                     option);
+    return EINVAL;
+  }
+
+  if (!strcmp(option, "queues") && value > 0 && value <= SHM_MAX_QUEUES)
+    self->queue_count = (uint32_t)value;
+  else if (!strcmp(option, "messages") && value > 0 &&
+           value <= SHM_MAX_MESSAGES)
+    self->message_count = _round_up_pow2((uint32_t)value);
+  else if (!strcmp(option, "message_size") && value >= 0 &&
+           value <= SHM_MAX_MESSAGE_SIZE)
+    self->message_size = (uint32_t)value;
+  else
+  {
+    burrow_log_error(self->burrow, "shm: bad option %s", option);
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+static void *_create(void *ptr, burrow_st *burrow, bool persistent)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+
+  if (self == NULL)
+  {
+    self = burrow_malloc(burrow, sizeof(burrow_backend_shm_st));
+    if (!self)
+      return NULL;
+    self->selfallocated = 1;
+  }
+  else
+    self->selfallocated = 0;
+
+  self->burrow = burrow;
+  self->persistent = persistent;
+  self->sync = false;
+  strcpy(self->name, persistent ? SHM_DEFAULT_PATH : SHM_DEFAULT_NAME);
+  self->queue_count = SHM_DEFAULT_QUEUES;
+  self->message_count = SHM_DEFAULT_MESSAGES;
+  self->message_size = SHM_DEFAULT_MESSAGE_SIZE;
+  self->header = NULL;
+  self->fd = -1;
+
+  self->waits = NULL;
+  self->wait_count = 0;
+  self->wait_size = 0;
+
+  self->event_fd = -1;
+  self->waiter_started = false;
+  self->waiter_armed = false;
+  self->waiter_stop = false;
+  self->waiter_seen = 0;
+  pthread_mutex_init(&self->waiter_lock, NULL);
+  pthread_cond_init(&self->waiter_cond, NULL);
+
+  self->reports = NULL;
+  self->reports_size = 0;
+  self->reports_used = 0;
+
+  return self;
+}
+
+/**
+ * Implements burrow_backend_functions_st#create
+ */
+static void *burrow_backend_shm_create(void *ptr, burrow_st *burrow)
+{
+  return _create(ptr, burrow, false);
+}
+
+/**
+ * Implements burrow_backend_functions_st#create
+ */
+static void *burrow_backend_mmap_create(void *ptr, burrow_st *burrow)
+{
+  return _create(ptr, burrow, true);
+}
+
+/**
+ * Implements burrow_backend_functions_st#destroy
+ */
+static void burrow_backend_shm_destroy(void *ptr)
+{
+  burrow_backend_shm_st *self = (burrow_backend_shm_st *)ptr;
+
+  burrow_backend_shm_cancel(self);
+
+  if (self->waiter_started)
+  {
+    pthread_mutex_lock(&self->waiter_lock);
+    self->waiter_stop = true;
+    pthread_cond_signal(&self->waiter_cond);
+    pthread_mutex_unlock(&self->waiter_lock);
+
+    /* It may be in the futex: a bump wakes it, and any other waiter on
+       the region only looks again */
+    __atomic_fetch_add(&self->header->wakeups, 1, __ATOMIC_SEQ_CST);
+    _futex_wake(&self->header->wakeups);
+    pthread_join(self->waiter, NULL);
+  }
+
+  if (self->event_fd != -1)
+    close(self->event_fd);
+  if (self->header)
+  {
+    if (self->persistent)
+      _file_close(self);
+    munmap(self->header, self->header->size);
+  }
+  if (self->fd != -1)
+    close(self->fd);
+
+  pthread_mutex_destroy(&self->waiter_lock);
+  pthread_cond_destroy(&self->waiter_cond);
+  if (self->waits)
+    burrow_free(self->burrow, self->waits);
+  if (self->reports)
+    burrow_free(self->burrow, self->reports);
+
+  if (self->selfallocated)
+    burrow_free(self->burrow, self);
+}
+
+/**
+ * Implements burrow_backend_functions_st#size
+ */
+static size_t burrow_backend_shm_size(void)
+{
+  return sizeof(burrow_backend_shm_st);
+}
+
+burrow_backend_functions_st burrow_backend_shm_functions = {
+  .create = &burrow_backend_shm_create,
+  .destroy = &burrow_backend_shm_destroy,
+  .size = &burrow_backend_shm_size,
+
+  .set_option = &burrow_backend_shm_set_option,
+  .set_option_int = &burrow_backend_shm_set_option_int,
+
+  .cancel = &burrow_backend_shm_cancel,
+  .process = &burrow_backend_shm_process,
+  .event_raised = &burrow_backend_shm_event_raised,
+
+  .get_accounts = &burrow_backend_shm_get_accounts,
+  .delete_accounts = &burrow_backend_shm_delete_accounts,
+
+  .get_queues = &burrow_backend_shm_get_queues,
+  .delete_queues = &burrow_backend_shm_delete_queues,
+
+  .get_messages = &burrow_backend_shm_get_messages,
+  .update_messages = &burrow_backend_shm_update_messages,
+  .delete_messages = &burrow_backend_shm_delete_messages,
+
+  .create_message = &burrow_backend_shm_create_message,
+  .create_messages = &burrow_backend_shm_create_messages,
+  .get_message = &burrow_backend_shm_get_message,
+  .update_message = &burrow_backend_shm_update_message,
+  .delete_message = &burrow_backend_shm_delete_message,
+};
+
+/* The same, in a file */
+burrow_backend_functions_st burrow_backend_mmap_functions = {
+  .create = &burrow_backend_mmap_create,
+  .destroy = &burrow_backend_shm_destroy,
+  .size = &burrow_backend_shm_size,
+
+  .set_option = &burrow_backend_shm_set_option,
+  .set_option_int = &burrow_backend_shm_set_option_int,
+
+  .cancel = &burrow_backend_shm_cancel,
+  .process = &burrow_backend_shm_process,
+  .event_raised = &burrow_backend_shm_event_raised,
+
+  .get_accounts = &burrow_backend_shm_get_accounts,
+  .delete_accounts = &burrow_backend_shm_delete_accounts,
+
+  .get_queues = &burrow_backend_shm_get_queues,
+  .delete_queues = &burrow_backend_shm_delete_queues,
+
+  .get_messages = &burrow_backend_shm_get_messages,
+  .update_messages = &burrow_backend_shm_update_messages,
+  .delete_messages = &burrow_backend_shm_delete_messages,
+
+  .create_message = &burrow_backend_shm_create_message,
+  .create_messages = &burrow_backend_shm_create_messages,
+  .get_message = &burrow_backend_shm_get_message,
+  .update_message = &burrow_backend_shm_update_message,
+  .delete_message = &burrow_backend_shm_delete_message,
+};
+
+#endif /* BURROW_BACKEND_SHM */
@@ -0,0 +1,44 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Shared memory backends, for processes on the same host: shm, in
+ * a shared memory object, and mmap, in a file that outlives them
+ *
+ * An mmap store is kept consistent against processes crashing, not the
+ * host losing power; see shm.c.
+ */
+#ifndef __BURROW_BACKEND_SHM_H
+#define __BURROW_BACKEND_SHM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_EVENTFD_H)
+#define BURROW_BACKEND_SHM 1
+
+extern burrow_backend_functions_st burrow_backend_shm_functions;
+extern burrow_backend_functions_st burrow_backend_mmap_functions;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __BURROW_BACKEND_SHM_H */
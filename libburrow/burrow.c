@@ -61,50 +61,230 @@ void burrow_internal_log(burrow_st *burrow,
 }
 
 
+/* Internal fd watching helpers: */
+
+/* Most events dispatched per poll; any others are raised again next poll */
+#define BURROW_POLL_MAX_EVENTS 64
+
+static short _poll_events(burrow_ioevent_t events)
+{
+  short poll_events = 0;
+
+  if (events & BURROW_IOEVENT_READ)
+    poll_events |= POLLIN;
+  if (events & BURROW_IOEVENT_WRITE)
+    poll_events |= POLLOUT;
+
+  return poll_events;
+}
+
+static burrow_ioevent_t _burrow_events(short poll_events)
+{
+  burrow_ioevent_t events = BURROW_IOEVENT_NONE;
+
+  if (poll_events & POLLIN)
+    events |= BURROW_IOEVENT_READ;
+  if (poll_events & POLLOUT)
+    events |= BURROW_IOEVENT_WRITE;
+
+  return events;
+}
+
+static struct pollfd *_pfds_find(burrow_st *burrow, int fd,
+                                 uint32_t first, uint32_t last)
+{
+  uint32_t i;
+
+  for (i = first; i < last; i++)
+  {
+    if (burrow->pfds[i].fd == fd)
+      return &burrow->pfds[i];
+  }
+
+  return NULL;
+}
+
+static int _pfds_reserve(burrow_st *burrow, const char *caller)
+{
+  struct pollfd *pfds;
+  uint32_t needed;
+
+  needed = burrow->interest_size + burrow->watch_size + 1;
+  if (burrow->pfds_size >= needed)
+    return 0;
+
+  if (needed < burrow->pfds_size * 2)
+    needed = burrow->pfds_size * 2;
+
+  pfds = realloc(burrow->pfds, needed * sizeof(struct pollfd));
+  if (!pfds)
+  {
+    burrow_log_error(burrow, "%s: couldn't reallocate pfds", caller);
+    return ENOMEM;
+  }
+  burrow->pfds = pfds;
+  burrow->pfds_size = needed;
+
+  return 0;
+}
+
+/* Drops the one-shot watch of an fd handed to the user's watch_fd_add_fn,
+   now that its event has been raised */
+static void _unwatch_raised(burrow_st *burrow, int fd)
+{
+  struct pollfd *pfd;
+  uint32_t last;
+
+  last = burrow->interest_size + burrow->watch_size;
+  pfd = _pfds_find(burrow, fd, burrow->interest_size, last);
+  if (!pfd)
+    return;
+
+  *pfd = burrow->pfds[last - 1];
+  burrow->watch_size--;
+  burrow->watch_fd_remove_fn(burrow, fd);
+}
+
+static void _unwatch_all(burrow_st *burrow)
+{
+  uint32_t i;
+
+  if (burrow->watch_fd_remove_fn)
+  {
+    for (i = burrow->interest_size;
+         i < burrow->interest_size + burrow->watch_size; i++)
+      burrow->watch_fd_remove_fn(burrow, burrow->pfds[i].fd);
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  burrow_internal_epoll_cancel(burrow);
+#endif
+  burrow->watch_size = 0;
+  burrow->interest_size = 0;
+}
+
 int burrow_internal_watch_fd(burrow_st *burrow, int fd, burrow_ioevent_t events)
 {
   struct pollfd *pfd;
-  uint32_t needed;
+  short poll_events;
 
-  needed = burrow->watch_size + 1;
+#ifdef HAVE_SYS_EPOLL_H
+  if ((burrow->options & BURROW_OPT_EPOLL) && !burrow->watch_fd_add_fn)
+    return burrow_internal_epoll_watch_fd(burrow, fd, events);
+#endif
+
+  poll_events = _poll_events(events);
+
+  /* Nothing to do if a persistent interest already covers it */
+  pfd = _pfds_find(burrow, fd, 0, burrow->interest_size);
+  if (pfd && (pfd->events & poll_events) == poll_events)
+    return 0;
 
-  if (burrow->pfds_size < needed)
+  /* Watching an fd again only adds to its events */
+  pfd = _pfds_find(burrow, fd, burrow->interest_size,
+                   burrow->interest_size + burrow->watch_size);
+  if (pfd)
   {
-    pfd = realloc(burrow->pfds, needed * sizeof(struct pollfd));
-    if (!pfd)
+    if ((pfd->events | poll_events) != pfd->events)
     {
-      burrow_log_error(burrow,
-                       "burrow_internal_watch_fd: couldn't reallocate pfds");
-      return ENOMEM;
+      pfd->events |= poll_events;
+      if (burrow->watch_fd_modify_fn)
+        burrow->watch_fd_modify_fn(burrow, fd, _burrow_events(pfd->events));
     }
-    burrow->pfds = pfd;
-    burrow->pfds_size = needed;
+    return 0;
   }
 
-  burrow->watch_size = needed;
+  if (_pfds_reserve(burrow, "burrow_internal_watch_fd"))
+    return ENOMEM;
 
-  pfd = &burrow->pfds[needed-1];
+  pfd = &burrow->pfds[burrow->interest_size + burrow->watch_size];
   pfd->fd = fd;
-  pfd->events = 0;
-  if (events & BURROW_IOEVENT_READ)
-    pfd->events |= POLLIN;
-  if (events & BURROW_IOEVENT_WRITE)
-    pfd->events |= POLLOUT;
+  pfd->events = poll_events;
+  pfd->revents = 0;
+  burrow->watch_size++;
+
+  /* Handed over to the user's event loop until burrow_event_raised */
+  if (burrow->watch_fd_add_fn)
+    burrow->watch_fd_add_fn(burrow, fd, events);
 
   return 0;
 }
 
-int burrow_internal_poll_fds(burrow_st *burrow)
+int burrow_internal_watch_fd_interest(burrow_st *burrow,
+                                      int fd,
+                                      burrow_ioevent_t events)
 {
-  int count;
-  uint32_t watch_size;
   struct pollfd *pfd;
-  struct pollfd *last_pfd;
-  
-  if (burrow->watch_size == 0) /* nothing to watch */
+  struct pollfd *last_interest;
+
+#ifdef HAVE_SYS_EPOLL_H
+  if ((burrow->options & BURROW_OPT_EPOLL) && !burrow->watch_fd_fn)
+    return burrow_internal_epoll_interest(burrow, fd, events);
+#endif
+
+  pfd = _pfds_find(burrow, fd, 0, burrow->interest_size);
+
+  if (events == BURROW_IOEVENT_NONE)
+  {
+    if (!pfd)
+      return 0;
+
+    /* Fill the hole with the last interest, and that one's with the
+       last one-shot watch, keeping both ranges contiguous */
+    last_interest = &burrow->pfds[burrow->interest_size - 1];
+    *pfd = *last_interest;
+    if (burrow->watch_size > 0)
+      *last_interest = burrow->pfds[burrow->interest_size +
+                                    burrow->watch_size - 1];
+    burrow->interest_size--;
     return 0;
+  }
 
-  count = poll(burrow->pfds, burrow->watch_size, burrow->timeout);
+  if (pfd)
+  {
+    pfd->events = _poll_events(events);
+    return 0;
+  }
+
+  if (_pfds_reserve(burrow, "burrow_internal_watch_fd_interest"))
+    return ENOMEM;
+
+  /* Make room at the end of the interests by moving the first one-shot
+     watch to the very end */
+  pfd = &burrow->pfds[burrow->interest_size];
+  if (burrow->watch_size > 0)
+    burrow->pfds[burrow->interest_size + burrow->watch_size] = *pfd;
+
+  pfd->fd = fd;
+  pfd->events = _poll_events(events);
+  pfd->revents = 0;
+  burrow->interest_size++;
+
+  return 0;
+}
+
+int burrow_internal_poll_fds(burrow_st *burrow)
+{
+  int raised_fds[BURROW_POLL_MAX_EVENTS];
+  burrow_ioevent_t raised_events[BURROW_POLL_MAX_EVENTS];
+  uint32_t raised_count;
+  struct pollfd *pfd;
+  uint32_t i;
+  int32_t wait_ms;
+  int count;
+
+  if (burrow->watch_size == 0 && burrow->interest_size == 0 &&
+      burrow->watch_timeout < 0)
+    return 0; /* nothing to watch */
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (burrow->options & BURROW_OPT_EPOLL)
+    return burrow_internal_epoll_wait(burrow);
+#endif
+
+  wait_ms = burrow_internal_wait_time(burrow);
+  count = poll(burrow->pfds, burrow->interest_size + burrow->watch_size,
+               wait_ms);
   if (count == -1)
   {
     burrow_log_error(burrow,
@@ -112,127 +292,328 @@ int burrow_internal_poll_fds(burrow_st *burrow)
                      errno);
     return errno;
   }
-  else if (count == 0)
-  {
-    /* Timeout has occurred */
-    burrow_log_info(burrow,
-                    "burrow_internal_poll_fds: timeout %d reached",
-                    burrow->timeout);
-    burrow_cancel(burrow);
-    return ETIMEDOUT;
-  }
+  else if (count == 0) /* timeout, or the backend's wakeup */
+    return burrow_internal_wait_expired(burrow, wait_ms);
 
-  pfd = burrow->pfds;
-  watch_size = burrow->watch_size;
-  /* OSX will return one 'count' value per event raised, not per fd;
+  burrow->idle = 0;
+
+  /* Collect the events before dispatching any, as the backend may change
+     what is watched while handling them.
+     OSX will return one 'count' value per event raised, not per fd;
      this is a bug in its poll implementation. We work around by simply
      checking all fds, otherwise ignoring the count retrieved above */
-  while(pfd < (burrow->pfds + watch_size))
+  raised_count = 0;
+  i = 0;
+  while (i < burrow->interest_size + burrow->watch_size &&
+         raised_count < BURROW_POLL_MAX_EVENTS)
   {
-    if (pfd->revents) /* found a live event */
+    pfd = &burrow->pfds[i];
+    if (!pfd->revents) /* this event not live -- skip it */
     {
-      
-      /* Dispatch it: */
-      burrow_ioevent_t event = BURROW_IOEVENT_NONE;      
-      if (pfd->revents & POLLIN)
-        event |= BURROW_IOEVENT_READ;
-      if (pfd->revents & POLLOUT)
-        event |= BURROW_IOEVENT_WRITE;
-      burrow_event_raised(burrow, pfd->fd, event);
-
-      /* And copy the last pfd to this location */
-      watch_size--;
-      last_pfd = &burrow->pfds[watch_size];
-      
-      /* But not if we're at the last pfd entry */
-      if (last_pfd > pfd)
-      {
-        pfd->fd = last_pfd->fd;
-        pfd->events = last_pfd->events;
-        pfd->revents = last_pfd->revents;
-      }
-      /* Note that we don't increment pfd here, because this location
-         now has new data */
+      i++;
+      continue;
+    }
+
+    raised_fds[raised_count] = pfd->fd;
+    raised_events[raised_count] = _burrow_events(pfd->revents);
+    /* Let the backend find out about errors by doing what it waited for */
+    if (pfd->revents & (POLLERR | POLLHUP))
+      raised_events[raised_count] |= _burrow_events(pfd->events);
+    raised_count++;
+    pfd->revents = 0;
+
+    if (i < burrow->interest_size) /* persistent: stays watched */
+    {
+      i++;
+      continue;
+    }
+
+    /* One-shot: copy the last pfd to this location. Note that we don't
+       increment i here, because this location now has new data */
+    *pfd = burrow->pfds[burrow->interest_size + burrow->watch_size - 1];
+    burrow->watch_size--;
+  }
+
+  for (i = 0; i < raised_count; i++)
+    burrow_event_raised(burrow, raised_fds[i], raised_events[i]);
+
+  return 0;
+}
+
+/* Command queue helpers: */
+
+static burrow_command_st *_command_slot(burrow_st *burrow, uint32_t index)
+{
+  return &burrow->commands[burrow->commands_order[index]];
+}
+
+static burrow_command_st *_command_find(burrow_st *burrow,
+                                        burrow_state_t state)
+{
+  uint32_t i;
+
+  for (i = 0; i < burrow->commands_count; i++)
+  {
+    if (_command_slot(burrow, i)->state == state)
+      return _command_slot(burrow, i);
+  }
+
+  return NULL;
+}
+
+static void _command_set_states(burrow_st *burrow,
+                                burrow_state_t from,
+                                burrow_state_t to,
+                                int result)
+{
+  burrow_command_st *cmd;
+  uint32_t i;
+
+  for (i = 0; i < burrow->commands_count; i++)
+  {
+    cmd = _command_slot(burrow, i);
+    if (cmd->state == from)
+    {
+      cmd->state = to;
+      cmd->result = result;
     }
-    else /* this event not live -- skip it */
-      pfd++;
   }
-  burrow->watch_size = watch_size;
+}
+
+static bool _command_queue_full(burrow_st *burrow, const char *caller)
+{
+  if (burrow->commands_count < burrow->commands_size)
+    return false;
+
+  burrow_log_error(burrow, "%s: command queue full", caller);
+  return true;
+}
+
+static burrow_command_st *_command_push(burrow_st *burrow,
+                                        burrow_command_t command,
+                                        burrow_backend_command_fn *command_fn)
+{
+  burrow_command_st *cmd;
+  uint32_t slot;
+
+  /* Any idle slot will do, the queue not being full */
+  slot = burrow->commands_free;
+  while (burrow->commands[slot].state != BURROW_STATE_IDLE)
+    slot = (slot + 1) % burrow->commands_size;
+  burrow->commands_free = (slot + 1) % burrow->commands_size;
+
+  burrow->commands_order[burrow->commands_count] = slot;
+  cmd = &burrow->commands[slot];
+  burrow->commands_count++;
+
+  cmd->command = command;
+  cmd->command_fn = command_fn;
+  cmd->state = BURROW_STATE_START;
+  cmd->result = 0;
+  cmd->id = burrow->command_next_id++;
+  cmd->account = NULL;
+  cmd->queue = NULL;
+  cmd->message_id = NULL;
+  cmd->body = NULL;
+  cmd->body_size = 0;
+  cmd->filters = NULL;
+  cmd->attributes = NULL;
+  cmd->messages = NULL;
+  cmd->message_count = 0;
+
+  burrow->command_current_id = cmd->id;
+
+  return cmd;
+}
+
+static int _command_submit(burrow_st *burrow)
+{
+  if (burrow->options & BURROW_OPT_AUTOPROCESS)
+    return burrow_process(burrow);
+
   return 0;
 }
 
+/* Frees up the slots of commands that have completed, wherever they are in
+   the queue, keeping the rest in order */
+static void _command_retire(burrow_st *burrow)
+{
+  uint32_t kept = 0;
+  uint32_t i;
+
+  for (i = 0; i < burrow->commands_count; i++)
+  {
+    if (_command_slot(burrow, i)->state != BURROW_STATE_IDLE)
+      burrow->commands_order[kept++] = burrow->commands_order[i];
+  }
+
+  burrow->commands_count = kept;
+}
+
+void burrow_internal_command_done(burrow_st *burrow,
+                                  const burrow_command_st *cmd,
+                                  int result)
+{
+  burrow_command_st *command = (burrow_command_st *)cmd;
+
+  if (command->state != BURROW_STATE_WAITING &&
+      command->state != BURROW_STATE_READY)
+  {
+    burrow_log_warn(burrow,
+                    "burrow_internal_command_done: command %u not in flight",
+                    command->id);
+    return;
+  }
+
+  command->result = result;
+  command->state = BURROW_STATE_FINISH;
+}
+
+int32_t burrow_internal_wait_time(burrow_st *burrow)
+{
+  int32_t wait_ms;
+
+  wait_ms = burrow->timeout - burrow->idle;
+  if (wait_ms < 0)
+    wait_ms = 0;
+  if (burrow->watch_timeout >= 0 && burrow->watch_timeout < wait_ms)
+    wait_ms = burrow->watch_timeout;
+
+  return wait_ms;
+}
+
+int burrow_internal_wait_expired(burrow_st *burrow, int32_t waited)
+{
+  burrow->idle += waited;
+  if (burrow->idle < burrow->timeout)
+  {
+    /* Only the backend's wakeup came due: let it process again */
+    _command_set_states(burrow, BURROW_STATE_WAITING, BURROW_STATE_READY, 0);
+    return 0;
+  }
+
+  burrow_log_info(burrow, "burrow_internal_wait_expired: timeout %d reached",
+                  burrow->timeout);
+  burrow_cancel(burrow);
+  return ETIMEDOUT;
+}
+
 int burrow_process(burrow_st *burrow)
 {
+  burrow_command_st *cmd;
+  uint32_t i;
   int result = 0;
 
   if (burrow->flags & BURROW_FLAG_PROCESSING)/* prevent recursion */
     return EAGAIN; /* parent process loop will pick it up */
 
   burrow->flags |= BURROW_FLAG_PROCESSING;
+  burrow->idle = 0;
 
-  while (burrow->state != BURROW_STATE_IDLE)
+  /* The backend asked to be processed again after a while, and the client
+     may be calling now because that time has come */
+  if (burrow->watch_timeout >= 0)
+    _command_set_states(burrow, BURROW_STATE_WAITING, BURROW_STATE_READY, 0);
+
+  while (burrow->commands_count > 0)
   {
-    switch(burrow->state)
+    /* Kick off commands that are initialized but haven't started; any that
+       would block stay in flight while we move on to the next */
+    for (i = 0; i < burrow->commands_count; i++)
     {
-    case BURROW_STATE_START:
-      /* command is initialized, but hasn't kicked off */
-      result = burrow->cmd.command_fn(burrow->backend_context, &burrow->cmd);
+      cmd = _command_slot(burrow, i);
+      if (cmd->state != BURROW_STATE_START)
+        continue;
+
+      burrow->command_current_id = cmd->id;
+      result = cmd->command_fn(burrow->backend_context, cmd);
       if (result == EAGAIN)
       {
         if (burrow->backend->process == NULL)
         {
           burrow_log_error(burrow, "burrow_process: unexpected EAGAIN");
-          burrow_cancel(burrow);
-          return EINVAL;
+          cmd->result = EINVAL;
+          cmd->state = BURROW_STATE_FINISH;
         }
-        burrow->state = BURROW_STATE_WAITING;
+        else
+          cmd->state = BURROW_STATE_READY; /* let process get it going */
       }
       else /* could be error or OK */
-        burrow->state = BURROW_STATE_FINISH;
-      break;
+      {
+        cmd->result = result;
+        cmd->state = BURROW_STATE_FINISH;
+      }
+    }
 
-    case BURROW_STATE_READY:
-      /* io events have made the backend ready */
+    /* io events (or newly started commands) have made the backend ready */
+    if (_command_find(burrow, BURROW_STATE_READY) != NULL)
+    {
+      _command_set_states(burrow, BURROW_STATE_READY,
+                          BURROW_STATE_WAITING, 0);
+      burrow->watch_timeout = -1;
       result = burrow->backend->process(burrow->backend_context);
-      if (result == EAGAIN)
-        burrow->state = BURROW_STATE_WAITING;
-      else /* could be error or OK */
-        burrow->state = BURROW_STATE_FINISH;
-      break;
+      if (result != EAGAIN) /* nothing left in flight, or backend error */
+        _command_set_states(burrow, BURROW_STATE_WAITING,
+                            BURROW_STATE_FINISH, result);
+    }
 
-    case BURROW_STATE_WAITING: /* backend is blocking on io */
-      if (burrow->watch_size == 0)
-        return EAGAIN; /* waiting is performed by the client */
-      
-      if ((result = burrow_internal_poll_fds(burrow)) != 0)
-        return result; /* error received */
+    /* Report finished commands, freeing their slots first so that
+       the callback may queue new commands in their place */
+    while ((cmd = _command_find(burrow, BURROW_STATE_FINISH)) != NULL)
+    {
+      cmd->state = BURROW_STATE_IDLE; /* we now accept new commands */
+      cmd->command = BURROW_CMD_NONE;
+      result = cmd->result;
+      burrow->command_current_id = cmd->id;
+      _command_retire(burrow);
+
+      /* Note: this could queue up new commands: */
+      burrow_callback_complete(burrow);
+    }
+
+    if (burrow->commands_count == 0)
       break;
 
-    case BURROW_STATE_FINISH: /* backend is done */
-      if (burrow->watch_size > 0)
-        burrow_log_error(burrow, "burrow_process: finishd with active fds");
-        
-      burrow->state = BURROW_STATE_IDLE; /* we now accept new commands */
-      burrow->cmd.command = BURROW_CMD_NONE;
+    if (_command_find(burrow, BURROW_STATE_START) != NULL ||
+        _command_find(burrow, BURROW_STATE_READY) != NULL)
+      continue;
 
-      /* Note: this could update burrow state by calling a command again: */
-      burrow_callback_complete(burrow); 
+    /* Everything left is blocking on io */
+    if (burrow->watch_fd_add_fn)
+    {
+      result = EAGAIN; /* the client's event loop has every fd already */
       break;
-    
-    case BURROW_STATE_IDLE: /* suppress compiler warning */
-    default:
-      burrow_log_warn(burrow, "burrow_process: unexpected or unknown state %x",
-                      burrow->state);
+    }
+
+    if (burrow->watch_fd_fn)
+    {
+      /* The client forgets fds once they are raised, so hand it the
+         persistent interests again */
+      for (i = 0; i < burrow->interest_size; i++)
+        burrow->watch_fd_fn(burrow, burrow->pfds[i].fd,
+                            _burrow_events(burrow->pfds[i].events));
+      result = EAGAIN; /* waiting is performed by the client */
+      break;
+    }
+
+    if (burrow->watch_size == 0 && burrow->interest_size == 0 &&
+        burrow->watch_timeout < 0)
+    {
+      result = EAGAIN;
       break;
     }
+
+    if ((result = burrow_internal_poll_fds(burrow)) != 0)
+      break; /* error received */
   }
   
-  burrow->flags ^= BURROW_FLAG_PROCESSING;
+  burrow->flags &= ~BURROW_FLAG_PROCESSING;
   return result;
 }
 
 int burrow_event_raised(burrow_st *burrow, int fd, burrow_ioevent_t event)
 {
+  burrow_flags_t processing;
   int result;
   
   if (!burrow->backend->event_raised)
@@ -242,16 +623,26 @@ int burrow_event_raised(burrow_st *burrow, int fd, burrow_ioevent_t event)
     return ENOTCONN;
   }
 
-  if (burrow->state != BURROW_STATE_WAITING)
+  if (_command_find(burrow, BURROW_STATE_WAITING) == NULL &&
+      _command_find(burrow, BURROW_STATE_READY) == NULL)
     burrow_log_warn(burrow,
                     "burrow_event_raised: unexpected event, fd %d, event %x",
                     fd, event);
-        
+
+  if (burrow->watch_fd_remove_fn)
+    _unwatch_raised(burrow, fd);
+
+  /* The backend may make callbacks from here, which may queue commands:
+     these are started by the burrow_process call that follows, rather
+     than from within the backend */
+  processing = burrow->flags & BURROW_FLAG_PROCESSING;
+  burrow->flags |= BURROW_FLAG_PROCESSING;
   result = burrow->backend->event_raised(burrow->backend_context, fd, event);
+  burrow->flags = (burrow->flags & ~BURROW_FLAG_PROCESSING) | processing;
   
   if (result == 0)
   {
-    burrow->state = BURROW_STATE_READY;
+    _command_set_states(burrow, BURROW_STATE_WAITING, BURROW_STATE_READY, 0);
     if (burrow->options & BURROW_OPT_AUTOPROCESS)
       return burrow_process(burrow);
   }
@@ -259,25 +650,77 @@ int burrow_event_raised(burrow_st *burrow, int fd, burrow_ioevent_t event)
   {
     burrow_log_error(burrow,
                      "burrow_event_raised: backend returned errno 0x%x",
-                     errno);
+                     result);
     burrow_cancel(burrow);
   }
 
   return result;
 }
 
+int burrow_memory_expire(burrow_st *burrow)
+{
+  if (!burrow->backend->expire)
+    return EINVAL;
+
+  return burrow->backend->expire(burrow->backend_context);
+}
+
+int burrow_memory_usage(burrow_st *burrow, const char *account,
+                        const char *queue, uint64_t *messages,
+                        uint64_t *bytes)
+{
+  if (!burrow->backend->usage || (queue && !account))
+    return EINVAL;
+
+  return burrow->backend->usage(burrow->backend_context, account, queue,
+                                messages, bytes);
+}
+
+int burrow_memory_snapshot(burrow_st *burrow, const char *path)
+{
+  if (!burrow->backend->snapshot || !path)
+    return EINVAL;
+
+  return burrow->backend->snapshot(burrow->backend_context, path);
+}
+
+int burrow_memory_snapshot_wait(burrow_st *burrow, bool block)
+{
+  if (!burrow->backend->snapshot_wait)
+    return EINVAL;
+
+  return burrow->backend->snapshot_wait(burrow->backend_context, block);
+}
+
+int burrow_memory_restore(burrow_st *burrow, const char *path)
+{
+  if (!burrow->backend->restore || !path)
+    return EINVAL;
+
+  return burrow->backend->restore(burrow->backend_context, path);
+}
+
 void burrow_cancel(burrow_st *burrow)
 {
+  uint32_t i;
+
   /* TODO: Does not yet have the semantics as documented */
-  if (burrow->state == BURROW_STATE_IDLE)
+  if (burrow->commands_count == 0)
     return;
 
-  burrow->watch_size = 0;
+  _unwatch_all(burrow);
+  burrow->watch_timeout = -1;
   if (burrow->backend->cancel)
     burrow->backend->cancel(burrow->backend_context);
   
-  burrow->cmd.command = BURROW_CMD_NONE;
-  burrow->cmd.command_fn = NULL;
+  for (i = 0; i < burrow->commands_size; i++)
+  {
+    burrow->commands[i].state = BURROW_STATE_IDLE;
+    burrow->commands[i].command = BURROW_CMD_NONE;
+    burrow->commands[i].command_fn = NULL;
+  }
+  burrow->commands_free = 0;
+  burrow->commands_count = 0;
 }
 
 burrow_st *burrow_create(burrow_st *burrow, const char *backend)
@@ -302,11 +745,19 @@ burrow_st *burrow_create(burrow_st *burrow, const char *backend)
   
   burrow->options = 0;
   burrow->verbose = BURROW_VERBOSE_DEFAULT;
-  burrow->state = BURROW_STATE_IDLE;
   burrow->context = NULL;
 
   burrow->cmd.command_fn = NULL;
   burrow->cmd.command = BURROW_CMD_NONE;
+  burrow->cmd.state = BURROW_STATE_IDLE;
+
+  burrow->commands = &burrow->cmd;
+  burrow->commands_order = &burrow->cmd_order;
+  burrow->commands_size = 1;
+  burrow->commands_count = 0;
+  burrow->commands_free = 0;
+  burrow->command_next_id = 0;
+  burrow->command_current_id = 0;
 
   burrow->malloc_fn   = NULL;
   burrow->free_fn     = NULL;
@@ -316,12 +767,21 @@ burrow_st *burrow_create(burrow_st *burrow, const char *backend)
   burrow->account_fn  = NULL;
   burrow->complete_fn = NULL;
   burrow->watch_fd_fn = NULL;
+  burrow->watch_fd_add_fn    = NULL;
+  burrow->watch_fd_modify_fn = NULL;
+  burrow->watch_fd_remove_fn = NULL;
   burrow->log_fn      = NULL;
   
   burrow->pfds = NULL;
   burrow->pfds_size = 0;
   burrow->watch_size = 0;
+  burrow->interest_size = 0;
+  burrow->watch_timeout = -1;
   burrow->timeout = 10 * 1000; /* ten seconds */
+  burrow->idle = 0;
+  burrow->epoll_fd = -1;
+  burrow->epoll_fds_size = 0;
+  burrow->epoll_fds = NULL;
   
   burrow->attributes_list = NULL;
   burrow->filters_list = NULL;
@@ -338,6 +798,12 @@ void burrow_destroy(burrow_st *burrow)
   burrow->backend->destroy((void*)(burrow+1));
 
   burrow_free(burrow, burrow->pfds);
+#ifdef HAVE_SYS_EPOLL_H
+  burrow_internal_epoll_destroy(burrow);
+#endif
+
+  if (burrow->commands != &burrow->cmd)
+    burrow_free(burrow, burrow->commands);
 
   burrow_log_debug(burrow, "burrow_destroy: attributes list %c= NULL",
                    (burrow->attributes_list == NULL ? '=' : '!')); 
@@ -402,6 +868,68 @@ burrow_options_t burrow_get_options(burrow_st *burrow)
   return burrow->options;
 }
 
+int burrow_set_max_commands(burrow_st *burrow, uint32_t max_commands)
+{
+  burrow_command_st *commands;
+  uint32_t *order;
+  uint32_t i;
+
+  if (max_commands == 0)
+    return EINVAL;
+
+  if (burrow->commands_count > 0)
+  {
+    burrow_log_error(burrow, "burrow_set_max_commands: commands pending");
+    return EINPROGRESS;
+  }
+
+  if (max_commands == 1)
+  {
+    commands = &burrow->cmd;
+    order = &burrow->cmd_order;
+  }
+  else
+  {
+    /* The order of the slots goes in the same piece, after them */
+    commands = burrow_malloc(burrow, max_commands *
+                             (sizeof(burrow_command_st) + sizeof(uint32_t)));
+    if (!commands)
+    {
+      burrow_log_error(burrow,
+                       "burrow_set_max_commands: couldn't allocate queue");
+      return ENOMEM;
+    }
+    order = (uint32_t *)(commands + max_commands);
+  }
+
+  if (burrow->commands != &burrow->cmd)
+    burrow_free(burrow, burrow->commands);
+
+  for (i = 0; i < max_commands; i++)
+  {
+    commands[i].command = BURROW_CMD_NONE;
+    commands[i].command_fn = NULL;
+    commands[i].state = BURROW_STATE_IDLE;
+  }
+
+  burrow->commands = commands;
+  burrow->commands_order = order;
+  burrow->commands_size = max_commands;
+  burrow->commands_free = 0;
+
+  return 0;
+}
+
+uint32_t burrow_get_command_id(burrow_st *burrow)
+{
+  return burrow->command_current_id;
+}
+
+int32_t burrow_get_timeout(burrow_st *burrow)
+{
+  return burrow->watch_timeout;
+}
+
 int burrow_set_backend_option(burrow_st *burrow,
                               const char *option,
                               const char *value)
@@ -452,6 +980,23 @@ void burrow_set_watch_fd_fn(burrow_st *burrow, burrow_watch_fd_fn *callback)
   burrow->watch_fd_fn = callback;
 }
 
+void burrow_set_watch_fd_fns(burrow_st *burrow,
+                             burrow_watch_fd_add_fn *add_fn,
+                             burrow_watch_fd_modify_fn *modify_fn,
+                             burrow_watch_fd_remove_fn *remove_fn)
+{
+  if (!add_fn != !modify_fn || !add_fn != !remove_fn)
+  {
+    burrow_log_warn(burrow,
+                    "burrow_set_watch_fd_fns: all three functions are needed");
+    return;
+  }
+
+  burrow->watch_fd_add_fn = add_fn;
+  burrow->watch_fd_modify_fn = modify_fn;
+  burrow->watch_fd_remove_fn = remove_fn;
+}
+
 void burrow_set_malloc_fn(burrow_st *burrow, burrow_malloc_fn *func)
 {
   burrow->malloc_fn = func;
@@ -474,11 +1019,10 @@ int burrow_get_message(burrow_st *burrow,
                        const char *message_id,
                        const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_get_message: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_get_message"))
     return EINPROGRESS;
-  }
 
   if (!account || !queue || !message_id)
   {
@@ -486,19 +1030,13 @@ int burrow_get_message(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_GET_MESSAGE;
-  burrow->cmd.command_fn = burrow->backend->get_message;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.message_id = message_id;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_GET_MESSAGE, burrow->backend->get_message);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->message_id = message_id;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_create_message(burrow_st *burrow,
@@ -509,11 +1047,10 @@ int burrow_create_message(burrow_st *burrow,
                           size_t body_size,
                           const burrow_attributes_st *attributes)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_create_message: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_create_message"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue || !message_id || !body)
   {
@@ -521,21 +1058,53 @@ int burrow_create_message(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_CREATE_MESSAGE;
-  burrow->cmd.command_fn = burrow->backend->create_message;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.message_id = message_id;
-  burrow->cmd.body = body;
-  burrow->cmd.body_size = body_size;
-  burrow->cmd.attributes = attributes;
+  cmd = _command_push(burrow, BURROW_CMD_CREATE_MESSAGE, burrow->backend->create_message);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->message_id = message_id;
+  cmd->body = body;
+  cmd->body_size = body_size;
+  cmd->attributes = attributes;
   
-  burrow->state = BURROW_STATE_START;
+  return _command_submit(burrow);
+}
 
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
+int burrow_create_messages(burrow_st *burrow,
+                           const char *account,
+                           const char *queue,
+                           const burrow_message_st *messages,
+                           size_t message_count)
+{
+  burrow_command_st *cmd;
+  size_t i;
 
-  return 0;
+  if (_command_queue_full(burrow, "burrow_create_messages"))
+    return EINPROGRESS;
+
+  if (!account || !queue || !messages || message_count == 0)
+  {
+    burrow_log_error(burrow, "burrow_create_messages: invalid parameters");
+    return EINVAL;
+  }
+
+  for (i = 0; i < message_count; i++)
+  {
+    if (!messages[i].message_id || !messages[i].body)
+    {
+      burrow_log_error(burrow,
+                       "burrow_create_messages: invalid message %zu", i);
+      return EINVAL;
+    }
+  }
+
+  cmd = _command_push(burrow, BURROW_CMD_CREATE_MESSAGES,
+                      burrow->backend->create_messages);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->messages = messages;
+  cmd->message_count = message_count;
+
+  return _command_submit(burrow);
 }
 
 int burrow_update_message(burrow_st *burrow,
@@ -545,11 +1114,10 @@ int burrow_update_message(burrow_st *burrow,
                                       const burrow_attributes_st *attributes,
                                       const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_update_message: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_update_message"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue || !message_id || !attributes)
   {
@@ -557,20 +1125,14 @@ int burrow_update_message(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_UPDATE_MESSAGE;
-  burrow->cmd.command_fn = burrow->backend->update_message;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.message_id = message_id;
-  burrow->cmd.attributes = attributes;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_UPDATE_MESSAGE, burrow->backend->update_message);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->message_id = message_id;
+  cmd->attributes = attributes;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_delete_message(burrow_st *burrow,
@@ -579,11 +1141,10 @@ int burrow_delete_message(burrow_st *burrow,
                           const char *message_id,
                           const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_delete_message: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_delete_message"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue || !message_id)
   {
@@ -591,19 +1152,13 @@ int burrow_delete_message(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_DELETE_MESSAGE;
-  burrow->cmd.command_fn = burrow->backend->delete_message;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.message_id = message_id;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_DELETE_MESSAGE, burrow->backend->delete_message);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->message_id = message_id;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_get_messages(burrow_st *burrow,
@@ -611,11 +1166,10 @@ int burrow_get_messages(burrow_st *burrow,
                         const char *queue,
                         const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_get_messages: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_get_messages"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue)
   {
@@ -623,18 +1177,12 @@ int burrow_get_messages(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_GET_MESSAGES;
-  burrow->cmd.command_fn = burrow->backend->get_messages;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_GET_MESSAGES, burrow->backend->get_messages);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 
@@ -643,11 +1191,10 @@ int burrow_delete_messages(burrow_st *burrow,
                            const char *queue,
                            const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_delete_messages: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_delete_messages"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue)
   {
@@ -655,18 +1202,12 @@ int burrow_delete_messages(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_DELETE_MESSAGES;
-  burrow->cmd.command_fn = burrow->backend->delete_messages;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_DELETE_MESSAGES, burrow->backend->delete_messages);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 
@@ -676,11 +1217,10 @@ int burrow_update_messages(burrow_st *burrow,
                            const burrow_attributes_st *attributes,
                            const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_update_messages: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_update_messages"))
     return EINPROGRESS;
-  }
   
   if (!account || !queue || !attributes)
   {
@@ -688,19 +1228,13 @@ int burrow_update_messages(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_UPDATE_MESSAGES;
-  burrow->cmd.command_fn = burrow->backend->update_messages;
-  burrow->cmd.account = account;
-  burrow->cmd.queue = queue;
-  burrow->cmd.filters = filters;
-  burrow->cmd.attributes = attributes;
+  cmd = _command_push(burrow, BURROW_CMD_UPDATE_MESSAGES, burrow->backend->update_messages);
+  cmd->account = account;
+  cmd->queue = queue;
+  cmd->filters = filters;
+  cmd->attributes = attributes;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 
@@ -708,11 +1242,10 @@ int burrow_get_queues(burrow_st *burrow,
                       const char *account,
                       const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_get_queues: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_get_queues"))
     return EINPROGRESS;
-  }
   
   if (!account)
   {
@@ -720,28 +1253,21 @@ int burrow_get_queues(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_GET_QUEUES;
-  burrow->cmd.command_fn = burrow->backend->get_queues;
-  burrow->cmd.account = account;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_GET_QUEUES, burrow->backend->get_queues);
+  cmd->account = account;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_delete_queues(burrow_st *burrow,
                          const char *account,
                          const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_delete_queues: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_delete_queues"))
     return EINPROGRESS;
-  }
   
   if (!account)
   {
@@ -749,55 +1275,35 @@ int burrow_delete_queues(burrow_st *burrow,
     return EINVAL;
   }
   
-  burrow->cmd.command = BURROW_CMD_DELETE_QUEUES;
-  burrow->cmd.command_fn = burrow->backend->delete_queues;
-  burrow->cmd.account = account;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_DELETE_QUEUES, burrow->backend->delete_queues);
+  cmd->account = account;
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_get_accounts(burrow_st *burrow, const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_get_accounts: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_get_accounts"))
     return EINPROGRESS;
-  }
   
-  burrow->cmd.command = BURROW_CMD_GET_ACCOUNTS;
-  burrow->cmd.command_fn = burrow->backend->get_accounts;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_GET_ACCOUNTS, burrow->backend->get_accounts);
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
 
 int burrow_delete_accounts(burrow_st *burrow, const burrow_filters_st *filters)
 {
-  if (burrow->state != BURROW_STATE_IDLE)
-  {
-    burrow_log_error(burrow, "burrow_delete_accounts: burrow not idle");
+  burrow_command_st *cmd;
+
+  if (_command_queue_full(burrow, "burrow_delete_accounts"))
     return EINPROGRESS;
-  }
   
-  burrow->cmd.command = BURROW_CMD_DELETE_ACCOUNTS;
-  burrow->cmd.command_fn = burrow->backend->delete_accounts;
-  burrow->cmd.filters = filters;
+  cmd = _command_push(burrow, BURROW_CMD_DELETE_ACCOUNTS, burrow->backend->delete_accounts);
+  cmd->filters = filters;
   
-  burrow->state = BURROW_STATE_START;
-
-  if (burrow->options & BURROW_OPT_AUTOPROCESS)
-    return burrow_process(burrow);
-
-  return 0;
+  return _command_submit(burrow);
 }
@@ -128,6 +128,47 @@ void burrow_remove_options(burrow_st *burrow, burrow_options_t options);
 BURROW_API
 burrow_options_t burrow_get_options(burrow_st *burrow);
 
+/**
+ * Sets how many commands may be queued on a burrow object at once. Commands
+ * beyond the first are queued and, if the backend supports it, kept in
+ * flight simultaneously by burrow_process; each one invokes the
+ * command-complete callback as it finishes, not necessarily in the order
+ * they were issued. The strings and structures passed to a command must
+ * remain valid until it completes. Defaults to 1, i.e. one command at a time.
+ *
+ * @param burrow Burrow object
+ * @param max_commands Size of the command queue, at least 1
+ * @return 0 on success, EINPROGRESS if commands are pending, EINVAL or ENOMEM
+ */
+BURROW_API
+int burrow_set_max_commands(burrow_st *burrow, uint32_t max_commands);
+
+/**
+ * Returns the id of the command being reported on. Inside the message,
+ * queue, account and command-complete callbacks this is the command the
+ * callback belongs to; elsewhere, the most recently issued command. Ids
+ * increase by one with each command issued.
+ *
+ * @param burrow Burrow object
+ * @return Command id
+ */
+BURROW_API
+uint32_t burrow_get_command_id(burrow_st *burrow);
+
+/**
+ * Returns how long the client's event loop may wait on the watched fds
+ * before calling burrow_process() regardless, for backends that have work
+ * due at a given time (timeouts, retries) rather than on fd activity.
+ * Only meaningful after burrow_process() has returned EAGAIN; the internal
+ * blocking function honors it by itself.
+ *
+ * @param burrow Burrow object
+ * @return Milliseconds until burrow_process() should be called, or -1 if
+ *         only watched fds coming live can make progress
+ */
+BURROW_API
+int32_t burrow_get_timeout(burrow_st *burrow);
+
 /**
  * Sets a string backend option.
  *
@@ -218,6 +259,32 @@ void burrow_set_complete_fn(burrow_st *burrow, burrow_complete_fn *callback);
 BURROW_API
 void burrow_set_watch_fd_fn(burrow_st *burrow, burrow_watch_fd_fn *callback);
 
+/**
+ * Sets the functions used to keep a persistent set of watched file
+ * descriptors, for event loops that register fds once rather than on every
+ * wait (epoll, kqueue, libevent and the like). Backends only report changes
+ * to what they watch: an fd is added once, modified when its events change,
+ * and removed when no longer needed. Fds the backend asks to watch for a
+ * single event are added, then removed once burrow_event_raised() is called
+ * for them.
+ *
+ * While set, these take precedence over burrow_set_watch_fd_fn(), and
+ * burrow_process() returns EAGAIN rather than blocking. All three must be
+ * given together; pass NULL for all of them to go back to the watch_fd
+ * function or the internal blocking function. Only change these while no
+ * commands are in flight.
+ *
+ * @param burrow Burrow object
+ * @param add_fn Pointer to the function that starts watching an fd
+ * @param modify_fn Pointer to the function that changes an fd's events
+ * @param remove_fn Pointer to the function that stops watching an fd
+ */
+BURROW_API
+void burrow_set_watch_fd_fns(burrow_st *burrow,
+                             burrow_watch_fd_add_fn *add_fn,
+                             burrow_watch_fd_modify_fn *modify_fn,
+                             burrow_watch_fd_remove_fn *remove_fn);
+
 /**
  * Sets the malloc function burrow uses to allocate memory. Defaults to malloc.
  *
@@ -243,8 +310,8 @@ void burrow_set_free_fn(burrow_st *burrow, burrow_free_fn *func);
 /**
  * Sets up burrow to issue a create_message command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -265,12 +332,35 @@ int burrow_create_message(burrow_st *burrow,
                           size_t body_size,
                           const burrow_attributes_st *attributes);
 
+/**
+ * Sets up burrow to issue a create_messages command, creating or
+ * overwriting a batch of messages in one queue as a single command. The
+ * command-complete callback fires once, after every message is stored.
+ *
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
+ *
+ * @param burrow Burrow object
+ * @param account Account name
+ * @param queue Queue name
+ * @param messages Array of messages, each with a message id and body
+ * @param message_count Number of messages in the array, at least 1
+ * @return 0 on command completion or an errno value on error, such as
+ *         EINPROGRESS or EINVAL
+ */
+BURROW_API
+int burrow_create_messages(burrow_st *burrow,
+                           const char *account,
+                           const char *queue,
+                           const burrow_message_st *messages,
+                           size_t message_count);
+
 
 /**
  * Sets up burrow to issue an update_message command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -292,8 +382,8 @@ int burrow_update_message(burrow_st *burrow,
 /**
  * Sets up burrow to issue a get_message command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -313,8 +403,8 @@ int burrow_get_message(burrow_st *burrow,
 /**
  * Sets up burrow to issue a delete_message command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -334,8 +424,8 @@ int burrow_delete_message(burrow_st *burrow,
 /**
  * Sets up burrow to issue a get_messages command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -353,8 +443,8 @@ int burrow_get_messages(burrow_st *burrow,
 /**
  * Sets up burrow to issue a delete_messages command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object, non-NULL
  * @param account Account name, non-NULL
@@ -372,8 +462,8 @@ int burrow_delete_messages(burrow_st *burrow,
 /**
  * Sets up burrow to issue an update_messages command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -393,8 +483,8 @@ int burrow_update_messages(burrow_st *burrow,
 /**
  * Sets up burrow to issue a get_queues command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -410,8 +500,8 @@ int burrow_get_queues(burrow_st *burrow,
 /**
  * Sets up burrow to issue a delete_queues command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param account Account name
@@ -427,8 +517,8 @@ int burrow_delete_queues(burrow_st *burrow,
 /**
  * Sets up burrow to issue a get_accounts command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param filters Filters to apply, may be NULL
@@ -441,8 +531,8 @@ int burrow_get_accounts(burrow_st *burrow, const burrow_filters_st *filters);
 /**
  * Sets up burrow to issue a delete_accounts command.
  *
- * If burrow is already issuing a command, this will fail and trigger
- * a warning.
+ * If the command queue is full (see burrow_set_max_commands), this will
+ * fail with EINPROGRESS and trigger a warning.
  *
  * @param burrow Burrow object
  * @param filters Filters to apply, may be NULL
@@ -453,7 +543,7 @@ BURROW_API
 int burrow_delete_accounts(burrow_st *burrow, const burrow_filters_st *filters);
 
 /**
- * Cancels an ongoing command. 
+ * Cancels all queued and ongoing commands.
  * Will trigger a command-complete callback if any command is pending.
  *
  * @param burrow Burrow object
@@ -462,14 +552,14 @@ BURROW_API
 void burrow_cancel(burrow_st *burrow);
 
 /**
- * Begins or continues processing of the current burrow command.
- * If there is no command, returns immediately. If a command completes
+ * Begins or continues processing of the queued burrow commands.
+ * If there is no command, returns immediately. As each command completes
  * inside of burrow_process, the command-complete callback will be
  * invoked, after which point burrow will see if any new command has
- * been issues which it can continue processing.
+ * been issued which it can continue processing.
  *
  * @param burrow Burrow object
- * @return 0 on command completion, EAGAIN if burrow would block,
+ * @return 0 once all commands complete, EAGAIN if burrow would block,
  *         or another error code if an error occurred
  */
 BURROW_API
@@ -487,6 +577,92 @@ int burrow_process(burrow_st *burrow);
 BURROW_API
 int burrow_event_raised(burrow_st *burrow, int fd, burrow_ioevent_t event);
 
+/**
+ * Reclaims the messages whose ttl has run out, with the memory backend.
+ * Each command does this too, so this is only needed to let go of the
+ * memory of expired messages while no command is issued.
+ *
+ * @param burrow Burrow object
+ * @return 0 on success, or EINVAL if burrow's backend doesn't keep its
+ *         messages in memory (only the memory and journal backends do)
+ */
+BURROW_API
+int burrow_memory_expire(burrow_st *burrow);
+
+/**
+ * Returns how many messages the memory backend holds, and how many bytes of
+ * memory they take (ids and bookkeeping included, each rounded up to the
+ * block it is allocated in, but not the room left in blocks not yet
+ * handed out), in a queue, an account, or its whole store. Limits on these
+ * are set with the backend's int options "queue_max_messages",
+ * "queue_max_kbytes", "account_max_messages" and "account_max_kbytes", and
+ * what is done with a message that would go past one with its
+ * "limit_policy" option: "reject" (the default, with ENOSPC), "drop_oldest"
+ * or "drop_expiring".
+ *
+ * @param burrow Burrow object
+ * @param account Account name, or NULL for the whole store
+ * @param queue Queue name, or NULL for the whole account
+ * @param messages Where to put the count of messages, may be NULL
+ * @param bytes Where to put the bytes they take, may be NULL
+ * @return 0 on success, or EINVAL if burrow's backend doesn't keep its
+ *         messages in memory (only the memory and journal backends do)
+ *         or a queue is given without an account
+ */
+BURROW_API
+int burrow_memory_usage(burrow_st *burrow, const char *account,
+                        const char *queue, uint64_t *messages,
+                        uint64_t *bytes);
+
+/**
+ * Starts writing an image of everything the memory backend holds to a
+ * file: every account, queue and message, with when each message expires
+ * and shows again. The image is written by a child process, from a copy of
+ * the store as it is now, so this returns at once and commands go on as
+ * usual meanwhile. The file only appears once the image is complete, and
+ * is replaced if it was there. Only one snapshot is written at a time.
+ *
+ * @param burrow Burrow object
+ * @param path File to write the image to
+ * @return 0 once started, EINPROGRESS if a snapshot is still being
+ *         written, EINVAL if burrow's backend doesn't keep its messages
+ *         in memory (only the memory and journal backends do), or
+ *         another errno value if the child couldn't be started
+ */
+BURROW_API
+int burrow_memory_snapshot(burrow_st *burrow, const char *path);
+
+/**
+ * Finds out how the last snapshot started went, waiting for it to be
+ * written if asked to. Destroying burrow waits for it too.
+ *
+ * @param burrow Burrow object
+ * @param block Whether to wait until the snapshot is written
+ * @return 0 if it was written, or if there was none, EINPROGRESS if it is
+ *         still being written and block is false, or the errno value it
+ *         failed with
+ */
+BURROW_API
+int burrow_memory_snapshot_wait(burrow_st *burrow, bool block);
+
+/**
+ * Replaces what the memory backend holds with an image written by
+ * burrow_memory_snapshot(), on the same machine. Messages that have
+ * expired since are left out; the rest keep their deadlines and order.
+ * The journal backend logs what it then holds as a snapshot of its own,
+ * in place of its log so far.
+ *
+ * @param burrow Burrow object
+ * @param path File the image was written to
+ * @return 0 on success, EINVAL if burrow's backend doesn't keep its
+ *         messages in memory (only the memory and journal backends do) or
+ *         the file holds no image (in which case nothing is changed), or
+ *         another errno value such as ENOMEM, in which case only part of
+ *         the image is loaded
+ */
+BURROW_API
+int burrow_memory_restore(burrow_st *burrow, const char *path);
+
 /**
  * Returns a string describing the verbosity level. Useful for logging.
  *
@@ -32,6 +32,7 @@ extern "C" {
 /* Used internally */
 typedef struct burrow_command_st burrow_command_st;
 typedef struct burrow_backend_functions_st burrow_backend_functions_st;
+typedef struct burrow_epoll_fd_st burrow_epoll_fd_st;
 
 /* Function pointers used for backend communication */
 typedef void *(burrow_backend_create_fn)(void *dest, burrow_st *burrow);
@@ -54,6 +55,18 @@ typedef int (burrow_backend_event_raised_fn)(void *backend,
 typedef int (burrow_backend_command_fn)(void *backend,
                                         const burrow_command_st *command);
 
+/* Optional, for backends that hold their messages in memory */
+typedef int (burrow_backend_expire_fn)(void *backend);
+typedef int (burrow_backend_usage_fn)(void *backend,
+                                      const char *account,
+                                      const char *queue,
+                                      uint64_t *messages,
+                                      uint64_t *bytes);
+typedef int (burrow_backend_snapshot_fn)(void *backend, const char *path);
+typedef int (burrow_backend_snapshot_wait_fn)(void *backend, bool block);
+typedef int (burrow_backend_restore_fn)(void *backend, const char *path);
+
+/* Per-command states; an IDLE command is a free queue slot */
 typedef enum {
   BURROW_STATE_IDLE,
   BURROW_STATE_START,
@@ -77,6 +90,7 @@ typedef enum {
   BURROW_CMD_UPDATE_MESSAGE,
   BURROW_CMD_DELETE_MESSAGE,
   BURROW_CMD_CREATE_MESSAGE,
+  BURROW_CMD_CREATE_MESSAGES,
 
   BURROW_CMD_MAX,
 
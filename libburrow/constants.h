@@ -47,7 +47,9 @@ typedef enum {
 typedef enum {
   BURROW_OPT_AUTOPROCESS  = (1 << 0),
   BURROW_OPT_COPY_STRINGS = (1 << 1), /*!< Not yet implemented */
-  BURROW_OPT_MAX          = (1 << 2)
+  BURROW_OPT_EPOLL        = (1 << 2), /*!< Internal fd watching uses epoll
+                                           where available, else poll */
+  BURROW_OPT_MAX          = (1 << 3)
 } burrow_options_t;
  
 /**
@@ -75,6 +77,7 @@ typedef enum {
 typedef struct burrow_filters_st burrow_filters_st;
 typedef struct burrow_attributes_st burrow_attributes_st;
 typedef struct burrow_st burrow_st;
+typedef struct burrow_message_st burrow_message_st;
 
 /* Function pointers for user callbacks */
 
@@ -166,6 +169,50 @@ typedef void (burrow_watch_fd_fn)(burrow_st *burrow,
                                   int fd,
                                   burrow_ioevent_t event);
 
+/**
+ * Signature for the callback that starts watching a file descriptor.
+ *
+ * Unlike burrow_watch_fd_fn, the interest persists: the fd should be
+ * watched for the given events, and burrow_event_raised() called each time
+ * any of them is ready, until it is changed by burrow_watch_fd_modify_fn or
+ * dropped by burrow_watch_fd_remove_fn.
+ *
+ * See: burrow_set_watch_fd_fns()
+ *
+ * @param burrow Burrow object that is invoking this callback
+ * @param fd Which file descriptor to start watching
+ * @param events Bitmask of which event(s) to watch for
+ */
+typedef void (burrow_watch_fd_add_fn)(burrow_st *burrow,
+                                      int fd,
+                                      burrow_ioevent_t events);
+
+/**
+ * Signature for the callback that changes the events watched on a file
+ * descriptor previously passed to burrow_watch_fd_add_fn.
+ *
+ * See: burrow_set_watch_fd_fns()
+ *
+ * @param burrow Burrow object that is invoking this callback
+ * @param fd Which file descriptor to change
+ * @param events Bitmask of which event(s) to watch for from now on
+ */
+typedef void (burrow_watch_fd_modify_fn)(burrow_st *burrow,
+                                         int fd,
+                                         burrow_ioevent_t events);
+
+/**
+ * Signature for the callback that stops watching a file descriptor
+ * previously passed to burrow_watch_fd_add_fn. The fd may be closed
+ * right after this returns.
+ *
+ * See: burrow_set_watch_fd_fns()
+ *
+ * @param burrow Burrow object that is invoking this callback
+ * @param fd Which file descriptor to stop watching
+ */
+typedef void (burrow_watch_fd_remove_fn)(burrow_st *burrow, int fd);
+
 /**
  * Signature for a user-overridable malloc function.
  *
@@ -0,0 +1,326 @@
+/*
+ * libburrow -- Burrow Client Library
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief epoll-based internal fd watching, used with BURROW_OPT_EPOLL
+ *
+ * Unlike the poll engine, which hands its whole pollfd array to the kernel
+ * for every wait, fds stay in the epoll set once added. One-shot watches are
+ * registered EPOLLONESHOT, so that an fd reports at most one event per
+ * watch; watching it again re-arms it with a single EPOLL_CTL_MOD.
+ * Persistent interests (burrow_watch_fd_add) are level-triggered and cost
+ * an epoll_ctl only when they change.
+ */
+
+#include "common.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Most events collected per epoll_wait */
+#define BURROW_EPOLL_MAX_EVENTS 64
+
+static uint32_t _epoll_events(burrow_ioevent_t events, bool oneshot)
+{
+  uint32_t epoll_events = oneshot ? EPOLLONESHOT : 0;
+
+  if (events & BURROW_IOEVENT_READ)
+    epoll_events |= EPOLLIN;
+  if (events & BURROW_IOEVENT_WRITE)
+    epoll_events |= EPOLLOUT;
+
+  return epoll_events;
+}
+
+static int _epoll_ctl(burrow_st *burrow, int op, int fd,
+                      burrow_ioevent_t events, bool oneshot)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = _epoll_events(events, oneshot);
+  event.data.fd = fd;
+
+  return epoll_ctl(burrow->epoll_fd, op, fd, &event);
+}
+
+/* Finds the table entry for fd, creating the epoll set and growing the
+   table as needed */
+static burrow_epoll_fd_st *_epoll_entry(burrow_st *burrow, int fd,
+                                        const char *caller)
+{
+  burrow_epoll_fd_st *entry;
+  uint32_t needed;
+
+  if (burrow->epoll_fd == -1)
+  {
+    burrow->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (burrow->epoll_fd == -1)
+    {
+      burrow_log_error(burrow, "%s: epoll_create1: 0x%x", caller, errno);
+      return NULL;
+    }
+  }
+
+  needed = (uint32_t)fd + 1;
+  if (burrow->epoll_fds_size < needed)
+  {
+    if (needed < burrow->epoll_fds_size * 2)
+      needed = burrow->epoll_fds_size * 2;
+
+    entry = realloc(burrow->epoll_fds, needed * sizeof(burrow_epoll_fd_st));
+    if (!entry)
+    {
+      burrow_log_error(burrow, "%s: couldn't reallocate epoll_fds", caller);
+      errno = ENOMEM;
+      return NULL;
+    }
+    memset(entry + burrow->epoll_fds_size, 0,
+           (needed - burrow->epoll_fds_size) * sizeof(burrow_epoll_fd_st));
+    burrow->epoll_fds = entry;
+    burrow->epoll_fds_size = needed;
+  }
+
+  return &burrow->epoll_fds[fd];
+}
+
+/* Registers fd with the given events, whether or not it is in the set */
+static int _epoll_register(burrow_st *burrow, burrow_epoll_fd_st *entry,
+                           int fd, burrow_ioevent_t events, bool oneshot,
+                           const char *caller)
+{
+  int result;
+
+  if (entry->registered)
+  {
+    result = _epoll_ctl(burrow, EPOLL_CTL_MOD, fd, events, oneshot);
+    /* The fd was closed (dropping it from the set) and its number reused */
+    if (result == -1 && errno == ENOENT)
+      result = _epoll_ctl(burrow, EPOLL_CTL_ADD, fd, events, oneshot);
+  }
+  else
+  {
+    result = _epoll_ctl(burrow, EPOLL_CTL_ADD, fd, events, oneshot);
+    if (result == -1 && errno == EEXIST)
+      result = _epoll_ctl(burrow, EPOLL_CTL_MOD, fd, events, oneshot);
+  }
+
+  if (result == -1)
+  {
+    burrow_log_error(burrow, "%s: epoll_ctl fd %d: 0x%x", caller, fd, errno);
+    entry->registered = false;
+    return errno;
+  }
+
+  entry->registered = true;
+  entry->events = (uint8_t)events;
+
+  return 0;
+}
+
+int burrow_internal_epoll_watch_fd(burrow_st *burrow,
+                                   int fd,
+                                   burrow_ioevent_t events)
+{
+  burrow_epoll_fd_st *entry;
+  int result;
+
+  if (fd < 0)
+    return EINVAL;
+
+  entry = _epoll_entry(burrow, fd, "burrow_internal_epoll_watch_fd");
+  if (!entry)
+    return errno;
+
+  /* Already waiting on everything asked for: nothing to tell the kernel */
+  if ((entry->armed || entry->persistent) &&
+      (entry->events & events) == events)
+    return 0;
+
+  if (entry->armed || entry->persistent)
+    events |= entry->events;
+
+  result = _epoll_register(burrow, entry, fd, events, !entry->persistent,
+                           "burrow_internal_epoll_watch_fd");
+  if (result)
+    return result;
+
+  /* A persistent fd stays armed; the extra events simply join it */
+  if (!entry->armed && !entry->persistent)
+  {
+    entry->armed = true;
+    burrow->watch_size++;
+  }
+
+  return 0;
+}
+
+int burrow_internal_epoll_interest(burrow_st *burrow,
+                                   int fd,
+                                   burrow_ioevent_t events)
+{
+  burrow_epoll_fd_st *entry;
+  int result;
+
+  if (fd < 0)
+    return EINVAL;
+
+  if (events == BURROW_IOEVENT_NONE)
+  {
+    if ((uint32_t)fd >= burrow->epoll_fds_size)
+      return 0;
+
+    entry = &burrow->epoll_fds[fd];
+    if (!entry->persistent)
+      return 0;
+
+    /* Dropped rather than disarmed, as the backend may close it next */
+    epoll_ctl(burrow->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    entry->registered = false;
+    entry->persistent = false;
+    burrow->interest_size--;
+    return 0;
+  }
+
+  entry = _epoll_entry(burrow, fd, "burrow_internal_epoll_interest");
+  if (!entry)
+    return errno;
+
+  if (entry->persistent && entry->events == events)
+    return 0;
+
+  result = _epoll_register(burrow, entry, fd, events, false,
+                           "burrow_internal_epoll_interest");
+  if (result)
+    return result;
+
+  /* Any one-shot watch is folded into the persistent interest */
+  if (entry->armed)
+  {
+    entry->armed = false;
+    burrow->watch_size--;
+  }
+
+  if (!entry->persistent)
+  {
+    entry->persistent = true;
+    burrow->interest_size++;
+  }
+
+  return 0;
+}
+
+int burrow_internal_epoll_wait(burrow_st *burrow)
+{
+  struct epoll_event events[BURROW_EPOLL_MAX_EVENTS];
+  burrow_ioevent_t raised[BURROW_EPOLL_MAX_EVENTS];
+  burrow_epoll_fd_st *entry;
+  int32_t wait_ms;
+  int count;
+  int i;
+
+  if (burrow->watch_size == 0 && burrow->interest_size == 0 &&
+      burrow->watch_timeout < 0)
+    return 0; /* nothing to watch */
+
+  wait_ms = burrow_internal_wait_time(burrow);
+  if (burrow->epoll_fd == -1) /* only the backend's wakeup to wait for */
+    count = poll(NULL, 0, wait_ms);
+  else
+    count = epoll_wait(burrow->epoll_fd, events, BURROW_EPOLL_MAX_EVENTS,
+                       wait_ms);
+  if (count == -1)
+  {
+    burrow_log_error(burrow,
+                     "burrow_internal_epoll_wait: epoll_wait: error 0x%x",
+                     errno);
+    return errno;
+  }
+  else if (count == 0) /* timeout, or the backend's wakeup */
+    return burrow_internal_wait_expired(burrow, wait_ms);
+
+  burrow->idle = 0;
+
+  /* Work out every event and disarm one-shot fds first: dispatching may
+     change what is watched */
+  for (i = 0; i < count; i++)
+  {
+    uint32_t epoll_events = events[i].events;
+
+    entry = &burrow->epoll_fds[events[i].data.fd];
+    raised[i] = BURROW_IOEVENT_NONE;
+    if (epoll_events & EPOLLIN)
+      raised[i] |= BURROW_IOEVENT_READ;
+    if (epoll_events & EPOLLOUT)
+      raised[i] |= BURROW_IOEVENT_WRITE;
+    /* Let the backend find out about errors by doing what it waited for */
+    if (epoll_events & (EPOLLERR | EPOLLHUP))
+      raised[i] |= (burrow_ioevent_t)entry->events;
+
+    if (entry->armed)
+    {
+      entry->armed = false;
+      burrow->watch_size--;
+    }
+  }
+
+  for (i = 0; i < count; i++)
+    burrow_event_raised(burrow, events[i].data.fd, raised[i]);
+
+  return 0;
+}
+
+void burrow_internal_epoll_cancel(burrow_st *burrow)
+{
+  burrow_epoll_fd_st *entry;
+  uint32_t fd;
+
+  for (fd = 0; fd < burrow->epoll_fds_size &&
+       burrow->watch_size + burrow->interest_size > 0; fd++)
+  {
+    entry = &burrow->epoll_fds[fd];
+    if (!entry->armed && !entry->persistent)
+      continue;
+
+    /* Dropped rather than disarmed, as the backend may close it next */
+    epoll_ctl(burrow->epoll_fd, EPOLL_CTL_DEL, (int)fd, NULL);
+    if (entry->armed)
+      burrow->watch_size--;
+    if (entry->persistent)
+      burrow->interest_size--;
+    entry->registered = false;
+    entry->armed = false;
+    entry->persistent = false;
+  }
+}
+
+void burrow_internal_epoll_destroy(burrow_st *burrow)
+{
+  if (burrow->epoll_fd != -1)
+    close(burrow->epoll_fd);
+
+  burrow->epoll_fd = -1;
+  free(burrow->epoll_fds);
+  burrow->epoll_fds = NULL;
+  burrow->epoll_fds_size = 0;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
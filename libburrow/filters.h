@@ -247,8 +247,9 @@ void burrow_filters_unset_detail(burrow_filters_st *filters);
 
 
 /**
- * Sets the marker filter. Note: If marker_id is NULL, then marker will
- * be unset.
+ * Sets the marker filter. Listings start after the account, queue or
+ * message it names, or from the first if it names none there. Note: If
+ * marker_id is NULL, then marker will be unset.
  *
  * @param filters filters struct
  * @param marker_id null-terminated marker-id
@@ -53,6 +53,23 @@ void burrow_internal_log(burrow_st *burrow,
 BURROW_LOCAL
 int burrow_internal_watch_fd(burrow_st *burrow, int fd, burrow_ioevent_t evnts);
 
+/**
+ * Default for the watch_fd_add, modify and remove functions, if the user
+ * hasn't set them. Keeps the persistent interest set that the internal
+ * blocking function waits on, or that is handed to the user's watch_fd_fn
+ * whenever burrow_process would block.
+ *
+ * @param burrow Burrow object
+ * @param fd Which FD to change
+ * @param events Which events to watch for from now on, or
+ *        BURROW_IOEVENT_NONE to stop watching it
+ * @return 0 on success, ENOMEM on memory error
+ */
+BURROW_LOCAL
+int burrow_internal_watch_fd_interest(burrow_st *burrow,
+                                      int fd,
+                                      burrow_ioevent_t events);
+
 /**
  * Kicks off an blocking for any fds currently being watched internal
  * to the burrow structure.
@@ -63,4 +80,96 @@ int burrow_internal_watch_fd(burrow_st *burrow, int fd, burrow_ioevent_t evnts);
 BURROW_LOCAL
 int burrow_internal_poll_fds(burrow_st *burrow);
 
+/**
+ * How long the internal blocking functions may wait for fds: the rest of
+ * the burrow timeout, or less if the backend wants processing sooner.
+ *
+ * @param burrow Burrow object
+ * @return Milliseconds to wait
+ */
+BURROW_LOCAL
+int32_t burrow_internal_wait_time(burrow_st *burrow);
+
+/**
+ * Called by the internal blocking functions when a wait of
+ * burrow_internal_wait_time() ended without any fd coming live. Either
+ * readies the commands in flight for the backend's wakeup, or cancels them
+ * once the burrow timeout is reached.
+ *
+ * @param burrow Burrow object
+ * @param waited Milliseconds just waited
+ * @return 0 on wakeup, ETIMEDOUT on timeout
+ */
+BURROW_LOCAL
+int burrow_internal_wait_expired(burrow_st *burrow, int32_t waited);
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * burrow_internal_watch_fd for the epoll engine. The fd is added to a
+ * persistent epoll set on first use and re-armed afterwards.
+ *
+ * @param burrow Burrow object
+ * @param fd Which FD to watch
+ * @param events Which events to watch for
+ * @return 0 on success, ENOMEM or epoll errno on error
+ */
+BURROW_LOCAL
+int burrow_internal_epoll_watch_fd(burrow_st *burrow,
+                                   int fd,
+                                   burrow_ioevent_t events);
+
+/**
+ * burrow_internal_watch_fd_interest for the epoll engine. The fd stays
+ * armed (level-triggered) until its interest is changed or removed.
+ *
+ * @param burrow Burrow object
+ * @param fd Which FD to change
+ * @param events Which events to watch for, or BURROW_IOEVENT_NONE
+ * @return 0 on success, ENOMEM or epoll errno on error
+ */
+BURROW_LOCAL
+int burrow_internal_epoll_interest(burrow_st *burrow,
+                                   int fd,
+                                   burrow_ioevent_t events);
+
+/**
+ * burrow_internal_poll_fds for the epoll engine.
+ *
+ * @param burrow Burrow object
+ * @return 0 on success, appropriate errno on error
+ */
+BURROW_LOCAL
+int burrow_internal_epoll_wait(burrow_st *burrow);
+
+/**
+ * Stops watching every armed or persistent fd, as burrow_cancel requires.
+ *
+ * @param burrow Burrow object
+ */
+BURROW_LOCAL
+void burrow_internal_epoll_cancel(burrow_st *burrow);
+
+/**
+ * Releases the epoll fd and interest table.
+ *
+ * @param burrow Burrow object
+ */
+BURROW_LOCAL
+void burrow_internal_epoll_destroy(burrow_st *burrow);
+#endif
+
+/**
+ * Called by backends to report that a command which previously returned
+ * EAGAIN has finished. The command-complete callback will be invoked for it
+ * from within burrow_process.
+ *
+ * @param burrow Burrow object
+ * @param cmd The finished command
+ * @param result 0 on success, errno value on error
+ */
+BURROW_LOCAL
+void burrow_internal_command_done(burrow_st *burrow,
+                                  const burrow_command_st *cmd,
+                                  int result);
+
 #endif /* __BURROW_INTERNAL_H */
\ No newline at end of file
@@ -82,6 +82,20 @@ static inline void burrow_callback_complete(burrow_st *burrow)
     burrow->complete_fn(burrow);
 }
 
+/**
+ * Inline helper for backends with several commands in flight. Marks which
+ * command the callbacks that follow belong to, as reported to the user by
+ * burrow_get_command_id().
+ *
+ * @param burrow Burrow object
+ * @param cmd Command about to be reported on
+ */
+static inline void burrow_current_command(burrow_st *burrow,
+                                          const burrow_command_st *cmd)
+{
+  burrow->command_current_id = cmd->id;
+}
+
 /**
  * Inline wrapper for either calling the user's watch_fd function or
  * the internal burrow watch_fd function. Called to notify the user or
@@ -95,12 +109,82 @@ static inline void burrow_watch_fd(burrow_st *burrow,
                                    int fd,
                                    burrow_ioevent_t events)
 {
-  if (burrow->watch_fd_fn)
+  if (burrow->watch_fd_fn && !burrow->watch_fd_add_fn)
     burrow->watch_fd_fn(burrow, fd, events);
   else
     burrow_internal_watch_fd(burrow, fd, events);
 }
 
+/**
+ * Inline wrapper for either calling the user's watch_fd_add function or
+ * the internal burrow one. Called by backends to start watching an fd
+ * until burrow_watch_fd_remove is called for it.
+ *
+ * @param burrow Burrow object
+ * @param fd File descriptor
+ * @param events Events to watch for
+ */
+static inline void burrow_watch_fd_add(burrow_st *burrow,
+                                       int fd,
+                                       burrow_ioevent_t events)
+{
+  if (burrow->watch_fd_add_fn)
+    burrow->watch_fd_add_fn(burrow, fd, events);
+  else
+    burrow_internal_watch_fd_interest(burrow, fd, events);
+}
+
+/**
+ * Inline wrapper for either calling the user's watch_fd_modify function or
+ * the internal burrow one. Called by backends when the events they need on
+ * an fd previously passed to burrow_watch_fd_add change.
+ *
+ * @param burrow Burrow object
+ * @param fd File descriptor
+ * @param events Events to watch for from now on
+ */
+static inline void burrow_watch_fd_modify(burrow_st *burrow,
+                                          int fd,
+                                          burrow_ioevent_t events)
+{
+  if (burrow->watch_fd_modify_fn)
+    burrow->watch_fd_modify_fn(burrow, fd, events);
+  else
+    burrow_internal_watch_fd_interest(burrow, fd, events);
+}
+
+/**
+ * Inline wrapper for either calling the user's watch_fd_remove function or
+ * the internal burrow one. Called by backends to stop watching an fd
+ * previously passed to burrow_watch_fd_add, before closing it.
+ *
+ * @param burrow Burrow object
+ * @param fd File descriptor
+ */
+static inline void burrow_watch_fd_remove(burrow_st *burrow, int fd)
+{
+  if (burrow->watch_fd_remove_fn)
+    burrow->watch_fd_remove_fn(burrow, fd);
+  else
+    burrow_internal_watch_fd_interest(burrow, fd, BURROW_IOEVENT_NONE);
+}
+
+/**
+ * Called by backends from their process function, before returning EAGAIN,
+ * when they must be processed again within a given time even if no watched
+ * fd comes live. The shortest time asked for during the call wins.
+ *
+ * @param burrow Burrow object
+ * @param timeout Milliseconds until processing is needed
+ */
+static inline void burrow_watch_timeout(burrow_st *burrow, int32_t timeout)
+{
+  if (timeout < 0)
+    timeout = 0;
+  if (burrow->watch_timeout < 0 || timeout < burrow->watch_timeout)
+    burrow->watch_timeout = timeout;
+}
+
 /**
  * Inline wrapper to invoke the appropriate user supplied/internal malloc.
  *
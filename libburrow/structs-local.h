@@ -29,10 +29,18 @@
 extern "C" {
 #endif
 
+/**
+ * A command queued on the frontend. Backends receive a pointer to one in
+ * each command function; if that function returns EAGAIN, the pointer
+ * stays valid until the command is reported done or canceled.
+ */
 struct burrow_command_st
 {
   burrow_command_t command;
   burrow_backend_command_fn *command_fn;
+  burrow_state_t state;
+  int result;
+  uint32_t id;
   const char *account;
   const char *queue;
   const char *message_id;
@@ -40,6 +48,8 @@ struct burrow_command_st
   size_t body_size;
   const burrow_filters_st *filters;
   const burrow_attributes_st *attributes;
+  const burrow_message_st *messages;
+  size_t message_count;
 };
 
 /**
@@ -95,7 +105,8 @@ struct burrow_backend_functions_st
 
   /**
    * Called when the user requests all pending activity to be canceled.
-   * The backend should be in a good but idle state after this call.
+   * The backend should be in a good but idle state after this call, and
+   * must drop any command pointers it is holding on to.
    * All previously requested watch-fds will no longer be watched after
    * this call.
    *
@@ -104,22 +115,32 @@ struct burrow_backend_functions_st
   burrow_backend_cancel_fn *cancel;
   
   /**
-   * Called when the user wants the backend to continue processing whichever
-   * command last returned EAGAIN.
+   * Called when the user wants the backend to continue processing the
+   * commands that returned EAGAIN. Several such commands may be in flight
+   * at once; the backend reports each one that finishes by calling
+   * burrow_internal_command_done(), and should call burrow_current_command()
+   * before invoking any callbacks on behalf of that command.
    *
    * Backends SHOULD NOT block; if a backend would block, it should instead
-   * call burrow_watch_fd() one or more times and return EAGAIN.
+   * call burrow_watch_fd() one or more times and return EAGAIN. Backends
+   * that keep fds open across calls should rather report only changes to
+   * what they watch, with burrow_watch_fd_add(), burrow_watch_fd_modify()
+   * and burrow_watch_fd_remove(). Backends with work due at a given time
+   * should also call burrow_watch_timeout().
    *
    * @param ptr pointer to backend struct
-   * @return 0 on command completion, EAGAIN on wouldblock, or any other
-   *         errno constant on error
+   * @return 0 when no more commands are in flight (any not yet reported
+   *         are considered complete), EAGAIN on wouldblock, or any other
+   *         errno constant on error, which fails all commands in flight
    */
   burrow_backend_process_fn *process;
   
   /**
    * Called when an event previously watched by calling burrow_watch_fd
-   * comes live. Processing should not occur at this stage, only within
-   * the backend's process function.
+   * (or burrow_watch_fd_add) comes live. The backend may do its io here,
+   * and make callbacks for results as they arrive (calling
+   * burrow_current_command() first), but commands are only reported done
+   * from within the backend's process function.
    *
    * @param ptr pointer to backend struct
    * @param fd file descriptor that came live
@@ -299,6 +320,79 @@ struct burrow_backend_functions_st
    * @return 0 on success, EAGAIN if would block, any other errors otherwise
    */
   burrow_backend_command_fn *create_message;
+
+  /**
+   * Called when the user wishes to create/overwrite a batch of messages
+   * in a given account and queue, each optionally with its own attributes.
+   * The command completes once all of them have been stored.
+   *
+   * Incoming, the following is guaranteed:
+   *   cmd->account WILL be non-NULL
+   *   cmd->queue WILL be non-NULL
+   *   cmd->messages WILL be non-NULL, each with non-NULL message_id and body
+   *   cmd->message_count WILL be at least 1
+   *
+   * @param ptr Pointer to backend context
+   * @param cmd Command structure
+   * @return 0 on success, EAGAIN if would block, any other errors otherwise
+   */
+  burrow_backend_command_fn *create_messages;
+
+  /**
+   * The rest are optional, and only set by backends that hold messages in
+   * memory; the functions using them return EINVAL for a backend without.
+   */
+
+  /**
+   * Called for burrow_memory_expire(), to reclaim expired messages.
+   *
+   * @param ptr Pointer to backend context
+   * @return 0 on success, any errno otherwise
+   */
+  burrow_backend_expire_fn *expire;
+
+  /**
+   * Called for burrow_memory_usage().
+   *
+   * Incoming, the following is guaranteed:
+   *   queue WILL be NULL if account is
+   *
+   * @param ptr Pointer to backend context
+   * @param account Account name, or NULL for the whole store
+   * @param queue Queue name, or NULL for the whole account
+   * @param messages Where to put the count of messages, may be NULL
+   * @param bytes Where to put the bytes they take, may be NULL
+   * @return 0 on success, any errno otherwise
+   */
+  burrow_backend_usage_fn *usage;
+
+  /**
+   * Called for burrow_memory_snapshot().
+   *
+   * @param ptr Pointer to backend context
+   * @param path File to write the image to, non-NULL
+   * @return 0 once started, any errno otherwise
+   */
+  burrow_backend_snapshot_fn *snapshot;
+
+  /**
+   * Called for burrow_memory_snapshot_wait().
+   *
+   * @param ptr Pointer to backend context
+   * @param block Whether to wait until the snapshot is written
+   * @return 0 if it was written or there was none, EINPROGRESS, or the
+   *         errno it failed with
+   */
+  burrow_backend_snapshot_wait_fn *snapshot_wait;
+
+  /**
+   * Called for burrow_memory_restore().
+   *
+   * @param ptr Pointer to backend context
+   * @param path File the image was written to, non-NULL
+   * @return 0 on success, any errno otherwise
+   */
+  burrow_backend_restore_fn *restore;
 };
 
 /* Public */
@@ -331,16 +425,38 @@ struct burrow_filters_st
   burrow_filters_st *prev;
 };
 
+/**
+ * What the epoll engine knows about one fd of its interest set.
+ */
+struct burrow_epoll_fd_st
+{
+  uint8_t events;  /* burrow_ioevent_t last registered */
+  bool registered; /* fd is in the epoll set */
+  bool armed;      /* watched, and its event not yet raised */
+  bool persistent; /* added by burrow_watch_fd_add: stays armed */
+};
+
 struct burrow_st
 {
   /* Frontend state */
   burrow_options_t options;
   burrow_flags_t flags;
   burrow_verbose_t verbose;
-  burrow_state_t state;
 
-  /* Current command structure */
+  /* Command queue: commands_size slots, which stay put while their
+     commands are pending, as backends keep pointers to them. The slots of
+     the commands_count pending ones are listed in commands_order, oldest
+     first, so that one completing anywhere in the queue frees its slot at
+     once. Points at cmd and cmd_order while the size is 1. */
+  burrow_command_st *commands;
+  uint32_t *commands_order;
+  uint32_t commands_size;
+  uint32_t commands_count;
+  uint32_t commands_free;  /* where to look for a free slot first */
+  uint32_t command_next_id;
+  uint32_t command_current_id;
   burrow_command_st cmd;
+  uint32_t cmd_order;
   
   /* User callbacks & context */
   void *context;
@@ -351,6 +467,9 @@ struct burrow_st
   burrow_log_fn *log_fn;
   burrow_complete_fn *complete_fn;
   burrow_watch_fd_fn *watch_fd_fn;
+  burrow_watch_fd_add_fn *watch_fd_add_fn;
+  burrow_watch_fd_modify_fn *watch_fd_modify_fn;
+  burrow_watch_fd_remove_fn *watch_fd_remove_fn;
   
   burrow_malloc_fn *malloc_fn;
   burrow_free_fn *free_fn;
@@ -359,11 +478,21 @@ struct burrow_st
   burrow_backend_functions_st *backend;
   void *backend_context;
   
-  /* Built-in FD polling */
+  /* Built-in FD polling. pfds holds the interest_size persistent fds
+     first, then the watch_size one-shot ones. */
   uint32_t watch_size;
+  uint32_t interest_size;
+  int32_t watch_timeout; /* ms until the backend wants processing, or -1 */
   int32_t timeout;
+  int32_t idle; /* ms waited without any fd coming live */
   uint32_t pfds_size;
   struct pollfd *pfds;
+
+  /* epoll engine (BURROW_OPT_EPOLL): fds stay in the set between waits,
+     indexed by fd in epoll_fds */
+  int epoll_fd;
+  uint32_t epoll_fds_size;
+  burrow_epoll_fd_st *epoll_fds;
   
   /* Managed objects */
   burrow_attributes_st *attributes_list;
@@ -50,6 +50,18 @@ struct burrow_filters_st;
  */
 struct burrow_st;
 
+/**
+ * @struct burrow_message_st
+ * One message of a batch given to burrow_create_messages(). Unlike the
+ * other structures this one is filled in directly by the user.
+ */
+struct burrow_message_st
+{
+  const char *message_id;
+  const void *body;
+  size_t body_size;
+  const burrow_attributes_st *attributes; /* may be NULL */
+};
 
 #ifdef __cplusplus
 }
@@ -21,9 +21,105 @@
  * @brief Burrow_st tests
  */
 
+#include <errno.h>
+#include <poll.h>
+
 #include "common.h"
 #include "burrow_generic_tests.h"
 
+/* A small client event loop, fed through burrow_set_watch_fd_fns */
+#define MAX_WATCHED 64
+
+static struct pollfd watched[MAX_WATCHED];
+static nfds_t watched_count = 0;
+static int watch_adds = 0;
+static int watch_removes = 0;
+
+static struct pollfd *find_watched(int fd)
+{
+  nfds_t i;
+
+  for (i = 0; i < watched_count; i++)
+    if (watched[i].fd == fd)
+      return &watched[i];
+  return NULL;
+}
+
+static short poll_events(burrow_ioevent_t events)
+{
+  return (short)(((events & BURROW_IOEVENT_READ) ? POLLIN : 0) |
+                 ((events & BURROW_IOEVENT_WRITE) ? POLLOUT : 0));
+}
+
+static void watch_add(burrow_st *burrow, int fd, burrow_ioevent_t events)
+{
+  (void)burrow;
+  if (find_watched(fd) != NULL)
+    burrow_test_error("fd %d added twice", fd);
+  if (watched_count == MAX_WATCHED)
+    burrow_test_error("too many fds");
+  watched[watched_count].fd = fd;
+  watched[watched_count].events = poll_events(events);
+  watched_count++;
+  watch_adds++;
+}
+
+static void watch_modify(burrow_st *burrow, int fd, burrow_ioevent_t events)
+{
+  struct pollfd *pfd = find_watched(fd);
+
+  (void)burrow;
+  if (pfd == NULL)
+    burrow_test_error("fd %d modified but not added", fd);
+  if (pfd->events == poll_events(events))
+    burrow_test_error("fd %d modified without a change", fd);
+  pfd->events = poll_events(events);
+}
+
+static void watch_remove(burrow_st *burrow, int fd)
+{
+  struct pollfd *pfd = find_watched(fd);
+
+  (void)burrow;
+  if (pfd == NULL)
+    burrow_test_error("fd %d removed but not added", fd);
+  *pfd = watched[--watched_count];
+  watch_removes++;
+}
+
+static void run_event_loop(burrow_st *burrow)
+{
+  struct pollfd raised[MAX_WATCHED];
+  nfds_t raised_count;
+  nfds_t i;
+  int32_t timeout;
+  int count;
+
+  while (burrow_process(burrow) == EAGAIN)
+  {
+    timeout = burrow_get_timeout(burrow);
+    count = poll(watched, watched_count, timeout < 0 ? 10 * 1000 : timeout);
+    if (count < 0 || (count == 0 && timeout < 0))
+      burrow_test_error("poll failed or timed out");
+
+    /* Copy out first: raising events changes the watched set */
+    raised_count = watched_count;
+    memcpy(raised, watched, sizeof(struct pollfd) * watched_count);
+
+    for (i = 0; i < raised_count; i++)
+    {
+      burrow_ioevent_t event = BURROW_IOEVENT_NONE;
+      if (raised[i].revents == 0)
+        continue;
+      if (raised[i].revents & POLLIN)
+        event |= BURROW_IOEVENT_READ;
+      if (raised[i].revents & POLLOUT)
+        event |= BURROW_IOEVENT_WRITE;
+      burrow_event_raised(burrow, raised[i].fd, event);
+    }
+  }
+}
+
 int main(int argc, char **argv)
 {
   const char *server = "localhost";
@@ -39,8 +135,78 @@ int main(int argc, char **argv)
 
   burrow_set_backend_option(client->burrow, "server", server);
   burrow_set_backend_option(client->burrow, "port", port);
+
+  burrow_test("burrow_set_backend_option_int");
+
+    if (burrow_set_backend_option_int(client->burrow, "pool_size", 4) != 0)
+      burrow_test_error("pool_size not accepted");
+    if (burrow_set_backend_option_int(client->burrow, "idle_timeout", 5) != 0)
+      burrow_test_error("idle_timeout not accepted");
+  
+  test_run_functional(client);
+
+  /* Same again, waiting on the sockets with epoll rather than poll */
+  burrow_add_options(client->burrow, BURROW_OPT_EPOLL);
+  test_run_functional(client);
+
+  /* Same again with each JSON decoder that runs everywhere */
+  burrow_test("burrow_set_backend_option json_decoder");
+
+    if (burrow_set_backend_option(client->burrow, "json_decoder", "contrib") != 0)
+      burrow_test_error("contrib decoder not accepted");
+  
+  test_run_functional(client);
+
+  burrow_test("burrow_set_backend_option json_decoder");
+
+    if (burrow_set_backend_option(client->burrow, "json_decoder", "scalar") != 0)
+      burrow_test_error("scalar decoder not accepted");
   
   test_run_functional(client);
+
+  burrow_test("burrow_create_messages past the pool");
+
+    {
+      burrow_message_st batch[6];
+      char ids[6][sizeof("b-2147483648")];
+      int i;
+
+      for (i = 0; i < 6; i++)
+      {
+        snprintf(ids[i], sizeof(ids[i]), "b%d", i);
+        batch[i].message_id = ids[i];
+        batch[i].body = client->body;
+        batch[i].body_size = client->body_size;
+        batch[i].attributes = NULL;
+      }
+
+      /* One request in flight at a time, the rest started as each ends */
+      burrow_set_backend_option_int(client->burrow, "pool_size", 1);
+      if (burrow_create_messages(client->burrow, client->acct, "batch queue",
+                                 batch, 6) != 0)
+        burrow_test_error("batch failed");
+      client->message_callback_called = 0;
+      burrow_get_messages(client->burrow, client->acct, "batch queue", NULL);
+      if (client->message_callback_called != 6)
+        burrow_test_error("%d messages, expected 6",
+                          client->message_callback_called);
+      burrow_delete_messages(client->burrow, client->acct, "batch queue",
+                             NULL);
+      burrow_set_backend_option_int(client->burrow, "pool_size", 4);
+    }
+
+  burrow_test("burrow_set_watch_fd_fns");
+
+    burrow_set_watch_fd_fns(client->burrow, &watch_add, &watch_modify,
+                            &watch_remove);
+    burrow_set_max_commands(client->burrow, 4);
+    burrow_get_accounts(client->burrow, NULL);
+    burrow_get_queues(client->burrow, client->acct, NULL);
+    burrow_get_messages(client->burrow, client->acct, client->queue, NULL);
+    run_event_loop(client->burrow);
+    if (watch_adds == 0 || watch_removes > watch_adds)
+      burrow_test_error("%d fds added, %d removed", watch_adds, watch_removes);
+    burrow_set_watch_fd_fns(client->burrow, NULL, NULL, NULL);
   
   test_teardown(client);
   return 0;
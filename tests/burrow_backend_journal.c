@@ -0,0 +1,491 @@
+/*
+ * libburrow/tests -- Burrow Client Library Unit Tests
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Journal backend tests
+ */
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "burrow_generic_tests.h"
+
+static char path[64];
+static int messages_seen = 0;
+static char message_ids[256];
+static uint32_t last_ttl = 0;
+static int commands_complete = 0;
+
+static void count_message(burrow_st *burrow, const char *message_id,
+                          const void *body, size_t body_size,
+                          const burrow_attributes_st *attributes)
+{
+  (void)burrow; (void)body; (void)body_size;
+  messages_seen++;
+  strncat(message_ids, message_id,
+          sizeof(message_ids) - strlen(message_ids) - 1);
+  last_ttl = attributes ? burrow_attributes_get_ttl(attributes) : 0;
+}
+
+static void count_complete(burrow_st *burrow)
+{
+  (void)burrow;
+  commands_complete++;
+}
+
+/* Finds the last segment and whether there's a snapshot */
+static int scan_journal(char *last, size_t size)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  int snapshots = 0;
+
+  last[0] = '\0';
+  if (!dir)
+    return 0;
+
+  while ((entry = readdir(dir)))
+  {
+    const char *suffix = strchr(entry->d_name, '.');
+
+    if (!suffix || suffix == entry->d_name)
+      continue;
+    if (!strcmp(suffix, ".snap"))
+      snapshots++;
+    else if (!strcmp(suffix, ".log") && strcmp(entry->d_name, last) > 0)
+      snprintf(last, size, "%s", entry->d_name);
+  }
+
+  closedir(dir);
+  return snapshots;
+}
+
+static void remove_journal(void)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  char name[PATH_MAX];
+
+  if (!dir)
+    return;
+
+  while ((entry = readdir(dir)))
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+    unlink(name);
+  }
+
+  closedir(dir);
+  rmdir(path);
+}
+
+static burrow_st *open_journal(void)
+{
+  burrow_st *burrow;
+
+  if ((burrow = burrow_create(NULL, "journal")) == NULL)
+    burrow_test_error("returned NULL");
+  if (burrow_set_backend_option(burrow, "path", path) != 0)
+    burrow_test_error("couldn't set the path");
+  burrow_set_message_fn(burrow, &count_message);
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+  return burrow;
+}
+
+/* Everything done before is there again once the journal is reopened,
+   with what's left of each message's ttl */
+static void test_restart(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+  burrow_filters_st *filters;
+
+  burrow_test("journal backend restart");
+
+    remove_journal();
+    burrow = open_journal();
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_attributes_set_ttl(attr, 100);
+    burrow_create_message(burrow, "acct", "q", "a", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "b", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "c", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "gone", "d", "x", 1, attr);
+    burrow_create_message(burrow, "other", "q", "e", "x", 1, attr);
+    burrow_delete_message(burrow, "acct", "q", "b", NULL);
+    burrow_delete_queues(burrow, "acct", NULL);
+    burrow_create_message(burrow, "acct", "q", "a", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "c", "x", 1, attr);
+
+    /* Hidden messages come back hidden */
+    burrow_attributes_unset_ttl(attr);
+    burrow_attributes_set_hide(attr, 100);
+    burrow_update_message(burrow, "acct", "q", "c", attr, NULL);
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "a"))
+      burrow_test_error("got \"%s\", expected \"a\"", message_ids);
+    if (last_ttl == 0 || last_ttl > 100)
+      burrow_test_error("ttl %u, expected up to 100", last_ttl);
+
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_filters_set_match_hidden(filters, true);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (strcmp(message_ids, "ac"))
+      burrow_test_error("got \"%s\", expected \"ac\"", message_ids);
+
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "gone", filters);
+    burrow_get_messages(burrow, "other", "q", filters);
+    if (strcmp(message_ids, "e"))
+      burrow_test_error("got \"%s\", expected \"e\"", message_ids);
+
+    burrow_filters_destroy(filters);
+    burrow_destroy(burrow);
+}
+
+/* A record cut short at the end of the log, by a crash while it was being
+   written, is dropped along with nothing before it */
+static void test_torn(void)
+{
+  burrow_st *burrow;
+  char last[NAME_MAX + 1];
+  char name[PATH_MAX];
+  int fd;
+
+  burrow_test("journal backend torn record");
+
+    remove_journal();
+    burrow = open_journal();
+    burrow_create_message(burrow, "acct", "q", "a", "x", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "x", 1, NULL);
+    burrow_destroy(burrow);
+
+    scan_journal(last, sizeof(last));
+    snprintf(name, sizeof(name), "%s/%s", path, last);
+    if ((fd = open(name, O_WRONLY | O_APPEND)) == -1)
+      burrow_test_error("couldn't open %s", name);
+    if (write(fd, "\x40\0\0\0torn", 8) != 8)
+      burrow_test_error("couldn't write %s", name);
+    close(fd);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    if (burrow_get_messages(burrow, "acct", "q", NULL) != 0)
+      burrow_test_error("couldn't replay");
+    if (strcmp(message_ids, "ab"))
+      burrow_test_error("got \"%s\", expected \"ab\"", message_ids);
+
+    /* Appended to after that, and replayed again */
+    burrow_create_message(burrow, "acct", "q", "c", "x", 1, NULL);
+    burrow_destroy(burrow);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "abc"))
+      burrow_test_error("got \"%s\", expected \"abc\"", message_ids);
+    burrow_destroy(burrow);
+}
+
+/* Once enough segments fill up the log is compacted to a snapshot of what
+   the index holds, which is what comes back */
+static void test_compact(void)
+{
+  burrow_st *burrow;
+  char message_id[32];
+  char body[512];
+  char last[NAME_MAX + 1];
+  int i;
+
+  burrow_test("journal backend compaction");
+
+    remove_journal();
+    burrow = open_journal();
+    if (burrow_set_backend_option_int(burrow, "segment_size", 4096) != 0 ||
+        burrow_set_backend_option_int(burrow, "compact_segments", 2) != 0)
+      burrow_test_error("couldn't set the segments");
+    if (burrow_set_backend_option_int(burrow, "segment_size", 1024) != EINVAL)
+      burrow_test_error("didn't refuse a segment too small");
+
+    memset(body, 'x', sizeof(body));
+    for (i = 0; i < 200; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "%d", i % 10);
+      if (burrow_create_message(burrow, "acct", "q", message_id, body,
+                                sizeof(body), NULL) != 0)
+        burrow_test_error("couldn't create message %d", i);
+    }
+    burrow_delete_message(burrow, "acct", "q", "5", NULL);
+
+    if (burrow_set_backend_option(burrow, "path", "elsewhere") != EINVAL)
+      burrow_test_error("didn't refuse a path once opened");
+
+    /* The last snapshot may still be being written until then */
+    burrow_destroy(burrow);
+    if (scan_journal(last, sizeof(last)) != 1)
+      burrow_test_error("expected one snapshot");
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    messages_seen = 0;
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "012346789"))
+      burrow_test_error("got \"%s\", expected \"012346789\"", message_ids);
+    burrow_destroy(burrow);
+}
+
+/* A snapshot that can't be written whole is dropped, and the segments it
+   would have replaced kept, so that nothing logged is lost */
+static void test_compact_failure(void)
+{
+  burrow_st *burrow;
+  struct rlimit limit;
+  struct rlimit saved;
+  char message_id[32];
+  static char body[4000];
+  int i;
+
+  burrow_test("journal backend compaction failure");
+
+    remove_journal();
+    burrow = open_journal();
+    if (burrow_set_backend_option_int(burrow, "segment_size", 256 * 1024) ||
+        burrow_set_backend_option_int(burrow, "compact_segments", 2))
+      burrow_test_error("couldn't set the segments");
+
+    /* Segments fit under the file size limit, snapshots soon don't */
+    signal(SIGXFSZ, SIG_IGN);
+    getrlimit(RLIMIT_FSIZE, &saved);
+    limit = saved;
+    limit.rlim_cur = 768 * 1024;
+    if (setrlimit(RLIMIT_FSIZE, &limit))
+      burrow_test_error("couldn't limit the file size");
+
+    memset(body, 'x', sizeof(body));
+    for (i = 0; i < 400; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "%d", i);
+      burrow_create_message(burrow, "acct", "q", message_id, body,
+                            sizeof(body), NULL);
+    }
+
+    burrow_destroy(burrow);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, SIG_DFL);
+
+    burrow = open_journal();
+    messages_seen = 0;
+    if (burrow_get_messages(burrow, "acct", "q", NULL) != 0)
+      burrow_test_error("couldn't replay");
+    if (messages_seen != 400)
+      burrow_test_error("%d messages replayed, expected 400", messages_seen);
+    burrow_destroy(burrow);
+}
+
+/* Commands started together are committed together, and complete once
+   they are */
+static void test_group_commit(void)
+{
+  burrow_st *burrow;
+  char message_ids_in[8][sizeof("-2147483648")];
+  int i;
+
+  burrow_test("journal backend group commit");
+
+    remove_journal();
+    burrow = open_journal();
+    burrow_remove_options(burrow, BURROW_OPT_AUTOPROCESS);
+    burrow_set_complete_fn(burrow, &count_complete);
+    if (burrow_set_max_commands(burrow, 8) != 0)
+      burrow_test_error("couldn't queue commands");
+    if (burrow_set_backend_option_int(burrow, "commit_interval", 20) != 0)
+      burrow_test_error("couldn't set the commit interval");
+
+    commands_complete = 0;
+    for (i = 0; i < 8; i++)
+    {
+      snprintf(message_ids_in[i], sizeof(message_ids_in[i]), "%d", i);
+      burrow_create_message(burrow, "acct", "q", message_ids_in[i], "x", 1,
+                            NULL);
+    }
+    if (commands_complete != 0)
+      burrow_test_error("commands completed before processing");
+
+    while (burrow_process(burrow) == EAGAIN)
+      usleep(1000);
+    if (commands_complete != 8)
+      burrow_test_error("%d commands completed, expected 8",
+                        commands_complete);
+    burrow_destroy(burrow);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "01234567"))
+      burrow_test_error("got \"%s\", expected \"01234567\"", message_ids);
+    burrow_destroy(burrow);
+}
+
+/* Updates and deletes are logged whatever detail the user asks for, and
+   reported with only that */
+static void test_detail(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+  burrow_filters_st *filters;
+
+  burrow_test("journal backend detail");
+
+    remove_journal();
+    burrow = open_journal();
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL ||
+        (filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_create_message(burrow, "acct", "q", "a", "x", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "x", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "c", "x", 1, NULL);
+
+    burrow_filters_set_detail(filters, BURROW_DETAIL_NONE);
+    messages_seen = 0;
+    burrow_delete_message(burrow, "acct", "q", "b", filters);
+    if (messages_seen)
+      burrow_test_error("%d messages reported, expected none",
+                        messages_seen);
+
+    burrow_filters_set_detail(filters, BURROW_DETAIL_ID);
+    burrow_attributes_set_hide(attr, 100);
+    message_ids[0] = '\0';
+    last_ttl = 1;
+    burrow_update_message(burrow, "acct", "q", "c", attr, filters);
+    if (strcmp(message_ids, "c") || last_ttl)
+      burrow_test_error("got \"%s\" with attributes, expected \"c\"",
+                        message_ids);
+
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "a"))
+      burrow_test_error("got \"%s\", expected \"a\"", message_ids);
+    burrow_destroy(burrow);
+}
+
+/* The memory store functions reach the journal's index, and a restore is
+   logged, so it's still there once the journal is reopened */
+static void test_memory_functions(void)
+{
+  burrow_st *burrow;
+  char image[PATH_MAX];
+  uint64_t messages;
+  uint64_t bytes;
+  int ret;
+
+  burrow_test("journal backend memory functions");
+
+    snprintf(image, sizeof(image), "%s.image", path);
+    unlink(image);
+    remove_journal();
+    burrow = open_journal();
+
+    burrow_create_message(burrow, "acct", "q", "a", "xx", 2, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "xx", 2, NULL);
+
+    if ((ret = burrow_memory_usage(burrow, "acct", "q", &messages,
+                                   &bytes)) != 0)
+      burrow_test_error("usage returned %d", ret);
+    if (messages != 2 || bytes < 4)
+      burrow_test_error("usage %llu messages of %llu bytes, expected 2",
+                        (unsigned long long)messages,
+                        (unsigned long long)bytes);
+    if ((ret = burrow_memory_expire(burrow)) != 0)
+      burrow_test_error("expire returned %d", ret);
+
+    if ((ret = burrow_memory_snapshot(burrow, image)) != 0)
+      burrow_test_error("snapshot returned %d", ret);
+    if ((ret = burrow_memory_snapshot_wait(burrow, true)) != 0)
+      burrow_test_error("snapshot wait returned %d", ret);
+
+    burrow_delete_messages(burrow, "acct", "q", NULL);
+    burrow_create_message(burrow, "acct", "q", "c", "xx", 2, NULL);
+    if ((ret = burrow_memory_restore(burrow, image)) != 0)
+      burrow_test_error("restore returned %d", ret);
+
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "ab"))
+      burrow_test_error("got \"%s\", expected \"ab\"", message_ids);
+    burrow_destroy(burrow);
+
+    burrow = open_journal();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "ab"))
+      burrow_test_error("got \"%s\" after reopening, expected \"ab\"",
+                        message_ids);
+    burrow_destroy(burrow);
+    unlink(image);
+}
+
+int main(void)
+{
+  client_st *client;
+
+  snprintf(path, sizeof(path), "burrow_backend_journal-%ld.journal",
+           (long)getpid());
+  remove_journal();
+
+  client = test_setup("journal");
+  if (burrow_set_backend_option(client->burrow, "path", path) != 0)
+    burrow_test_error("couldn't set the path");
+
+  test_run_functional(client);
+  test_run_markers(client);
+
+  test_teardown(client);
+
+  test_restart();
+  test_torn();
+  test_compact();
+  test_compact_failure();
+  test_group_commit();
+  test_detail();
+  test_memory_functions();
+
+  remove_journal();
+  return 0;
+}
@@ -21,16 +21,754 @@
  * @brief Burrow_st tests
  */
 
+#include <errno.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include "common.h"
 #include "burrow_generic_tests.h"
 
+static int messages_seen = 0;
+static int bodies_seen = 0;
+static int attributes_seen = 0;
+static int accounts_seen = 0;
+static char message_ids[64];
+
+static void count_message(burrow_st *burrow, const char *message_id,
+                          const void *body, size_t body_size,
+                          const burrow_attributes_st *attributes)
+{
+  (void)burrow; (void)body_size;
+  messages_seen++;
+  bodies_seen += body != NULL;
+  attributes_seen += attributes != NULL;
+  strncat(message_ids, message_id,
+          sizeof(message_ids) - strlen(message_ids) - 1);
+}
+
+static void count_account(burrow_st *burrow, const char *account)
+{
+  (void)burrow; (void)account;
+  accounts_seen++;
+}
+
+static bool malloc_fails = false;
+
+static void *failing_malloc(burrow_st *burrow, size_t size)
+{
+  (void)burrow;
+  return malloc_fails ? NULL : malloc(size);
+}
+
+static void plain_free(burrow_st *burrow, void *ptr)
+{
+  (void)burrow;
+  free(ptr);
+}
+
+static ssize_t bytes_held = 0;
+
+/* Counts what's held, of what's allocated once the functions are set */
+static void *counting_malloc(burrow_st *burrow, size_t size)
+{
+  void *ptr;
+
+  (void)burrow;
+  if ((ptr = malloc(size)) != NULL)
+    bytes_held += malloc_usable_size(ptr);
+  return ptr;
+}
+
+static void counting_free(burrow_st *burrow, void *ptr)
+{
+  (void)burrow;
+  if (ptr == NULL)
+    return;
+  bytes_held -= malloc_usable_size(ptr);
+  free(ptr);
+}
+
+/* Running out of memory for a message's queue fails the message */
+static void test_create_enomem(void)
+{
+  burrow_st *burrow;
+
+  burrow_test("memory backend create_message out of memory");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_malloc_fn(burrow, &failing_malloc);
+    burrow_set_free_fn(burrow, &plain_free);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+
+    malloc_fails = true;
+    if (burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL) !=
+        ENOMEM)
+      burrow_test_error("didn't report ENOMEM");
+    malloc_fails = false;
+
+    if (burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL) != 0)
+      burrow_test_error("failed once memory was back");
+
+    burrow_destroy(burrow);
+}
+
+/* A queue holding a message or two takes a small slab, and the slabs a
+   burst of messages took are given back, but for the tables that
+   indexed them, once they're deleted */
+static void test_slabs(void)
+{
+  burrow_st *burrow;
+  char message_id[32];
+  char body[1000];
+  ssize_t held;
+  int i;
+
+  burrow_test("memory backend slabs");
+
+    memset(body, 'x', sizeof(body));
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_malloc_fn(burrow, &counting_malloc);
+    burrow_set_free_fn(burrow, &counting_free);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+
+    burrow_create_message(burrow, "acct", "q", "first", "a", 1, NULL);
+    held = bytes_held;
+    burrow_create_message(burrow, "acct", "q2", "first", "a", 1, NULL);
+    if (bytes_held - held > 16384)
+      burrow_test_error("a queue of one message took %zd bytes",
+                        bytes_held - held);
+
+    held = bytes_held;
+    for (i = 0; i < 2000; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "m%d", i);
+      burrow_create_message(burrow, "acct", "q", message_id, body,
+                            sizeof(body), NULL);
+    }
+    for (i = 0; i < 2000; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "m%d", i);
+      burrow_delete_message(burrow, "acct", "q", message_id, NULL);
+    }
+    if (bytes_held - held > 262144)
+      burrow_test_error("%zd bytes still held after the burst",
+                        bytes_held - held);
+
+    burrow_destroy(burrow);
+}
+
+/* Messages past their ttl are reclaimed, queues and accounts with them,
+   while the rest are left alone */
+static void test_expire(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+
+  burrow_test("burrow_memory_expire");
+
+    if ((burrow = burrow_create(NULL, "dummy")) == NULL)
+      burrow_test_error("returned NULL");
+    if (burrow_memory_expire(burrow) != EINVAL)
+      burrow_test_error("didn't refuse a backend other than memory");
+    burrow_destroy(burrow);
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_set_account_fn(burrow, &count_account);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_attributes_set_ttl(attr, 1);
+    burrow_create_message(burrow, "short", "q", "a", "a", 1, attr);
+    burrow_create_message(burrow, "mixed", "q", "b", "b", 1, attr);
+    burrow_attributes_set_ttl(attr, 100);
+    burrow_create_message(burrow, "mixed", "q", "c", "c", 1, attr);
+
+    sleep(2);
+    if (burrow_memory_expire(burrow) != 0)
+      burrow_test_error("failed");
+
+    burrow_get_accounts(burrow, NULL);
+    if (accounts_seen != 1)
+      burrow_test_error("%d accounts left, expected 1", accounts_seen);
+
+    burrow_get_messages(burrow, "mixed", "q", NULL);
+    if (messages_seen != 1)
+      burrow_test_error("%d messages left, expected 1", messages_seen);
+
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+}
+
+/* Hidden messages are skipped until their hide runs out, and then come
+   back in the order they were created */
+static void test_hide(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+
+  burrow_test("memory backend hidden messages");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_attributes_set_hide(attr, 1);
+    burrow_create_message(burrow, "acct", "q", "a", "a", 1, attr);
+    burrow_attributes_set_hide(attr, 0);
+    burrow_create_message(burrow, "acct", "q", "b", "b", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "c", "c", 1, attr);
+    burrow_attributes_set_hide(attr, 100);
+    burrow_update_message(burrow, "acct", "q", "c", attr, NULL);
+
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "b"))
+      burrow_test_error("got \"%s\", expected \"b\"", message_ids);
+
+    sleep(2);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "ab"))
+      burrow_test_error("got \"%s\", expected \"ab\"", message_ids);
+
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+}
+
+/* An image taken of the store holds it as it was when taken, whatever is
+   done to the store meanwhile, and loads back in its place */
+static void test_snapshot(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+  burrow_filters_st *filters;
+  char path[64];
+  FILE *file;
+
+  burrow_test("burrow_memory_snapshot");
+
+    snprintf(path, sizeof(path), "burrow_backend_memory-%ld.image",
+             (long)getpid());
+
+    if ((burrow = burrow_create(NULL, "dummy")) == NULL)
+      burrow_test_error("returned NULL");
+    if (burrow_memory_snapshot(burrow, path) != EINVAL ||
+        burrow_memory_restore(burrow, path) != EINVAL)
+      burrow_test_error("didn't refuse a backend other than memory");
+    burrow_destroy(burrow);
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "b", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "c", "c", 1, NULL);
+    burrow_attributes_set_hide(attr, 100);
+    burrow_update_message(burrow, "acct", "q", "b", attr, NULL);
+    burrow_create_message(burrow, "other", "q", "d", "d", 1, NULL);
+
+    if (burrow_memory_snapshot(burrow, path) != 0)
+      burrow_test_error("couldn't start a snapshot");
+    if (burrow_memory_snapshot(burrow, path) != EINPROGRESS)
+      burrow_test_error("started a second snapshot");
+    burrow_delete_messages(burrow, "acct", "q", NULL);
+    if (burrow_memory_snapshot_wait(burrow, true) != 0)
+      burrow_test_error("snapshot failed");
+    if (burrow_memory_snapshot_wait(burrow, false) != 0)
+      burrow_test_error("no snapshot to wait for");
+
+    burrow_create_message(burrow, "gone", "q", "e", "e", 1, NULL);
+    if (burrow_memory_restore(burrow, path) != 0)
+      burrow_test_error("couldn't restore");
+
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    burrow_get_messages(burrow, "other", "q", NULL);
+    burrow_get_messages(burrow, "gone", "q", NULL);
+    if (strcmp(message_ids, "acd"))
+      burrow_test_error("got \"%s\", expected \"acd\"", message_ids);
+
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_filters_set_match_hidden(filters, true);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (strcmp(message_ids, "abc"))
+      burrow_test_error("got \"%s\", expected \"abc\"", message_ids);
+
+    /* A file that's no image changes nothing */
+    if ((file = fopen(path, "w")) == NULL)
+      burrow_test_error("couldn't write %s", path);
+    fputs("BURROWM1 and then some", file);
+    fclose(file);
+    if (burrow_memory_restore(burrow, path) != EINVAL)
+      burrow_test_error("didn't refuse a broken image");
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (strcmp(message_ids, "abc"))
+      burrow_test_error("got \"%s\", expected \"abc\"", message_ids);
+
+    unlink(path);
+    burrow_filters_destroy(filters);
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+}
+
+/* Queues and accounts hold no more than their limits, and what they hold
+   is counted as it comes and goes */
+static void test_limits(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t account_bytes;
+  char body[2048];
+
+  burrow_test("burrow_memory_usage");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    if (burrow_memory_usage(burrow, NULL, "q", &messages, &bytes) != EINVAL)
+      burrow_test_error("didn't refuse a queue without an account");
+
+    burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "b", 1, NULL);
+    burrow_create_message(burrow, "acct", "other", "c", "c", 1, NULL);
+    burrow_memory_usage(burrow, "acct", "q", &messages, &bytes);
+    if (messages != 2 || bytes == 0)
+      burrow_test_error("queue holds %u messages", (unsigned)messages);
+    burrow_memory_usage(burrow, "acct", NULL, &messages, &account_bytes);
+    if (messages != 3 || account_bytes <= bytes)
+      burrow_test_error("account holds %u messages", (unsigned)messages);
+    burrow_memory_usage(burrow, NULL, NULL, &messages, &bytes);
+    if (messages != 3 || bytes != account_bytes)
+      burrow_test_error("store holds %u messages", (unsigned)messages);
+
+    /* Each message counts the whole slab block it takes */
+    burrow_create_message(burrow, "acct", "sized", "a", "a", 1, NULL);
+    burrow_create_message(burrow, "acct", "sized", "b", "bb", 2, NULL);
+    burrow_create_message(burrow, "acct", "sized", "c", "ccc", 3, NULL);
+    burrow_memory_usage(burrow, "acct", "sized", &messages, &bytes);
+    if (messages != 3 || bytes % 16)
+      burrow_test_error("%u bytes aren't whole blocks", (unsigned)bytes);
+    burrow_delete_messages(burrow, "acct", "sized", NULL);
+
+    burrow_delete_messages(burrow, "acct", "q", NULL);
+    burrow_memory_usage(burrow, "acct", "q", &messages, &bytes);
+    if (messages != 0 || bytes != 0)
+      burrow_test_error("deleted queue holds %u messages", (unsigned)messages);
+    burrow_delete_accounts(burrow, NULL);
+    burrow_memory_usage(burrow, NULL, NULL, &messages, &bytes);
+    if (messages != 0 || bytes != 0)
+      burrow_test_error("empty store holds %u messages", (unsigned)messages);
+
+  burrow_test("memory backend limits");
+
+    if (burrow_set_backend_option_int(burrow, "queue_max", 3) != EINVAL ||
+        burrow_set_backend_option_int(burrow, "queue_max_messages", -1) !=
+        EINVAL ||
+        burrow_set_backend_option(burrow, "limit_policy", "drop") != EINVAL)
+      burrow_test_error("didn't refuse a bad option");
+    if (burrow_set_backend_option_int(burrow, "queue_max_messages", 3) != 0)
+      burrow_test_error("couldn't set a limit");
+
+    burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "b", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "c", "c", 1, NULL);
+    if (burrow_create_message(burrow, "acct", "q", "d", "d", 1, NULL) !=
+        ENOSPC)
+      burrow_test_error("didn't refuse a message past the limit");
+    if (burrow_create_message(burrow, "acct", "q", "b", "b", 1, NULL) != 0)
+      burrow_test_error("couldn't overwrite a message at the limit");
+
+    burrow_set_backend_option(burrow, "limit_policy", "drop_oldest");
+    if (burrow_create_message(burrow, "acct", "q", "d", "d", 1, NULL) != 0)
+      burrow_test_error("couldn't make room for a message");
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "bcd"))
+      burrow_test_error("got \"%s\", expected \"bcd\"", message_ids);
+
+    burrow_set_backend_option(burrow, "limit_policy", "drop_expiring");
+    burrow_attributes_set_ttl(attr, 10);
+    burrow_update_message(burrow, "acct", "q", "c", attr, NULL);
+    burrow_create_message(burrow, "acct", "q", "e", "e", 1, NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "bde"))
+      burrow_test_error("got \"%s\", expected \"bde\"", message_ids);
+
+    /* Nothing is dropped for a message that could never fit */
+    burrow_set_backend_option_int(burrow, "queue_max_kbytes", 1);
+    memset(body, 'x', sizeof(body));
+    if (burrow_create_message(burrow, "acct", "q", "f", body, sizeof(body),
+                              NULL) != ENOSPC)
+      burrow_test_error("didn't refuse a message past the limit");
+    burrow_memory_usage(burrow, "acct", "q", &messages, NULL);
+    if (messages != 3)
+      burrow_test_error("queue holds %u messages", (unsigned)messages);
+
+    /* An account's limit only drops from the queue written to */
+    burrow_set_backend_option_int(burrow, "queue_max_messages", 0);
+    burrow_set_backend_option_int(burrow, "account_max_messages", 4);
+    burrow_create_message(burrow, "acct", "other", "g", "g", 1, NULL);
+    burrow_create_message(burrow, "acct", "other", "h", "h", 1, NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    burrow_get_messages(burrow, "acct", "other", NULL);
+    if (strcmp(message_ids, "bdeh"))
+      burrow_test_error("got \"%s\", expected \"bdeh\"", message_ids);
+    burrow_create_message(burrow, "else", "q", "i", "i", 1, NULL);
+    burrow_memory_usage(burrow, NULL, NULL, &messages, NULL);
+    if (messages != 5)
+      burrow_test_error("store holds %u messages", (unsigned)messages);
+
+    burrow_set_backend_option(burrow, "limit_policy", "reject");
+    burrow_delete_message(burrow, "acct", "q", "b", NULL);
+    if (burrow_create_message(burrow, "acct", "q", "j", "j", 1, NULL) != 0 ||
+        burrow_create_message(burrow, "acct", "q", "k", "k", 1, NULL) !=
+        ENOSPC)
+      burrow_test_error("didn't hold the account to its limit");
+
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+}
+
+#define SHARED_PRODUCERS 4
+#define SHARED_MESSAGES 2000
+
+/* Each producer thread has a burrow_st of its own, on the shared store */
+static void *produce(void *arg)
+{
+  burrow_st *burrow;
+  char message_id[32];
+  int i;
+
+  if ((burrow = burrow_create(NULL, "memory")) == NULL)
+    burrow_test_error("returned NULL");
+  if (burrow_set_backend_option(burrow, "store", "test") != 0)
+    burrow_test_error("couldn't attach to the shared store");
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+
+  for (i = 0; i < SHARED_MESSAGES; i++)
+  {
+    snprintf(message_id, sizeof(message_id), "%ld-%d", (long)arg, i);
+    burrow_create_message(burrow, "acct", "q", message_id, "x", 1, NULL);
+  }
+
+  burrow_destroy(burrow);
+  return NULL;
+}
+
+/* Messages created through one burrow_st attached to a shared store are
+   there for any other attached, from any thread, and for no other */
+static void test_shared_store(void)
+{
+  burrow_st *burrow;
+  burrow_st *other;
+  pthread_t producers[SHARED_PRODUCERS];
+  long i;
+
+  burrow_test("memory backend shared store");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    if ((other = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    if (burrow_set_backend_option(burrow, "shared", "test") != EINVAL)
+      burrow_test_error("didn't refuse an unknown option");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_set_message_fn(other, &count_message);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    burrow_add_options(other, BURROW_OPT_AUTOPROCESS);
+
+    burrow_create_message(burrow, "acct", "q", "own", "x", 1, NULL);
+    if (burrow_set_backend_option(burrow, "store", "test") != 0 ||
+        burrow_set_backend_option(other, "store", "test") != 0)
+      burrow_test_error("couldn't attach to the shared store");
+
+    burrow_create_message(burrow, "acct", "q", "shared", "x", 1, NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(other, "acct", "q", NULL);
+    if (strcmp(message_ids, "shared"))
+      burrow_test_error("got \"%s\", expected \"shared\"", message_ids);
+    burrow_delete_messages(other, "acct", "q", NULL);
+
+    for (i = 0; i < SHARED_PRODUCERS; i++)
+      if (pthread_create(&producers[i], NULL, &produce, (void *)i))
+        burrow_test_error("couldn't start a producer");
+
+    /* Consume while they produce, until every message has come through */
+    messages_seen = 0;
+    while (messages_seen < SHARED_PRODUCERS * SHARED_MESSAGES)
+    {
+      message_ids[0] = '\0';
+      burrow_delete_messages(other, "acct", "q", NULL);
+    }
+
+    for (i = 0; i < SHARED_PRODUCERS; i++)
+      pthread_join(producers[i], NULL);
+
+    if (messages_seen != SHARED_PRODUCERS * SHARED_MESSAGES)
+      burrow_test_error("%d messages consumed, expected %d", messages_seen,
+                        SHARED_PRODUCERS * SHARED_MESSAGES);
+
+    burrow_destroy(other);
+
+    /* Back on its own store, the first message is still there */
+    if (burrow_set_backend_option(burrow, "store", NULL) != 0)
+      burrow_test_error("couldn't detach from the shared store");
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "own"))
+      burrow_test_error("got \"%s\", expected \"own\"", message_ids);
+
+    burrow_destroy(burrow);
+}
+
+/* Messages are reported with only the detail asked for, and not at all
+   with none, whatever the command does to them */
+static void test_detail(void)
+{
+  burrow_st *burrow;
+  burrow_filters_st *filters;
+  static const struct
+  {
+    burrow_detail_t detail;
+    int bodies;
+    int attributes;
+  } levels[] =
+  {
+    { BURROW_DETAIL_ID, 0, 0 },
+    { BURROW_DETAIL_ATTRIBUTES, 0, 3 },
+    { BURROW_DETAIL_BODY, 3, 0 },
+    { BURROW_DETAIL_ALL, 3, 3 }
+  };
+  size_t i;
+
+  burrow_test("memory backend detail");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+
+    burrow_create_message(burrow, "acct", "q", "a", "a", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "b", "b", 1, NULL);
+    burrow_create_message(burrow, "acct", "q", "c", "c", 1, NULL);
+
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+      burrow_filters_set_detail(filters, levels[i].detail);
+      messages_seen = bodies_seen = attributes_seen = 0;
+      message_ids[0] = '\0';
+      burrow_get_messages(burrow, "acct", "q", filters);
+      if (strcmp(message_ids, "abc"))
+        burrow_test_error("got \"%s\", expected \"abc\"", message_ids);
+      if (bodies_seen != levels[i].bodies ||
+          attributes_seen != levels[i].attributes)
+        burrow_test_error("detail %d: %d bodies, %d attributes",
+                          (int)levels[i].detail, bodies_seen,
+                          attributes_seen);
+    }
+
+    burrow_filters_set_detail(filters, BURROW_DETAIL_NONE);
+    messages_seen = 0;
+    burrow_get_message(burrow, "acct", "q", "a", filters);
+    burrow_delete_message(burrow, "acct", "q", "a", filters);
+    burrow_delete_messages(burrow, "acct", "q", filters);
+    if (messages_seen)
+      burrow_test_error("%d messages reported, expected none",
+                        messages_seen);
+
+    burrow_filters_unset_detail(filters);
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (messages_seen)
+      burrow_test_error("%d messages left, expected none", messages_seen);
+
+    burrow_filters_destroy(filters);
+    burrow_destroy(burrow);
+}
+
+/* Creates a message on the shared store after a while, from its thread */
+static void *produce_later(void *arg)
+{
+  burrow_st *burrow;
+
+  (void)arg;
+  if ((burrow = burrow_create(NULL, "memory")) == NULL)
+    burrow_test_error("returned NULL");
+  if (burrow_set_backend_option(burrow, "store", "wait") != 0)
+    burrow_test_error("couldn't attach to the shared store");
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+
+  usleep(200000);
+  burrow_create_message(burrow, "acct", "q", "waited", "x", 1, NULL);
+
+  burrow_destroy(burrow);
+  return NULL;
+}
+
+/* A command reading with the wait filter that finds nothing is woken by
+   the next message into its queue, whether created by a command queued
+   after it or from another thread, or else runs out with nothing, and
+   leaves nothing behind */
+static void test_wait(void)
+{
+  burrow_st *burrow;
+  burrow_filters_st *filters;
+  pthread_t producer;
+  time_t started;
+
+  burrow_test("memory backend wait");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_set_account_fn(burrow, &count_account);
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_filters_set_wait(filters, 5);
+
+    if (burrow_set_max_commands(burrow, 2) != 0)
+      burrow_test_error("couldn't queue commands");
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_delete_messages(burrow, "acct", "q", filters);
+    burrow_create_message(burrow, "acct", "q", "queued", "x", 1, NULL);
+    if (burrow_process(burrow) != 0)
+      burrow_test_error("couldn't process");
+    if (strcmp(message_ids, "queued"))
+      burrow_test_error("got \"%s\", expected \"queued\"", message_ids);
+    if (time(NULL) - started > 3)
+      burrow_test_error("woke only after the wait ran out");
+
+    burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+    if (burrow_set_backend_option(burrow, "store", "wait") != 0)
+      burrow_test_error("couldn't attach to the shared store");
+    if (pthread_create(&producer, NULL, &produce_later, NULL))
+      burrow_test_error("couldn't start the producer");
+
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_delete_messages(burrow, "acct", "q", filters);
+    if (strcmp(message_ids, "waited"))
+      burrow_test_error("got \"%s\", expected \"waited\"", message_ids);
+    if (time(NULL) - started > 3)
+      burrow_test_error("woke only after the wait ran out");
+    pthread_join(producer, NULL);
+
+    if (burrow_set_backend_option(burrow, "store", NULL) != 0)
+      burrow_test_error("couldn't detach from the shared store");
+    burrow_filters_set_wait(filters, 1);
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (message_ids[0])
+      burrow_test_error("got \"%s\", expected nothing", message_ids);
+    if (time(NULL) - started < 1)
+      burrow_test_error("didn't wait");
+
+    accounts_seen = 0;
+    burrow_get_accounts(burrow, NULL);
+    if (accounts_seen)
+      burrow_test_error("%d accounts left, expected none", accounts_seen);
+
+    burrow_filters_destroy(filters);
+    burrow_destroy(burrow);
+}
+
+/* Completing once, queues a message for the command still waiting */
+static bool queued_from_callback = false;
+static int queued_result = -1;
+
+static void queue_on_complete(burrow_st *burrow)
+{
+  if (queued_from_callback)
+    return;
+  queued_from_callback = true;
+  queued_result = burrow_create_message(burrow, "acct", "q", "woken", "x", 1,
+                                        NULL);
+}
+
+/* A command completing behind one still waiting frees its slot at once,
+   for another to take */
+static void test_queue_slots(void)
+{
+  burrow_st *burrow;
+  burrow_filters_st *filters;
+  time_t started;
+
+  burrow_test("memory backend queue slots");
+
+    if ((burrow = burrow_create(NULL, "memory")) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_set_message_fn(burrow, &count_message);
+    burrow_set_complete_fn(burrow, &queue_on_complete);
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_filters_set_wait(filters, 5);
+
+    if (burrow_set_max_commands(burrow, 2) != 0)
+      burrow_test_error("couldn't queue commands");
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    burrow_create_message(burrow, "acct", "other", "a", "x", 1, NULL);
+    if (burrow_process(burrow) != 0)
+      burrow_test_error("couldn't process");
+    if (queued_result != 0)
+      burrow_test_error("couldn't queue a command behind the waiting one");
+    if (strcmp(message_ids, "woken"))
+      burrow_test_error("got \"%s\", expected \"woken\"", message_ids);
+    if (time(NULL) - started > 3)
+      burrow_test_error("woke only after the wait ran out");
+
+    burrow_filters_destroy(filters);
+    burrow_destroy(burrow);
+}
+
 int main(void)
 {
   client_st *client;
   client = test_setup("memory");
   
   test_run_functional(client);
+  test_run_markers(client);
   
   test_teardown(client);
+
+  test_expire();
+  test_hide();
+  test_snapshot();
+  test_limits();
+  test_shared_store();
+  test_create_enomem();
+  test_slabs();
+  test_detail();
+  test_wait();
+  test_queue_slots();
   return 0;
 }
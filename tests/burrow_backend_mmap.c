@@ -0,0 +1,172 @@
+/*
+ * libburrow/tests -- Burrow Client Library Unit Tests
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Memory-mapped file backend tests
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "burrow_generic_tests.h"
+
+static char path[64];
+static int messages_seen = 0;
+static char message_ids[64];
+static uint32_t last_ttl = 0;
+
+static void count_message(burrow_st *burrow, const char *message_id,
+                          const void *body, size_t body_size,
+                          const burrow_attributes_st *attributes)
+{
+  (void)burrow; (void)body; (void)body_size;
+  messages_seen++;
+  strncat(message_ids, message_id,
+          sizeof(message_ids) - strlen(message_ids) - 1);
+  last_ttl = burrow_attributes_get_ttl(attributes);
+}
+
+static burrow_st *open_store(void)
+{
+  burrow_st *burrow;
+
+  if ((burrow = burrow_create(NULL, "mmap")) == NULL)
+    burrow_test_error("returned NULL");
+  if (burrow_set_backend_option(burrow, "path", path) != 0)
+    burrow_test_error("couldn't set the path");
+  if (burrow_set_backend_option_int(burrow, "messages", 8) != 0)
+    burrow_test_error("couldn't size the store");
+  burrow_set_message_fn(burrow, &count_message);
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+  return burrow;
+}
+
+/* What's in the store is there again once it's reopened, with what's
+   left of each message's ttl */
+static void test_restart(void)
+{
+  burrow_st *burrow;
+  burrow_attributes_st *attr;
+
+  burrow_test("mmap backend restart");
+
+    unlink(path);
+    burrow = open_store();
+    if (burrow_set_backend_option_int(burrow, "sync", 1) != 0)
+      burrow_test_error("couldn't set sync");
+    if ((attr = burrow_attributes_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_attributes_set_ttl(attr, 100);
+
+    burrow_create_message(burrow, "acct", "q", "a", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "b", "x", 1, attr);
+    burrow_create_message(burrow, "acct", "q", "c", "x", 1, attr);
+    burrow_delete_message(burrow, "acct", "q", "b", NULL);
+    burrow_attributes_destroy(attr);
+    burrow_destroy(burrow);
+
+    burrow = open_store();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "ac"))
+      burrow_test_error("got \"%s\", expected \"ac\"", message_ids);
+    if (last_ttl == 0 || last_ttl > 100)
+      burrow_test_error("ttl %u, expected up to 100", last_ttl);
+
+    burrow_destroy(burrow);
+}
+
+/* A store left by a process that died without closing it is repaired by
+   the next to open it, with every slot free again that no message holds */
+static void test_crash(void)
+{
+  burrow_st *burrow;
+  char message_id[32];
+  pid_t child;
+  int status;
+  int i;
+
+  burrow_test("mmap backend crash recovery");
+
+    unlink(path);
+    child = fork();
+    if (child == -1)
+      burrow_test_error("couldn't fork");
+    if (child == 0)
+    {
+      burrow = open_store();
+      for (i = 0; i < 8; i++)
+      {
+        snprintf(message_id, sizeof(message_id), "%d", i);
+        burrow_create_message(burrow, "acct", "q", message_id, "x", 1, NULL);
+      }
+      burrow_delete_messages(burrow, "acct", "q", NULL);
+      burrow_create_message(burrow, "acct", "q", "kept", "x", 1, NULL);
+      _exit(0);
+    }
+
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      burrow_test_error("child failed");
+
+    burrow = open_store();
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (strcmp(message_ids, "kept"))
+      burrow_test_error("got \"%s\", expected \"kept\"", message_ids);
+
+    for (i = 0; i < 7; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "%d", i);
+      if (burrow_create_message(burrow, "acct", "other", message_id, "x", 1,
+                                NULL) != 0)
+        burrow_test_error("couldn't create message %d", i);
+    }
+    if (burrow_create_message(burrow, "acct", "other", "full", "x", 1,
+                              NULL) != ENOSPC)
+      burrow_test_error("didn't refuse a message past the store");
+
+    burrow_destroy(burrow);
+}
+
+int main(void)
+{
+  client_st *client;
+
+  snprintf(path, sizeof(path), "burrow_backend_mmap-%ld.store",
+           (long)getpid());
+  unlink(path);
+
+  client = test_setup("mmap");
+  if (burrow_set_backend_option(client->burrow, "path", path) != 0)
+    burrow_test_error("couldn't set the path");
+
+  test_run_functional(client);
+  test_run_markers(client);
+
+  test_teardown(client);
+
+  test_restart();
+  test_crash();
+
+  unlink(path);
+  return 0;
+}
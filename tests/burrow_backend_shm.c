@@ -0,0 +1,292 @@
+/*
+ * libburrow/tests -- Burrow Client Library Unit Tests
+ *
+ * Copyright 2011 Tony Wooster
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Shared memory backend tests
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "burrow_generic_tests.h"
+
+static char region[64];
+static int messages_seen = 0;
+static char message_ids[64];
+static char accounts_seen[64];
+
+static void count_message(burrow_st *burrow, const char *message_id,
+                          const void *body, size_t body_size,
+                          const burrow_attributes_st *attributes)
+{
+  (void)burrow; (void)body; (void)body_size; (void)attributes;
+  messages_seen++;
+  strncat(message_ids, message_id,
+          sizeof(message_ids) - strlen(message_ids) - 1);
+}
+
+static void list_account(burrow_st *burrow, const char *account)
+{
+  (void)burrow;
+  strncat(accounts_seen, account,
+          sizeof(accounts_seen) - strlen(accounts_seen) - 1);
+}
+
+static burrow_st *open_region(void)
+{
+  burrow_st *burrow;
+
+  if ((burrow = burrow_create(NULL, "shm")) == NULL)
+    burrow_test_error("returned NULL");
+  if (burrow_set_backend_option(burrow, "name", region) != 0)
+    burrow_test_error("couldn't name the region");
+  burrow_set_message_fn(burrow, &count_message);
+  burrow_add_options(burrow, BURROW_OPT_AUTOPROCESS);
+  return burrow;
+}
+
+/* A consumer waiting on an empty queue gets what another process puts in
+   it, as soon as it's put there, and gives up once its wait runs out */
+static void test_wait(void)
+{
+  burrow_st *burrow;
+  burrow_filters_st *filters;
+  time_t started;
+  pid_t child;
+  int status;
+
+  burrow_test("shm backend wait across processes");
+
+    burrow = open_region();
+    if (burrow_set_backend_option_int(burrow, "messages", 16) != 0)
+      burrow_test_error("couldn't size the region");
+    if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+      burrow_test_error("returned NULL");
+    burrow_filters_set_wait(filters, 5);
+
+    /* Opens the region before the child does */
+    burrow_delete_accounts(burrow, NULL);
+    if (burrow_set_backend_option_int(burrow, "messages", 16) != EINVAL)
+      burrow_test_error("didn't refuse an option once opened");
+
+    child = fork();
+    if (child == -1)
+      burrow_test_error("couldn't fork");
+    if (child == 0)
+    {
+      burrow_st *producer = open_region();
+
+      usleep(200000);
+      burrow_create_message(producer, "acct", "q", "waited", "x", 1, NULL);
+      burrow_destroy(producer);
+      _exit(0);
+    }
+
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_delete_messages(burrow, "acct", "q", filters);
+    if (strcmp(message_ids, "waited"))
+      burrow_test_error("got \"%s\", expected \"waited\"", message_ids);
+    if (time(NULL) - started > 3)
+      burrow_test_error("woke only after the wait ran out");
+
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      burrow_test_error("producer failed");
+
+    burrow_filters_set_wait(filters, 1);
+    started = time(NULL);
+    message_ids[0] = '\0';
+    burrow_get_messages(burrow, "acct", "q", filters);
+    if (message_ids[0])
+      burrow_test_error("got \"%s\", expected nothing", message_ids);
+    if (time(NULL) - started < 1)
+      burrow_test_error("didn't wait");
+
+    burrow_filters_destroy(filters);
+    burrow_destroy(burrow);
+}
+
+/* A consumer parked by a process that dies doesn't keep its queue's entry
+   in the table from being freed and taken by another */
+static void test_dead_waiter(void)
+{
+  burrow_st *burrow;
+  pid_t child;
+  int status;
+
+  burrow_test("shm backend consumer dying while it waits");
+
+    shm_unlink(region);
+    burrow = open_region();
+    if (burrow_set_backend_option_int(burrow, "queues", 2) != 0)
+      burrow_test_error("couldn't size the region");
+    burrow_delete_accounts(burrow, NULL);
+
+    child = fork();
+    if (child == -1)
+      burrow_test_error("couldn't fork");
+    if (child == 0)
+    {
+      burrow_st *consumer = open_region();
+      burrow_filters_st *filters = burrow_filters_create(NULL, consumer);
+
+      burrow_filters_set_wait(filters, 30);
+      burrow_get_messages(consumer, "acct", "q1", filters);
+      _exit(1);
+    }
+
+    usleep(200000);
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+    if (!WIFSIGNALED(status))
+      burrow_test_error("consumer didn't wait");
+
+    burrow_delete_queues(burrow, "acct", NULL);
+    if (burrow_create_message(burrow, "acct", "q2", "m", "x", 1, NULL) != 0 ||
+        burrow_create_message(burrow, "acct", "q3", "m", "x", 1, NULL) != 0)
+      burrow_test_error("the dead consumer's queue wasn't freed");
+
+    burrow_destroy(burrow);
+}
+
+/* The region is fixed in size: a queue can't take more messages than it
+   was laid out for, nor bodies past the largest */
+static void test_limits(void)
+{
+  burrow_st *burrow;
+  char message_id[32];
+  char body[2048];
+  int i;
+
+  burrow_test("shm backend limits");
+
+    shm_unlink(region);
+    burrow = open_region();
+    if (burrow_set_backend_option_int(burrow, "messages", 10) != 0 ||
+        burrow_set_backend_option_int(burrow, "message_size", 1024) != 0)
+      burrow_test_error("couldn't size the region");
+    if (burrow_set_backend_option_int(burrow, "queue", 1) != EINVAL)
+      burrow_test_error("didn't refuse an unknown option");
+
+    /* Rounded up to 16 */
+    for (i = 0; i < 16; i++)
+    {
+      snprintf(message_id, sizeof(message_id), "%d", i);
+      if (burrow_create_message(burrow, "acct", "q", message_id, "x", 1,
+                                NULL) != 0)
+        burrow_test_error("couldn't create message %d", i);
+    }
+
+    if (burrow_create_message(burrow, "acct", "q", "full", "x", 1, NULL) !=
+        ENOSPC)
+      burrow_test_error("didn't refuse a message past the ring");
+
+    burrow_delete_message(burrow, "acct", "q", "3", NULL);
+    if (burrow_create_message(burrow, "acct", "q", "full", "x", 1, NULL) != 0)
+      burrow_test_error("couldn't reuse a deleted message's room");
+
+    memset(body, 'x', sizeof(body));
+    if (burrow_create_message(burrow, "acct", "q", "big", body,
+                              sizeof(body), NULL) != EINVAL)
+      burrow_test_error("didn't refuse a body past the largest");
+
+    messages_seen = 0;
+    burrow_get_messages(burrow, "acct", "q", NULL);
+    if (messages_seen != 16)
+      burrow_test_error("%d messages, expected 16", messages_seen);
+
+    burrow_destroy(burrow);
+}
+
+/* The marker and limit of delete_accounts count accounts, not the queues
+   in them */
+static void test_delete_accounts(void)
+{
+  const char *accounts[] = { "a", "b", "c", "d" };
+  const char *queues[] = { "q1", "q2", "q3" };
+  burrow_filters_st *filters;
+  burrow_st *burrow;
+  size_t a, q;
+
+  burrow_test("shm backend delete_accounts with marker and limit");
+
+    shm_unlink(region);
+    burrow = open_region();
+    burrow_set_account_fn(burrow, &list_account);
+
+    /* Interleaved, so an account's queues aren't together in the table */
+    for (q = 0; q < 3; q++)
+      for (a = 0; a < 4; a++)
+        if (burrow_create_message(burrow, accounts[a], queues[q], "m", "x", 1,
+                                  NULL) != 0)
+          burrow_test_error("couldn't create %s/%s", accounts[a], queues[q]);
+
+    filters = burrow_filters_create(NULL, burrow);
+    burrow_filters_set_marker(filters, "a");
+    burrow_filters_set_limit(filters, 2);
+    burrow_delete_accounts(burrow, filters);
+    burrow_filters_destroy(filters);
+
+    accounts_seen[0] = 0;
+    burrow_get_accounts(burrow, NULL);
+    if (strcmp(accounts_seen, "ad"))
+      burrow_test_error("accounts \"%s\", expected \"ad\"", accounts_seen);
+
+    messages_seen = 0;
+    for (q = 0; q < 3; q++)
+    {
+      burrow_get_messages(burrow, "a", queues[q], NULL);
+      burrow_get_messages(burrow, "d", queues[q], NULL);
+    }
+    if (messages_seen != 6)
+      burrow_test_error("%d messages left, expected 6", messages_seen);
+
+    burrow_destroy(burrow);
+}
+
+int main(void)
+{
+  client_st *client;
+
+  snprintf(region, sizeof(region), "/burrow-test-%ld", (long)getpid());
+  shm_unlink(region);
+
+  client = test_setup("shm");
+  if (burrow_set_backend_option(client->burrow, "name", region) != 0)
+    burrow_test_error("couldn't name the region");
+
+  test_run_functional(client);
+  test_run_markers(client);
+
+  test_teardown(client);
+
+  test_wait();
+  test_dead_waiter();
+  test_limits();
+  test_delete_accounts();
+
+  shm_unlink(region);
+  return 0;
+}
@@ -277,6 +277,127 @@ client_st *test_setup(const char *backend)
   return client;
 }
   
+static char listed[256];
+
+static void list_name(burrow_st *burrow, const char *name)
+{
+  (void)burrow;
+  strncat(listed, name, sizeof(listed) - strlen(listed) - 2);
+  strcat(listed, ",");
+}
+
+static void list_message(burrow_st *burrow, const char *message_id, const void *body, size_t body_size, const burrow_attributes_st *attributes)
+{
+  (void)body; (void)body_size; (void)attributes;
+  list_name(burrow, message_id);
+}
+
+/* Lists what's after the first of all, as a marker naming it should */
+static const char *after_first(const char *all)
+{
+  const char *comma = strchr(all, ',');
+  return comma ? comma + 1 : all;
+}
+
+static void first_name(char *name, size_t size, const char *all)
+{
+  size_t length = strcspn(all, ",");
+
+  if (length >= size)
+    length = size - 1;
+  memcpy(name, all, length);
+  name[length] = '\0';
+}
+
+/* Markers are exclusive: a listing starts after the one named, or from the
+   first if the marker names nothing there */
+void test_run_markers(client_st *client)
+{
+  burrow_st *burrow = client->burrow;
+  const char *acct = "marker acct";
+  burrow_filters_st *filters;
+  char all[256];
+  char first[64];
+
+  burrow_set_message_fn(burrow, &list_message);
+  burrow_set_queue_fn(burrow, &list_name);
+  burrow_set_account_fn(burrow, &list_name);
+
+  if ((filters = burrow_filters_create(NULL, burrow)) == NULL)
+    burrow_test_error("returned NULL");
+
+  burrow_create_message(burrow, acct, "q1", "m1", "x", 1, NULL);
+  burrow_create_message(burrow, acct, "q1", "m2", "x", 1, NULL);
+  burrow_create_message(burrow, acct, "q1", "m3", "x", 1, NULL);
+  burrow_create_message(burrow, acct, "q2", "m", "x", 1, NULL);
+  burrow_create_message(burrow, acct, "q3", "m", "x", 1, NULL);
+
+  burrow_test("burrow_get_messages marker");
+
+    burrow_filters_set_marker(filters, "m1");
+    listed[0] = '\0';
+    burrow_get_messages(burrow, acct, "q1", filters);
+    if (strcmp(listed, "m2,m3,"))
+      burrow_test_error("after m1 got \"%s\", expected \"m2,m3,\"", listed);
+
+    burrow_filters_set_marker(filters, "m3");
+    listed[0] = '\0';
+    burrow_get_messages(burrow, acct, "q1", filters);
+    if (listed[0])
+      burrow_test_error("after m3 got \"%s\", expected nothing", listed);
+
+    burrow_filters_set_marker(filters, "none");
+    listed[0] = '\0';
+    burrow_get_messages(burrow, acct, "q1", filters);
+    if (strcmp(listed, "m1,m2,m3,"))
+      burrow_test_error("after an unknown marker got \"%s\", expected \"m1,m2,m3,\"", listed);
+
+  burrow_test("burrow_get_queues marker");
+
+    listed[0] = '\0';
+    burrow_get_queues(burrow, acct, NULL);
+    strcpy(all, listed);
+    first_name(first, sizeof(first), all);
+
+    burrow_filters_set_marker(filters, first);
+    listed[0] = '\0';
+    burrow_get_queues(burrow, acct, filters);
+    if (strcmp(listed, after_first(all)))
+      burrow_test_error("after %s got \"%s\", expected \"%s\"", first, listed, after_first(all));
+
+    burrow_filters_set_marker(filters, "none");
+    listed[0] = '\0';
+    burrow_get_queues(burrow, acct, filters);
+    if (strcmp(listed, all))
+      burrow_test_error("after an unknown marker got \"%s\", expected \"%s\"", listed, all);
+
+  burrow_test("burrow_get_accounts marker");
+
+    listed[0] = '\0';
+    burrow_get_accounts(burrow, NULL);
+    strcpy(all, listed);
+    first_name(first, sizeof(first), all);
+
+    burrow_filters_set_marker(filters, first);
+    listed[0] = '\0';
+    burrow_get_accounts(burrow, filters);
+    if (strcmp(listed, after_first(all)))
+      burrow_test_error("after %s got \"%s\", expected \"%s\"", first, listed, after_first(all));
+
+    burrow_filters_set_marker(filters, "none");
+    listed[0] = '\0';
+    burrow_get_accounts(burrow, filters);
+    if (strcmp(listed, all))
+      burrow_test_error("after an unknown marker got \"%s\", expected \"%s\"", listed, all);
+
+  burrow_delete_queues(burrow, acct, NULL);
+  burrow_filters_destroy(filters);
+
+  burrow_set_message_fn(burrow, &message_callback);
+  burrow_set_queue_fn(burrow, &queue_callback);
+  burrow_set_account_fn(burrow, &account_callback);
+}
+
 void test_run_functional(client_st *client)
 {
   burrow_st *burrow = client->burrow;
@@ -627,7 +748,48 @@ void test_run_functional(client_st *client)
     client_only(client, EXPECT_NONE);
     burrow_get_messages(burrow, client->acct, client->queue, filters);
     client_check(client);
-}
 
+  /* TEST SET: Create a batch of messages, verify all exist, delete them */
+  burrow_message_st batch[3] = {
+    {client->msgid, client->body, client->body_size, NULL},
+    {altid, client->body, client->body_size, NULL},
+    {"third message id", client->body, client->body_size, attr}
+  };
+  int called;
+
+  burrow_test("burrow_create_messages");
 
+    /* Create all three as one command */
+    called = client->complete_callback_called;
+    client_may(client, MATCH_MSG | MULT_MSG);
+    burrow_create_messages(burrow, client->acct, client->queue, batch, 3);
+    client_check(client);
+    if (client->complete_callback_called != called + 1)
+      burrow_test_error("batch not completed as one command");
+
+  burrow_test("burrow_create_messages bad params");
+
+    client_may(client, LOG_ERROR);
+    if (!burrow_create_messages(burrow, client->acct, client->queue, batch, 0)
+        || !burrow_create_messages(burrow, client->acct, client->queue, NULL, 3)
+        || !burrow_create_messages(burrow, NULL, client->queue, batch, 3))
+      burrow_test_error("bad command allowed");
+    client_check(client);
 
+  burrow_test("burrow_get_messages");
+
+    /* All of the batch should appear, hidden one included */
+    called = client->message_callback_called;
+    client_must(client, MATCH_MSG | MULT_MSG);
+    burrow_get_messages(burrow, client->acct, client->queue, filters);
+    client_check(client);
+    if (client->message_callback_called != called + 3)
+      burrow_test_error("expected 3 messages, got %d",
+                        client->message_callback_called - called);
+
+  burrow_test("burrow_delete_messages");
+
+    client_must(client, MATCH_MSG | MULT_MSG);
+    burrow_delete_messages(burrow, client->acct, client->queue, filters);
+    client_check(client);
+}
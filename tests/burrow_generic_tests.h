@@ -74,5 +74,6 @@ typedef struct client_st client_st;
 client_st *test_setup(const char *backend);
 void test_teardown(client_st *client);
 void test_run_functional(client_st *client);
+void test_run_markers(client_st *client);
 
 #endif /* __BURROW_GENERIC_TESTS_H */
\ No newline at end of file
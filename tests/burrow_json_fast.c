@@ -0,0 +1,333 @@
+/*
+ * libburrow/tests -- Burrow Client Library Unit Tests
+ *
+ * Copyright 2011 Adrian Miranda
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file
+ * @brief Fast JSON decoder tests
+ *
+ * Every text is decoded whole and split in two at each byte, with each
+ * string scanner this build and cpu can run, and what the callbacks are
+ * told is written down to compare against what is expected.
+ */
+
+#include <limits.h>
+
+#include "common.h"
+#include "libburrow/backends/http/json_fast.h"
+
+/* What the callbacks were told, one token after another */
+static char told[4096];
+static size_t told_size;
+
+static void tell(const char *data, size_t size)
+{
+  if (told_size + size > sizeof(told))
+    burrow_test_error("told too much");
+  memcpy(told + told_size, data, size);
+  told_size += size;
+}
+
+static int callback(void *ctx, int type, const JSON_value *value)
+{
+  char number[64];
+
+  (void)ctx;
+  switch (type)
+  {
+  case JSON_T_OBJECT_BEGIN: tell("{ ", 2); break;
+  case JSON_T_OBJECT_END: tell("} ", 2); break;
+  case JSON_T_ARRAY_BEGIN: tell("[ ", 2); break;
+  case JSON_T_ARRAY_END: tell("] ", 2); break;
+  case JSON_T_TRUE: tell("true ", 5); break;
+  case JSON_T_FALSE: tell("false ", 6); break;
+  case JSON_T_NULL: tell("null ", 5); break;
+  case JSON_T_KEY:
+  case JSON_T_STRING:
+    tell(type == JSON_T_KEY ? "k:" : "s:", 2);
+    tell(value->vu.str.value, value->vu.str.length);
+    tell(" ", 1);
+    break;
+  case JSON_T_INTEGER:
+    snprintf(number, sizeof(number), "i:%lld ",
+             (long long)value->vu.integer_value);
+    tell(number, strlen(number));
+    break;
+  case JSON_T_FLOAT:
+    snprintf(number, sizeof(number), "f:%.17g ", value->vu.float_value);
+    tell(number, strlen(number));
+    break;
+  default:
+    return 0;
+  }
+
+  return 1;
+}
+
+static const char *modes[] = { "scalar", "sse2", "avx2" };
+
+/* Decodes text in two pieces, split where asked, returning whether it was
+   good */
+static int decode_fast(json_fast *jf, const char *text, size_t size,
+                       size_t split)
+{
+  told_size = 0;
+  json_fast_reset(jf);
+  return json_fast_parse(jf, text, split) &&
+         json_fast_parse(jf, text + split, size - split) &&
+         json_fast_done(jf);
+}
+
+/* Checks that text is told as expected (of expected_size bytes), or is
+   turned down if expected is NULL, however it's split */
+static void check_sized(const char *text, size_t size, int depth,
+                        const char *expected, size_t expected_size)
+{
+  JSON_config config;
+  json_fast_mode_t mode;
+  json_fast *jf;
+  size_t split;
+  size_t i;
+
+  memset(&config, 0, sizeof(config));
+  config.callback = &callback;
+  config.depth = depth;
+
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+  {
+    if (json_fast_mode_by_name(modes[i], &mode) != 0)
+      continue;
+    if ((jf = json_fast_create(&config, mode)) == NULL)
+      burrow_test_error("json_fast_create returned NULL");
+
+    for (split = 0; split <= size; split++)
+    {
+      int good = decode_fast(jf, text, size, split);
+
+      if (expected == NULL && good)
+        burrow_test_error("%s took bad text split at %zu: %.*s", modes[i],
+                          split, (int)size, text);
+      if (expected != NULL && !good)
+        burrow_test_error("%s turned down text split at %zu: %.*s",
+                          modes[i], split, (int)size, text);
+      if (expected != NULL && (told_size != expected_size ||
+                               memcmp(told, expected, expected_size)))
+        burrow_test_error("%s split at %zu told \"%.*s\", expected \"%s\"",
+                          modes[i], split, (int)told_size, told, expected);
+    }
+
+    json_fast_destroy(jf);
+  }
+}
+
+static void check(const char *text, const char *expected)
+{
+  check_sized(text, strlen(text), 19, expected,
+              expected ? strlen(expected) : 0);
+}
+
+static void test_structure(void)
+{
+  burrow_test("json_fast structure");
+
+    check("{}", "{ } ");
+    check(" [ ] ", "[ ] ");
+    check("", "");
+    check("{\"a\":[1,true,false,null],\"b\":{}}",
+          "{ k:a [ i:1 true false null ] k:b { } } ");
+    check("\t{\r\n\"a\" : \"b\" }\n", "{ k:a s:b } ");
+
+    check("{\"a\" 1}", NULL);
+    check("{\"a\":1,}", NULL);
+    check("[1,]", NULL);
+    check("[1 2]", NULL);
+    check("{,}", NULL);
+    check("{1:2}", NULL);
+    check("[1]]", NULL);
+    check("[1]x", NULL);
+    check("[1][2]", NULL);
+    check("\"a\"", NULL);
+    check("1", NULL);
+    check("[tru]", NULL);
+    check("[nulll]", NULL);
+    check("[True]", NULL);
+    check("[/* no */1]", NULL);
+}
+
+static void test_escapes(void)
+{
+  char text[256];
+  char expected[256];
+
+  burrow_test("json_fast escapes");
+
+    check("[\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\te\"]",
+          "[ s:a\"b\\c/d\b\f\n\r\te ] ");
+    check("[\"\\u0041\\u00e9\\u20AC\"]", "[ s:A\xc3\xa9\xe2\x82\xac ] ");
+    check("{\"\\u006b\":\"\"}", "{ k:k s: } ");
+    check_sized("[\"a\\u0000b\"]", 12, 19, "[ s:a\0b ] ", 10);
+
+    check("[\"\\x\"]", NULL);
+    check("[\"\\U0041\"]", NULL);
+    check("[\"\\u12g4\"]", NULL);
+    check("[\"\\u12\"]", NULL);
+    check("[\"a\nb\"]", NULL);
+    check("[\"a\x01\"]", NULL);
+
+    /* An escape well past where the wider scanners start */
+    memset(text, 'x', sizeof(text));
+    memcpy(text, "[\"", 2);
+    memcpy(text + 70, "\\\"", 2);
+    memcpy(text + 150, "\"]", 3);
+    memset(expected, 'x', sizeof(expected));
+    memcpy(expected, "[ s:", 4);
+    expected[72] = '"';
+    memcpy(expected + 151, " ] ", 4);
+    check(text, expected);
+
+    /* And a control character, where none is looked for one at a time */
+    text[100] = '\x1f';
+    check(text, NULL);
+}
+
+static void test_surrogates(void)
+{
+  burrow_test("json_fast surrogates");
+
+    check("[\"\\ud83d\\ude00\"]", "[ s:\xf0\x9f\x98\x80 ] ");
+    check("[\"a\\uD834\\uDD1Eb\"]", "[ s:a\xf0\x9d\x84\x9e" "b ] ");
+    check("[\"\\udbff\\udfff\"]", "[ s:\xf4\x8f\xbf\xbf ] ");
+
+    check("[\"\\ud83d\"]", NULL);
+    check("[\"\\ud83dx\"]", NULL);
+    check("[\"\\ud83d\\n\"]", NULL);
+    check("[\"\\ud83d\\ud83d\"]", NULL);
+    check("[\"\\ude00\"]", NULL);
+    check("[\"\\ude00\\ud83d\"]", NULL);
+}
+
+static void test_truncated(void)
+{
+  static const char *texts[] =
+  {
+    "{\"a\":[1,2.5,\"xyz\",true,null,{\"b\":-3e2}]}",
+    "[\"\\ud83d\\ude00\",\"\\n\"]",
+  };
+  json_fast_mode_t mode;
+  JSON_config config;
+  json_fast *jf;
+  size_t size;
+  size_t i;
+  size_t j;
+
+  burrow_test("json_fast truncated");
+
+    memset(&config, 0, sizeof(config));
+    config.callback = &callback;
+    config.depth = 19;
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+      if (json_fast_mode_by_name(modes[i], &mode) != 0)
+        continue;
+      if ((jf = json_fast_create(&config, mode)) == NULL)
+        burrow_test_error("json_fast_create returned NULL");
+
+      for (j = 0; j < sizeof(texts) / sizeof(texts[0]); j++)
+      {
+        /* What there is is good, but it isn't done */
+        for (size = 1; size < strlen(texts[j]); size++)
+        {
+          if (!json_fast_parse(jf, texts[j], size))
+            burrow_test_error("%s turned down %.*s", modes[i], (int)size,
+                              texts[j]);
+          if (json_fast_done(jf))
+            burrow_test_error("%s took %.*s as done", modes[i], (int)size,
+                              texts[j]);
+          json_fast_reset(jf);
+        }
+      }
+
+      json_fast_destroy(jf);
+    }
+}
+
+static void test_depth(void)
+{
+  char text[2048];
+  char expected[4096];
+  int i;
+
+  burrow_test("json_fast nesting depth");
+
+    check_sized("[[[1]]]", 7, 3, "[ [ [ i:1 ] ] ] ", 16);
+    check_sized("[{\"a\":[]}]", 10, 3, "[ { k:a [ ] } ] ", 16);
+    check_sized("[[[[1]]]]", 9, 3, NULL, 0);
+    check_sized("[{\"a\":[{}]}]", 12, 3, NULL, 0);
+    check_sized("{}", 2, 0, NULL, 0);
+
+    /* With no limit, as deep as it goes */
+    for (i = 0; i < 1000; i++)
+    {
+      text[i] = '[';
+      text[1000 + i] = ']';
+      memcpy(expected + i * 2, "[ ", 2);
+      memcpy(expected + 2000 + i * 2, "] ", 2);
+    }
+    check_sized(text, 2000, -1, expected, 4000);
+}
+
+static void test_numbers(void)
+{
+  char expected[64];
+
+  burrow_test("json_fast numbers");
+
+    check("[0,-0,7,-12,1234567890]", "[ i:0 i:0 i:7 i:-12 i:1234567890 ] ");
+    snprintf(expected, sizeof(expected), "[ i:%lld i:%lld ] ", LLONG_MAX,
+             LLONG_MIN);
+    check("[9223372036854775807,-9223372036854775808]", expected);
+    check("[0.5,-2.25,1e3,1E+2,25e-1,-0.0]",
+          "[ f:0.5 f:-2.25 f:1000 f:100 f:2.5 f:-0 ] ");
+    check("[1.7976931348623157e308,4.9406564584124654e-324]",
+          "[ f:1.7976931348623157e+308 f:4.9406564584124654e-324 ] ");
+    check("{\"a\":1}", "{ k:a i:1 } ");
+
+    check("[01]", NULL);
+    check("[-01]", NULL);
+    check("[1.]", NULL);
+    check("[.5]", NULL);
+    check("[-]", NULL);
+    check("[--1]", NULL);
+    check("[+1]", NULL);
+    check("[1e]", NULL);
+    check("[1e+]", NULL);
+    check("[1.2.3]", NULL);
+    check("[1-2]", NULL);
+    check("[0x10]", NULL);
+}
+
+int main(void)
+{
+  test_structure();
+  test_escapes();
+  test_surrogates();
+  test_truncated();
+  test_depth();
+  test_numbers();
+  return 0;
+}
@@ -21,6 +21,8 @@
  * @brief Burrow_st tests
  */
 
+#include <errno.h>
+
 #include "tests/common.h"
 
 const char *ACCT = "my_acct";
@@ -29,6 +31,15 @@ const char *MSGID = "my_msg";
 const void *BODY = (void *)"body";
 const size_t BODY_SIZE = 5;
 
+static uint32_t completed = 0;
+static uint32_t last_id = 0;
+
+static void complete_count(burrow_st *burrow)
+{
+  completed++;
+  last_id = burrow_get_command_id(burrow);
+}
+
 int main(void)
 {
   burrow_st *burrow;
@@ -162,6 +173,43 @@ int main(void)
 
   /* no bad commands to check for accounts */
 
+  /* COMMAND QUEUE */
+
+  burrow_remove_options(burrow, BURROW_OPT_AUTOPROCESS);
+  burrow_set_complete_fn(burrow, &complete_count);
+
+  burrow_test("burrow_set_max_commands bad params");
+  if (!burrow_set_max_commands(burrow, 0))
+    burrow_test_error("bad command allowed");
+
+  burrow_test("burrow_set_max_commands");
+  if (burrow_set_max_commands(burrow, 3))
+    burrow_test_error("good command failed");
+
+  burrow_test("burrow queue commands");
+  if (burrow_get_messages(burrow, ACCT, QUEUE, NULL)
+      || burrow_get_queues(burrow, ACCT, NULL)
+      || burrow_get_accounts(burrow, NULL))
+    burrow_test_error("good command failed");
+
+  burrow_test("burrow queue full");
+  if (burrow_get_accounts(burrow, NULL) != EINPROGRESS)
+    burrow_test_error("command allowed on a full queue");
+
+  burrow_test("burrow_set_max_commands while pending");
+  if (burrow_set_max_commands(burrow, 1) != EINPROGRESS)
+    burrow_test_error("queue resized with commands pending");
+
+  burrow_test("burrow_process queued commands");
+  if (burrow_process(burrow) || completed != 3
+      || last_id != burrow_get_command_id(burrow))
+    burrow_test_error("queued commands not all completed");
+
+  burrow_test("burrow queue reuse");
+  if (burrow_get_accounts(burrow, NULL) || burrow_process(burrow)
+      || completed != 4)
+    burrow_test_error("queue slots not reused");
+
   burrow_test("burrow_destroy dummy");
   burrow_destroy(burrow);
   